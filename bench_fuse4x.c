@@ -0,0 +1,2234 @@
+/*
+ * Copyright (C) 2012 Anatol Pomozov. All Rights Reserved.
+ */
+
+/*
+ * bench_fuse4x mounts an in-memory file system served by its own threads,
+ * which speak the raw /dev/fuse4xN protocol of fuse_kernel.h, and runs
+ * workloads against it. No libfuse is involved, so the numbers are the kext
+ * plus a daemon that does next to nothing.
+ *
+ * Every workload runs once per -t thread count (and per -b block size for
+ * the data workloads) for -d seconds. A run prints ops/s, MB/s and latency
+ * percentiles, the kext counters before and after it, and the requests the
+ * daemon answered by opcode alongside the kernel's view of their latency
+ * from SYSCTL_FUSE4X_MOUNT_STATS.
+ *
+ * Entries and attributes are not cacheable by default (-e 0) so that every
+ * lookup and getattr makes it to the bench_dev.
+ *
+ * UNVERIFIED: this tool has not been run end to end yet, so it has produced
+ * no numbers. It needs a kext that never hands out unique 0, which is
+ * reserved for notifications: an older one sends INIT with unique 0, the
+ * echoed reply matches no request and the mount hangs. The daemon refuses
+ * such a request instead of hanging.
+ *
+ * Until it has been, it stays out of kext.xcodeproj and build.rb. Build it
+ * by hand from the top of the tree:
+ *
+ *   cc -O2 -Wall -I. -Icommon -o bench_fuse4x bench_fuse4x.c
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/mount.h>
+#include <sys/wait.h>
+#include <mach/mach_time.h>
+
+#include <fuse_kernel.h>
+#include <fuse_mount.h>
+#include <fuse_param.h>
+#include <fuse_version.h>
+
+#define BENCH_FSNAME               "bench_fuse4x"
+#define BENCH_IOSIZE               (1024 * 1024)
+#define BENCH_MAX_THREADS          256
+#define BENCH_MAX_SIZES            16
+#define BENCH_NAME_HASH_BUCKETS    (1 << 16)
+#define BENCH_NOREPLY              (-1)
+
+#ifndef ARRAY_SIZE
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#endif
+
+/* Options */
+
+static struct {
+    const char *mountpoint;
+    int         threads[BENCH_MAX_THREADS];
+    int         nthreads;
+    size_t      sizes[BENCH_MAX_SIZES];
+    int         nsizes;
+    unsigned    duration;       /* s */
+    int         nfiles;
+    uint64_t    filesize;
+    int         daemon_threads;
+    uint32_t    iosize;
+    uint32_t    init_flags;
+    double      timeout;        /* entry and attribute timeout, s */
+    const char *workloads;
+} opts = {
+    .duration       = 5,
+    .nfiles         = 1000,
+    .filesize       = 64 * 1024 * 1024,
+    .daemon_threads = 4,
+    .iosize         = BENCH_IOSIZE,
+    .init_flags     = FUSE_ASYNC_READ | FUSE_BIG_WRITES | FUSE_ATOMIC_O_TRUNC,
+    .timeout        = 0,
+    .workloads      = "lookup,getattr,readdir,create,seqread,randread,seqwrite,randwrite,mmap",
+};
+
+static volatile sig_atomic_t bench_interrupted;
+
+/* Time */
+
+static mach_timebase_info_data_t bench_timebase;
+
+static inline uint64_t
+bench_now(void)
+{
+    return mach_absolute_time() * bench_timebase.numer / bench_timebase.denom;
+}
+
+/* Latency Histograms */
+
+/*
+ * Nanoseconds go to log2 buckets, each split into HIST_SUB linear
+ * sub-buckets, which keeps percentiles within ~6% of the real value.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+static inline unsigned
+hist_index(uint64_t v)
+{
+    if (v < HIST_SUB) {
+        return (unsigned)v;
+    }
+
+    unsigned shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + (unsigned)((v >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t
+hist_value(unsigned i)
+{
+    if (i < HIST_SUB) {
+        return i;
+    }
+
+    unsigned shift = (i >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(HIST_SUB | (i & (HIST_SUB - 1)))) << shift;
+}
+
+static uint64_t
+hist_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t want = (uint64_t)(total * p + 0.5);
+    uint64_t seen = 0;
+
+    if (want == 0) {
+        want = 1;
+    }
+
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= want) {
+            return hist_value(i);
+        }
+    }
+
+    return 0;
+}
+
+static void
+print_ns(const char *label, uint64_t ns)
+{
+    if (ns < 10000) {
+        printf(" %s %lluns", label, (unsigned long long)ns);
+    } else if (ns < 10000000) {
+        printf(" %s %.1fus", label, ns / 1000.0);
+    } else {
+        printf(" %s %.1fms", label, ns / 1000000.0);
+    }
+}
+
+/* The In-Memory File System */
+
+struct bench_node {
+    uint64_t            nodeid;
+    uint32_t            mode;
+    uint32_t            nlink;
+    uint64_t            nlookup;
+    uint64_t            parent;
+    char               *name;
+    struct bench_node  *hash_next;
+
+    /* directories */
+    uint64_t           *children;
+    uint32_t            nchildren;
+    uint32_t            children_cap;
+
+    /* files, and the times of both, under lock */
+    pthread_mutex_t     lock;
+    char               *data;
+    uint64_t            size;
+    uint64_t            data_cap;
+    struct timespec     atime;
+    struct timespec     mtime;
+    struct timespec     ctime;
+};
+
+/*
+ * ns_lock covers the node table, the name hash, the children arrays and
+ * nlink; it is held shared by everything that only looks names up or moves
+ * data. nlookup is changed atomically under the shared lock and dropped to
+ * zero only under the exclusive one, which is where nodes are freed.
+ */
+static struct {
+    pthread_rwlock_t    ns_lock;
+    struct bench_node **nodes;
+    uint64_t            nnodes;
+    uint64_t            nodes_cap;
+    struct bench_node  *hash[BENCH_NAME_HASH_BUCKETS];
+    uid_t               uid;
+    gid_t               gid;
+    uint64_t            op_count[FUSE_STATS_MAX_OPCODE];
+} fs;
+
+static uint32_t
+bench_name_hash(uint64_t parent, const char *name)
+{
+    uint32_t h = 2166136261U ^ (uint32_t)parent ^ (uint32_t)(parent >> 32);
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    }
+
+    return h & (BENCH_NAME_HASH_BUCKETS - 1);
+}
+
+static inline struct bench_node *
+bench_node_get(uint64_t nodeid)
+{
+    return (nodeid < fs.nnodes) ? fs.nodes[nodeid] : NULL;
+}
+
+static struct bench_node *
+bench_node_find(struct bench_node *dir, const char *name)
+{
+    struct bench_node *n = fs.hash[bench_name_hash(dir->nodeid, name)];
+
+    for (; n; n = n->hash_next) {
+        if (n->parent == dir->nodeid && !strcmp(n->name, name)) {
+            return n;
+        }
+    }
+
+    return NULL;
+}
+
+static void
+bench_now_ts(struct timespec *ts)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ts->tv_sec  = tv.tv_sec;
+    ts->tv_nsec = tv.tv_usec * 1000;
+}
+
+static void
+bench_link(struct bench_node *dir, struct bench_node *n, const char *name)
+{
+    uint32_t bucket;
+
+    n->parent = dir->nodeid;
+    n->name = strdup(name);
+    if (!n->name) {
+        abort();
+    }
+
+    bucket = bench_name_hash(dir->nodeid, name);
+    n->hash_next = fs.hash[bucket];
+    fs.hash[bucket] = n;
+
+    if (dir->nchildren == dir->children_cap) {
+        dir->children_cap = dir->children_cap ? dir->children_cap * 2 : 16;
+        dir->children = realloc(dir->children,
+                                dir->children_cap * sizeof(*dir->children));
+        if (!dir->children) {
+            abort();
+        }
+    }
+    dir->children[dir->nchildren++] = n->nodeid;
+}
+
+static void
+bench_unlink(struct bench_node *dir, struct bench_node *n)
+{
+    struct bench_node **pp = &fs.hash[bench_name_hash(dir->nodeid, n->name)];
+
+    for (; *pp; pp = &(*pp)->hash_next) {
+        if (*pp == n) {
+            *pp = n->hash_next;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < dir->nchildren; i++) {
+        if (dir->children[i] == n->nodeid) {
+            dir->children[i] = dir->children[--dir->nchildren];
+            break;
+        }
+    }
+
+    free(n->name);
+    n->name = NULL;
+    n->hash_next = NULL;
+}
+
+static void
+bench_node_free_if_unused(struct bench_node *n)
+{
+    if (n->nlink || n->nlookup || n->nodeid == FUSE_ROOT_ID) {
+        return;
+    }
+
+    fs.nodes[n->nodeid] = NULL;
+    pthread_mutex_destroy(&n->lock);
+    free(n->children);
+    free(n->data);
+    free(n);
+}
+
+/* Called with ns_lock held exclusive. */
+static struct bench_node *
+bench_node_new(uint32_t mode)
+{
+    struct bench_node *n = calloc(1, sizeof(*n));
+
+    if (!n) {
+        abort();
+    }
+
+    if (fs.nnodes == fs.nodes_cap) {
+        fs.nodes_cap = fs.nodes_cap ? fs.nodes_cap * 2 : 1024;
+        fs.nodes = realloc(fs.nodes, fs.nodes_cap * sizeof(*fs.nodes));
+        if (!fs.nodes) {
+            abort();
+        }
+    }
+
+    n->nodeid = fs.nnodes;
+    fs.nodes[fs.nnodes++] = n;
+
+    n->mode  = mode;
+    n->nlink = S_ISDIR(mode) ? 2 : 1;
+    pthread_mutex_init(&n->lock, NULL);
+    bench_now_ts(&n->atime);
+    n->mtime = n->ctime = n->atime;
+
+    return n;
+}
+
+static void
+bench_fs_init(void)
+{
+    pthread_rwlock_init(&fs.ns_lock, NULL);
+    fs.uid = geteuid();
+    fs.gid = getegid();
+
+    /* nodeid 0 is never handed out */
+    fs.nnodes = FUSE_ROOT_ID;
+    fs.nodes_cap = 1024;
+    fs.nodes = calloc(fs.nodes_cap, sizeof(*fs.nodes));
+    if (!fs.nodes) {
+        abort();
+    }
+
+    struct bench_node *root = bench_node_new(S_IFDIR | 0755);
+    root->parent = FUSE_ROOT_ID;
+    root->nlookup = 1;
+}
+
+static void
+bench_fill_attr(struct bench_node *n, struct fuse_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+
+    pthread_mutex_lock(&n->lock);
+    attr->ino       = n->nodeid;
+    attr->size      = n->size;
+    attr->blocks    = (n->size + 511) / 512;
+    attr->atime     = n->atime.tv_sec;
+    attr->atimensec = (uint32_t)n->atime.tv_nsec;
+    attr->mtime     = n->mtime.tv_sec;
+    attr->mtimensec = (uint32_t)n->mtime.tv_nsec;
+    attr->ctime     = n->ctime.tv_sec;
+    attr->ctimensec = (uint32_t)n->ctime.tv_nsec;
+#ifdef __APPLE__
+    attr->crtime    = n->ctime.tv_sec;
+    attr->crtimensec = (uint32_t)n->ctime.tv_nsec;
+#endif
+    pthread_mutex_unlock(&n->lock);
+
+    attr->mode    = n->mode;
+    attr->nlink   = n->nlink;
+    attr->uid     = fs.uid;
+    attr->gid     = fs.gid;
+    attr->blksize = 4096;
+}
+
+static void
+bench_fill_entry(struct bench_node *n, struct fuse_entry_out *feo)
+{
+    uint64_t sec  = (uint64_t)opts.timeout;
+    uint32_t nsec = (uint32_t)((opts.timeout - sec) * 1000000000);
+
+    memset(feo, 0, sizeof(*feo));
+    feo->nodeid           = n->nodeid;
+    feo->entry_valid      = sec;
+    feo->entry_valid_nsec = nsec;
+    feo->attr_valid       = sec;
+    feo->attr_valid_nsec  = nsec;
+    bench_fill_attr(n, &feo->attr);
+
+    __sync_fetch_and_add(&n->nlookup, 1);
+}
+
+/* Called with the node locked. */
+static int
+bench_node_resize(struct bench_node *n, uint64_t size)
+{
+    if (size > n->data_cap) {
+        uint64_t cap = n->data_cap ? n->data_cap : 4096;
+        char *data;
+
+        while (cap < size) {
+            cap *= 2;
+        }
+        data = realloc(n->data, (size_t)cap);
+        if (!data) {
+            return ENOSPC;
+        }
+        n->data = data;
+        n->data_cap = cap;
+    }
+
+    if (size > n->size) {
+        memset(n->data + n->size, 0, (size_t)(size - n->size));
+    }
+    n->size = size;
+
+    return 0;
+}
+
+/* Request Handlers */
+
+/*
+ * A handler gets the request body in 'arg' and builds its answer body in
+ * 'out', which has room for iosize bytes. It returns 0 with *outlen set, an
+ * errno for an error reply or BENCH_NOREPLY.
+ */
+typedef int bench_handler_t(struct fuse_in_header *in, void *arg,
+                            void *out, size_t *outlen);
+
+static int
+bench_op_init(__unused struct fuse_in_header *in, void *arg,
+              void *out, size_t *outlen)
+{
+    struct fuse_init_in  *fii = arg;
+    struct fuse_init_out *fio = out;
+
+    if (fii->major != FUSE_KERNEL_VERSION) {
+        return EPROTO;
+    }
+
+    memset(fio, 0, sizeof(*fio));
+    fio->major         = FUSE_KERNEL_VERSION;
+    fio->minor         = FUSE_KERNEL_MINOR_VERSION;
+    fio->max_readahead = fii->max_readahead;
+    fio->flags         = opts.init_flags & fii->flags;
+    fio->max_write     = opts.iosize;
+
+    *outlen = sizeof(*fio);
+    return 0;
+}
+
+static int
+bench_op_lookup(struct fuse_in_header *in, void *arg,
+                void *out, size_t *outlen)
+{
+    struct bench_node *dir, *n;
+    int err = 0;
+
+    pthread_rwlock_rdlock(&fs.ns_lock);
+    dir = bench_node_get(in->nodeid);
+    if (!dir || !S_ISDIR(dir->mode)) {
+        err = ENOTDIR;
+    } else if (!(n = bench_node_find(dir, arg))) {
+        err = ENOENT;
+    } else {
+        bench_fill_entry(n, out);
+        *outlen = sizeof(struct fuse_entry_out);
+    }
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    return err;
+}
+
+static void
+bench_forget_one(uint64_t nodeid, uint64_t nlookup)
+{
+    struct bench_node *n = bench_node_get(nodeid);
+
+    if (!n) {
+        return;
+    }
+
+    n->nlookup = (nlookup < n->nlookup) ? n->nlookup - nlookup : 0;
+    bench_node_free_if_unused(n);
+}
+
+static int
+bench_op_forget(struct fuse_in_header *in, void *arg,
+                __unused void *out, __unused size_t *outlen)
+{
+    struct fuse_forget_in *ffi = arg;
+
+    pthread_rwlock_wrlock(&fs.ns_lock);
+    bench_forget_one(in->nodeid, ffi->nlookup);
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    return BENCH_NOREPLY;
+}
+
+static int
+bench_op_batch_forget(__unused struct fuse_in_header *in, void *arg,
+                      __unused void *out, __unused size_t *outlen)
+{
+    struct fuse_batch_forget_in *fbfi = arg;
+    struct fuse_forget_one *ffo = (struct fuse_forget_one *)(fbfi + 1);
+
+    pthread_rwlock_wrlock(&fs.ns_lock);
+    for (uint32_t i = 0; i < fbfi->count; i++) {
+        bench_forget_one(ffo[i].nodeid, ffo[i].nlookup);
+    }
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    return BENCH_NOREPLY;
+}
+
+static int
+bench_reply_attr(struct bench_node *n, void *out, size_t *outlen)
+{
+    struct fuse_attr_out *fao = out;
+    uint64_t sec = (uint64_t)opts.timeout;
+
+    memset(fao, 0, sizeof(*fao));
+    fao->attr_valid      = sec;
+    fao->attr_valid_nsec = (uint32_t)((opts.timeout - sec) * 1000000000);
+    bench_fill_attr(n, &fao->attr);
+
+    *outlen = sizeof(*fao);
+    return 0;
+}
+
+static int
+bench_op_getattr(struct fuse_in_header *in, __unused void *arg,
+                 void *out, size_t *outlen)
+{
+    struct bench_node *n;
+    int err;
+
+    pthread_rwlock_rdlock(&fs.ns_lock);
+    n = bench_node_get(in->nodeid);
+    err = n ? bench_reply_attr(n, out, outlen) : ENOENT;
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    return err;
+}
+
+static int
+bench_op_setattr(struct fuse_in_header *in, void *arg,
+                 void *out, size_t *outlen)
+{
+    struct fuse_setattr_in *fsai = arg;
+    struct bench_node *n;
+    int err = 0;
+
+    pthread_rwlock_rdlock(&fs.ns_lock);
+    n = bench_node_get(in->nodeid);
+    if (!n) {
+        pthread_rwlock_unlock(&fs.ns_lock);
+        return ENOENT;
+    }
+
+    pthread_mutex_lock(&n->lock);
+    if (fsai->valid & FATTR_SIZE) {
+        if (S_ISDIR(n->mode)) {
+            err = EISDIR;
+        } else {
+            err = bench_node_resize(n, fsai->size);
+        }
+    }
+    if (fsai->valid & FATTR_MODE) {
+        n->mode = (n->mode & S_IFMT) | (fsai->mode & ~S_IFMT);
+    }
+    if (fsai->valid & FATTR_ATIME) {
+        n->atime.tv_sec  = fsai->atime;
+        n->atime.tv_nsec = fsai->atimensec;
+    }
+    if (fsai->valid & FATTR_MTIME) {
+        n->mtime.tv_sec  = fsai->mtime;
+        n->mtime.tv_nsec = fsai->mtimensec;
+    }
+    bench_now_ts(&n->ctime);
+    pthread_mutex_unlock(&n->lock);
+
+    if (!err) {
+        err = bench_reply_attr(n, out, outlen);
+    }
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    return err;
+}
+
+static int
+bench_op_access(__unused struct fuse_in_header *in, __unused void *arg,
+                __unused void *out, size_t *outlen)
+{
+    *outlen = 0;
+    return 0;
+}
+
+static int
+bench_op_open(struct fuse_in_header *in, __unused void *arg,
+              void *out, size_t *outlen)
+{
+    struct fuse_open_out *foo = out;
+
+    memset(foo, 0, sizeof(*foo));
+    foo->fh = in->nodeid;
+    foo->open_flags = FOPEN_PURGE_UBC;
+
+    *outlen = sizeof(*foo);
+    return 0;
+}
+
+static int
+bench_op_read(struct fuse_in_header *in, void *arg,
+              void *out, size_t *outlen)
+{
+    struct fuse_read_in *fri = arg;
+    struct bench_node *n;
+    size_t len = 0;
+
+    if (fri->size > opts.iosize) {
+        return EINVAL;
+    }
+
+    pthread_rwlock_rdlock(&fs.ns_lock);
+    n = bench_node_get(in->nodeid);
+    if (!n) {
+        pthread_rwlock_unlock(&fs.ns_lock);
+        return ENOENT;
+    }
+
+    pthread_mutex_lock(&n->lock);
+    if (fri->offset < n->size) {
+        len = (size_t)(n->size - fri->offset);
+        if (len > fri->size) {
+            len = fri->size;
+        }
+        memcpy(out, n->data + fri->offset, len);
+    }
+    pthread_mutex_unlock(&n->lock);
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    *outlen = len;
+    return 0;
+}
+
+static int
+bench_op_write(struct fuse_in_header *in, void *arg,
+               void *out, size_t *outlen)
+{
+    struct fuse_write_in  *fwi = arg;
+    struct fuse_write_out *fwo = out;
+    struct bench_node *n;
+    int err = 0;
+
+    if (sizeof(*in) + sizeof(*fwi) + fwi->size > in->len) {
+        return EINVAL;
+    }
+
+    pthread_rwlock_rdlock(&fs.ns_lock);
+    n = bench_node_get(in->nodeid);
+    if (!n) {
+        pthread_rwlock_unlock(&fs.ns_lock);
+        return ENOENT;
+    }
+
+    pthread_mutex_lock(&n->lock);
+    if (fwi->offset + fwi->size > n->size) {
+        err = bench_node_resize(n, fwi->offset + fwi->size);
+    }
+    if (!err) {
+        memcpy(n->data + fwi->offset, fwi + 1, fwi->size);
+        bench_now_ts(&n->mtime);
+        n->ctime = n->mtime;
+    }
+    pthread_mutex_unlock(&n->lock);
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    if (err) {
+        return err;
+    }
+
+    memset(fwo, 0, sizeof(*fwo));
+    fwo->size = fwi->size;
+    *outlen = sizeof(*fwo);
+    return 0;
+}
+
+static int
+bench_op_statfs(__unused struct fuse_in_header *in, __unused void *arg,
+                void *out, size_t *outlen)
+{
+    struct fuse_statfs_out *fso = out;
+
+    memset(fso, 0, sizeof(*fso));
+    fso->st.blocks  = 1ULL << 32;
+    fso->st.bfree   = 1ULL << 31;
+    fso->st.bavail  = 1ULL << 31;
+    fso->st.files   = 1ULL << 24;
+    fso->st.ffree   = (1ULL << 24) - fs.nnodes;
+    fso->st.bsize   = 4096;
+    fso->st.frsize  = 4096;
+    fso->st.namelen = 255;
+
+    *outlen = sizeof(*fso);
+    return 0;
+}
+
+static int
+bench_op_empty(__unused struct fuse_in_header *in, __unused void *arg,
+               __unused void *out, size_t *outlen)
+{
+    *outlen = 0;
+    return 0;
+}
+
+static int
+bench_op_interrupt(__unused struct fuse_in_header *in, __unused void *arg,
+                   __unused void *out, __unused size_t *outlen)
+{
+    /* Every request is answered right away; nothing to interrupt. */
+    return BENCH_NOREPLY;
+}
+
+static int
+bench_create_node(uint64_t parent, const char *name, uint32_t mode,
+                  void *out, size_t *outlen)
+{
+    struct bench_node *dir, *n;
+    int err = 0;
+
+    pthread_rwlock_wrlock(&fs.ns_lock);
+    dir = bench_node_get(parent);
+    if (!dir || !S_ISDIR(dir->mode)) {
+        err = ENOTDIR;
+    } else if (bench_node_find(dir, name)) {
+        err = EEXIST;
+    } else {
+        n = bench_node_new(mode);
+        bench_link(dir, n, name);
+        bench_now_ts(&dir->mtime);
+        dir->ctime = dir->mtime;
+        bench_fill_entry(n, out);
+        *outlen = sizeof(struct fuse_entry_out);
+    }
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    return err;
+}
+
+static int
+bench_op_create(struct fuse_in_header *in, void *arg,
+                void *out, size_t *outlen)
+{
+    struct fuse_create_in *fci = arg;
+    struct fuse_entry_out *feo = out;
+    struct fuse_open_out  *foo = (struct fuse_open_out *)(feo + 1);
+    int err;
+
+    err = bench_create_node(in->nodeid, (char *)(fci + 1),
+                            S_IFREG | (fci->mode & ~S_IFMT & ~fci->umask),
+                            out, outlen);
+    if (err) {
+        return err;
+    }
+
+    memset(foo, 0, sizeof(*foo));
+    foo->fh = feo->nodeid;
+    foo->open_flags = FOPEN_PURGE_UBC;
+
+    *outlen = sizeof(*feo) + sizeof(*foo);
+    return 0;
+}
+
+static int
+bench_op_mknod(struct fuse_in_header *in, void *arg,
+               void *out, size_t *outlen)
+{
+    struct fuse_mknod_in *fmni = arg;
+
+    if (!S_ISREG(fmni->mode)) {
+        return EPERM;
+    }
+
+    return bench_create_node(in->nodeid, (char *)(fmni + 1),
+                             fmni->mode & ~fmni->umask, out, outlen);
+}
+
+static int
+bench_op_mkdir(struct fuse_in_header *in, void *arg,
+               void *out, size_t *outlen)
+{
+    struct fuse_mkdir_in *fmdi = arg;
+
+    return bench_create_node(in->nodeid, (char *)(fmdi + 1),
+                             S_IFDIR | (fmdi->mode & ~S_IFMT & ~fmdi->umask),
+                             out, outlen);
+}
+
+static int
+bench_op_remove(struct fuse_in_header *in, void *arg,
+                __unused void *out, size_t *outlen)
+{
+    struct bench_node *dir, *n;
+    int err = 0;
+
+    pthread_rwlock_wrlock(&fs.ns_lock);
+    dir = bench_node_get(in->nodeid);
+    if (!dir || !S_ISDIR(dir->mode)) {
+        err = ENOTDIR;
+    } else if (!(n = bench_node_find(dir, arg))) {
+        err = ENOENT;
+    } else if (in->opcode == FUSE_RMDIR && !S_ISDIR(n->mode)) {
+        err = ENOTDIR;
+    } else if (in->opcode == FUSE_UNLINK && S_ISDIR(n->mode)) {
+        err = EISDIR;
+    } else if (S_ISDIR(n->mode) && n->nchildren) {
+        err = ENOTEMPTY;
+    } else {
+        bench_unlink(dir, n);
+        n->nlink = 0;
+        bench_node_free_if_unused(n);
+        bench_now_ts(&dir->mtime);
+        dir->ctime = dir->mtime;
+    }
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    *outlen = 0;
+    return err;
+}
+
+static int
+bench_op_rename(struct fuse_in_header *in, void *arg,
+                __unused void *out, size_t *outlen)
+{
+    struct fuse_rename_in *fri = arg;
+    const char *oldname = (char *)(fri + 1);
+    const char *newname = oldname + strlen(oldname) + 1;
+    struct bench_node *olddir, *newdir, *n, *victim;
+    int err = 0;
+
+    pthread_rwlock_wrlock(&fs.ns_lock);
+    olddir = bench_node_get(in->nodeid);
+    newdir = bench_node_get(fri->newdir);
+    if (!olddir || !newdir || !S_ISDIR(olddir->mode) || !S_ISDIR(newdir->mode)) {
+        err = ENOTDIR;
+    } else if (!(n = bench_node_find(olddir, oldname))) {
+        err = ENOENT;
+    } else {
+        victim = bench_node_find(newdir, newname);
+        if (victim == n) {
+            goto out;
+        }
+        if (victim) {
+            if (S_ISDIR(victim->mode) && victim->nchildren) {
+                err = ENOTEMPTY;
+                goto out;
+            }
+            bench_unlink(newdir, victim);
+            victim->nlink = 0;
+            bench_node_free_if_unused(victim);
+        }
+        bench_unlink(olddir, n);
+        bench_link(newdir, n, newname);
+        bench_now_ts(&n->ctime);
+    }
+
+out:
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    *outlen = 0;
+    return err;
+}
+
+static int
+bench_readdir(struct fuse_in_header *in, void *arg,
+              void *out, size_t *outlen, bool plus)
+{
+    struct fuse_read_in *fri = arg;
+    struct bench_node *dir, *n;
+    char *p = out;
+    size_t left = fri->size;
+    uint64_t off;
+
+    if (fri->size > opts.iosize) {
+        return EINVAL;
+    }
+
+    pthread_rwlock_rdlock(&fs.ns_lock);
+    dir = bench_node_get(in->nodeid);
+    if (!dir || !S_ISDIR(dir->mode)) {
+        pthread_rwlock_unlock(&fs.ns_lock);
+        return ENOTDIR;
+    }
+
+    /* Offsets 0 and 1 are "." and "..", then come the children. */
+    for (off = fri->offset; off < 2 + (uint64_t)dir->nchildren; off++) {
+        const char *name;
+        uint64_t ino;
+        uint32_t mode;
+        size_t namelen, reclen;
+        struct fuse_dirent *fde;
+
+        if (off < 2) {
+            n = NULL;
+            name = off ? ".." : ".";
+            ino = off ? dir->parent : dir->nodeid;
+            mode = S_IFDIR;
+        } else {
+            n = bench_node_get(dir->children[off - 2]);
+            name = n->name;
+            ino = n->nodeid;
+            mode = n->mode;
+        }
+
+        namelen = strlen(name);
+        reclen = plus ? FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + namelen)
+                      : FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+        if (reclen > left) {
+            break;
+        }
+
+        if (plus) {
+            struct fuse_direntplus *fdp = (struct fuse_direntplus *)p;
+
+            if (n) {
+                bench_fill_entry(n, &fdp->entry_out);
+            } else {
+                memset(&fdp->entry_out, 0, sizeof(fdp->entry_out));
+            }
+            fde = &fdp->dirent;
+        } else {
+            fde = (struct fuse_dirent *)p;
+        }
+
+        fde->ino     = ino;
+        fde->off     = off + 1;
+        fde->namelen = (uint32_t)namelen;
+        fde->type    = (mode & S_IFMT) >> 12;
+        memcpy(fde->name, name, namelen);
+        memset(fde->name + namelen, 0, reclen - (fde->name - p) - namelen);
+
+        p += reclen;
+        left -= reclen;
+    }
+    pthread_rwlock_unlock(&fs.ns_lock);
+
+    *outlen = fri->size - left;
+    return 0;
+}
+
+static int
+bench_op_readdir(struct fuse_in_header *in, void *arg,
+                 void *out, size_t *outlen)
+{
+    return bench_readdir(in, arg, out, outlen, false);
+}
+
+static int
+bench_op_readdirplus(struct fuse_in_header *in, void *arg,
+                     void *out, size_t *outlen)
+{
+    return bench_readdir(in, arg, out, outlen, true);
+}
+
+static bench_handler_t *bench_handlers[FUSE_STATS_MAX_OPCODE] = {
+    [FUSE_LOOKUP]       = bench_op_lookup,
+    [FUSE_FORGET]       = bench_op_forget,
+    [FUSE_GETATTR]      = bench_op_getattr,
+    [FUSE_SETATTR]      = bench_op_setattr,
+    [FUSE_MKNOD]        = bench_op_mknod,
+    [FUSE_MKDIR]        = bench_op_mkdir,
+    [FUSE_UNLINK]       = bench_op_remove,
+    [FUSE_RMDIR]        = bench_op_remove,
+    [FUSE_RENAME]       = bench_op_rename,
+    [FUSE_OPEN]         = bench_op_open,
+    [FUSE_READ]         = bench_op_read,
+    [FUSE_WRITE]        = bench_op_write,
+    [FUSE_STATFS]       = bench_op_statfs,
+    [FUSE_RELEASE]      = bench_op_empty,
+    [FUSE_FSYNC]        = bench_op_empty,
+    [FUSE_FLUSH]        = bench_op_empty,
+    [FUSE_INIT]         = bench_op_init,
+    [FUSE_OPENDIR]      = bench_op_open,
+    [FUSE_READDIR]      = bench_op_readdir,
+    [FUSE_RELEASEDIR]   = bench_op_empty,
+    [FUSE_FSYNCDIR]     = bench_op_empty,
+    [FUSE_ACCESS]       = bench_op_access,
+    [FUSE_CREATE]       = bench_op_create,
+    [FUSE_INTERRUPT]    = bench_op_interrupt,
+    [FUSE_DESTROY]      = bench_op_empty,
+    [FUSE_BATCH_FORGET] = bench_op_batch_forget,
+    [FUSE_READDIRPLUS]  = bench_op_readdirplus,
+};
+
+static const char *bench_opnames[FUSE_STATS_MAX_OPCODE] = {
+    [FUSE_LOOKUP]       = "LOOKUP",
+    [FUSE_FORGET]       = "FORGET",
+    [FUSE_GETATTR]      = "GETATTR",
+    [FUSE_SETATTR]      = "SETATTR",
+    [FUSE_READLINK]     = "READLINK",
+    [FUSE_SYMLINK]      = "SYMLINK",
+    [FUSE_MKNOD]        = "MKNOD",
+    [FUSE_MKDIR]        = "MKDIR",
+    [FUSE_UNLINK]       = "UNLINK",
+    [FUSE_RMDIR]        = "RMDIR",
+    [FUSE_RENAME]       = "RENAME",
+    [FUSE_LINK]         = "LINK",
+    [FUSE_OPEN]         = "OPEN",
+    [FUSE_READ]         = "READ",
+    [FUSE_WRITE]        = "WRITE",
+    [FUSE_STATFS]       = "STATFS",
+    [FUSE_RELEASE]      = "RELEASE",
+    [FUSE_FSYNC]        = "FSYNC",
+    [FUSE_SETXATTR]     = "SETXATTR",
+    [FUSE_GETXATTR]     = "GETXATTR",
+    [FUSE_LISTXATTR]    = "LISTXATTR",
+    [FUSE_REMOVEXATTR]  = "REMOVEXATTR",
+    [FUSE_FLUSH]        = "FLUSH",
+    [FUSE_INIT]         = "INIT",
+    [FUSE_OPENDIR]      = "OPENDIR",
+    [FUSE_READDIR]      = "READDIR",
+    [FUSE_RELEASEDIR]   = "RELEASEDIR",
+    [FUSE_FSYNCDIR]     = "FSYNCDIR",
+    [FUSE_GETLK]        = "GETLK",
+    [FUSE_SETLK]        = "SETLK",
+    [FUSE_SETLKW]       = "SETLKW",
+    [FUSE_ACCESS]       = "ACCESS",
+    [FUSE_CREATE]       = "CREATE",
+    [FUSE_INTERRUPT]    = "INTERRUPT",
+    [FUSE_BMAP]         = "BMAP",
+    [FUSE_DESTROY]      = "DESTROY",
+    [FUSE_IOCTL]        = "IOCTL",
+    [FUSE_POLL]         = "POLL",
+    [FUSE_BATCH_FORGET] = "BATCH_FORGET",
+    [FUSE_READDIRPLUS]  = "READDIRPLUS",
+    [FUSE_SETVOLNAME]   = "SETVOLNAME",
+    [FUSE_GETXTIMES]    = "GETXTIMES",
+    [FUSE_EXCHANGE]     = "EXCHANGE",
+};
+
+/* The Daemon */
+
+struct bench_daemon_thread {
+    pthread_t  thread;
+    int        fd;
+    char      *inbuf;
+    size_t     inbuf_size;
+    char      *outbuf;
+    size_t     outbuf_size;
+    size_t     outlen;
+};
+
+static struct {
+    int                         fd;          /* /dev/fuse4xN */
+    int                         unit;
+    dev_t                       rdev;
+    int                         chfd[FUSE4X_NCHANNELS];
+    int                         nchannels;
+    struct bench_daemon_thread *threads;
+    int                         nthreads;
+} bench_dev;
+
+static void
+bench_daemon_flush(struct bench_daemon_thread *dt)
+{
+    if (dt->outlen && write(dt->fd, dt->outbuf, dt->outlen) < 0) {
+        /* The request may well have been interrupted meanwhile. */
+        if (errno != ENOENT) {
+            perror("bench_fuse4x: write");
+        }
+    }
+
+    dt->outlen = 0;
+}
+
+static void
+bench_daemon_dispatch(struct bench_daemon_thread *dt, struct fuse_in_header *in)
+{
+    struct fuse_out_header *out;
+    bench_handler_t *handler = NULL;
+    size_t bodylen = 0;
+    int err;
+
+    if (in->unique == 0) {
+        fprintf(stderr, "bench_fuse4x: request %u came with unique 0, "
+                "the kext is too old to be benchmarked\n", in->opcode);
+        exit(EXIT_FAILURE);
+    }
+
+    /* Without batched I/O every answer goes in a write of its own. */
+    if (dt->outlen && (!(opts.init_flags & FUSE_BATCH_IO) ||
+                       dt->outbuf_size - dt->outlen < sizeof(*out) + opts.iosize)) {
+        bench_daemon_flush(dt);
+    }
+
+    if (in->opcode < FUSE_STATS_MAX_OPCODE) {
+        __sync_fetch_and_add(&fs.op_count[in->opcode], 1);
+        handler = bench_handlers[in->opcode];
+    }
+
+    out = (struct fuse_out_header *)(dt->outbuf + dt->outlen);
+    err = handler ? handler(in, in + 1, out + 1, &bodylen) : ENOSYS;
+    if (err == BENCH_NOREPLY) {
+        return;
+    }
+    if (err) {
+        bodylen = 0;
+    }
+
+    out->len    = (uint32_t)(sizeof(*out) + bodylen);
+    out->error  = -err;
+    out->unique = in->unique;
+    dt->outlen += out->len;
+
+    if (in->opcode == FUSE_DESTROY) {
+        bench_daemon_flush(dt);
+    }
+}
+
+static void *
+bench_daemon_main(void *arg)
+{
+    struct bench_daemon_thread *dt = arg;
+
+    for (;;) {
+        ssize_t n = read(dt->fd, dt->inbuf, dt->inbuf_size);
+        size_t off = 0;
+
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            if (errno != ENODEV) {
+                perror("bench_fuse4x: read");
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        /* With batched I/O one read can bring several requests. */
+        while (off + sizeof(struct fuse_in_header) <= (size_t)n) {
+            struct fuse_in_header *in = (struct fuse_in_header *)(dt->inbuf + off);
+
+            if (in->len < sizeof(*in) || off + in->len > (size_t)n) {
+                fprintf(stderr, "bench_fuse4x: malformed request (len=%u)\n", in->len);
+                break;
+            }
+            bench_daemon_dispatch(dt, in);
+            off += in->len;
+        }
+
+        bench_daemon_flush(dt);
+    }
+
+    return NULL;
+}
+
+static int
+bench_load_kext(void)
+{
+    struct vfsconf vfc;
+    pid_t pid;
+    int status;
+
+    if (getvfsbyname(FUSE4X_FS_TYPE, &vfc) == 0) {
+        return 0;
+    }
+
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    if (pid == 0) {
+        execl(FUSE4X_LOAD_PROG, FUSE4X_LOAD_PROG, NULL);
+        perror("execl");
+        _exit(EXIT_FAILURE);
+    }
+
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return -1;
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "bench_fuse4x: cannot load the kext with " FUSE4X_LOAD_PROG "\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+static int
+bench_daemon_start(void)
+{
+    char path[MAXPATHLEN];
+    struct stat sb;
+
+    bench_dev.fd = -1;
+    for (int i = 0; i < FUSE4X_NDEVICES; i++) {
+        snprintf(path, sizeof(path), "/dev/" FUSE4X_DEVICE_BASENAME "%d", i);
+        bench_dev.fd = open(path, O_RDWR);
+        if (bench_dev.fd >= 0) {
+            bench_dev.unit = i;
+            break;
+        }
+    }
+    if (bench_dev.fd < 0) {
+        fprintf(stderr, "bench_fuse4x: no free /dev/" FUSE4X_DEVICE_BASENAME "N device\n");
+        return -1;
+    }
+
+    if (fstat(bench_dev.fd, &sb) < 0) {
+        perror("fstat");
+        return -1;
+    }
+    bench_dev.rdev = sb.st_rdev;
+
+    bench_dev.chfd[0] = bench_dev.fd;
+    bench_dev.nchannels = 1;
+    while (bench_dev.nchannels < opts.daemon_threads &&
+           bench_dev.nchannels < FUSE4X_NCHANNELS) {
+        int fd;
+
+        snprintf(path, sizeof(path), "/dev/" FUSE4X_DEVICE_BASENAME "%d.%d",
+                 bench_dev.unit, bench_dev.nchannels);
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            /* An older kext has no channels, share the device then. */
+            break;
+        }
+        bench_dev.chfd[bench_dev.nchannels++] = fd;
+    }
+
+    bench_dev.nthreads = opts.daemon_threads;
+    bench_dev.threads = calloc(bench_dev.nthreads, sizeof(*bench_dev.threads));
+    if (!bench_dev.threads) {
+        abort();
+    }
+
+    for (int i = 0; i < bench_dev.nthreads; i++) {
+        struct bench_daemon_thread *dt = &bench_dev.threads[i];
+
+        dt->fd = bench_dev.chfd[i % bench_dev.nchannels];
+        dt->inbuf_size = opts.iosize + 64 * 1024;
+        dt->outbuf_size = 2 * (opts.iosize + sizeof(struct fuse_out_header)) + 64 * 1024;
+        dt->inbuf = malloc(dt->inbuf_size);
+        dt->outbuf = malloc(dt->outbuf_size);
+        if (!dt->inbuf || !dt->outbuf) {
+            abort();
+        }
+
+        if (pthread_create(&dt->thread, NULL, bench_daemon_main, dt)) {
+            perror("pthread_create");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+bench_mount(void)
+{
+    struct fuse_mount_args args;
+    int flags = MNT_NOSUID | MNT_NODEV;
+
+    memset(&args, 0, sizeof(args));
+    if (!realpath(opts.mountpoint, args.mntpath)) {
+        perror(opts.mountpoint);
+        return -1;
+    }
+
+    snprintf(args.fsname, sizeof(args.fsname), BENCH_FSNAME "@" FUSE4X_DEVICE_BASENAME "%d",
+             bench_dev.unit);
+    snprintf(args.volname, sizeof(args.volname), BENCH_FSNAME);
+    args.altflags       = FUSE_MOPT_NO_APPLEDOUBLE | FUSE_MOPT_NO_APPLEXATTR |
+                          FUSE_MOPT_BLOCKSIZE | FUSE_MOPT_IOSIZE |
+                          FUSE_MOPT_DAEMON_TIMEOUT;
+    args.blocksize      = FUSE_DEFAULT_BLOCKSIZE;
+    args.iosize         = opts.iosize;
+    args.daemon_timeout = FUSE_DEFAULT_DAEMON_TIMEOUT;
+    args.rdev           = (uint32_t)bench_dev.rdev;
+
+    if (mount(FUSE4X_FS_TYPE, args.mntpath, flags, &args) < 0) {
+        perror("mount");
+        return -1;
+    }
+
+    /* The first access waits for INIT to be answered. */
+    struct statfs sfs;
+    if (statfs(args.mntpath, &sfs) < 0) {
+        perror("statfs");
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+bench_unmount(void)
+{
+    if (unmount(opts.mountpoint, 0) < 0 && unmount(opts.mountpoint, MNT_FORCE) < 0) {
+        perror("unmount");
+    }
+
+    for (int i = 0; i < bench_dev.nthreads; i++) {
+        pthread_join(bench_dev.threads[i].thread, NULL);
+    }
+
+    for (int c = bench_dev.nchannels - 1; c >= 0; c--) {
+        close(bench_dev.chfd[c]);
+    }
+}
+
+/* Kext Counters */
+
+static const char *bench_counters[] = {
+    "counters.filehandle_reuse",
+    "counters.filehandle_upcalls",
+    "counters.interrupts_sent",
+    "counters.interrupts_withdrawn",
+    "counters.lookup_cache_hits",
+    "counters.lookup_cache_misses",
+    "counters.lookup_cache_overrides",
+    "counters.lookup_negative_hits",
+    "counters.lookup_negative_misses",
+    "counters.lookup_negative_overrides",
+    "counters.memory_reallocs",
+    "counters.readdir_cache_hits",
+    "counters.readdir_cache_misses",
+    "counters.xattr_cache_hits",
+    "counters.xattr_cache_misses",
+    "resourceusage.filehandles",
+    "resourceusage.filehandles_zombies",
+    "resourceusage.ipc_iovs",
+    "resourceusage.ipc_queued_background",
+    "resourceusage.ipc_queued_data",
+    "resourceusage.ipc_queued_metadata",
+    "resourceusage.ipc_tickets",
+    "resourceusage.memory_bytes",
+    "resourceusage.mounts",
+    "resourceusage.vnodes",
+    "resourceusage.vnodes_dirty",
+};
+
+struct bench_snapshot {
+    int64_t                 counters[ARRAY_SIZE(bench_counters)];
+    bool                    have_stats;
+    struct fuse_mount_stats stats;
+    uint64_t                op_count[FUSE_STATS_MAX_OPCODE];
+};
+
+static void
+bench_snapshot_take(struct bench_snapshot *snap)
+{
+    char name[128];
+
+    for (size_t i = 0; i < ARRAY_SIZE(bench_counters); i++) {
+        union { int32_t i32; int64_t i64; } v = { .i64 = 0 };
+        size_t len = sizeof(v);
+
+        snprintf(name, sizeof(name), "vfs.generic." FUSE4X_FS_TYPE ".%s", bench_counters[i]);
+        if (sysctlbyname(name, &v, &len, NULL, 0) < 0) {
+            snap->counters[i] = -1;
+        } else {
+            snap->counters[i] = (len == sizeof(v.i32)) ? v.i32 : v.i64;
+        }
+    }
+
+    snap->have_stats = false;
+
+    size_t len = 0;
+    if (sysctlbyname(SYSCTL_FUSE4X_MOUNT_STATS, NULL, &len, NULL, 0) == 0 && len) {
+        struct fuse_mount_stats *all = malloc(len);
+
+        if (all && sysctlbyname(SYSCTL_FUSE4X_MOUNT_STATS, all, &len, NULL, 0) == 0) {
+            for (size_t i = 0; i < len / sizeof(*all); i++) {
+                if (all[i].unit == (uint32_t)bench_dev.unit) {
+                    snap->stats = all[i];
+                    snap->have_stats = true;
+                    break;
+                }
+            }
+        }
+        free(all);
+    }
+
+    for (int op = 0; op < FUSE_STATS_MAX_OPCODE; op++) {
+        snap->op_count[op] = fs.op_count[op];
+    }
+}
+
+/* Returns the lower bound, in us, of the bucket the pth request falls into. */
+static unsigned
+bench_stats_percentile(const uint32_t *before, const uint32_t *after, double p)
+{
+    uint64_t total = 0, seen = 0, want;
+    int i;
+
+    for (i = 0; i < FUSE_STATS_HIST_BUCKETS; i++) {
+        total += after[i] - before[i];
+    }
+    want = (uint64_t)(total * p + 0.5);
+    if (!want) {
+        want = 1;
+    }
+
+    for (i = 0; i < FUSE_STATS_HIST_BUCKETS; i++) {
+        seen += after[i] - before[i];
+        if (seen >= want) {
+            break;
+        }
+    }
+
+    return i ? 1U << i : 0;
+}
+
+static void
+bench_snapshot_print(const struct bench_snapshot *before,
+                     const struct bench_snapshot *after, double seconds)
+{
+    printf("    %-36s %12s %12s %12s\n", "kext counter", "before", "after", "delta");
+    for (size_t i = 0; i < ARRAY_SIZE(bench_counters); i++) {
+        if (before->counters[i] < 0 || after->counters[i] < 0) {
+            continue;
+        }
+        printf("    %-36s %12lld %12lld %+12lld\n", bench_counters[i],
+               (long long)before->counters[i], (long long)after->counters[i],
+               (long long)(after->counters[i] - before->counters[i]));
+    }
+
+    if (after->have_stats) {
+        printf("    queue depth max %u, answer wait depth max %u, steals %llu\n",
+               after->stats.ms_depth_max, after->stats.aw_depth_max,
+               (unsigned long long)(after->stats.ms_steals - before->stats.ms_steals));
+    }
+
+    printf("    %-14s %10s %12s %11s %11s %11s %11s\n", "opcode", "requests", "req/s",
+           "queue p50", "queue p99", "daemon p50", "daemon p99");
+    for (int op = 0; op < FUSE_STATS_MAX_OPCODE; op++) {
+        uint64_t n = after->op_count[op] - before->op_count[op];
+
+        if (!n) {
+            continue;
+        }
+
+        printf("    %-14s %10llu %12.0f", bench_opnames[op] ? bench_opnames[op] : "?",
+               (unsigned long long)n, n / seconds);
+        if (before->have_stats && after->have_stats) {
+            const struct fuse_opcode_stats *b = &before->stats.op[op];
+            const struct fuse_opcode_stats *a = &after->stats.op[op];
+
+            printf(" %9uus %9uus %10uus %10uus",
+                   bench_stats_percentile(b->queue_hist, a->queue_hist, 0.5),
+                   bench_stats_percentile(b->queue_hist, a->queue_hist, 0.99),
+                   bench_stats_percentile(b->daemon_hist, a->daemon_hist, 0.5),
+                   bench_stats_percentile(b->daemon_hist, a->daemon_hist, 0.99));
+        }
+        printf("\n");
+    }
+}
+
+/* Workloads */
+
+struct bench_thread {
+    pthread_t                     thread;
+    int                           index;
+    const struct bench_workload  *wl;
+    size_t                        block;
+    char                         *buf;
+    int                           fd;
+    char                         *map;
+    uint64_t                      offset;
+    uint64_t                      seq;
+    uint64_t                      rand;
+    uint64_t                      ops;
+    uint64_t                      bytes;
+    int                           error;
+    char                          path[MAXPATHLEN];
+    uint64_t                      hist[HIST_BUCKETS];
+};
+
+struct bench_workload {
+    const char *name;
+    bool        sized;                              /* runs for every -b size */
+    bool        data;                               /* uses the data.N files */
+    int       (*start)(struct bench_thread *t);     /* untimed, once */
+    int       (*prep)(struct bench_thread *t);      /* untimed, before every op */
+    int       (*op)(struct bench_thread *t);        /* the timed operation */
+    void      (*stop)(struct bench_thread *t);
+};
+
+static inline uint64_t
+bench_rand(struct bench_thread *t)
+{
+    /* xorshift64* */
+    t->rand ^= t->rand >> 12;
+    t->rand ^= t->rand << 25;
+    t->rand ^= t->rand >> 27;
+    return t->rand * 2685821657736338717ULL;
+}
+
+static int
+bench_errno(void)
+{
+    return errno ? errno : EIO;
+}
+
+static int
+wl_lookup_op(struct bench_thread *t)
+{
+    struct stat sb;
+
+    snprintf(t->path, sizeof(t->path), "%s/meta/f%llu", opts.mountpoint,
+             (unsigned long long)(bench_rand(t) % opts.nfiles));
+
+    return (stat(t->path, &sb) < 0) ? bench_errno() : 0;
+}
+
+static int
+wl_getattr_start(struct bench_thread *t)
+{
+    snprintf(t->path, sizeof(t->path), "%s/meta/f%d", opts.mountpoint,
+             t->index % opts.nfiles);
+
+    t->fd = open(t->path, O_RDONLY);
+    return (t->fd < 0) ? bench_errno() : 0;
+}
+
+static int
+wl_getattr_op(struct bench_thread *t)
+{
+    struct stat sb;
+
+    return (fstat(t->fd, &sb) < 0) ? bench_errno() : 0;
+}
+
+static void
+wl_close(struct bench_thread *t)
+{
+    if (t->map) {
+        munmap(t->map, (size_t)opts.filesize);
+        t->map = NULL;
+    }
+    if (t->fd >= 0) {
+        close(t->fd);
+        t->fd = -1;
+    }
+}
+
+static int
+wl_readdir_op(struct bench_thread *t)
+{
+    DIR *dir;
+
+    snprintf(t->path, sizeof(t->path), "%s/meta", opts.mountpoint);
+    dir = opendir(t->path);
+    if (!dir) {
+        return bench_errno();
+    }
+
+    errno = 0;
+    while (readdir(dir)) {
+        /* nothing */
+    }
+    int err = errno;
+    closedir(dir);
+
+    return err;
+}
+
+/* The file made by the previous op is removed outside of the timed part. */
+static int
+wl_create_prep(struct bench_thread *t)
+{
+    if (t->seq && unlink(t->path) < 0) {
+        return bench_errno();
+    }
+
+    snprintf(t->path, sizeof(t->path), "%s/create.%d/f%llu", opts.mountpoint,
+             t->index, (unsigned long long)t->seq++);
+    return 0;
+}
+
+static int
+wl_create_op(struct bench_thread *t)
+{
+    int fd = open(t->path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+
+    if (fd < 0) {
+        return bench_errno();
+    }
+
+    if (write(fd, t->buf, 4096) != 4096) {
+        int err = bench_errno();
+        close(fd);
+        return err;
+    }
+    t->bytes += 4096;
+
+    return (close(fd) < 0) ? bench_errno() : 0;
+}
+
+static void
+wl_create_stop(struct bench_thread *t)
+{
+    if (t->seq) {
+        unlink(t->path);
+    }
+}
+
+static int
+wl_data_open(struct bench_thread *t, int flags)
+{
+    snprintf(t->path, sizeof(t->path), "%s/data.%d", opts.mountpoint, t->index);
+
+    t->fd = open(t->path, flags);
+    if (t->fd < 0) {
+        return bench_errno();
+    }
+
+    /* Measure the trips to the daemon, not the UBC. */
+    if (fcntl(t->fd, F_NOCACHE, 1) < 0) {
+        return bench_errno();
+    }
+
+    return 0;
+}
+
+static int
+wl_read_start(struct bench_thread *t)
+{
+    return wl_data_open(t, O_RDONLY);
+}
+
+static int
+wl_write_start(struct bench_thread *t)
+{
+    return wl_data_open(t, O_WRONLY);
+}
+
+static inline uint64_t
+wl_next_offset(struct bench_thread *t, bool random)
+{
+    uint64_t blocks = opts.filesize / t->block;
+    uint64_t off;
+
+    if (random) {
+        return (bench_rand(t) % blocks) * t->block;
+    }
+
+    off = t->offset;
+    t->offset = (off + t->block >= blocks * t->block) ? 0 : off + t->block;
+    return off;
+}
+
+static int
+wl_pio(struct bench_thread *t, bool writing, bool random)
+{
+    off_t off = (off_t)wl_next_offset(t, random);
+    ssize_t n = writing ? pwrite(t->fd, t->buf, t->block, off)
+                      : pread(t->fd, t->buf, t->block, off);
+
+    if (n != (ssize_t)t->block) {
+        return (n < 0) ? bench_errno() : EIO;
+    }
+
+    t->bytes += t->block;
+    return 0;
+}
+
+static int
+wl_seqread_op(struct bench_thread *t)
+{
+    return wl_pio(t, false, false);
+}
+
+static int
+wl_randread_op(struct bench_thread *t)
+{
+    return wl_pio(t, false, true);
+}
+
+static int
+wl_seqwrite_op(struct bench_thread *t)
+{
+    return wl_pio(t, true, false);
+}
+
+static int
+wl_randwrite_op(struct bench_thread *t)
+{
+    return wl_pio(t, true, true);
+}
+
+/*
+ * Every op touches the next page of a shared mapping of data.N. Once the
+ * whole file is touched it is mapped again through a new open, whose
+ * FOPEN_PURGE_UBC makes the pages come from the daemon once more.
+ */
+static int
+wl_mmap_prep(struct bench_thread *t)
+{
+    if (t->map && t->offset < opts.filesize) {
+        return 0;
+    }
+
+    wl_close(t);
+
+    snprintf(t->path, sizeof(t->path), "%s/data.%d", opts.mountpoint, t->index);
+    t->fd = open(t->path, O_RDONLY);
+    if (t->fd < 0) {
+        return bench_errno();
+    }
+
+    t->map = mmap(NULL, (size_t)opts.filesize, PROT_READ, MAP_SHARED, t->fd, 0);
+    if (t->map == MAP_FAILED) {
+        t->map = NULL;
+        return bench_errno();
+    }
+
+    t->offset = 0;
+    return 0;
+}
+
+static int
+wl_mmap_op(struct bench_thread *t)
+{
+    volatile char c = t->map[t->offset];
+
+    (void)c;
+    t->offset += PAGE_SIZE;
+    t->bytes += PAGE_SIZE;
+    return 0;
+}
+
+static const struct bench_workload bench_workloads[] = {
+    { "lookup",    false, false, NULL,             NULL,           wl_lookup_op,    NULL },
+    { "getattr",   false, false, wl_getattr_start, NULL,           wl_getattr_op,   wl_close },
+    { "readdir",   false, false, NULL,             NULL,           wl_readdir_op,   NULL },
+    { "create",    false, false, NULL,             wl_create_prep, wl_create_op,    wl_create_stop },
+    { "seqread",   true,  true,  wl_read_start,    NULL,           wl_seqread_op,   wl_close },
+    { "randread",  true,  true,  wl_read_start,    NULL,           wl_randread_op,  wl_close },
+    { "seqwrite",  true,  true,  wl_write_start,   NULL,           wl_seqwrite_op,  wl_close },
+    { "randwrite", true,  true,  wl_write_start,   NULL,           wl_randwrite_op, wl_close },
+    { "mmap",      false, true,  NULL,             wl_mmap_prep,   wl_mmap_op,      wl_close },
+};
+
+/* Runs */
+
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t  cond;
+    int             ready;
+    bool            go;
+    volatile bool   stop;
+} run = {
+    .mtx  = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+bench_thread_main(void *arg)
+{
+    struct bench_thread *t = arg;
+    const struct bench_workload *wl = t->wl;
+
+    if (wl->start) {
+        t->error = wl->start(t);
+    }
+
+    pthread_mutex_lock(&run.mtx);
+    run.ready++;
+    pthread_cond_broadcast(&run.cond);
+    while (!run.go) {
+        pthread_cond_wait(&run.cond, &run.mtx);
+    }
+    pthread_mutex_unlock(&run.mtx);
+
+    while (!t->error && !run.stop) {
+        uint64_t start;
+
+        if (wl->prep && (t->error = wl->prep(t))) {
+            break;
+        }
+
+        start = bench_now();
+        if ((t->error = wl->op(t))) {
+            break;
+        }
+        t->hist[hist_index(bench_now() - start)]++;
+        t->ops++;
+    }
+
+    if (wl->stop) {
+        wl->stop(t);
+    }
+
+    return NULL;
+}
+
+static int
+bench_run(const struct bench_workload *wl, int nthreads, size_t block)
+{
+    struct bench_snapshot before, after;
+    struct bench_thread *threads;
+    uint64_t *hist, ops = 0, bytes = 0, start, elapsed;
+    double seconds;
+    int err = 0;
+
+    threads = calloc(nthreads, sizeof(*threads));
+    hist = calloc(HIST_BUCKETS, sizeof(*hist));
+    if (!threads || !hist) {
+        abort();
+    }
+
+    run.ready = 0;
+    run.go = false;
+    run.stop = false;
+
+    bench_snapshot_take(&before);
+
+    for (int i = 0; i < nthreads; i++) {
+        struct bench_thread *t = &threads[i];
+
+        t->index = i;
+        t->wl    = wl;
+        t->block = block ? block : 4096;
+        t->fd    = -1;
+        t->rand  = 0x9e3779b97f4a7c15ULL * (i + 1);
+        t->buf   = valloc(t->block);
+        if (!t->buf) {
+            abort();
+        }
+        memset(t->buf, 0xa5, t->block);
+
+        if (pthread_create(&t->thread, NULL, bench_thread_main, t)) {
+            perror("pthread_create");
+            abort();
+        }
+    }
+
+    pthread_mutex_lock(&run.mtx);
+    while (run.ready < nthreads) {
+        pthread_cond_wait(&run.cond, &run.mtx);
+    }
+    run.go = true;
+    start = bench_now();
+    pthread_cond_broadcast(&run.cond);
+    pthread_mutex_unlock(&run.mtx);
+
+    for (unsigned s = 0; s < opts.duration * 10 && !bench_interrupted; s++) {
+        usleep(100000);
+    }
+    run.stop = true;
+
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    elapsed = bench_now() - start;
+
+    bench_snapshot_take(&after);
+
+    for (int i = 0; i < nthreads; i++) {
+        struct bench_thread *t = &threads[i];
+
+        ops += t->ops;
+        bytes += t->bytes;
+        for (unsigned b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] += t->hist[b];
+        }
+        if (t->error && !err) {
+            err = t->error;
+        }
+        free(t->buf);
+    }
+
+    seconds = elapsed / 1e9;
+
+    printf("%-9s", wl->name);
+    if (wl->sized) {
+        printf(" bs=%-8zu", block);
+    }
+    printf(" threads=%-3d %10.0f ops/s", nthreads, ops / seconds);
+    if (bytes) {
+        printf(" %9.1f MB/s", bytes / seconds / (1024 * 1024));
+    }
+    if (ops) {
+        print_ns("p50", hist_percentile(hist, ops, 0.5));
+        print_ns("p90", hist_percentile(hist, ops, 0.9));
+        print_ns("p99", hist_percentile(hist, ops, 0.99));
+        print_ns("p99.9", hist_percentile(hist, ops, 0.999));
+        print_ns("max", hist_percentile(hist, ops, 1.0));
+    }
+    printf("\n");
+    if (err) {
+        printf("    failed: %s\n", strerror(err));
+    }
+
+    bench_snapshot_print(&before, &after, seconds);
+    fflush(stdout);
+
+    free(hist);
+    free(threads);
+
+    return err;
+}
+
+/* Lays out the files the workloads expect, outside of any run. */
+static int
+bench_populate(int maxthreads, bool data)
+{
+    char path[MAXPATHLEN];
+    char *buf;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/meta", opts.mountpoint);
+    if (mkdir(path, 0755) < 0) {
+        perror(path);
+        return -1;
+    }
+
+    for (int i = 0; i < opts.nfiles; i++) {
+        snprintf(path, sizeof(path), "%s/meta/f%d", opts.mountpoint, i);
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0) {
+            perror(path);
+            return -1;
+        }
+        close(fd);
+    }
+
+    for (int t = 0; t < maxthreads; t++) {
+        snprintf(path, sizeof(path), "%s/create.%d", opts.mountpoint, t);
+        if (mkdir(path, 0755) < 0) {
+            perror(path);
+            return -1;
+        }
+    }
+
+    if (!data) {
+        return 0;
+    }
+
+    buf = malloc(opts.iosize);
+    if (!buf) {
+        abort();
+    }
+    memset(buf, 0x5a, opts.iosize);
+
+    for (int t = 0; t < maxthreads; t++) {
+        snprintf(path, sizeof(path), "%s/data.%d", opts.mountpoint, t);
+        fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+        if (fd < 0) {
+            perror(path);
+            free(buf);
+            return -1;
+        }
+
+        for (uint64_t off = 0; off < opts.filesize; off += opts.iosize) {
+            size_t len = (size_t)MIN((uint64_t)opts.iosize, opts.filesize - off);
+
+            if (write(fd, buf, len) != (ssize_t)len) {
+                perror(path);
+                close(fd);
+                free(buf);
+                return -1;
+            }
+        }
+
+        if (fsync(fd) < 0 || close(fd) < 0) {
+            perror(path);
+            free(buf);
+            return -1;
+        }
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* Command Line */
+
+static void
+usage(void)
+{
+    fprintf(stderr,
+            "usage: bench_fuse4x [options] mountpoint\n"
+            "  -t 1,2,4,8       thread counts to run every workload with\n"
+            "  -b 4k,64k,1m     block sizes of the data workloads\n"
+            "  -d seconds       duration of a run (default %u)\n"
+            "  -n files         files in the lookup/getattr/readdir directory (default %d)\n"
+            "  -s size          size of every data file (default %llum)\n"
+            "  -j threads       daemon threads, spread over up to %d channels (default %d)\n"
+            "  -i size          iosize of the mount (default %uk)\n"
+            "  -e seconds       entry and attribute timeout (default %g)\n"
+            "  -o flags         more INIT flags: batch,writeback,readdirplus,asyncflush\n"
+            "  -w list          workloads to run (default %s)\n",
+            opts.duration, opts.nfiles, (unsigned long long)(opts.filesize >> 20),
+            FUSE4X_NCHANNELS, opts.daemon_threads, opts.iosize >> 10, opts.timeout,
+            opts.workloads);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t
+parse_size(const char *s)
+{
+    char *end;
+    uint64_t v = strtoull(s, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; end++; break;
+    case 'm': case 'M': v <<= 20; end++; break;
+    case 'g': case 'G': v <<= 30; end++; break;
+    }
+
+    if (end == s || *end || !v) {
+        fprintf(stderr, "bench_fuse4x: bad size '%s'\n", s);
+        usage();
+    }
+
+    return v;
+}
+
+static void
+parse_options(int argc, char *argv[])
+{
+    char *list, *item;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "t:b:d:n:s:j:i:e:o:w:")) != -1) {
+        switch (ch) {
+        case 't':
+            opts.nthreads = 0;
+            list = strdup(optarg);
+            while ((item = strsep(&list, ",")) && opts.nthreads < BENCH_MAX_THREADS) {
+                int n = atoi(item);
+                if (n <= 0 || n > BENCH_MAX_THREADS) {
+                    usage();
+                }
+                opts.threads[opts.nthreads++] = n;
+            }
+            break;
+        case 'b':
+            opts.nsizes = 0;
+            list = strdup(optarg);
+            while ((item = strsep(&list, ",")) && opts.nsizes < BENCH_MAX_SIZES) {
+                opts.sizes[opts.nsizes++] = (size_t)parse_size(item);
+            }
+            break;
+        case 'd':
+            opts.duration = (unsigned)atoi(optarg);
+            break;
+        case 'n':
+            opts.nfiles = atoi(optarg);
+            break;
+        case 's':
+            opts.filesize = parse_size(optarg);
+            break;
+        case 'j':
+            opts.daemon_threads = atoi(optarg);
+            break;
+        case 'i':
+            opts.iosize = (uint32_t)parse_size(optarg);
+            break;
+        case 'e':
+            opts.timeout = atof(optarg);
+            break;
+        case 'o':
+            list = strdup(optarg);
+            while ((item = strsep(&list, ","))) {
+                if (!strcmp(item, "batch")) {
+                    opts.init_flags |= FUSE_BATCH_IO;
+                } else if (!strcmp(item, "writeback")) {
+                    opts.init_flags |= FUSE_WRITEBACK_CACHE;
+                } else if (!strcmp(item, "readdirplus")) {
+                    opts.init_flags |= FUSE_DO_READDIRPLUS;
+                } else if (!strcmp(item, "asyncflush")) {
+                    opts.init_flags |= FUSE_ASYNC_FLUSH;
+                } else {
+                    usage();
+                }
+            }
+            break;
+        case 'w':
+            opts.workloads = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (optind + 1 != argc) {
+        usage();
+    }
+    opts.mountpoint = argv[optind];
+
+    if (!opts.nthreads) {
+        opts.threads[opts.nthreads++] = 1;
+        opts.threads[opts.nthreads++] = 2;
+        opts.threads[opts.nthreads++] = 4;
+        opts.threads[opts.nthreads++] = 8;
+    }
+    if (!opts.nsizes) {
+        opts.sizes[opts.nsizes++] = 4096;
+        opts.sizes[opts.nsizes++] = 64 * 1024;
+        opts.sizes[opts.nsizes++] = 1024 * 1024;
+    }
+
+    if (opts.nfiles <= 0 || opts.daemon_threads <= 0 || !opts.duration ||
+        opts.iosize > FUSE_MAX_IOSIZE || opts.filesize % PAGE_SIZE) {
+        usage();
+    }
+}
+
+static const struct bench_workload *
+bench_workload_find(const char *name)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(bench_workloads); i++) {
+        if (!strcmp(bench_workloads[i].name, name)) {
+            return &bench_workloads[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void
+bench_sigint(__unused int sig)
+{
+    bench_interrupted = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const struct bench_workload *selected[ARRAY_SIZE(bench_workloads)];
+    size_t nselected = 0;
+    int maxthreads = 0;
+    bool data = false;
+    char *list, *item;
+    int err = 0;
+
+    parse_options(argc, argv);
+    mach_timebase_info(&bench_timebase);
+
+    list = strdup(opts.workloads);
+    while ((item = strsep(&list, ","))) {
+        const struct bench_workload *wl = bench_workload_find(item);
+
+        if (!wl || nselected == ARRAY_SIZE(selected)) {
+            fprintf(stderr, "bench_fuse4x: unknown workload '%s'\n", item);
+            usage();
+        }
+        selected[nselected++] = wl;
+        data |= wl->data;
+    }
+
+    for (int i = 0; i < opts.nthreads; i++) {
+        maxthreads = MAX(maxthreads, opts.threads[i]);
+    }
+
+    if (bench_load_kext() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    bench_fs_init();
+
+    /* The daemon must be reading before the first access to the mount. */
+    if (bench_daemon_start() < 0 || bench_mount() < 0) {
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, bench_sigint);
+
+    printf("# " BENCH_FSNAME " on %s: /dev/" FUSE4X_DEVICE_BASENAME "%d, %d channel(s), "
+           "%d daemon thread(s), iosize %u, INIT flags 0x%x, timeout %gs\n",
+           opts.mountpoint, bench_dev.unit, bench_dev.nchannels, bench_dev.nthreads,
+           opts.iosize, opts.init_flags, opts.timeout);
+
+    if (bench_populate(maxthreads, data) < 0) {
+        err = -1;
+        goto out;
+    }
+
+    for (size_t w = 0; w < nselected && !bench_interrupted; w++) {
+        const struct bench_workload *wl = selected[w];
+
+        for (int s = 0; s < (wl->sized ? opts.nsizes : 1) && !bench_interrupted; s++) {
+            size_t block = wl->sized ? opts.sizes[s] : 0;
+
+            if (block > opts.filesize) {
+                continue;
+            }
+
+            for (int i = 0; i < opts.nthreads && !bench_interrupted; i++) {
+                if (bench_run(wl, opts.threads[i], block)) {
+                    err = -1;
+                }
+            }
+        }
+    }
+
+out:
+    bench_unmount();
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -9,6 +9,8 @@
 #include <AvailabilityMacros.h>
 #include <mach/vm_param.h>
 #include <sys/ioctl.h>
+#include <sys/param.h>
+#include <sys/types.h>
 
 /* User Control */
 
@@ -16,6 +18,84 @@
 
 #define SYSCTL_FUSE4X_TUNABLES_ADMIN      "vfs.generic.fuse4x.tunables.admin_group"
 #define SYSCTL_FUSE4X_VERSION_NUMBER      "vfs.generic.fuse4x.version.number"
+#define SYSCTL_FUSE4X_MOUNT_STATS         "vfs.generic.fuse4x.resourceusage.mount_stats"
+
+/* Per-Mount Statistics */
+
+/*
+ * SYSCTL_FUSE4X_MOUNT_STATS reads as an array of struct fuse_mount_stats,
+ * one for every mounted device. Requests are accounted by opcode; opcodes
+ * from FUSE_STATS_MAX_OPCODE up are not accounted.
+ *
+ * Latencies go to log2 histograms of microseconds: bucket i counts the
+ * requests that took [2^i, 2^(i+1)) us, bucket 0 also those under 1 us and
+ * the last bucket everything longer. queue_hist is the time a request spent
+ * in the kernel queue until the daemon read it, daemon_hist the time from
+ * that read to the daemon's answer. Requests that get no answer (FORGET,
+ * INTERRUPT, rejected ones) only show up in queue_hist.
+ */
+#define FUSE_STATS_MAX_OPCODE              64
+#define FUSE_MS_CLASSES                    3
+#define FUSE_STATS_HIST_BUCKETS            32
+
+struct fuse_opcode_stats {
+    uint64_t count;       /* requests read by the daemon */
+    uint64_t bytes_in;    /* bytes of those requests, headers included */
+    uint64_t answers;     /* answers written by the daemon */
+    uint64_t bytes_out;   /* bytes of those answers, headers included */
+    uint32_t queue_hist[FUSE_STATS_HIST_BUCKETS];
+    uint32_t daemon_hist[FUSE_STATS_HIST_BUCKETS];
+};
+
+struct fuse_mount_stats {
+    uint32_t unit;                /* N of /dev/fuse4xN */
+    uint32_t ms_depth;            /* requests queued for the daemon */
+    uint32_t ms_depth_max;
+    uint32_t aw_depth;            /* requests waiting for an answer */
+    uint32_t aw_depth_max;
+    char     mntonname[MAXPATHLEN];
+    uint64_t ra_issued;           /* bytes asked for by readahead */
+    uint64_t ra_hits;             /* of those, bytes the reader came for */
+    uint64_t ra_waste;            /* bytes left behind when a stream broke */
+    uint32_t node_count;          /* vnodes in the nodeid hash */
+    uint32_t node_buckets;
+    uint32_t node_buckets_used;
+    uint32_t node_chain_max;      /* longest bucket chain since the last resize */
+    uint64_t node_collisions;     /* inserts into a non-empty bucket */
+    uint64_t ms_steals;           /* requests read from another channel's queue */
+    uint32_t ms_class_depth[FUSE_MS_CLASSES]; /* ms_depth by metadata, data, background */
+    uint32_t dirty_nodes;         /* vnodes on the dirty list */
+    struct fuse_opcode_stats op[FUSE_STATS_MAX_OPCODE];
+};
+
+/* Tracepoints */
+
+/*
+ * Tickets report their lifecycle as kdebug events of class DBG_FSYSTEM,
+ * subclass FUSE4X_KDBG_SUBCLASS, for trace(1) and friends. On LP64 kernels
+ * the arguments of every event are the unique, the opcode, the nodeid, and
+ * a size in the upper and an error in the lower 32 bits of the fourth. The
+ * arguments of an i386 kernel are 32 bits wide: there an event carries the
+ * low and high halves of the unique and of the nodeid, and is followed by an
+ * ARGS event with the low half of the unique, the opcode, the size and the
+ * error.
+ *
+ *   FETCH    set up for a request         size of the request header+body
+ *   ENQUEUE  queued for the daemon        size of the whole message
+ *   DEQUEUE  read by the daemon           size of the whole message
+ *   REPLY    answer matched to it         size of the answer, its error
+ *   WAKEUP   answer handed to the waiter  0, error of the pull
+ *   DROP     back to the free list        0, 0
+ */
+#define FUSE4X_KDBG_SUBCLASS               0xf4
+
+#define FUSE4X_KDBG_TICKET_FETCH           1
+#define FUSE4X_KDBG_TICKET_ENQUEUE         2
+#define FUSE4X_KDBG_TICKET_DEQUEUE         3
+#define FUSE4X_KDBG_TICKET_REPLY           4
+#define FUSE4X_KDBG_TICKET_WAKEUP          5
+#define FUSE4X_KDBG_TICKET_DROP            6
+#define FUSE4X_KDBG_TICKET_ARGS            7
 
 /* Paths */
 
@@ -38,6 +118,17 @@
  */
 #define FUSE4X_NDEVICES                   24
 
+/*
+ * A daemon can read requests through up to this many channels per mount.
+ * Channel 0 is /dev/fuse4x<n> itself. Channel <c> is /dev/fuse4x<n>.<c>;
+ * the daemon opens it after /dev/fuse4x<n>, with the same credentials.
+ * Every channel has its own request queue. Requests are spread over the
+ * open channels by nodeid, or by the submitting CPU if they have no
+ * particular node; a reader with nothing queued steals from the others.
+ * Replies can be written to any channel.
+ */
+#define FUSE4X_NCHANNELS                  8
+
 /*
  * This is the default block size of the virtual storage devices that are
  * implicitly implemented by the FUSE kernel extension. This can be changed
@@ -55,7 +146,8 @@
  * Before 10.7 because of a bug there is an increased probability of a kernel panic
  * due to potentially running out of vm maps if a buf_map() is called on large (32Mb) IO's
  * (and there is other stuff doing a lot of user-kernel maps, like some driver).
- * This is fixed in 10.7.
+ * This is fixed in 10.7. Cluster bufs go through their UPL and are never mapped, but
+ * strategy still maps every other buf, so the smaller limit stays.
  */
 #  define MAX_IO_PAGES 4096
 #endif
@@ -84,7 +176,127 @@
  */
 #define FUSE_DEFAULT_MAX_FREE_TICKETS      1024
 #define FUSE_DEFAULT_IOV_PERMANENT_BUFSIZE (1 << 19)
-#define FUSE_DEFAULT_IOV_CREDIT            16
+
+/*
+ * Message buffers of a ticket start out inline in the ticket. Bigger ones
+ * come from per-mount pools of size classes PAGE_SIZE << 0..8 (4K to 1M with
+ * 4K pages), each with FUSE_IOV_HEADROOM extra bytes for the FUSE headers in
+ * front of the data. A class keeps at most FUSE_IOV_POOL_CLASS_BUDGET bytes
+ * of free buffers; anything beyond that goes back to the allocator.
+ */
+#define FUSE_IOV_INLINE_SIZE               512
+#define FUSE_IOV_HEADROOM                  256
+#define FUSE_IOV_POOL_CLASSES              9
+#define FUSE_IOV_POOL_CLASS_BUDGET         (4 * 1024 * 1024)
+
+/*
+ * Requests wait in three classes per channel: metadata, data an application
+ * is waiting for, and background work (readahead, write-behind, FLUSH,
+ * RELEASE, FORGET and DESTROY). A round of dequeuing hands out up to this many requests
+ * of each class, metadata first; a class with nothing queued gives its
+ * share up to the others.
+ */
+#define FUSE_MS_WEIGHT_METADATA            8
+#define FUSE_MS_WEIGHT_DATA                4
+#define FUSE_MS_WEIGHT_BACKGROUND          2
+
+/*
+ * vnodes of a mount are found by nodeid in a hash table. It starts with the
+ * node_hash_buckets tunable rounded up to a power of 2 when the device is
+ * opened, and doubles whenever it holds more than FUSE_NODE_HASH_LOAD nodes
+ * per bucket, up to FUSE_MAX_NODE_HASH_BUCKETS. Buckets share
+ * FUSE_NODE_HASH_LOCKS locks, which is never more than there are buckets.
+ */
+#define FUSE_DEFAULT_NODE_HASH_BUCKETS     (1 << 10)
+#define FUSE_MIN_NODE_HASH_BUCKETS         (1 << 6)
+#define FUSE_MAX_NODE_HASH_BUCKETS         (1 << 22)
+#define FUSE_NODE_HASH_LOAD                2
+#define FUSE_NODE_HASH_LOCKS               64
+
+/*
+ * Tickets waiting for an answer from the daemon are kept in a hash table
+ * keyed by the ticket's unique id. Each bucket has its own lock, so replies
+ * coming from different daemon threads rarely contend. Must be a power of 2.
+ */
+#define FUSE_AW_HASH_BUCKETS               64
+
+/*
+ * Free tickets are cached in several lists, each with its own lock. A thread
+ * picks the list by hashing its thread pointer. Must be a power of 2.
+ */
+#define FUSE_TICKET_CACHE_SHARDS           16
+
+/*
+ * Tickets do not allocate a mutex each; they share one of a per-mount set of
+ * preallocated answer-wait mutexes, picked by the ticket's unique id.
+ * Must be a power of 2.
+ */
+#define FUSE_TICKET_WAIT_LOCKS             32
+
+/*
+ * This is the default number of chunks of one strategy buf that may be
+ * waiting for the daemon at the same time.
+ */
+#define FUSE_DEFAULT_STRATEGY_MAX_INFLIGHT 8
+
+/*
+ * This is the default number of reads or writes one direct_io call may keep
+ * waiting for the daemon at the same time. The tunable is clamped to
+ * FUSE_MAX_DIRECTIO_INFLIGHT, which sizes the dispatcher array on the stack.
+ */
+#define FUSE_DEFAULT_DIRECTIO_MAX_INFLIGHT 4
+#define FUSE_MAX_DIRECTIO_INFLIGHT         8
+
+/*
+ * This is the default number of FSYNC or FSYNCDIR requests sync keeps
+ * waiting for the daemon at the same time. The tunable is clamped to
+ * FUSE_MAX_SYNC_INFLIGHT, which sizes the dispatcher array on the stack.
+ */
+#define FUSE_DEFAULT_SYNC_MAX_INFLIGHT     8
+#define FUSE_MAX_SYNC_INFLIGHT             16
+
+/*
+ * Upper bound on the memory the readdir cache may hold for one directory.
+ */
+#define FUSE_DIRCACHE_MAX_SIZE             (256 * 1024)
+
+/*
+ * Upper bounds on the memory the xattr cache may hold for one node, and on
+ * a single value (or name list) it keeps. Bigger values are cached by size
+ * only.
+ */
+#define FUSE_XATTRCACHE_MAX_SIZE           (16 * 1024)
+#define FUSE_XATTRCACHE_MAX_VALUE          4096
+
+/*
+ * Forgotten nodes are sent to daemons that speak 7.16 in BATCH_FORGET
+ * messages of up to this many entries. A partial batch goes out when the
+ * daemon runs out of other work, or at the latest FUSE_FORGET_BATCH_TIMEOUT
+ * milliseconds after its oldest entry was queued.
+ */
+#define FUSE_FORGET_BATCH_MAX              128
+#define FUSE_FORGET_BATCH_TIMEOUT          50
+
+/*
+ * Sequential readers of cached files get a prefetch window that starts at
+ * FUSE_READAHEAD_MIN_WINDOW bytes and doubles every time the reader catches
+ * up with it, up to the max_readahead negotiated in INIT (FUSE_MAX_IOSIZE at
+ * most). A non-sequential read resets it.
+ */
+#define FUSE_READAHEAD_MIN_WINDOW          (128 * 1024)
+
+/*
+ * With write-back caching, the per-mount flusher wakes up this often (in
+ * seconds) and starts writing out files that were written to since.
+ */
+#define FUSE_WRITEBACK_INTERVAL            5
+
+/*
+ * The hot statistics counters are kept in this many cache-line-sized slots,
+ * one per CPU, and added up when read through sysctl. Must be a power of 2.
+ */
+#define FUSE_COUNTER_SLOTS                 32
+#define FUSE_CACHE_LINE_SIZE               64
 
 /* User-Kernel IPC Buffer */
 
@@ -38,6 +38,13 @@
 #endif /* __LP64__ */
 #endif
 
+/*
+ * EXPERIMENTAL, UNVERIFIED: has never been built, run or stress tested.
+ * Adds the fine_grained_locking tunable, which lets mounts run without the
+ * biglock. Leave it off in anything that ships.
+ */
+// #define FUSE4X_ENABLE_FINE_LOCKING
+
 #ifdef FUSE4X_ENABLE_BIGLOCK
 #define FUSE_VNOP_EXPORT __private_extern__
 #else
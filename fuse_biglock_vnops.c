@@ -215,9 +215,15 @@ FUSE_VNOP_EXPORT
 int
 fuse_biglock_vnop_link(struct vnop_link_args *ap)
 {
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+	/* kpi_vfs.c only locks a_vp, but the link also changes a_tdvp (its
+	 * attributes and readdir cache), so lock that one too. */
+	nodelocked_pair_vnop(ap->a_tdvp, ap->a_vp, fuse_vnop_link, ap);
+#else
 	/* TODO: What about a_tdvp? No need to lock that one? kpi_vfs.c does
 	 * not, but maybe we should... */
 	nodelocked_vnop(ap->a_vp, fuse_vnop_link, ap);
+#endif
 }
 
 /*
@@ -403,7 +409,11 @@ FUSE_VNOP_EXPORT
 int
 fuse_biglock_vnop_pathconf(struct vnop_pathconf_args *ap)
 {
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+	shared_nodelocked_vnop(ap->a_vp, fuse_vnop_pathconf, ap);
+#else
 	nodelocked_vnop(ap->a_vp, fuse_vnop_pathconf, ap);
+#endif
 }
 
 /*
@@ -442,6 +452,27 @@ fuse_biglock_vnop_readdir(struct vnop_readdir_args *ap)
 	nodelocked_vnop(ap->a_vp, fuse_vnop_readdir, ap);
 }
 
+/*
+ struct vnop_readdirattr_args {
+ struct vnodeop_desc *a_desc;
+ vnode_t              a_vp;
+ struct attrlist     *a_alist;
+ struct uio          *a_uio;
+ uint32_t             a_maxcount;
+ uint32_t             a_options;
+ uint32_t            *a_newstate;
+ int                 *a_eofflag;
+ uint32_t            *a_actualcount;
+ vfs_context_t        a_context;
+ };
+ */
+FUSE_VNOP_EXPORT
+int
+fuse_biglock_vnop_readdirattr(struct vnop_readdirattr_args *ap)
+{
+	nodelocked_vnop(ap->a_vp, fuse_vnop_readdirattr, ap);
+}
+
 /*
  struct vnop_readlink_args {
  struct vnodeop_desc *a_desc;
@@ -454,7 +485,11 @@ FUSE_VNOP_EXPORT
 int
 fuse_biglock_vnop_readlink(struct vnop_readlink_args *ap)
 {
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+	shared_nodelocked_vnop(ap->a_vp, fuse_vnop_readlink, ap);
+#else
 	nodelocked_vnop(ap->a_vp, fuse_vnop_readlink, ap);
+#endif
 }
 
 /*
@@ -485,7 +520,12 @@ FUSE_VNOP_EXPORT
 int
 fuse_biglock_vnop_remove(struct vnop_remove_args *ap)
 {
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+	/* a_dvp is changed as well, see fuse_biglock_vnop_link(). */
+	nodelocked_pair_vnop(ap->a_dvp, ap->a_vp, fuse_vnop_remove, ap);
+#else
 	nodelocked_vnop(ap->a_vp, fuse_vnop_remove, ap);
+#endif
 }
 
 /*
@@ -541,9 +581,14 @@ FUSE_VNOP_EXPORT
 int
 fuse_biglock_vnop_rmdir(struct vnop_rmdir_args *ap)
 {
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+	/* a_dvp is changed as well, see fuse_biglock_vnop_link(). */
+	nodelocked_pair_vnop(ap->a_dvp, ap->a_vp, fuse_vnop_rmdir, ap);
+#else
 	/* TODO: Shouldn't we also lock ap->a_dvp? kpi_vfs.c does not, but maybe
 	 * we should anyway... */
 	nodelocked_vnop(ap->a_vp, fuse_vnop_rmdir, ap);
+#endif
 }
 
 /*
@@ -704,7 +749,7 @@ struct vnodeopv_entry_desc fuse_biglock_vnode_operation_entries[] = {
     { &vnop_pathconf_desc,      (fuse_vnode_op_t) fuse_biglock_vnop_pathconf      },
     { &vnop_read_desc,          (fuse_vnode_op_t) fuse_biglock_vnop_read          },
     { &vnop_readdir_desc,       (fuse_vnode_op_t) fuse_biglock_vnop_readdir       },
-    //  { &vnop_readdirattr_desc,   (fuse_vnode_op_t) fuse_biglock_vnop_readdirattr   },
+    { &vnop_readdirattr_desc,   (fuse_vnode_op_t) fuse_biglock_vnop_readdirattr   },
     { &vnop_readlink_desc,      (fuse_vnode_op_t) fuse_biglock_vnop_readlink      },
     { &vnop_reclaim_desc,       (fuse_vnode_op_t) fuse_biglock_vnop_reclaim       },
     { &vnop_remove_desc,        (fuse_vnode_op_t) fuse_biglock_vnop_remove        },
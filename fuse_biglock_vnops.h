@@ -18,8 +18,21 @@
 #define biglock_log(fmt, ...)   {}
 #endif
 
-#define fuse_biglock_lock(lock)   fuse_lck_mtx_lock(lock)
-#define fuse_biglock_unlock(lock) fuse_lck_mtx_unlock(lock)
+/*
+ * Mounts set up with fine-grained locking have no biglock (it is NULL) and
+ * rely on the node locks taken by the wrappers below.
+ */
+#define fuse_biglock_lock(lock) \
+    do { \
+        if (lock) \
+            fuse_lck_mtx_lock(lock); \
+    } while(0)
+
+#define fuse_biglock_unlock(lock) \
+    do { \
+        if (lock) \
+            fuse_lck_mtx_unlock(lock); \
+    } while(0)
 
 #define fuse_nodelock_lock(node, type) \
     do { \
@@ -113,6 +126,24 @@
         return res; \
     } while(0)
 
+/**
+ * Wrapper that surrounds a vnop call with biglock locking and shared
+ * single-node locking, for vnops that do not modify the node.
+ */
+#define shared_nodelocked_vnop(vnode, vnop, args) \
+    do { \
+        int res; \
+        vnode_t vp = (vnode); \
+        struct fuse_data *data __unused = fuse_get_mpdata(vnode_mount(vp)); \
+        struct fuse_vnode_data *node = VTOFUD(vp); \
+        fuse_nodelock_lock(node, FUSEFS_SHARED_LOCK); \
+        fuse_biglock_lock(data->biglock); \
+        res = vnop(args); \
+        fuse_biglock_unlock(data->biglock); \
+        fuse_nodelock_unlock(node); \
+        return res; \
+    } while(0)
+
 /**
  * Wrapper that surrounds a vnop call with biglock locking and dual node
  * locking.
@@ -223,7 +254,7 @@ FUSE_VNOP_EXPORT int fuse_biglock_vnop_read(struct vnop_read_args *ap);
 
 FUSE_VNOP_EXPORT int fuse_biglock_vnop_readdir(struct vnop_readdir_args *ap);
 
-// FUSE_VNOP_EXPORT int fuse_biglock_vnop_readdirattr(struct vnop_readdirattr_args *ap);
+FUSE_VNOP_EXPORT int fuse_biglock_vnop_readdirattr(struct vnop_readdirattr_args *ap);
 
 FUSE_VNOP_EXPORT int fuse_biglock_vnop_readlink(struct vnop_readlink_args *ap);
 
@@ -14,7 +14,9 @@
 
 #include <libkern/libkern.h>
 #include <stdbool.h>
+#include <sys/poll.h>
 #include <sys/queue.h>
+#include <sys/select.h>
 
 static int  fuse_cdev_major          = -1;
 static bool fuse_interface_available = false;
@@ -23,15 +25,19 @@ static struct fuse_device fuse_device_table[FUSE4X_NDEVICES];
 
 #define FUSE_DEVICE_FROM_UNIT_FAST(u) (fuse_device_t)&(fuse_device_table[(u)])
 
+/* Channel <c> of unit <u> has minor u + c * FUSE4X_NDEVICES. */
+#define FUSE_DEVICE_UNIT(dev)    (minor(dev) % FUSE4X_NDEVICES)
+#define FUSE_DEVICE_CHANNEL(dev) (minor(dev) / FUSE4X_NDEVICES)
+
 /* Interface for VFS */
 
 /* Doesn't need lock. */
 fuse_device_t
 fuse_device_get(dev_t dev)
 {
-    int unit = minor(dev);
+    int unit = FUSE_DEVICE_UNIT(dev);
 
-    if ((unit < 0) || (unit >= FUSE4X_NDEVICES)) {
+    if ((unit < 0) || (FUSE_DEVICE_CHANNEL(dev) >= FUSE4X_NCHANNELS)) {
         return NULL;
     }
 
@@ -49,24 +55,54 @@ fuse_device_close_final(fuse_device_t fdev)
 }
 
 
-static __inline__
+/*
+ * Fails every request that waits for an answer. For a session that has been
+ * killed, nobody else is going to.
+ */
+__private_extern__
 void
 fuse_reject_answers(struct fuse_data *data)
 {
     struct fuse_ticket *ticket;
+    TAILQ_HEAD(, fuse_ticket) async_head = TAILQ_HEAD_INITIALIZER(async_head);
 
-    fuse_lck_mtx_lock(data->aw_mtx);
+    for (int i = 0; i < FUSE_AW_HASH_BUCKETS; i++) {
+        struct fuse_aw_bucket *bucket = &data->aw_hash[i];
 
-    TAILQ_FOREACH(ticket, &data->aw_head, aw_link) {
-        fuse_lck_mtx_lock(ticket->aw_mtx);
-        ticket->answered = true;
-        ticket->aw_errno = ENOTCONN;
-        fuse_wakeup(ticket);
-        fuse_lck_mtx_unlock(ticket->aw_mtx);
+        fuse_lck_mtx_lock(bucket->mtx);
+
+        while ((ticket = TAILQ_FIRST(&bucket->head))) {
+            TAILQ_REMOVE(&bucket->head, ticket, aw_link);
+            OSDecrementAtomic((SInt32 *)&data->stats.aw_depth);
+
+            if (ticket->async) {
+                /* Completed below, nobody is going to wake up for it. */
+                TAILQ_INSERT_TAIL(&async_head, ticket, aw_link);
+                continue;
+            }
+
+            fuse_lck_mtx_lock(ticket->aw_mtx);
+            if (ticket->abandoned) {
+                /* Its requester is gone; no answer will come to drop it. */
+                fuse_lck_mtx_unlock(ticket->aw_mtx);
+                fuse_ticket_drop(ticket);
+                continue;
+            }
+            ticket->answered = true;
+            ticket->aw_errno = ENOTCONN;
+            fuse_wakeup(ticket);
+            fuse_lck_mtx_unlock(ticket->aw_mtx);
+        }
+
+        fuse_lck_mtx_unlock(bucket->mtx);
     }
-    TAILQ_INIT(&data->aw_head); // Remove all tickets from the queue
 
-    fuse_lck_mtx_unlock(data->aw_mtx);
+    /* Asynchronous tickets get their callback invoked with no answer. */
+    while ((ticket = TAILQ_FIRST(&async_head))) {
+        TAILQ_REMOVE(&async_head, ticket, aw_link);
+        ticket->aw_errno = ENOTCONN;
+        ticket->aw_callback(ticket, NULL);
+    }
 }
 
 /* /dev/fuse4xN implementation */
@@ -75,6 +111,7 @@ d_open_t   fuse_device_open;
 d_close_t  fuse_device_close;
 d_read_t   fuse_device_read;
 d_write_t  fuse_device_write;
+d_select_t fuse_device_select;
 
 static struct cdevsw fuse_device_cdevsw = {
     /* open     */ fuse_device_open,
@@ -85,7 +122,7 @@ static struct cdevsw fuse_device_cdevsw = {
     /* stop     */ eno_stop,
     /* reset    */ eno_reset,
     /* ttys     */ NULL,
-    /* select   */ eno_select,
+    /* select   */ fuse_device_select,
     /* mmap     */ eno_mmap,
     /* strategy */ eno_strat,
     /* getc     */ eno_getc,
@@ -93,6 +130,110 @@ static struct cdevsw fuse_device_cdevsw = {
     /* flags    */ D_TTY,
 };
 
+/*
+ * Opens an additional channel of a session the daemon has already opened
+ * through /dev/fuse4xN.
+ */
+static int
+fuse_device_open_channel(dev_t dev, struct proc *p)
+{
+    int error = 0;
+    int chan = FUSE_DEVICE_CHANNEL(dev);
+    struct fuse_device *fdev;
+    struct fuse_data   *data;
+    kauth_cred_t        cred;
+
+    if (chan >= FUSE4X_NCHANNELS) {
+        return ENOENT;
+    }
+
+    fdev = FUSE_DEVICE_FROM_UNIT_FAST(FUSE_DEVICE_UNIT(dev));
+
+    /* The channel keeps the kext from being unloaded under it. */
+    fuse_lck_mtx_lock(fuse_device_mutex);
+    fdev->usecount++;
+    fuse_lck_mtx_lock(fdev->mtx);
+    fuse_lck_mtx_unlock(fuse_device_mutex);
+
+    data = fdev->data;
+    if (!data || !data->opened || data->dead) {
+        error = ENXIO;
+        goto out;
+    }
+
+    if (data->ch_open & (1U << chan)) {
+        error = EBUSY;
+        goto out;
+    }
+
+    cred = kauth_cred_proc_ref(p);
+    if (fuse_match_cred(data->daemoncred, cred)) {
+        error = EPERM;
+    }
+    kauth_cred_unref(&cred);
+
+    if (!error) {
+        fuse_lck_mtx_lock(data->ch[chan].mtx);
+        data->ch[chan].closed = false;
+        fuse_lck_mtx_unlock(data->ch[chan].mtx);
+        data->ch_open |= 1U << chan;
+    }
+
+out:
+    fuse_lck_mtx_unlock(fdev->mtx);
+
+    if (error) {
+        fuse_lck_mtx_lock(fuse_device_mutex);
+        fdev->usecount--;
+        fuse_lck_mtx_unlock(fuse_device_mutex);
+    }
+
+    return error;
+}
+
+static int
+fuse_device_close_channel(dev_t dev)
+{
+    struct fuse_device  *fdev = FUSE_DEVICE_FROM_UNIT_FAST(FUSE_DEVICE_UNIT(dev));
+    struct fuse_data    *data;
+    struct fuse_channel *ch, *ch0;
+
+    fuse_lck_mtx_lock(fdev->mtx);
+
+    data = fdev->data;
+    if (!data) {
+        panic("fuse4x: no device private data in device_close");
+    }
+
+    data->ch_open &= ~(1U << FUSE_DEVICE_CHANNEL(dev));
+
+    /* Whatever is still queued here goes to the primary channel. */
+    ch  = &data->ch[FUSE_DEVICE_CHANNEL(dev)];
+    ch0 = &data->ch[0];
+    fuse_lck_mtx_lock(ch->mtx);
+    ch->closed = true;
+    fuse_lck_mtx_lock(ch0->mtx);
+    if (!fuse_channel_empty(ch)) {
+        fuse_channel_move(data, ch0, ch);
+        fuse_wakeup_one(ch0);
+    }
+    fuse_lck_mtx_unlock(ch0->mtx);
+    fuse_lck_mtx_unlock(ch->mtx);
+    selwakeup(&ch0->rsel);
+
+    if (!data->opened && !data->mounted && !data->ch_open) {
+        fuse_device_close_final(fdev);
+    }
+
+    fuse_lck_mtx_unlock(fdev->mtx);
+
+    fuse_lck_mtx_lock(fuse_device_mutex);
+    fdev->usecount--;
+    fuse_lck_mtx_unlock(fuse_device_mutex);
+
+    return KERN_SUCCESS;
+}
+
 int
 fuse_device_open(dev_t dev, __unused int flags, __unused int devtype,
                  struct proc *p)
@@ -107,6 +248,10 @@ fuse_device_open(dev_t dev, __unused int flags, __unused int devtype,
         return ENOENT;
     }
 
+    if (FUSE_DEVICE_CHANNEL(dev) != 0) {
+        return fuse_device_open_channel(dev, p);
+    }
+
     unit = minor(dev);
     if ((unit >= FUSE4X_NDEVICES) || (unit < 0)) {
         fuse_lck_mtx_unlock(fuse_device_mutex);
@@ -176,6 +321,10 @@ fuse_device_close(dev_t dev, __unused int flags, __unused int devtype,
 
     fuse_trace_printf_func();
 
+    if (FUSE_DEVICE_CHANNEL(dev) != 0) {
+        return fuse_device_close_channel(dev);
+    }
+
     unit = minor(dev);
     if (unit >= FUSE4X_NDEVICES) {
         return ENOENT;
@@ -199,7 +348,7 @@ fuse_device_close(dev_t dev, __unused int flags, __unused int devtype,
 
     fuse_reject_answers(data);
 
-    if (!data->mounted) {
+    if (!data->mounted && !data->ch_open) {
         /* We're not mounted. Can destroy mpdata. */
         fuse_device_close_final(fdev);
     }
@@ -221,52 +370,210 @@ fuse_device_close(dev_t dev, __unused int flags, __unused int devtype,
     return KERN_SUCCESS;
 }
 
-int
-fuse_device_read(dev_t dev, uio_t uio, int ioflag)
+/* Copies the message of the ticket to the daemon's buffer. */
+static int
+fuse_device_copyout(struct fuse_data *data, struct fuse_ticket *ticket, uio_t uio)
 {
     int i, err = 0;
     size_t buflen[3];
     void *buf[] = { NULL, NULL, NULL };
 
-    struct fuse_device *fdev;
-    struct fuse_data   *data;
-    struct fuse_ticket *ticket;
+    switch (ticket->ms_type) {
+
+    case FT_M_FIOV:
+        buf[0]    = ticket->ms_fiov.base;
+        buflen[0] = ticket->ms_fiov.len;
+        break;
+
+    case FT_M_BUF:
+        buf[0]    = ticket->ms_fiov.base;
+        buflen[0] = ticket->ms_fiov.len;
+        buf[1]    = ticket->ms_bufdata;
+        buflen[1] = ticket->ms_bufsize;
+        break;
+
+    case FT_M_UPL:
+        buf[0]    = ticket->ms_fiov.base;
+        buflen[0] = ticket->ms_fiov.len;
+        break;
+
+    default:
+        panic("fuse4x: unknown message type for ticket %p", ticket);
+    }
+
+    for (i = 0; buf[i]; i++) {
+        if (uio_resid(uio) < (user_ssize_t)buflen[i]) {
+            data->dead = true;
+            err = ENODEV;
+            break;
+        }
+
+        err = uiomove(buf[i], (int)buflen[i], uio);
+
+        if (err) {
+            break;
+        }
+    }
+
+    if (!err && ticket->ms_type == FT_M_UPL) {
+        int resid = (int)ticket->ms_bufsize;
+
+        if (uio_resid(uio) < (user_ssize_t)ticket->ms_bufsize) {
+            data->dead = true;
+            return ENODEV;
+        }
+
+        /* Straight from the physical pages, they need no kernel mapping. */
+        err = cluster_copy_upl_data(uio, ticket->ms_upl,
+                                    (int)ticket->ms_uploff, &resid);
+    }
+
+    return err;
+}
+
+/*
+ * Takes the next request for a reader of <ch>, whose mutex is held. If
+ * the channel's own queue is empty and other channels are open, the reader
+ * steals from their queues. The mutex is dropped in the meantime.
+ */
+static struct fuse_ticket *
+fuse_channel_dequeue(struct fuse_data *data, struct fuse_channel *ch)
+{
+    struct fuse_ticket *ticket = fuse_channel_pop(data, ch);
+
+    if (ticket || !data->ch_open) {
+        return ticket;
+    }
+
+    fuse_lck_mtx_unlock(ch->mtx);
+
+    for (int i = 0; i < FUSE4X_NCHANNELS && !ticket; i++) {
+        struct fuse_channel *victim = &data->ch[i];
+
+        /* Peeked at without the lock, checked again under it. */
+        if (victim == ch || fuse_channel_empty(victim)) {
+            continue;
+        }
+
+        fuse_lck_mtx_lock(victim->mtx);
+        ticket = fuse_channel_pop(data, victim);
+        fuse_lck_mtx_unlock(victim->mtx);
+
+        if (ticket) {
+            OSIncrementAtomic64((SInt64 *)&data->stats.ms_steals);
+        }
+    }
+
+    fuse_lck_mtx_lock(ch->mtx);
+
+    if (!ticket) {
+        ticket = fuse_channel_pop(data, ch);
+    }
+
+    return ticket;
+}
+
+/*
+ * A requester that gives up once the ticket has left the queue leaves it to
+ * the answer. If the daemon is not going to see it, that answer never comes
+ * and the reader drops the ticket instead. Returns true if it did.
+ *
+ * Otherwise the ticket is marked read. The decision is made under aw_mtx,
+ * so a requester giving up later sees the mark and sends an INTERRUPT,
+ * and one that gave up earlier sends none.
+ */
+static bool
+fuse_device_reclaim(struct fuse_data *data, struct fuse_ticket *ticket)
+{
+    bool abandoned;
+
+    fuse_lck_mtx_lock(ticket->aw_mtx);
+    abandoned = ticket->abandoned;
+    if (!abandoned) {
+        ticket->read = true;
+    }
+    fuse_lck_mtx_unlock(ticket->aw_mtx);
+
+    /* Stable once set; a late abandon is left to the answer. */
+    if (!abandoned) {
+        return false;
+    }
+
+    /* Or fuse_reject_answers() has it and drops it. */
+    if (fuse_remove_callback(data, ticket->unique) == ticket) {
+        fuse_ticket_drop(ticket);
+    }
+
+    return true;
+}
+
+int
+fuse_device_read(dev_t dev, uio_t uio, int ioflag)
+{
+    int err = 0;
+
+    struct fuse_device  *fdev;
+    struct fuse_data    *data;
+    struct fuse_channel *ch;
+    struct fuse_ticket  *ticket;
+    uint32_t             gen;
 
     fuse_trace_printf_func();
 
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(minor(dev));
+    fdev = fuse_device_get(dev);
     if (!fdev) {
         return ENXIO;
     }
 
     data = fdev->data;
+    ch = &data->ch[FUSE_DEVICE_CHANNEL(dev)];
 
-    fuse_lck_mtx_lock(data->ms_mtx);
+    fuse_lck_mtx_lock(ch->mtx);
 
     /* The read loop (outgoing messages to the user daemon). */
 
 again:
+    /* Sampled before looking, so a request queued meanwhile is noticed. */
+    gen = *(volatile uint32_t *)&data->ms_gen;
+
     if (data->dead) {
-        fuse_lck_mtx_unlock(data->ms_mtx);
+        fuse_lck_mtx_unlock(ch->mtx);
         return ENODEV;
     }
 
-    if ((ticket = STAILQ_FIRST(&data->ms_head))) {
-        STAILQ_REMOVE_HEAD(&data->ms_head, ms_link);
-    } else {
+    if (!(ticket = fuse_channel_dequeue(data, ch))) {
+        /* Idle: hand the daemon the forgets that have piled up. */
+        if (data->forget_count) {
+            fuse_lck_mtx_unlock(ch->mtx);
+            fuse_internal_forget_flush(data);
+            fuse_lck_mtx_lock(ch->mtx);
+            goto again;
+        }
         if (ioflag & IO_NDELAY) {
-            fuse_lck_mtx_unlock(data->ms_mtx);
+            fuse_lck_mtx_unlock(ch->mtx);
             return EAGAIN;
         }
-        err = fuse_msleep(data, data->ms_mtx, PCATCH, "fu_msg", NULL);
+
+        /*
+         * A request queued on another channel since we sampled gen may have
+         * found no reader asleep: look again. Otherwise its enqueuer sees
+         * ms_idle and wakes us, see fuse_insert_message().
+         */
+        ch->waiters++;
+        OSIncrementAtomic((SInt32 *)&data->ms_idle);
+        if (*(volatile uint32_t *)&data->ms_gen == gen) {
+            err = fuse_msleep(ch, ch->mtx, PCATCH, "fu_msg", NULL);
+        }
+        OSDecrementAtomic((SInt32 *)&data->ms_idle);
+        ch->waiters--;
         if (err) {
-            fuse_lck_mtx_unlock(data->ms_mtx);
+            fuse_lck_mtx_unlock(ch->mtx);
             return (data->dead ? ENODEV : err);
         }
         goto again;
     }
 
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    fuse_lck_mtx_unlock(ch->mtx);
 
     if (data->dead) {
          if (ticket) {
@@ -275,74 +582,89 @@ again:
          return ENODEV;
     }
 
-    switch (ticket->ms_type) {
+    /* Given up on between being queued and read, look for other work. */
+    if (fuse_device_reclaim(data, ticket)) {
+        fuse_lck_mtx_lock(ch->mtx);
+        goto again;
+    }
 
-    case FT_M_FIOV:
-        buf[0]    = ticket->ms_fiov.base;
-        buflen[0] = ticket->ms_fiov.len;
-        break;
+    err = fuse_device_copyout(data, ticket, uio);
+    if (!err) {
+        fuse_stats_sent(ticket);
+        fuse_ticket_trace(FUSE4X_KDBG_TICKET_DEQUEUE, ticket,
+                          fuse_ticket_msglen(ticket), 0);
+    }
 
-    case FT_M_BUF:
-        buf[0]    = ticket->ms_fiov.base;
-        buflen[0] = ticket->ms_fiov.len;
-        buf[1]    = ticket->ms_bufdata;
-        buflen[1] = ticket->ms_bufsize;
-        break;
+    /*
+     * The FORGET message is an example of a ticket that has explicitly
+     * been invalidated by the sender. The sender is not expecting or wanting
+     * a reply, so he sets the 'invalid' field in the ticket.
+     */
 
-    default:
-        panic("fuse4x: unknown message type for ticket %p", ticket);
+    fuse_ticket_drop_invalid(ticket);
+
+    if (err || !(data->dataflags & FSESS_BATCH_IO)) {
+        return err;
     }
 
-    for (i = 0; buf[i]; i++) {
-        if (uio_resid(uio) < (user_ssize_t)buflen[i]) {
-            data->dead = true;
-            err = ENODEV;
+    /*
+     * The daemon negotiated batched I/O: hand out all the messages that are
+     * already queued and fit into the rest of the buffer. Each message is
+     * framed by its own fuse_in_header. We never sleep for more messages here.
+     */
+
+    fuse_lck_mtx_lock(ch->mtx);
+
+    while (!data->dead && (ticket = fuse_channel_pop(data, ch))) {
+        if (fuse_ticket_msglen(ticket) > (size_t)uio_resid(uio)) {
+            /* Does not fit, it goes first in the next read. */
+            fuse_channel_unpop(data, ch, ticket);
             break;
         }
+        fuse_lck_mtx_unlock(ch->mtx);
 
-        err = uiomove(buf[i], (int)buflen[i], uio);
+        /* Requester has already given up on this one, do not send it. */
+        if (fuse_device_reclaim(data, ticket)) {
+            fuse_lck_mtx_lock(ch->mtx);
+            continue;
+        }
+
+        err = fuse_device_copyout(data, ticket, uio);
+        if (!err) {
+            fuse_stats_sent(ticket);
+            fuse_ticket_trace(FUSE4X_KDBG_TICKET_DEQUEUE, ticket,
+                              fuse_ticket_msglen(ticket), 0);
+        }
+
+        fuse_ticket_drop_invalid(ticket);
 
         if (err) {
-            break;
+            return err;
         }
-    }
 
-    /*
-     * XXX: Stop gap! I really need to finish interruption plumbing.
-     */
-    if (ticket->answered) {
-        err = EINTR;
+        fuse_lck_mtx_lock(ch->mtx);
     }
 
-    /*
-     * The FORGET message is an example of a ticket that has explicitly
-     * been invalidated by the sender. The sender is not expecting or wanting
-     * a reply, so he sets the 'invalid' field in the ticket.
-     */
+    fuse_lck_mtx_unlock(ch->mtx);
 
-    fuse_ticket_drop_invalid(ticket);
-
-    return err;
+    return 0;
 }
 
-int
-fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
+/*
+ * Reads one reply from the daemon's buffer and passes it to the ticket
+ * waiting for it. If 'batched' is false the reply must take the whole buffer,
+ * otherwise the reply body ends where its fuse_out_header says and the rest
+ * of the buffer is left for the next reply.
+ */
+static int
+fuse_device_write_reply(struct fuse_data *data, uio_t uio, bool batched)
 {
     int err = 0;
-    bool found = false;
 
-    struct fuse_device    *fdev;
-    struct fuse_data      *data;
     struct fuse_ticket    *ticket;
-    struct fuse_ticket    *x_ticket;
     struct fuse_out_header ohead;
-
-    fuse_trace_printf_func();
-
-    fdev = FUSE_DEVICE_FROM_UNIT_FAST(minor(dev));
-    if (!fdev) {
-        return ENXIO;
-    }
+    user_ssize_t           bodylen;
+    user_ssize_t           rest;
 
     if (uio_resid(uio) < (user_ssize_t)sizeof(struct fuse_out_header)) {
         log("fuse4x: Incorrect header size. Got %lld, expected at least %lu\n",
@@ -356,49 +678,152 @@ fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
 
     /* begin audit */
 
-    if (uio_resid(uio) + sizeof(struct fuse_out_header) != ohead.len) {
-        log("fuse4x: message body size does not match that in the header\n");
+    if (ohead.len < sizeof(struct fuse_out_header)) {
+        log("fuse4x: message size in the header is too small (%u)\n", ohead.len);
         return EINVAL;
     }
 
-    if (uio_resid(uio) && ohead.error) {
-        log("fuse4x: non-zero error for a message with a body\n");
+    bodylen = ohead.len - sizeof(struct fuse_out_header);
+
+    if (batched ? (bodylen > uio_resid(uio)) : (bodylen != uio_resid(uio))) {
+        log("fuse4x: message body size does not match that in the header\n");
         return EINVAL;
     }
 
-    ohead.error = -(ohead.error);
-
-    /* end audit */
-
-    data = fdev->data;
-
-    fuse_lck_mtx_lock(data->aw_mtx);
-
-    TAILQ_FOREACH_SAFE(ticket, &data->aw_head, aw_link, x_ticket) {
-        if (ticket->unique == ohead.unique) {
-            found = true;
-            TAILQ_REMOVE(&data->aw_head, ticket, aw_link);
-            break;
+    /* Notifications carry a (positive) code in the error field. */
+    if (ohead.unique != 0) {
+        if (bodylen && ohead.error) {
+            log("fuse4x: non-zero error for a message with a body\n");
+            return EINVAL;
         }
+
+        ohead.error = -(ohead.error);
     }
 
-    fuse_lck_mtx_unlock(data->aw_mtx);
+    /* end audit */
+
+    /* Let the callback see this reply's body only. */
+    rest = uio_resid(uio) - bodylen;
+    uio_setresid(uio, bodylen);
 
-    if (found) {
+    if (ohead.unique == 0) {
+        err = fuse_internal_notify(data, ohead.error, uio);
+    } else if ((ticket = fuse_remove_callback(data, ohead.unique))) {
+        fuse_stats_answered(ticket, ohead.len);
+        fuse_ticket_trace(FUSE4X_KDBG_TICKET_REPLY, ticket, ohead.len, ohead.error);
         if (ticket->aw_callback) {
             memcpy(&ticket->aw_ohead, &ohead, sizeof(ohead));
             err = ticket->aw_callback(ticket, uio);
         } else {
             fuse_ticket_drop(ticket);
-            return err;
         }
     } else {
         /* ticket has no response callback */
     }
 
+    /* Skip whatever the callback did not consume and expose the next reply. */
+    if (uio_resid(uio)) {
+        uio_update(uio, (user_size_t)uio_resid(uio));
+    }
+    uio_setresid(uio, rest);
+
     return err;
 }
 
+int
+fuse_device_write(dev_t dev, uio_t uio, __unused int ioflag)
+{
+    int err = 0;
+
+    struct fuse_device *fdev;
+    struct fuse_data   *data;
+
+    fuse_trace_printf_func();
+
+    fdev = fuse_device_get(dev);
+    if (!fdev) {
+        return ENXIO;
+    }
+
+    data = fdev->data;
+
+    if (!(data->dataflags & FSESS_BATCH_IO)) {
+        return fuse_device_write_reply(data, uio, false);
+    }
+
+    /*
+     * Batched I/O: the buffer holds several concatenated replies, each framed
+     * by its own fuse_out_header. The first failure ends the batch.
+     */
+    while (uio_resid(uio) > 0) {
+        if ((err = fuse_device_write_reply(data, uio, true))) {
+            break;
+        }
+    }
+
+    return err;
+}
+
+static void
+fuse_device_remove_nodes(struct fuse_device *fdev)
+{
+    for (int c = 0; c < FUSE4X_NCHANNELS - 1; c++) {
+        if (fdev->ch_cdev[c]) {
+            devfs_remove(fdev->ch_cdev[c]);
+            fdev->ch_cdev[c] = NULL;
+        }
+    }
+
+    if (fdev->cdev) {
+        devfs_remove(fdev->cdev);
+        fdev->cdev = NULL;
+    }
+}
+
+/*
+ * A channel reads as ready once it has a request queued, or once the session
+ * is dead so that the daemon's read fails with ENODEV. Replies can always be
+ * written.
+ *
+ * Only select(2) and poll(2) get here. Routing kqueue to d_select takes
+ * cdevsw_setkqueueok(), which is not part of the public KPI, so kqueue on
+ * the device nodes is not supported.
+ */
+int
+fuse_device_select(dev_t dev, int events, void *wql, struct proc *p)
+{
+    int revents = 0;
+
+    struct fuse_device  *fdev;
+    struct fuse_data    *data;
+    struct fuse_channel *ch;
+
+    fuse_trace_printf_func();
+
+    fdev = fuse_device_get(dev);
+    if (!fdev || !(data = fdev->data)) {
+        return events & (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM);
+    }
+
+    ch = &data->ch[FUSE_DEVICE_CHANNEL(dev)];
+
+    if (events & (POLLIN | POLLRDNORM)) {
+        fuse_lck_mtx_lock(ch->mtx);
+        if (data->dead || !fuse_channel_empty(ch)) {
+            revents |= events & (POLLIN | POLLRDNORM);
+        } else {
+            selrecord(p, &ch->rsel, wql);
+        }
+        fuse_lck_mtx_unlock(ch->mtx);
+    }
+
+    if (events & (POLLOUT | POLLWRNORM)) {
+        revents |= events & (POLLOUT | POLLWRNORM);
+    }
+
+    return revents;
+}
+
 int
 fuse_devices_start(void)
 {
@@ -427,6 +852,21 @@ fuse_devices_start(void)
             goto error;
         }
 
+        for (int c = 1; c < FUSE4X_NCHANNELS; c++) {
+            fuse_device_table[i].ch_cdev[c - 1] = devfs_make_node(
+                                        makedev(fuse_cdev_major, i + c * FUSE4X_NDEVICES),
+                                        DEVFS_CHAR,
+                                        UID_ROOT,
+                                        GID_OPERATOR,
+                                        0666,
+                                        FUSE4X_DEVICE_BASENAME "%d.%d",
+                                        i, c);
+            if (fuse_device_table[i].ch_cdev[c - 1] == NULL) {
+                fuse_device_remove_nodes(&fuse_device_table[i]);
+                goto error;
+            }
+        }
+
         fuse_device_table[i].data     = NULL;
         fuse_device_table[i].dev      = dev;
         fuse_device_table[i].pid      = -1;
@@ -441,8 +881,7 @@ fuse_devices_start(void)
 
 error:
     for (--i; i >= 0; i--) {
-        devfs_remove(fuse_device_table[i].cdev);
-        fuse_device_table[i].cdev = NULL;
+        fuse_device_remove_nodes(&fuse_device_table[i]);
         fuse_device_table[i].dev  = 0;
         lck_mtx_free(fuse_device_table[i].mtx, fuse_lock_group);
     }
@@ -496,9 +935,8 @@ fuse_devices_stop(void)
     /* No device is in use. */
 
     for (i = 0; i < FUSE4X_NDEVICES; i++) {
-        devfs_remove(fuse_device_table[i].cdev);
+        fuse_device_remove_nodes(&fuse_device_table[i]);
         lck_mtx_free(fuse_device_table[i].mtx, fuse_lock_group);
-        fuse_device_table[i].cdev   = NULL;
         fuse_device_table[i].dev    = 0;
         fuse_device_table[i].pid    = -1;
         fuse_device_table[i].mtx    = NULL;
@@ -559,6 +997,43 @@ fuse_device_kill(int unit, struct proc *p)
     return error;
 }
 
+/*
+ * Copies the statistics of the file system mounted from /dev/fuse4x<unit>.
+ * Returns ENOENT if there is no such mount.
+ */
+int
+fuse_device_get_stats(int unit, struct fuse_mount_stats *stats)
+{
+    int error = ENOENT;
+    struct fuse_device *fdev;
+    struct fuse_data   *data;
+
+    if ((unit < 0) || (unit >= FUSE4X_NDEVICES)) {
+        return EINVAL;
+    }
+
+    fdev = FUSE_DEVICE_FROM_UNIT_FAST(unit);
+    if (!fdev || !fdev->mtx) {
+        return ENOENT;
+    }
+
+    fuse_lck_mtx_lock(fdev->mtx);
+
+    data = fdev->data;
+    if (data && data->mounted) {
+        /* The counters move while we copy; that is fine for statistics. */
+        memcpy(stats, &data->stats, sizeof(*stats));
+        stats->unit = (uint32_t)unit;
+        strlcpy(stats->mntonname, vfs_statfs(data->mp)->f_mntonname,
+                sizeof(stats->mntonname));
+        error = 0;
+    }
+
+    fuse_lck_mtx_unlock(fdev->mtx);
+
+    return error;
+}
+
 int
 fuse_device_print_vnodes(int unit_flags, struct proc *p)
 {
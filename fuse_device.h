@@ -7,10 +7,13 @@
 #ifndef _FUSE_DEVICE_H_
 #define _FUSE_DEVICE_H_
 
+#include <fuse_param.h>
+
 #include <sys/conf.h>
 #include <miscfs/devfs/devfs.h>
 
 struct fuse_data;
+struct fuse_mount_stats;
 
 /* softc */
 
@@ -20,6 +23,7 @@ struct fuse_device {
     pid_t             pid;
     dev_t             dev;
     void             *cdev;
+    void             *ch_cdev[FUSE4X_NCHANNELS - 1]; // nodes of channels 1 and up
     struct fuse_data *data;
 };
 typedef struct fuse_device * fuse_device_t;
@@ -33,10 +37,12 @@ int fuse_devices_stop(void);
 
 fuse_device_t     fuse_device_get(dev_t dev);
 void              fuse_device_close_final(fuse_device_t fdev);
+void              fuse_reject_answers(struct fuse_data *data);
 
 /* Control/Debug Utilities */
 
 int fuse_device_kill(int unit, struct proc *p);
+int fuse_device_get_stats(int unit, struct fuse_mount_stats *stats);
 int fuse_device_print_vnodes(int unit_flags, struct proc *p);
 
 #endif /* _FUSE_DEVICE_H_ */
@@ -71,7 +71,7 @@ fuse_filehandle_get(vnode_t       vp,
     foi = fdi.indata;
     foi->flags = oflags;
 
-    OSIncrementAtomic((SInt32 *)&fuse_fh_upcall_count);
+    fuse_counter_inc(FUSE_CNT_FH_UPCALLS);
     if ((err = fuse_dispatcher_wait_answer(&fdi))) {
         const char *vname = vnode_getname(vp);
         if (err == ENOENT) {
@@ -99,7 +99,7 @@ fuse_filehandle_get(vnode_t       vp,
         }
         return err;
     }
-    OSIncrementAtomic((SInt32 *)&fuse_fh_current);
+    fuse_counter_inc(FUSE_CNT_FH_CURRENT);
 
     foo = fdi.answer;
 
@@ -120,6 +120,7 @@ fuse_filehandle_put(vnode_t vp, vfs_context_t context, fufh_type_t fufh_type)
     struct fuse_release_in *fri;
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
     struct fuse_filehandle *fufh  = NULL;
+    int err = 0;
 
     fuse_trace_printf("fuse_filehandle_put(vp=%p, fufh_type=%d)\n",
                       vp, fufh_type);
@@ -143,13 +144,27 @@ fuse_filehandle_put(vnode_t vp, vfs_context_t context, fufh_type_t fufh_type)
     fri->fh = fufh->fh_id;
     fri->flags = fufh->open_flags;
 
-    int err = fuse_dispatcher_wait_answer(&fdi);
-    if (!err) {
-        fuse_ticket_drop(fdi.ticket);
+    if (fuse_async_release) {
+        /*
+         * The message has its own copy of fh_id, so the slot is free for
+         * the next open right away, even if the daemon has not seen this
+         * release yet.
+         *
+         * Nothing keeps the node's FORGET behind it, though: a BATCH_FORGET
+         * may wait on another channel and a multithreaded daemon may handle
+         * both at once. Only a daemon that copes with a RELEASE of an
+         * already forgotten node may have this turned on.
+         */
+        fuse_dispatcher_send_async(&fdi);
+    } else {
+        err = fuse_dispatcher_wait_answer(&fdi);
+        if (!err) {
+            fuse_ticket_drop(fdi.ticket);
+        }
     }
 
 out:
-    OSDecrementAtomic((SInt32 *)&fuse_fh_current);
+    fuse_counter_dec(FUSE_CNT_FH_CURRENT);
     fuse_invalidate_attr(vp);
 
     return err;
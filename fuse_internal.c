@@ -210,9 +210,11 @@ fuse_internal_exchange(vnode_t       fvp,
     if (err == 0) {
         if (fdvp) {
             fuse_invalidate_attr(fdvp);
+            fuse_invalidate_dircache(fdvp);
         }
         if (tdvp && (tdvp != fdvp)) {
             fuse_invalidate_attr(tdvp);
+            fuse_invalidate_dircache(tdvp);
         }
 
         fuse_invalidate_attr(fvp);
@@ -283,58 +285,68 @@ fuse_internal_fsync_callback(struct fuse_ticket *ticket, __unused uio_t uio)
     return 0;
 }
 
+/*
+ * Queues an FSYNC (FSYNCDIR for a directory) of the handle without waiting.
+ * Several of them may be in flight; each is collected with
+ * fuse_internal_fsync_wait().
+ */
 __private_extern__
-int
-fuse_internal_fsync(vnode_t                 vp,
-                    vfs_context_t           context,
-                    struct fuse_filehandle *fufh,
-                    void                   *param)
+void
+fuse_internal_fsync_send(vnode_t                 vp,
+                         vfs_context_t           context,
+                         struct fuse_filehandle *fufh,
+                         struct fuse_dispatcher *dispatcher)
 {
-    int err = 0;
-    int op = FUSE_FSYNC;
     struct fuse_fsync_in *ffsi;
-    struct fuse_dispatcher *dispatcher = param;
-
-    const bool wait_for_completion = true;
 
     fuse_trace_printf_func();
 
-    dispatcher->iosize = sizeof(*ffsi);
-    dispatcher->ticket = NULL;
-    if (vnode_isdir(vp)) {
-        op = FUSE_FSYNCDIR;
-    }
-
-    fuse_dispatcher_make_vp(dispatcher, op, vp, context);
+    fuse_dispatcher_init(dispatcher, sizeof(*ffsi));
+    fuse_dispatcher_make_vp(dispatcher,
+                            vnode_isdir(vp) ? FUSE_FSYNCDIR : FUSE_FSYNC,
+                            vp, context);
     ffsi = dispatcher->indata;
     ffsi->fh = fufh->fh_id;
 
     ffsi->fsync_flags = 1; /* datasync */
 
-    if (wait_for_completion) {
-        if ((err = fuse_dispatcher_wait_answer(dispatcher))) {
-            if (err == ENOSYS) {
-                if (op == FUSE_FSYNC) {
-                    fuse_clear_implemented(dispatcher->ticket->data,
-                                           FSESS_NOIMPLBIT(FSYNC));
-                } else if (op == FUSE_FSYNCDIR) {
-                    fuse_clear_implemented(dispatcher->ticket->data,
-                                           FSESS_NOIMPLBIT(FSYNCDIR));
-                }
-            }
-            goto out;
-        } else {
-            fuse_ticket_drop(dispatcher->ticket);
+    fuse_dispatcher_send(dispatcher);
+}
+
+__private_extern__
+int
+fuse_internal_fsync_wait(vnode_t vp, struct fuse_dispatcher *dispatcher)
+{
+    int err;
+
+    if ((err = fuse_dispatcher_wait(dispatcher))) {
+        /* The ticket is gone by now. */
+        if (err == ENOSYS) {
+            fuse_clear_implemented(fuse_get_mpdata(vnode_mount(vp)),
+                                   vnode_isdir(vp) ? FSESS_NOIMPLBIT(FSYNCDIR) :
+                                                     FSESS_NOIMPLBIT(FSYNC));
         }
     } else {
-        fuse_insert_callback(dispatcher->ticket, fuse_internal_fsync_callback);
-        fuse_insert_message(dispatcher->ticket);
+        fuse_ticket_drop(dispatcher->ticket);
     }
 
-out:
     return err;
 }
 
+__private_extern__
+int
+fuse_internal_fsync(vnode_t                 vp,
+                    vfs_context_t           context,
+                    struct fuse_filehandle *fufh,
+                    void                   *param)
+{
+    struct fuse_dispatcher *dispatcher = param;
+
+    fuse_internal_fsync_send(vp, context, fufh, dispatcher);
+
+    return fuse_internal_fsync_wait(vp, dispatcher);
+}
+
 /* getattr sidekicks */
 __private_extern__
 int
@@ -566,139 +578,87 @@ fuse_internal_attr_vat2fsai(mount_t                 mp,
 
 /* readdir */
 
-__private_extern__
-int
-fuse_internal_readdir(vnode_t                 vp,
-                      uio_t                   uio,
-                      vfs_context_t           context,
-                      struct fuse_filehandle *fufh,
-                      struct fuse_iov        *cookediov,
-                      int                    *numdirent)
-{
-    int err = 0;
-    struct fuse_dispatcher fdi;
-    struct fuse_read_in   *fri;
-    struct fuse_data      *data;
-
-    if (uio_resid(uio) == 0) {
-        return 0;
-    }
-
-    fuse_dispatcher_init(&fdi, 0);
-
-    /* Note that we DO NOT have a UIO_SYSSPACE here (so no need for p2p I/O). */
-
-    while (uio_resid(uio) > 0) {
-
-        fdi.iosize = sizeof(*fri);
-        fuse_dispatcher_make_vp(&fdi, FUSE_READDIR, vp, context);
-
-        fri = fdi.indata;
-        fri->fh = fufh->fh_id;
-        fri->offset = uio_offset(uio);
-        data = fuse_get_mpdata(vnode_mount(vp));
-        fri->size = (typeof(fri->size))min((size_t)uio_resid(uio), data->iosize);
-
-        if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-            goto out;
-        }
-
-        if ((err = fuse_internal_readdir_processdata(vp,
-                                                     uio,
-                                                     fri->size,
-                                                     fdi.answer,
-                                                     fdi.iosize,
-                                                     cookediov,
-                                                     numdirent))) {
-            break;
-        }
-    }
-
-/* done: */
-
-    fuse_ticket_drop(fdi.ticket);
+/*
+ * FUSE_READDIR answers are converted into struct dirent records once, into
+ * a fuse_dirpage, and handed to the caller with one uiomove() per page. With
+ * the readdir cache on, the pages stay on the directory's fuse_vnode_data
+ * for its entry timeout, whichever filehandle they were read through, and
+ * later getdirentries calls at a known offset are served from them. Entry
+ * changes made through us or notified by the daemon drop them. Like
+ * the rest of fuse_vnode_data the pages are protected by the node lock (and
+ * the biglock, where there is one).
+ */
 
-out:
-    return ((err == -1) ? 0 : err);
-}
+#define FUSE_DIRENT_COOKED_SIZE(namelen) \\
+    ((sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) + (((namelen) + 1 + 3) & ~3))
 
-__private_extern__
-int
-fuse_internal_readdir_processdata(vnode_t          vp,
-                                  uio_t            uio,
-                         __unused size_t           reqsize,
-                                  void            *buf,
-                                  size_t           bufsize,
-                                  struct fuse_iov *cookediov,
-                                  int             *numdirent)
+static int
+fuse_internal_dirpage_build(vnode_t               vp,
+                            uint64_t              offset,
+                            void                 *buf,
+                            size_t                bufsize,
+                            struct fuse_dirpage **pagep)
 {
-    int err = 0;
-    int cou = 0;
-    int n   = 0;
-    size_t bytesavail;
-    size_t freclen;
-
-    struct dirent      *de;
-    struct fuse_dirent *fudge;
-
-    if (bufsize < FUSE_NAME_OFFSET) {
-        return -1;
-    }
-
-    for (;;) {
-
-        if (bufsize < FUSE_NAME_OFFSET) {
-            err = -1;
-            break;
-        }
-
-        fudge = (struct fuse_dirent *)buf;
+    struct fuse_dirpage *page;
+    struct fuse_dirent  *fudge;
+    uint32_t nent = 0;
+    uint32_t i;
+    size_t   size = 0;
+    size_t   allocsize;
+    size_t   left;
+    char    *from;
+    char    *to;
+
+    /* Validate and size the page first; a trailing partial entry is ignored. */
+    for (from = buf, left = bufsize; left >= FUSE_NAME_OFFSET; ) {
+        size_t freclen;
+
+        fudge = (struct fuse_dirent *)from;
         freclen = FUSE_DIRENT_SIZE(fudge);
 
-        cou++;
-
-        if (bufsize < freclen) {
-            err = ((cou == 1) ? -1 : 0);
+        if (left < freclen) {
             break;
         }
 
-        /*
-         * if (isbzero(buf, FUSE_NAME_OFFSET)) {
-         *     // zero-pad incomplete buffer
-         *     ...
-         *     err = -1;
-         *     break;
-         * }
-         */
-
         if (!fudge->namelen) {
-            err = EINVAL;
-            break;
+            return EINVAL;
         }
 
         if (fudge->namelen > FUSE_MAXNAMLEN) {
-            err = EIO;
-            break;
+            return EIO;
         }
 
-        bytesavail = (sizeof(struct dirent) - (FUSE_MAXNAMLEN + 1)) +
-            ((fudge->namelen + 1 + 3) & ~3);
+        nent++;
+        size += FUSE_DIRENT_COOKED_SIZE(fudge->namelen);
+        from += freclen;
+        left -= freclen;
+    }
 
-        if (bytesavail > (size_t)uio_resid(uio)) {
-            err = -1;
-            break;
-        }
+    allocsize = sizeof(*page) + nent * sizeof(uint64_t) + size;
+    page = FUSE_OSMalloc(allocsize, fuse_malloc_tag);
+    if (!page) {
+        return ENOMEM;
+    }
+    bzero(page, allocsize);
+
+    page->offset    = offset;
+    page->nent      = nent;
+    page->size      = size;
+    page->allocsize = allocsize;
+    page->cookies   = (uint64_t *)(page + 1);
+    page->data      = (char *)(page->cookies + nent);
+
+    for (i = 0, from = buf, to = page->data; i < nent; i++) {
+        struct dirent *de = (struct dirent *)to;
 
-        fiov_refresh(cookediov);
-        fiov_adjust(cookediov, bytesavail);
+        fudge = (struct fuse_dirent *)from;
 
-        de = (struct dirent *)cookediov->base;
 #ifdef _DARWIN_FEATURE_64_BIT_INODE
         de->d_ino = fudge->ino;
 #else
         de->d_ino = (ino_t)fudge->ino; /* XXX: truncation */
 #endif /* _DARWIN_FEATURE_64_BIT_INODE */
-        de->d_reclen = bytesavail;
+        de->d_reclen = FUSE_DIRENT_COOKED_SIZE(fudge->namelen);
         de->d_type   = fudge->type;
         de->d_namlen = fudge->namelen;
 
@@ -709,183 +669,1706 @@ fuse_internal_readdir_processdata(vnode_t          vp,
             de->d_type = DT_WHT;
         }
 
-        memcpy((char *)cookediov->base +
-               sizeof(struct dirent) - FUSE_MAXNAMLEN - 1,
-               (char *)buf + FUSE_NAME_OFFSET, fudge->namelen);
-        ((char *)cookediov->base)[bytesavail] = '\0';
-
-        err = uiomove(cookediov->base, (int)cookediov->len, uio);
-        if (err) {
-            break;
-        }
+        /* The page is zeroed, so the name is already terminated. */
+        memcpy(to + sizeof(struct dirent) - FUSE_MAXNAMLEN - 1,
+               from + FUSE_NAME_OFFSET, fudge->namelen);
 
-        n++;
+        page->cookies[i] = fudge->off;
 
-        buf = (char *)buf + freclen;
-        bufsize -= freclen;
-        uio_setoffset(uio, fudge->off);
+        from += FUSE_DIRENT_SIZE(fudge);
+        to += de->d_reclen;
     }
 
-    if (!err && numdirent) {
-        *numdirent = n;
-    }
+    *pagep = page;
 
-    return err;
+    return 0;
 }
 
-/* remove */
-
+/*
+ * Copies the entries of the page from index first on into uio, as many as
+ * fit, with a single uiomove(). Returns -1 when there is nothing more to
+ * give (the uio is full or the directory ended) and 0 when the page was
+ * consumed.
+ */
 static int
-fuse_internal_remove_callback(vnode_t vp, void *cargs)
+fuse_internal_dirpage_copyout(struct fuse_dirpage *page,
+                              uint32_t             first,
+                              uio_t                uio,
+                              int                 *numdirent)
 {
-    struct vnode_attr *vap;
-    uint64_t target_nlink;
+    int      err = 0;
+    char    *start = page->data;
+    size_t   len = 0;
+    uint32_t i;
 
-    vap = VTOVA(vp);
+    if (page->nent == 0) {
+        return -1;
+    }
 
-    target_nlink = *(uint64_t *)cargs;
+    for (i = 0; i < first; i++) {
+        start += ((struct dirent *)start)->d_reclen;
+    }
 
-    /* somewhat lame "heuristics", but you got better ideas? */
-    if ((vap->va_nlink == target_nlink) && vnode_isreg(vp)) {
-        fuse_invalidate_attr(vp);
+    for (i = first; i < page->nent; i++) {
+        size_t reclen = ((struct dirent *)(start + len))->d_reclen;
+
+        if (len + reclen > (size_t)uio_resid(uio)) {
+            break;
+        }
+        len += reclen;
     }
 
-    return VNODE_RETURNED;
+    if (len) {
+        if ((err = uiomove(start, (int)len, uio))) {
+            return err;
+        }
+        uio_setoffset(uio, page->cookies[i - 1]);
+        *numdirent += (int)(i - first);
+    }
+
+    return (i < page->nent) ? -1 : 0;
 }
 
-__private_extern__
-int
-fuse_internal_remove(vnode_t               dvp,
-                     vnode_t               vp,
-                     struct componentname *cnp,
-                     enum fuse_opcode      op,
-                     vfs_context_t         context)
+/*
+ * Looks for a cached page holding the entries that follow offset. A match on
+ * the last entry of a page is not used, the next page starts there.
+ */
+static struct fuse_dirpage *
+fuse_internal_dircache_find(struct fuse_vnode_data *fvdat, uint64_t offset,
+                            uint32_t *first)
 {
-    struct fuse_dispatcher fdi;
+    struct fuse_dirpage *page;
+    uint32_t i;
 
-    struct vnode_attr *vap = VTOVA(vp);
-    int need_invalidate = 0;
-    uint64_t target_nlink = 0;
-    mount_t mp = vnode_mount(vp);
+    LIST_FOREACH(page, &fvdat->dirpages, link) {
+        if (page->offset == offset) {
+            *first = 0;
+            return page;
+        }
+    }
 
-    int err = 0;
+    LIST_FOREACH(page, &fvdat->dirpages, link) {
+        for (i = 0; i + 1 < page->nent; i++) {
+            if (page->cookies[i] == offset) {
+                *first = i + 1;
+                return page;
+            }
+        }
+    }
 
-    fuse_dispatcher_init(&fdi, cnp->cn_namelen + 1);
-    fuse_dispatcher_make_vp(&fdi, op, dvp, context);
+    return NULL;
+}
 
-    memcpy(fdi.indata, cnp->cn_nameptr, cnp->cn_namelen);
-    ((char *)fdi.indata)[cnp->cn_namelen] = '\0';
+/* Returns true if the page now belongs to the cache. */
+static bool
+fuse_internal_dircache_insert(struct fuse_vnode_data *fvdat,
+                              struct fuse_dirpage    *page,
+                              uint32_t                gen)
+{
+    /* The directory changed, or was reread, while we were asleep. */
+    if (gen != fvdat->dircache_gen) {
+        return false;
+    }
 
-    if ((vap->va_nlink > 1) && vnode_isreg(vp)) {
-        need_invalidate = 1;
-        target_nlink = vap->va_nlink;
+    if (fvdat->entry_valid.tv_sec == 0 && fvdat->entry_valid.tv_nsec == 0) {
+        return false;
     }
 
-    if (!(err = fuse_dispatcher_wait_answer(&fdi))) {
-        fuse_ticket_drop(fdi.ticket);
+    if (fvdat->dircache_size + page->allocsize > FUSE_DIRCACHE_MAX_SIZE) {
+        return false;
     }
 
-    fuse_invalidate_attr(dvp);
-    fuse_invalidate_attr(vp);
+    if (LIST_EMPTY(&fvdat->dirpages)) {
+        nanouptime(&fvdat->dircache_expires);
+        fuse_timespec_add(&fvdat->dircache_expires, &fvdat->entry_valid);
+    }
 
-    /*
-     * XXX: M_FUSE4X_INVALIDATE_CACHED_VATTRS_UPON_UNLINK
-     *
-     * Consider the case where vap->va_nlink > 1 for the entity being
-     * removed. In our world, other in-memory vnodes that share a link
-     * count each with this one may not know right way that this one just
-     * got deleted. We should let them know, say, through a vnode_iterate()
-     * here and a callback that does fuse_invalidate_attr(vp) on each
-     * relevant vnode.
-     */
-    if (need_invalidate && !err) {
-        if (!vfs_busy(mp, LK_NOWAIT)) {
-#ifdef FUSE4X_ENABLE_BIGLOCK
-            struct fuse_data *data = fuse_get_mpdata(mp);
-            fuse_biglock_unlock(data->biglock);
-#endif
-            vnode_iterate(mp, 0, fuse_internal_remove_callback,
-                          (void *)&target_nlink);
-#ifdef FUSE4X_ENABLE_BIGLOCK
-            fuse_biglock_lock(data->biglock);
-#endif
-            vfs_unbusy(mp);
-        } else {
-            log("fuse4x: skipping link count fixup upon remove\n");
-        }
+    LIST_INSERT_HEAD(&fvdat->dirpages, page, link);
+    fvdat->dircache_size += page->allocsize;
+
+    return true;
+}
+
+static int
+fuse_internal_readdir_fetch(vnode_t                 vp,
+                            uio_t                   uio,
+                            vfs_context_t           context,
+                            struct fuse_filehandle *fufh,
+                            struct fuse_dirpage   **pagep)
+{
+    int err = 0;
+    struct fuse_dispatcher fdi;
+    struct fuse_read_in   *fri;
+    struct fuse_data      *data = fuse_get_mpdata(vnode_mount(vp));
+    uint64_t               offset = uio_offset(uio);
+
+    fuse_dispatcher_init(&fdi, sizeof(*fri));
+    fuse_dispatcher_make_vp(&fdi, FUSE_READDIR, vp, context);
+
+    fri = fdi.indata;
+    fri->fh = fufh->fh_id;
+    fri->offset = offset;
+    /* A cached page may serve later calls, so ask for a full one. */
+    if (fuse_readdir_cache) {
+        fri->size = (typeof(fri->size))data->max_read;
+    } else {
+        fri->size = (typeof(fri->size))min((size_t)uio_resid(uio), data->max_read);
+    }
+
+    if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+        return err;
     }
 
+    err = fuse_internal_dirpage_build(vp, offset, fdi.answer, fdi.iosize, pagep);
+
+    fuse_ticket_drop(fdi.ticket);
+
     return err;
 }
 
-/* rename */
-
 __private_extern__
 int
-fuse_internal_rename(vnode_t               fdvp,
-            __unused vnode_t               fvp,
-                     struct componentname *fcnp,
-                     vnode_t               tdvp,
-            __unused vnode_t               tvp,
-                     struct componentname *tcnp,
-                     vfs_context_t         context)
+fuse_internal_readdir(vnode_t                 vp,
+                      uio_t                   uio,
+                      vfs_context_t           context,
+                      struct fuse_filehandle *fufh,
+                      int                    *numdirent)
 {
-    struct fuse_dispatcher fdi;
-    struct fuse_rename_in *fri;
     int err = 0;
+    int n   = 0;
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct timespec         uptsp;
 
-    fuse_dispatcher_init(&fdi, sizeof(*fri) + fcnp->cn_namelen + tcnp->cn_namelen + 2);
-    fuse_dispatcher_make_vp(&fdi, FUSE_RENAME, fdvp, context);
+    if (uio_resid(uio) == 0) {
+        return 0;
+    }
 
-    fri = fdi.indata;
-    fri->newdir = VTOI(tdvp);
-    memcpy((char *)fdi.indata + sizeof(*fri), fcnp->cn_nameptr,
-           fcnp->cn_namelen);
-    ((char *)fdi.indata)[sizeof(*fri) + fcnp->cn_namelen] = '\0';
-    memcpy((char *)fdi.indata + sizeof(*fri) + fcnp->cn_namelen + 1,
-           tcnp->cn_nameptr, tcnp->cn_namelen);
-    ((char *)fdi.indata)[sizeof(*fri) + fcnp->cn_namelen +
-                         tcnp->cn_namelen + 1] = '\0';
+    /* Pages older than the entry timeout are useless. */
+    if (!LIST_EMPTY(&fvdat->dirpages)) {
+        nanouptime(&uptsp);
+        if (!fuse_readdir_cache ||
+            fuse_timespec_cmp(&uptsp, &fvdat->dircache_expires, >)) {
+            fuse_dircache_purge(fvdat);
+        }
+    }
 
-    if (!(err = fuse_dispatcher_wait_answer(&fdi))) {
-        fuse_ticket_drop(fdi.ticket);
+    while (uio_resid(uio) > 0) {
+        struct fuse_dirpage *page = NULL;
+        uint32_t first = 0;
+        bool     cached = false;
+
+        if (fuse_readdir_cache) {
+            page = fuse_internal_dircache_find(fvdat, uio_offset(uio), &first);
+            if (page) {
+                fuse_counter_inc(FUSE_CNT_READDIR_CACHE_HITS);
+                cached = true;
+            } else {
+                fuse_counter_inc(FUSE_CNT_READDIR_CACHE_MISSES);
+            }
+        }
+
+        if (!page) {
+            uint32_t gen = fvdat->dircache_gen;
+
+            if ((err = fuse_internal_readdir_fetch(vp, uio, context, fufh,
+                                                   &page))) {
+                break;
+            }
+
+            if (fuse_readdir_cache) {
+                cached = fuse_internal_dircache_insert(fvdat, page, gen);
+            }
+        }
+
+        err = fuse_internal_dirpage_copyout(page, first, uio, &n);
+
+        if (!cached) {
+            FUSE_OSFree(page, page->allocsize, fuse_malloc_tag);
+        }
+
+        if (err) {
+            break;
+        }
+    }
+
+    if ((!err || err == -1) && numdirent) {
+        *numdirent = n;
+    }
+
+    return ((err == -1) ? 0 : err);
+}
+
+/* readdirattr */
+
+/*
+ * getdirentriesattr(2) is answered from FUSE_READDIRPLUS. Every entry comes
+ * with a fuse_entry_out, from which its attributes are packed, and which is
+ * taken in the way an answer to LOOKUP would be: the node is found or
+ * created, its attributes are cached and its name is entered, so that the
+ * stat calls that usually follow never reach the daemon. Only attributes
+ * that can be derived from a struct fuse_attr are supported; for anything
+ * else ENOTSUP sends the caller back to readdir and getattrlist.
+ */
+
+#define FUSE_READDIRATTR_CMN_ATTRS                                      \
+    (ATTR_CMN_NAME | ATTR_CMN_DEVID | ATTR_CMN_FSID | ATTR_CMN_OBJTYPE | \
+     ATTR_CMN_OBJTAG | ATTR_CMN_OBJID | ATTR_CMN_OBJPERMANENTID |        \
+     ATTR_CMN_PAROBJID | ATTR_CMN_CRTIME | ATTR_CMN_MODTIME |            \
+     ATTR_CMN_CHGTIME | ATTR_CMN_ACCTIME | ATTR_CMN_BKUPTIME |           \
+     ATTR_CMN_FNDRINFO | ATTR_CMN_OWNERID | ATTR_CMN_GRPID |             \
+     ATTR_CMN_ACCESSMASK | ATTR_CMN_FLAGS | ATTR_CMN_USERACCESS |        \
+     ATTR_CMN_FILEID | ATTR_CMN_PARENTID)
+
+#define FUSE_READDIRATTR_DIR_ATTRS (ATTR_DIR_LINKCOUNT | ATTR_DIR_MOUNTSTATUS)
+
+#define FUSE_READDIRATTR_FILE_ATTRS                                     \
+    (ATTR_FILE_LINKCOUNT | ATTR_FILE_TOTALSIZE | ATTR_FILE_ALLOCSIZE |  \
+     ATTR_FILE_IOBLOCKSIZE | ATTR_FILE_DEVTYPE | ATTR_FILE_DATALENGTH | \
+     ATTR_FILE_DATAALLOCSIZE | ATTR_FILE_RSRCLENGTH |                   \
+     ATTR_FILE_RSRCALLOCSIZE)
+
+/*
+ * Finder info and resource forks live in com.apple.* xattrs. They are known
+ * to be empty only when the mount hides those.
+ */
+#define FUSE_READDIRATTR_APPLEXATTR_CMN_ATTRS  (ATTR_CMN_FNDRINFO)
+#define FUSE_READDIRATTR_APPLEXATTR_FILE_ATTRS \
+    (ATTR_FILE_RSRCLENGTH | ATTR_FILE_RSRCALLOCSIZE)
+
+/* Fixed-size attributes above take less than 512 bytes. */
+#define FUSE_READDIRATTR_ENTRY_MAX (512 + FUSE_MAXNAMLEN + 1 + 3)
+
+#define FUSE_ATTR_PACK(cursor, type, value) do { \
+    *(type *)(cursor) = (type)(value);           \
+    (cursor) += sizeof(type);                    \
+} while (0)
+
+__private_extern__
+int
+fuse_internal_readdirattr_check(vnode_t vp, struct attrlist *alist)
+{
+    struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+    attrgroup_t cmn  = FUSE_READDIRATTR_CMN_ATTRS;
+    attrgroup_t file = FUSE_READDIRATTR_FILE_ATTRS;
+
+    if (!(data->dataflags & FSESS_READDIRPLUS) ||
+        !fuse_implemented(data, FSESS_NOIMPLBIT(READDIRPLUS))) {
+        return ENOTSUP;
+    }
+
+    if ((alist->bitmapcount != ATTR_BIT_MAP_COUNT) || alist->volattr ||
+        alist->forkattr) {
+        return EINVAL;
+    }
+
+    if (!(data->dataflags & FSESS_NO_APPLEXATTR)) {
+        cmn  &= ~FUSE_READDIRATTR_APPLEXATTR_CMN_ATTRS;
+        file &= ~FUSE_READDIRATTR_APPLEXATTR_FILE_ATTRS;
+    }
+
+    if ((alist->commonattr & ~cmn) ||
+        (alist->dirattr & ~FUSE_READDIRATTR_DIR_ATTRS) ||
+        (alist->fileattr & ~file)) {
+        return ENOTSUP;
+    }
+
+    return 0;
+}
+
+static void
+fuse_internal_readdirattr_packtime(char **cursor, uint64_t sec, uint32_t nsec,
+                                   bool is64)
+{
+    if (is64) {
+        FUSE_ATTR_PACK(*cursor, int64_t, sec);
+        FUSE_ATTR_PACK(*cursor, int64_t, nsec);
+    } else {
+        FUSE_ATTR_PACK(*cursor, int32_t, sec); /* XXX: truncation */
+        FUSE_ATTR_PACK(*cursor, int32_t, nsec);
+    }
+}
+
+/* The same summary of the mode bits that HFS gives for ATTR_CMN_USERACCESS. */
+static uint32_t
+fuse_internal_readdirattr_access(struct fuse_attr *fat, vfs_context_t context)
+{
+    kauth_cred_t cred = vfs_context_ucred(context);
+    uint32_t mode = fat->mode;
+    int ismember = 0;
+
+    if (vfs_context_suser(context) == 0) {
+        return R_OK | W_OK | X_OK;
+    }
+
+    if (kauth_cred_getuid(cred) == fat->uid) {
+        mode >>= 6;
+    } else if (!kauth_cred_ismember_gid(cred, fat->gid, &ismember) &&
+               ismember) {
+        mode >>= 3;
+    }
+
+    return mode & (R_OK | W_OK | X_OK);
+}
+
+/*
+ * Packs the attributes of one entry into buf, in the getattrlist(2) layout,
+ * and returns the record length. vp is NULLVP if the node could not be had.
+ */
+static size_t
+fuse_internal_readdirattr_pack(vnode_t                 dvp,
+                               vnode_t                 vp,
+                               struct attrlist        *alist,
+                               struct fuse_direntplus *fdp,
+                               char                   *buf,
+                               vfs_context_t           context)
+{
+    mount_t           mp    = vnode_mount(dvp);
+    struct fuse_data *data  = fuse_get_mpdata(mp);
+    struct fuse_attr *fat   = &fdp->entry_out.attr;
+    bool              is64  = vfs_context_is64bit(context);
+    attrreference_t  *name  = NULL;
+    char             *fixed = buf + sizeof(uint32_t);
+    char             *var;
+    uint64_t          size  = fat->size;
+    uint64_t          alloc;
+    fsobj_id_t        objid;
+    attrgroup_t       a;
+
+    bzero(buf, FUSE_READDIRATTR_ENTRY_MAX);
+
+    /* ATTR_FUDGE_CASE: as in fuse_internal_attr_fat2vat() */
+    if (vp && !vfs_issynchronous(mp)) {
+        size = VTOFUD(vp)->filesize;
+    }
+
+    if (fuse_issparse_mp(mp)) {
+        alloc = fat->blocks * S_BLKSIZE;
+    } else {
+        uint64_t bsize = vfs_statfs(mp)->f_bsize;
+        alloc = ((size + bsize - 1) / bsize) * bsize;
+    }
+
+    a = alist->commonattr;
+
+    if (a & ATTR_CMN_NAME) {
+        name = (attrreference_t *)fixed;
+        fixed += sizeof(attrreference_t);
+    }
+    if (a & ATTR_CMN_DEVID) {
+        FUSE_ATTR_PACK(fixed, dev_t, vfs_statfs(mp)->f_fsid.val[0]);
+    }
+    if (a & ATTR_CMN_FSID) {
+        FUSE_ATTR_PACK(fixed, fsid_t, vfs_statfs(mp)->f_fsid);
+    }
+    if (a & ATTR_CMN_OBJTYPE) {
+        FUSE_ATTR_PACK(fixed, fsobj_type_t, IFTOVT(fat->mode));
+    }
+    if (a & ATTR_CMN_OBJTAG) {
+        FUSE_ATTR_PACK(fixed, fsobj_tag_t, vnode_tag(dvp));
+    }
+
+    objid.fid_objno      = (u_int32_t)fat->ino; /* XXX: truncation */
+    objid.fid_generation = (u_int32_t)fdp->entry_out.generation;
+    if (a & ATTR_CMN_OBJID) {
+        FUSE_ATTR_PACK(fixed, fsobj_id_t, objid);
+    }
+    if (a & ATTR_CMN_OBJPERMANENTID) {
+        FUSE_ATTR_PACK(fixed, fsobj_id_t, objid);
+    }
+    if (a & ATTR_CMN_PAROBJID) {
+        objid.fid_objno      = (u_int32_t)VTOVA(dvp)->va_fileid;
+        objid.fid_generation = 0;
+        FUSE_ATTR_PACK(fixed, fsobj_id_t, objid);
+    }
+
+    if (a & ATTR_CMN_CRTIME) {
+        fuse_internal_readdirattr_packtime(&fixed, fat->crtime, fat->crtimensec, is64);
+    }
+    if (a & ATTR_CMN_MODTIME) {
+        fuse_internal_readdirattr_packtime(&fixed, fat->mtime, fat->mtimensec, is64);
+    }
+    if (a & ATTR_CMN_CHGTIME) {
+        fuse_internal_readdirattr_packtime(&fixed, fat->ctime, fat->ctimensec, is64);
+    }
+    if (a & ATTR_CMN_ACCTIME) {
+        fuse_internal_readdirattr_packtime(&fixed, fat->atime, fat->atimensec, is64);
+    }
+    if (a & ATTR_CMN_BKUPTIME) {
+        fuse_internal_readdirattr_packtime(&fixed, 0, 0, is64);
+    }
+    if (a & ATTR_CMN_FNDRINFO) {
+        fixed += 32; /* zeroed above */
+    }
+    if (a & ATTR_CMN_OWNERID) {
+        FUSE_ATTR_PACK(fixed, uid_t, fat->uid);
+    }
+    if (a & ATTR_CMN_GRPID) {
+        FUSE_ATTR_PACK(fixed, gid_t, fat->gid);
+    }
+    if (a & ATTR_CMN_ACCESSMASK) {
+        FUSE_ATTR_PACK(fixed, u_int32_t, fat->mode & ~S_IFMT);
+    }
+    if (a & ATTR_CMN_FLAGS) {
+        FUSE_ATTR_PACK(fixed, u_int32_t, fat->flags);
+    }
+    if (a & ATTR_CMN_USERACCESS) {
+        FUSE_ATTR_PACK(fixed, u_int32_t,
+                       fuse_internal_readdirattr_access(fat, context));
+    }
+    if (a & ATTR_CMN_FILEID) {
+        FUSE_ATTR_PACK(fixed, u_int64_t, fat->ino);
+    }
+    if (a & ATTR_CMN_PARENTID) {
+        FUSE_ATTR_PACK(fixed, u_int64_t, VTOVA(dvp)->va_fileid);
+    }
+
+    if (S_ISDIR(fat->mode)) {
+        a = alist->dirattr;
+
+        if (a & ATTR_DIR_LINKCOUNT) {
+            FUSE_ATTR_PACK(fixed, u_int32_t, fat->nlink);
+        }
+        if (a & ATTR_DIR_MOUNTSTATUS) {
+            FUSE_ATTR_PACK(fixed, u_int32_t,
+                           (vp && vnode_mountedhere(vp)) ?
+                           DIR_MNTSTATUS_MNTPOINT : 0);
+        }
+    } else {
+        a = alist->fileattr;
+
+        if (a & ATTR_FILE_LINKCOUNT) {
+            FUSE_ATTR_PACK(fixed, u_int32_t, fat->nlink);
+        }
+        if (a & ATTR_FILE_TOTALSIZE) {
+            FUSE_ATTR_PACK(fixed, off_t, size);
+        }
+        if (a & ATTR_FILE_ALLOCSIZE) {
+            FUSE_ATTR_PACK(fixed, off_t, alloc);
+        }
+        if (a & ATTR_FILE_IOBLOCKSIZE) {
+            FUSE_ATTR_PACK(fixed, u_int32_t, data->iosize);
+        }
+        if (a & ATTR_FILE_DEVTYPE) {
+            FUSE_ATTR_PACK(fixed, u_int32_t,
+                           (S_ISBLK(fat->mode) || S_ISCHR(fat->mode)) ?
+                           fat->rdev : 0);
+        }
+        if (a & ATTR_FILE_DATALENGTH) {
+            FUSE_ATTR_PACK(fixed, off_t, size);
+        }
+        if (a & ATTR_FILE_DATAALLOCSIZE) {
+            FUSE_ATTR_PACK(fixed, off_t, alloc);
+        }
+        if (a & ATTR_FILE_RSRCLENGTH) {
+            FUSE_ATTR_PACK(fixed, off_t, 0);
+        }
+        if (a & ATTR_FILE_RSRCALLOCSIZE) {
+            FUSE_ATTR_PACK(fixed, off_t, 0);
+        }
+    }
+
+    var = fixed;
+
+    if (name) {
+        uint32_t namelen = fdp->dirent.namelen;
+
+        name->attr_dataoffset = (int32_t)(var - (char *)name);
+        name->attr_length     = namelen + 1;
+        memcpy(var, fdp->dirent.name, namelen);
+        var += (namelen + 1 + 3) & ~3;
+    }
+
+    *(uint32_t *)buf = (uint32_t)(var - buf);
+
+    return (size_t)(var - buf);
+}
+
+/*
+ * Takes the entry the way fuse_vnop_lookup() takes a LOOKUP answer. Returns
+ * the node with an iocount, or NULLVP, in which case the daemon has been
+ * told to forget the lookup it counted.
+ */
+static vnode_t
+fuse_internal_readdirattr_link(vnode_t                 dvp,
+                               struct fuse_direntplus *fdp,
+                               vfs_context_t           context)
+{
+    mount_t                mp  = vnode_mount(dvp);
+    struct fuse_entry_out *feo = &fdp->entry_out;
+    struct fuse_dispatcher fdi;
+    struct componentname   cn;
+    vnode_t                vp  = NULLVP;
+
+    /* fuse_vnop_lookup() refuses these without forgetting them, too. */
+    if (feo->nodeid == FUSE_ROOT_ID) {
+        return NULLVP;
+    }
+
+    bzero(&cn, sizeof(cn));
+    cn.cn_nameiop = LOOKUP;
+    cn.cn_flags   = fuse_isnovncache_mp(mp) ? 0 : MAKEENTRY;
+    cn.cn_nameptr = fdp->dirent.name;
+    cn.cn_namelen = (int)fdp->dirent.namelen;
+
+    if (((feo->attr.mode & S_IFMT) == 0) ||
+        fuse_vget_i(&vp, feo, &cn, dvp, mp, context)) {
+        fuse_dispatcher_init(&fdi, 0);
+        fuse_internal_forget_send(mp, context, feo->nodeid, 1, &fdi);
+        return NULLVP;
+    }
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    /* As in fuse_vnop_lookup(), never wait for a child's lock here. */
+    bool unlock_vp = false;
+
+    if (fuse_isfinelocking(fuse_get_mpdata(mp))) {
+        if (fusefs_trylock(VTOFUD(vp), FUSEFS_EXCLUSIVE_LOCK)) {
+            return vp;
+        }
+        unlock_vp = true;
+    }
+#endif
+
+    /* ATTR_FUDGE_CASE */
+    if (vnode_isreg(vp) && fuse_isdirectio(vp)) {
+        VTOFUD(vp)->filesize = feo->attr.size;
+    }
+
+    cache_attrs(vp, feo);
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    if (unlock_vp) {
+        fusefs_unlock(VTOFUD(vp));
+    }
+#endif
+
+    return vp;
+}
+
+__private_extern__
+int
+fuse_internal_readdirattr(vnode_t                 vp,
+                          struct attrlist        *alist,
+                          uio_t                   uio,
+                          uint32_t                maxcount,
+                          vfs_context_t           context,
+                          struct fuse_filehandle *fufh,
+                          uint32_t               *count,
+                          int                    *eofflag)
+{
+    int err = 0;
+    mount_t           mp   = vnode_mount(vp);
+    struct fuse_data *data = fuse_get_mpdata(mp);
+    char             *entry;
+    bool              full = false;
+
+    *count   = 0;
+    *eofflag = 0;
+
+    entry = FUSE_OSMalloc(FUSE_READDIRATTR_ENTRY_MAX, fuse_malloc_tag);
+    if (!entry) {
+        return ENOMEM;
+    }
+
+    while (!full && *count < maxcount) {
+        struct fuse_dispatcher  fdi;
+        struct fuse_read_in    *fri;
+        struct fuse_direntplus *fdp;
+        char    *from;
+        size_t   left;
+        size_t   reclen;
+        uint32_t nent = 0;
+        uint32_t i;
+
+        fuse_dispatcher_init(&fdi, sizeof(*fri));
+        fuse_dispatcher_make_vp(&fdi, FUSE_READDIRPLUS, vp, context);
+
+        fri = fdi.indata;
+        fri->fh = fufh->fh_id;
+        fri->offset = uio_offset(uio);
+        fri->size = (typeof(fri->size))data->max_read;
+
+        if ((err = fuse_dispatcher_wait_answer(&fdi))) {
+            if (err == ENOSYS) {
+                fuse_clear_implemented(data, FSESS_NOIMPLBIT(READDIRPLUS));
+                err = ENOTSUP;
+            }
+            break;
+        }
+
+        /* Validate the answer first; a trailing partial entry is ignored. */
+        for (from = fdi.answer, left = fdi.iosize;
+             left >= FUSE_NAME_OFFSET_DIRENTPLUS; nent++) {
+            fdp = (struct fuse_direntplus *)from;
+            reclen = FUSE_DIRENTPLUS_SIZE(fdp);
+
+            if (left < reclen) {
+                break;
+            }
+
+            if (!fdp->dirent.namelen) {
+                err = EINVAL;
+                break;
+            }
+
+            if (fdp->dirent.namelen > FUSE_MAXNAMLEN) {
+                err = EIO;
+                break;
+            }
+
+            from += reclen;
+            left -= reclen;
+        }
+
+        if (err || nent == 0) {
+            fuse_ticket_drop(fdi.ticket);
+            if (!err && fdi.iosize == 0) {
+                *eofflag = 1;
+            }
+            break;
+        }
+
+        /*
+         * Every entry but "." and ".." counts as a lookup in the daemon, so
+         * all of them are taken, including those there is no room for.
+         */
+        for (i = 0, from = fdi.answer; i < nent; i++, from += reclen) {
+            char    *name;
+            uint32_t namelen;
+            bool     dots;
+            bool     skip;
+            bool     take = !full && *count < maxcount;
+            vnode_t  evp = NULLVP;
+
+            fdp = (struct fuse_direntplus *)from;
+            reclen = FUSE_DIRENTPLUS_SIZE(fdp);
+            name = fdp->dirent.name;
+            namelen = fdp->dirent.namelen;
+
+            dots = (name[0] == '.') &&
+                   ((namelen == 1) || ((namelen == 2) && (name[1] == '.')));
+            skip = dots || fuse_skip_apple_double_mp(mp, name, namelen);
+
+            if (fdp->entry_out.nodeid && !dots) {
+                if (skip) {
+                    struct fuse_dispatcher fdi_forget;
+                    fuse_dispatcher_init(&fdi_forget, 0);
+                    fuse_internal_forget_send(mp, context,
+                                              fdp->entry_out.nodeid, 1,
+                                              &fdi_forget);
+                } else {
+                    evp = fuse_internal_readdirattr_link(vp, fdp, context);
+                }
+            }
+
+            if (take && !skip && !err) {
+                size_t len = fuse_internal_readdirattr_pack(vp, evp, alist,
+                                                            fdp, entry,
+                                                            context);
+
+                if ((user_ssize_t)len > uio_resid(uio)) {
+                    full = true;
+                    take = false;
+                } else if ((err = uiomove(entry, (int)len, uio))) {
+                    take = false;
+                } else {
+                    (*count)++;
+                }
+            }
+
+            if (take && !err) {
+                uio_setoffset(uio, fdp->dirent.off);
+            }
+
+            if (evp) {
+                vnode_put(evp);
+            }
+        }
+
+        fuse_ticket_drop(fdi.ticket);
+
+        if (err) {
+            break;
+        }
+    }
+
+    FUSE_OSFree(entry, FUSE_READDIRATTR_ENTRY_MAX, fuse_malloc_tag);
+
+    return err;
+}
+
+/* remove */
+
+static int
+fuse_internal_remove_callback(vnode_t vp, void *cargs)
+{
+    struct vnode_attr *vap;
+    uint64_t target_nlink;
+
+    vap = VTOVA(vp);
+
+    target_nlink = *(uint64_t *)cargs;
+
+    /* somewhat lame "heuristics", but you got better ideas? */
+    if ((vap->va_nlink == target_nlink) && vnode_isreg(vp)) {
+        fuse_invalidate_attr(vp);
+    }
+
+    return VNODE_RETURNED;
+}
+
+__private_extern__
+int
+fuse_internal_remove(vnode_t               dvp,
+                     vnode_t               vp,
+                     struct componentname *cnp,
+                     enum fuse_opcode      op,
+                     vfs_context_t         context)
+{
+    struct fuse_dispatcher fdi;
+
+    struct vnode_attr *vap = VTOVA(vp);
+    int need_invalidate = 0;
+    uint64_t target_nlink = 0;
+    mount_t mp = vnode_mount(vp);
+
+    int err = 0;
+
+    fuse_dispatcher_init(&fdi, cnp->cn_namelen + 1);
+    fuse_dispatcher_make_vp(&fdi, op, dvp, context);
+
+    memcpy(fdi.indata, cnp->cn_nameptr, cnp->cn_namelen);
+    ((char *)fdi.indata)[cnp->cn_namelen] = '\0';
+
+    if ((vap->va_nlink > 1) && vnode_isreg(vp)) {
+        need_invalidate = 1;
+        target_nlink = vap->va_nlink;
+    }
+
+    if (!(err = fuse_dispatcher_wait_answer(&fdi))) {
+        fuse_ticket_drop(fdi.ticket);
+    }
+
+    fuse_invalidate_attr(dvp);
+    fuse_invalidate_attr(vp);
+    fuse_invalidate_dircache(dvp);
+
+    /*
+     * XXX: M_FUSE4X_INVALIDATE_CACHED_VATTRS_UPON_UNLINK
+     *
+     * Consider the case where vap->va_nlink > 1 for the entity being
+     * removed. In our world, other in-memory vnodes that share a link
+     * count each with this one may not know right way that this one just
+     * got deleted. We should let them know, say, through a vnode_iterate()
+     * here and a callback that does fuse_invalidate_attr(vp) on each
+     * relevant vnode.
+     */
+    if (need_invalidate && !err) {
+        if (!vfs_busy(mp, LK_NOWAIT)) {
+#ifdef FUSE4X_ENABLE_BIGLOCK
+            struct fuse_data *data = fuse_get_mpdata(mp);
+            fuse_biglock_unlock(data->biglock);
+#endif
+            vnode_iterate(mp, 0, fuse_internal_remove_callback,
+                          (void *)&target_nlink);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+            fuse_biglock_lock(data->biglock);
+#endif
+            vfs_unbusy(mp);
+        } else {
+            log("fuse4x: skipping link count fixup upon remove\n");
+        }
+    }
+
+    return err;
+}
+
+/* rename */
+
+__private_extern__
+int
+fuse_internal_rename(vnode_t               fdvp,
+            __unused vnode_t               fvp,
+                     struct componentname *fcnp,
+                     vnode_t               tdvp,
+            __unused vnode_t               tvp,
+                     struct componentname *tcnp,
+                     vfs_context_t         context)
+{
+    struct fuse_dispatcher fdi;
+    struct fuse_rename_in *fri;
+    int err = 0;
+
+    fuse_dispatcher_init(&fdi, sizeof(*fri) + fcnp->cn_namelen + tcnp->cn_namelen + 2);
+    fuse_dispatcher_make_vp(&fdi, FUSE_RENAME, fdvp, context);
+
+    fri = fdi.indata;
+    fri->newdir = VTOI(tdvp);
+    memcpy((char *)fdi.indata + sizeof(*fri), fcnp->cn_nameptr,
+           fcnp->cn_namelen);
+    ((char *)fdi.indata)[sizeof(*fri) + fcnp->cn_namelen] = '\0';
+    memcpy((char *)fdi.indata + sizeof(*fri) + fcnp->cn_namelen + 1,
+           tcnp->cn_nameptr, tcnp->cn_namelen);
+    ((char *)fdi.indata)[sizeof(*fri) + fcnp->cn_namelen +
+                         tcnp->cn_namelen + 1] = '\0';
+
+    if (!(err = fuse_dispatcher_wait_answer(&fdi))) {
+        fuse_ticket_drop(fdi.ticket);
+    }
+
+    fuse_invalidate_dircache(fdvp);
+    if (tdvp != fdvp) {
+        fuse_invalidate_dircache(tdvp);
+    }
+    fuse_vncache_purge_negatives(tdvp);
+
+    if (err == 0) {
+        fuse_invalidate_attr(fdvp);
+        if (tdvp != fdvp) {
+            fuse_invalidate_attr(tdvp);
+        }
+    }
+
+    return err;
+}
+
+/* direct I/O */
+
+/*
+ * Direct I/O is split into max_read or max_write chunks and up to
+ * fuse_directio_max_inflight of them are sent before the first answer is
+ * waited for, so the daemon can work on them in parallel. Answers are still
+ * consumed in order.
+ *
+ * Read answers skip the copy through aw_fiov only for a single kernel iovec.
+ * The buffer of read(2) is in the reader's map, which the daemon's write(2)
+ * cannot reach: that would take wiring the user pages and mapping them into
+ * the kernel, and no KPI lets a kext do so. read(2) therefore gets the
+ * pipelining but keeps its copy.
+ */
+static __inline__
+uint32_t
+fuse_internal_directio_depth(void)
+{
+    uint32_t depth = fuse_directio_max_inflight;
+
+    if (depth < 1) {
+        depth = 1;
+    } else if (depth > FUSE_MAX_DIRECTIO_INFLIGHT) {
+        depth = FUSE_MAX_DIRECTIO_INFLIGHT;
+    }
+
+    return depth;
+}
+
+__private_extern__
+int
+fuse_internal_directio_read(vnode_t                 vp,
+                            uio_t                   uio,
+                            vfs_context_t           context,
+                            struct fuse_filehandle *fufh)
+{
+    struct fuse_dispatcher fdi[FUSE_MAX_DIRECTIO_INFLIGHT];
+    uint32_t               asked[FUSE_MAX_DIRECTIO_INFLIGHT];
+    struct fuse_data      *data = fuse_get_mpdata(vnode_mount(vp));
+    uint32_t               depth = fuse_internal_directio_depth();
+    bool                   direct;
+    bool                   eof = false;
+    int                    err = 0;
+
+    /*
+     * A single kernel buffer can take the answers as they come off the
+     * device (FT_A_BUF), which saves the copy through aw_fiov. User space
+     * buffers, read(2) included, still go through uiomove(); see above.
+     */
+    direct = !uio_isuserspace(uio) && uio_iovcnt(uio) == 1;
+
+    while (!err && !eof && uio_resid(uio) > 0) {
+        off_t        start  = uio_offset(uio);
+        off_t        offset = start;
+        user_ssize_t left   = uio_resid(uio);
+        caddr_t      base   = NULL;
+        uint32_t     count;
+        uint32_t     i;
+
+        if (direct) {
+            base = CAST_DOWN(caddr_t, uio_curriovbase(uio));
+        }
+
+        for (count = 0; count < depth && left > 0; count++) {
+            struct fuse_read_in *fri;
+            size_t size = min((size_t)left, data->max_read);
+
+            fuse_dispatcher_init(&fdi[count], sizeof(*fri));
+            fuse_dispatcher_make_vp(&fdi[count], FUSE_READ, vp, context);
+            fri = fdi[count].indata;
+            fri->fh = fufh->fh_id;
+            fri->offset = offset;
+            fri->size = (uint32_t)size;
+            asked[count] = fri->size;
+
+            if (direct) {
+                fdi[count].ticket->aw_type = FT_A_BUF;
+                fdi[count].ticket->aw_bufdata = base + (offset - start);
+            }
+
+            fuse_dispatcher_send(&fdi[count]);
+
+            offset += size;
+            left -= size;
+        }
+
+        /*
+         * Every ticket is waited for, even after an error or a short read,
+         * so that nothing is left landing in the caller's buffer.
+         */
+        for (i = 0; i < count; i++) {
+            size_t got;
+            int werr = fuse_dispatcher_wait(&fdi[i]);
+
+            if (werr) {
+                if (!err) {
+                    err = werr;
+                }
+                continue;
+            }
+
+            if (!err && !eof) {
+                if (direct) {
+                    got = min(fdi[i].ticket->aw_bufsize, asked[i]);
+                    uio_update(uio, (user_size_t)got);
+                } else {
+                    got = min(fdi[i].iosize, asked[i]);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+                    fuse_biglock_unlock(data->biglock);
+#endif
+                    err = uiomove(fdi[i].answer, (int)got, uio);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+                    fuse_biglock_lock(data->biglock);
+#endif
+                }
+
+                if (got < asked[i]) {
+                    eof = true;
+                }
+            }
+
+            fuse_ticket_drop(fdi[i].ticket);
+        }
+    }
+
+    return err;
+}
+
+__private_extern__
+int
+fuse_internal_directio_write(vnode_t                 vp,
+                             uio_t                   uio,
+                             vfs_context_t           context,
+                             struct fuse_filehandle *fufh)
+{
+    struct fuse_dispatcher fdi[FUSE_MAX_DIRECTIO_INFLIGHT];
+    uint32_t               asked[FUSE_MAX_DIRECTIO_INFLIGHT];
+    struct fuse_data      *data = fuse_get_mpdata(vnode_mount(vp));
+    uint32_t               depth = fuse_internal_directio_depth();
+    int                    err = 0;
+
+    while (!err && uio_resid(uio) > 0) {
+        off_t    written = uio_offset(uio);
+        bool     shortwrite = false;
+        uint32_t count;
+        uint32_t i;
+
+        for (count = 0; count < depth && uio_resid(uio) > 0; count++) {
+            struct fuse_write_in *fwi;
+            size_t chunksize = min((size_t)uio_resid(uio), data->max_write);
+
+            fuse_dispatcher_init(&fdi[count], sizeof(*fwi) + chunksize);
+            fuse_dispatcher_make_vp(&fdi[count], FUSE_WRITE, vp, context);
+            fwi = fdi[count].indata;
+            fwi->fh = fufh->fh_id;
+            fwi->offset = uio_offset(uio);
+            fwi->size = (uint32_t)chunksize;
+            asked[count] = fwi->size;
+
+            err = uiomove((char *)fdi[count].indata + sizeof(*fwi),
+                          (int)chunksize, uio);
+            if (err) {
+                fuse_ticket_drop(fdi[count].ticket);
+                break;
+            }
+
+            fuse_dispatcher_send(&fdi[count]);
+        }
+
+        for (i = 0; i < count; i++) {
+            struct fuse_write_out *fwo;
+            int werr = fuse_dispatcher_wait(&fdi[i]);
+
+            if (werr) {
+                if (!err) {
+                    err = werr;
+                }
+                continue;
+            }
+
+            fwo = (struct fuse_write_out *)fdi[i].answer;
+
+            if (fwo->size > asked[i]) {
+                if (!err) {
+                    err = EINVAL;
+                }
+            } else if (!shortwrite) {
+                written += fwo->size;
+                shortwrite = (fwo->size < asked[i]);
+            }
+
+            fuse_ticket_drop(fdi[i].ticket);
+        }
+
+        /*
+         * A short write ends the call at the last byte the daemon
+         * acknowledged in sequence, and write(2) returns a short count. The
+         * chunks past it are not sent again: the uio has moved on, and its
+         * iovecs cannot be rewound to their data.
+         */
+        if (!err && shortwrite) {
+            off_t diff = uio_offset(uio) - written;
+
+            uio_setresid(uio, (uio_resid(uio) + diff));
+            uio_setoffset(uio, written);
+            break;
+        }
+    }
+
+    if (!err) {
+        fuse_invalidate_attr(vp);
+    }
+
+    return err;
+}
+
+/*
+ * notify
+ *
+ * Notifications are written by the daemon, which may be the very thread a
+ * node lock holder is waiting for. So on mounts without the biglock the
+ * caches are only marked stale here, without taking any node lock.
+ */
+
+static int
+fuse_internal_notify_inval_inode(struct fuse_data *data, uio_t uio)
+{
+    int err = 0;
+    struct fuse_notify_inval_inode_out fniio;
+    vnode_t vp;
+
+    if (uio_resid(uio) != sizeof(fniio)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fniio, (int)sizeof(fniio), uio))) {
+        return err;
+    }
+
+    vp = fuse_node_find(data, fniio.ino);
+    if (vp == NULLVP) {
+        /* Nothing cached for this inode. */
+        return 0;
+    }
+
+    if (fuse_isfinelocking(data)) {
+        fuse_expire_attr(vp);
+        fuse_expire_xattrcache(vp);
+        if (vnode_isdir(vp) && fniio.off >= 0) {
+            fuse_expire_dircache(vp);
+        }
+    } else {
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_lock(data->biglock);
+#endif
+        fuse_invalidate_attr(vp);
+        fuse_invalidate_xattrcache(vp);
+        if (vnode_isdir(vp) && fniio.off >= 0) {
+            fuse_invalidate_dircache(vp);
+        }
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_unlock(data->biglock);
+#endif
+    }
+
+    /* A negative offset asks for the attributes only. */
+    if (fniio.off >= 0 && vnode_isreg(vp)) {
+        off_t end = (fniio.len > 0) ? (fniio.off + fniio.len) : ubc_getsize(vp);
+
+        /*
+         * Dirty pages are written back first, invalidating them would lose
+         * the data. The WRITEs go to the daemon while its notifying thread
+         * waits for them, so, as on Linux, a daemon must not notify from a
+         * thread its WRITEs depend on.
+         */
+        if (end > fniio.off) {
+            (void)ubc_msync(vp, (off_t)fniio.off, end, NULL,
+                            UBC_PUSHDIRTY | UBC_SYNC);
+            (void)ubc_msync(vp, (off_t)fniio.off, end, NULL, UBC_INVALIDATE);
+        }
+    }
+
+    vnode_put(vp);
+
+    return 0;
+}
+
+static int
+fuse_internal_notify_inval_entry(struct fuse_data *data, uio_t uio)
+{
+    int err = 0;
+    struct fuse_notify_inval_entry_out fnieo;
+    struct componentname cn;
+    char    name[FUSE_MAXNAMLEN + 1];
+    vnode_t dvp;
+    vnode_t vp = NULLVP;
+
+    if (uio_resid(uio) < (user_ssize_t)sizeof(fnieo)) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove((caddr_t)&fnieo, (int)sizeof(fnieo), uio))) {
+        return err;
+    }
+
+    /* The name is followed by a terminating zero. */
+    if (fnieo.namelen > FUSE_MAXNAMLEN ||
+        uio_resid(uio) != (user_ssize_t)fnieo.namelen + 1) {
+        return EINVAL;
+    }
+
+    if ((err = uiomove(name, (int)fnieo.namelen + 1, uio))) {
+        return err;
+    }
+    name[fnieo.namelen] = '\0';
+
+    dvp = fuse_node_find(data, fnieo.parent);
+    if (dvp == NULLVP) {
+        return 0;
+    }
+
+    /* Without MAKEENTRY a cache hit, positive or negative, is deleted. */
+    bzero(&cn, sizeof(cn));
+    cn.cn_nameiop = LOOKUP;
+    cn.cn_flags   = ISLASTCN;
+    cn.cn_nameptr = name;
+    cn.cn_namelen = (int)fnieo.namelen;
+
+    if (fuse_vncache_lookup(dvp, &vp, &cn) == -1) {
+        vnode_put(vp);
+    }
+
+    if (fuse_isfinelocking(data)) {
+        fuse_expire_attr(dvp);
+        fuse_expire_dircache(dvp);
+    } else {
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_lock(data->biglock);
+#endif
+        fuse_invalidate_attr(dvp);
+        fuse_invalidate_dircache(dvp);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_unlock(data->biglock);
+#endif
+    }
+
+    vnode_put(dvp);
+
+    return 0;
+}
+
+/*
+ * Handles an unsolicited message from the daemon (unique is 0 and the error
+ * field carries the notification code). The uio holds the body only.
+ */
+__private_extern__
+int
+fuse_internal_notify(struct fuse_data *data, int code, uio_t uio)
+{
+    switch (code) {
+    case FUSE_NOTIFY_INVAL_INODE:
+        return fuse_internal_notify_inval_inode(data, uio);
+
+    case FUSE_NOTIFY_INVAL_ENTRY:
+        return fuse_internal_notify_inval_entry(data, uio);
+
+    default:
+        return EINVAL;
+    }
+}
+
+/* readahead */
+
+/*
+ * Called after a cached read of <resid> bytes at <offset> has been served.
+ * While the reader keeps going sequentially, a window of the file ahead of
+ * it is kept in flight: advisory_read() only starts the I/O and strategy
+ * sends the READs without waiting, so the daemon fetches the data while the
+ * application consumes what it already has. Any other access pattern drops
+ * the window to zero.
+ *
+ * The tracker is updated without a lock; concurrent readers of one vnode
+ * can only make it guess wrong.
+ */
+__private_extern__
+void
+fuse_internal_readahead(vnode_t vp, off_t offset, off_t resid)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data       *data  = fuse_get_mpdata(vnode_mount(vp));
+    off_t    end = offset + resid;
+    off_t    filesize = fvdat->filesize;
+    off_t    start;
+    off_t    target;
+    uint32_t window;
+
+    if (!fuse_adaptive_readahead || fuse_isnoreadahead(vp) || resid <= 0 ||
+        !data->max_readahead) {
+        return;
+    }
+
+    if (offset != fvdat->ra_next) {
+        /* Whatever was prefetched past the old position is not wanted. */
+        if (fvdat->ra_end > fvdat->ra_next) {
+            OSAddAtomic64((SInt64)(fvdat->ra_end - fvdat->ra_next),
+                          (SInt64 *)&data->stats.ra_waste);
+        }
+        fvdat->ra_window = 0;
+        fvdat->ra_end = 0;
+        fvdat->ra_next = end;
+        return;
+    }
+
+    fvdat->ra_next = end;
+
+    if (offset < fvdat->ra_end) {
+        OSAddAtomic64((SInt64)(((end < fvdat->ra_end) ? end : fvdat->ra_end) - offset),
+                      (SInt64 *)&data->stats.ra_hits);
+    }
+
+    /* Nothing to do while more than half of the window is still ahead. */
+    window = fvdat->ra_window;
+    if (window && (fvdat->ra_end - end) > (off_t)(window / 2)) {
+        return;
+    }
+
+    /* The daemon may have asked for less than FUSE_MAX_IOSIZE in INIT. */
+    if (!window) {
+        window = FUSE_READAHEAD_MIN_WINDOW;
+    } else {
+        window *= 2;
+    }
+    if (window > data->max_readahead) {
+        window = data->max_readahead;
+    }
+    fvdat->ra_window = window;
+
+    start = (fvdat->ra_end > end) ? fvdat->ra_end : end;
+    target = end + window;
+    if (target > filesize) {
+        target = filesize;
+    }
+    if (start >= target) {
+        return;
+    }
+
+    fvdat->ra_end = target;
+    OSAddAtomic64((SInt64)(target - start), (SInt64 *)&data->stats.ra_issued);
+
+    (void)advisory_read(vp, filesize, start, (int)(target - start));
+}
+
+/* xattr cache */
+
+/*
+ * With the xattr_cache tunable on, getxattr and listxattr results are kept on
+ * the node, including ENOATTR answers, until the attributes that were valid
+ * when the first one was cached expire. setxattr and removexattr empty the
+ * cache; the inode invalidation notify expires it. Like the readdir cache it
+ * is protected by the node lock, and gen tells a filler that went to the
+ * daemon whether the cache was emptied in the meantime.
+ */
+
+/* Returns whether the cache may be used now. A stale cache is emptied. */
+bool
+fuse_internal_xattrcache_usable(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct timespec uptsp;
+
+    if (!fuse_xattr_cache) {
+        if (!LIST_EMPTY(&fvdat->xattrs)) {
+            fuse_xattrcache_purge(fvdat);
+        }
+        return false;
+    }
+
+    nanouptime(&uptsp);
+
+    if (fuse_timespec_cmp(&uptsp, &fvdat->xattrcache_expires, >)) {
+        fuse_xattrcache_purge(fvdat);
+
+        if (fuse_timespec_cmp(&uptsp, &fvdat->attr_valid, >)) {
+            return false;
+        }
+        fvdat->xattrcache_expires = fvdat->attr_valid;
+    }
+
+    return true;
+}
+
+struct fuse_xattr *
+fuse_internal_xattrcache_find(struct fuse_vnode_data *fvdat, const char *name)
+{
+    struct fuse_xattr *xa;
+
+    LIST_FOREACH(xa, &fvdat->xattrs, link) {
+        if (strcmp(xa->name, name) == 0) {
+            return xa;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Caches an answer for <name>, obtained while the cache generation was <gen>.
+ * <value> may be NULL to cache only the size; <err> is 0 or ENOATTR.
+ */
+void
+fuse_internal_xattrcache_insert(struct fuse_vnode_data *fvdat,
+                                uint32_t                gen,
+                                const char             *name,
+                                int                     err,
+                                const void             *value,
+                                size_t                  size)
+{
+    struct fuse_xattr *xa;
+    size_t namelen = strlen(name);
+    size_t allocsize;
+
+    if (gen != fvdat->xattrcache_gen) {
+        return;
+    }
+
+    if (value && size > FUSE_XATTRCACHE_MAX_VALUE) {
+        value = NULL;
+    }
+
+    allocsize = sizeof(*xa) + namelen + 1 + (value ? size : 0);
+
+    if ((xa = fuse_internal_xattrcache_find(fvdat, name))) {
+        LIST_REMOVE(xa, link);
+        fvdat->xattrcache_size -= xa->allocsize;
+        FUSE_OSFree(xa, xa->allocsize, fuse_malloc_tag);
+    }
+
+    if (fvdat->xattrcache_size + allocsize > FUSE_XATTRCACHE_MAX_SIZE) {
+        return;
+    }
+
+    xa = FUSE_OSMalloc(allocsize, fuse_malloc_tag);
+    if (!xa) {
+        return;
+    }
+
+    xa->allocsize = allocsize;
+    xa->err       = err;
+    xa->size      = err ? 0 : size;
+    xa->has_value = !err && value;
+    xa->value     = xa->name + namelen + 1;
+    memcpy(xa->name, name, namelen + 1);
+    if (xa->has_value) {
+        memcpy(xa->value, value, size);
+    }
+
+    LIST_INSERT_HEAD(&fvdat->xattrs, xa, link);
+    fvdat->xattrcache_size += allocsize;
+}
+
+/* Answers a getxattr or listxattr from a cache entry the way the daemon would. */
+int
+fuse_internal_xattrcache_copyout(struct fuse_xattr *xa, uio_t uio, size_t *sizep)
+{
+    if (xa->err) {
+        return xa->err;
+    }
+
+    *sizep = xa->size;
+
+    if (!uio) {
+        return 0;
+    }
+
+    if ((user_ssize_t)xa->size > uio_resid(uio)) {
+        return ERANGE;
+    }
+
+    return uiomove(xa->value, (int)xa->size, uio);
+}
+
+/* strategy */
+
+/*
+ * State of one buf being transferred by fuse_internal_strategy(). The buf is
+ * split into chunks that are sent to the daemon as asynchronous tickets, at
+ * most fuse_strategy_max_inflight at a time. Each completion issues the next
+ * chunk; whoever drops the last reference finishes the buf.
+ */
+struct fuse_strategy_io {
+    buf_t    bp;
+    mount_t  mp;
+    uint64_t nodeid;
+    uint64_t fh_id;
+    int      op;
+    caddr_t  bufdat;     // kernel mapping of the buf, NULL if upl is used
+    upl_t    upl;        // pages of a cluster buf, used in place of a mapping
+    upl_offset_t uploff; // where the buf starts in upl
+    off_t    offset;     // file offset of the buf
+    off_t    filesize;   // file size when the buf was issued
+    int32_t  count;      // bytes to transfer
+    int32_t  chunksize;
+    uint32_t pid;        // credentials of the original requester
+    uint32_t uid;
+    uint32_t gid;
+    bool     background; // B_ASYNC buf: readahead or write-behind
+
+    int32_t  next;       // buf offset of the next chunk to issue, atomic
+    int32_t  done;       // bytes transferred so far, atomic
+    int32_t  refcount;   // one per ticket in flight plus the issuer, atomic
+    int32_t  err;        // first error, atomic
+};
+
+static fuse_callback_t fuse_internal_strategy_callback;
+
+static void
+fuse_internal_strategy_seterror(struct fuse_strategy_io *sio, int err)
+{
+    OSCompareAndSwap(0, (UInt32)err, (volatile UInt32 *)&sio->err);
+}
+
+static void
+fuse_internal_strategy_release(struct fuse_strategy_io *sio)
+{
+    buf_t bp = sio->bp;
+
+    if (OSDecrementAtomic((SInt32 *)&sio->refcount) != 1) {
+        return;
+    }
+
+    /* Last reference: every chunk has been answered or rejected. */
+
+    buf_setresid(bp, (uint32_t)(sio->count - sio->done));
+    if (sio->err) {
+        buf_seterror(bp, sio->err);
+    }
+
+    if (sio->bufdat) {
+        buf_unmap(bp);
+    }
+    buf_biodone(bp);
+
+    FUSE_OSFree(sio, sizeof(*sio), fuse_malloc_tag);
+}
+
+/* Sends <size> bytes at buf offset <bufoff> to/from the daemon. Does not block. */
+static void
+fuse_internal_strategy_issue(struct fuse_strategy_io *sio, int32_t bufoff,
+                             int32_t size)
+{
+    struct fuse_dispatcher fdi;
+    struct fuse_ticket    *ticket;
+
+    OSIncrementAtomic((SInt32 *)&sio->refcount);
+
+    if (sio->op == FUSE_WRITE) {
+        struct fuse_write_in *fwi;
+
+        fuse_dispatcher_init(&fdi, sizeof(*fwi));
+        fuse_dispatcher_make(&fdi, FUSE_WRITE, sio->mp, sio->nodeid, NULL);
+
+        /* Take the size of the write buffer into account */
+        fdi.finh->len += (typeof(fdi.finh->len))size;
+
+        fwi = fdi.indata;
+        fwi->fh = sio->fh_id;
+        fwi->offset = sio->offset + bufoff;
+        fwi->size = (typeof(fwi->size))size;
+
+        if (sio->upl) {
+            fdi.ticket->ms_type = FT_M_UPL;
+            fdi.ticket->ms_upl = sio->upl;
+            fdi.ticket->ms_uploff = sio->uploff + bufoff;
+        } else {
+            fdi.ticket->ms_type = FT_M_BUF;
+            fdi.ticket->ms_bufdata = sio->bufdat + bufoff;
+        }
+        fdi.ticket->ms_bufsize = size;
+    } else {
+        struct fuse_read_in *fri;
+
+        fuse_dispatcher_init(&fdi, sizeof(*fri));
+        fuse_dispatcher_make(&fdi, sio->op, sio->mp, sio->nodeid, NULL);
+
+        fri = fdi.indata;
+        fri->fh = sio->fh_id;
+        fri->offset = sio->offset + bufoff;
+        fri->size = (typeof(fri->size))size;
+
+        if (sio->upl) {
+            fdi.ticket->aw_type = FT_A_UPL;
+            fdi.ticket->aw_upl = sio->upl;
+            fdi.ticket->aw_uploff = sio->uploff + bufoff;
+        } else {
+            fdi.ticket->aw_type = FT_A_BUF;
+            fdi.ticket->aw_bufdata = sio->bufdat + bufoff;
+        }
+    }
+
+    /* Completions run in the daemon's context, keep the requester identity. */
+    fdi.finh->pid = sio->pid;
+    fdi.finh->uid = sio->uid;
+    fdi.finh->gid = sio->gid;
+
+    ticket = fdi.ticket;
+    ticket->async = true;
+    ticket->background = sio->background;
+    ticket->aw_cookie = sio;
+
+    if (!fuse_insert_callback(ticket, fuse_internal_strategy_callback)) {
+        fuse_internal_strategy_seterror(sio, ENOTCONN);
+        fuse_ticket_drop(ticket);
+        fuse_internal_strategy_release(sio);
+        return;
+    }
+
+    /* The ticket may be answered and dropped before this returns. */
+    fuse_insert_message(ticket);
+}
+
+/* Issues the next chunk of the buf, if there is one left. */
+static bool
+fuse_internal_strategy_issue_next(struct fuse_strategy_io *sio)
+{
+    int32_t bufoff;
+
+    if (sio->err) {
+        return false;
+    }
+
+    bufoff = OSAddAtomic(sio->chunksize, (SInt32 *)&sio->next);
+    if (bufoff >= sio->count) {
+        return false;
+    }
+
+    fuse_internal_strategy_issue(sio, bufoff,
+                                 min(sio->chunksize, sio->count - bufoff));
+
+    return true;
+}
+
+static int
+fuse_internal_strategy_callback(struct fuse_ticket *ticket, uio_t uio)
+{
+    struct fuse_strategy_io *sio = ticket->aw_cookie;
+    int err;
+
+    /* aw_errno is set (and uio is NULL) if the answer will never come. */
+    if (!(err = ticket->aw_errno) && !(err = ticket->aw_ohead.error)) {
+        err = fuse_ticket_pull(ticket, uio);
+    }
+
+    if (!err && sio->op == FUSE_WRITE) {
+        struct fuse_write_in  *fwi = (struct fuse_write_in *)
+            ((char *)ticket->ms_fiov.base + sizeof(struct fuse_in_header));
+        struct fuse_write_out *fwo = ticket->aw_fiov.base;
+        int32_t bufoff = (int32_t)(fwi->offset - sio->offset);
+
+        if (fwo->size > fwi->size) {
+            err = EINVAL;
+        } else if (fwo->size == 0) {
+            err = EIO;
+        } else {
+            OSAddAtomic((SInt32)fwo->size, (SInt32 *)&sio->done);
+            if (fwo->size < fwi->size) {
+                /* Short write, send the rest of the chunk again. */
+                fuse_internal_strategy_issue(sio, bufoff + fwo->size,
+                                             fwi->size - fwo->size);
+            }
+        }
+    } else if (!err) {
+        struct fuse_read_in *fri = (struct fuse_read_in *)
+            ((char *)ticket->ms_fiov.base + sizeof(struct fuse_in_header));
+        int32_t bufoff = (int32_t)(fri->offset - sio->offset);
+
+        if (ticket->aw_bufsize < fri->size && ticket->aw_bufsize > 0 &&
+            sio->op == FUSE_READ &&
+            (off_t)(fri->offset + ticket->aw_bufsize) < sio->filesize) {
+            /*
+             * Short read before EOF. The daemon may return less than asked
+             * for, it does not mean a hole: ask again for the rest.
+             */
+            OSAddAtomic((SInt32)ticket->aw_bufsize, (SInt32 *)&sio->done);
+            fuse_internal_strategy_issue(sio, bufoff + (int32_t)ticket->aw_bufsize,
+                                         (int32_t)(fri->size - ticket->aw_bufsize));
+        } else {
+            if (ticket->aw_bufsize < fri->size) {
+                /*
+                 * EOF, or the daemon has nothing more to give: fill the rest
+                 * with zeros. In NFS context, this would mean a hole in the file.
+                 */
+                if (sio->upl) {
+                    cluster_zero(sio->upl,
+                                 ticket->aw_uploff + (upl_offset_t)ticket->aw_bufsize,
+                                 (int)(fri->size - ticket->aw_bufsize), NULL);
+                } else {
+                    bzero((char *)ticket->aw_bufdata + ticket->aw_bufsize,
+                          fri->size - ticket->aw_bufsize);
+                }
+            }
+            OSAddAtomic((SInt32)fri->size, (SInt32 *)&sio->done);
+        }
     }
 
-    if (err == 0) {
-        fuse_invalidate_attr(fdvp);
-        if (tdvp != fdvp) {
-            fuse_invalidate_attr(tdvp);
-        }
+    if (err) {
+        fuse_internal_strategy_seterror(sio, err);
+    } else {
+        fuse_internal_strategy_issue_next(sio);
     }
 
+    fuse_ticket_drop(ticket);
+    fuse_internal_strategy_release(sio);
+
     return err;
 }
 
-/* strategy */
-
 __private_extern__
 int
 fuse_internal_strategy(vnode_t vp, buf_t bp)
 {
     size_t biosize;
-    size_t chunksize;
-    size_t respsize;
 
-    bool mapped = false;
     int mode;
     int op;
     int vtype = vnode_vtype(vp);
 
     int err = 0;
+    int i, inflight;
 
     caddr_t bufdat;
-    off_t   left;
+    upl_t   bupl;
     off_t   offset;
     int32_t bflags = buf_flags(bp);
 
-    fufh_type_t             fufh_type;
-    struct fuse_dispatcher  fdi;
-    struct fuse_data       *data;
+    fufh_type_t              fufh_type;
+    struct fuse_strategy_io *sio;
+    struct fuse_data        *data;
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
     struct fuse_filehandle *fufh = NULL;
     mount_t mp = vnode_mount(vp);
@@ -930,16 +2413,40 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
          * Lets NOT do the filehandle preflight check here.
          */
 
-        err = fuse_filehandle_get(vp, NULL, fufh_type, 0 /* mode */);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        /*
+         * A pageout of a file nobody has open comes here without the node
+         * lock. Without the biglock that leaves open and close free to race
+         * us for the filehandle, so take the lock unless our caller has it.
+         */
+        bool unlock_node = false;
+
+        if (fuse_isfinelocking(data) && fvdat->nodelockowner != current_thread()) {
+            fusefs_lock(fvdat, FUSEFS_FORCE_LOCK);
+            unlock_node = true;
+        }
+
+#endif
+
+        /* Somebody may have opened one while we were waiting for the lock. */
+        if (!FUFH_IS_VALID(&(fvdat->fufh[fufh_type]))) {
+            err = fuse_filehandle_get(vp, NULL, fufh_type, 0 /* mode */);
+        }
 
         if (!err) {
             fufh = &(fvdat->fufh[fufh_type]);
             /* We've created a NEW fufh of type fufh_type. open_count is 1. */
         }
 
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        if (unlock_node) {
+            fusefs_unlock(fvdat);
+        }
+#endif
+
     } else { /* good fufh */
 
-        OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
+        fuse_counter_inc(FUSE_CNT_FH_REUSE);
 
         /* We're using an existing fufh of type fufh_type. */
     }
@@ -985,14 +2492,10 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
         return 0;
     }
 
-    fuse_dispatcher_init(&fdi, 0);
+    offset = (off_t)((off_t)buf_blkno(bp) * biosize);
 
     if (mode == FREAD) {
-
-        struct fuse_read_in *fri;
-
-        buf_setresid(bp, buf_count(bp));
-        offset = (off_t)((off_t)buf_blkno(bp) * biosize);
+        op = (vtype == VDIR) ? FUSE_READDIR : FUSE_READ;
 
         if (offset >= fvdat->filesize) {
             /* Trying to read at/after EOF? */
@@ -1000,6 +2503,7 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
                 /* Trying to read after EOF? */
                 buf_seterror(bp, EINVAL);
             }
+            buf_setresid(bp, buf_count(bp));
             buf_biodone(bp);
             return 0;
         }
@@ -1009,154 +2513,78 @@ fuse_internal_strategy(vnode_t vp, buf_t bp)
             /* Trimming read */
             buf_setcount(bp, (uint32_t)(fvdat->filesize - offset));
         }
-
-        if (buf_map(bp, &bufdat)) {
-            log("fuse4x: failed to map buffer in strategy\n");
-            return EFAULT;
-        } else {
-            mapped = true;
-        }
-
-        while (buf_resid(bp) > 0) {
-
-            chunksize = min((size_t)buf_resid(bp), data->iosize);
-
-            fdi.iosize = sizeof(*fri);
-
-            op = FUSE_READ;
-            if (vtype == VDIR) {
-                op = FUSE_READDIR;
-            }
-            fuse_dispatcher_make_vp(&fdi, op, vp, NULL);
-
-            fri = fdi.indata;
-            fri->fh = fufh->fh_id;
-
-            /*
-             * Historical note:
-             *
-             * fri->offset = ((off_t)(buf_blkno(bp))) * biosize;
-             *
-             * This wasn't being incremented!?
-             */
-
-            fri->offset = offset;
-            fri->size = (typeof(fri->size))chunksize;
-            fdi.ticket->aw_type = FT_A_BUF;
-            fdi.ticket->aw_bufdata = bufdat;
-
-            if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-                /* There was a problem with reading. */
-                goto out;
-            }
-
-            respsize = fdi.ticket->aw_bufsize;
-
-            buf_setresid(bp, (uint32_t)(buf_resid(bp) - respsize));
-            bufdat += respsize;
-            offset += respsize;
-
-            /* Did we hit EOF before being done? */
-            if ((respsize == 0) && (buf_resid(bp) > 0)) {
-                 /*
-                  * Historical note:
-                  * If we don't get enough data, just fill the rest with zeros.
-                  * In NFS context, this would mean a hole in the file.
-                  */
-
-                 /* Zero-pad the incomplete buffer. */
-                 bzero(bufdat, buf_resid(bp));
-                 buf_setresid(bp, 0);
-                 break;
-            }
-        } /* while (buf_resid(bp) > 0) */
     } else {
-        /* write */
-        struct fuse_write_in  *fwi;
-        struct fuse_write_out *fwo;
-        int merr = 0;
-        off_t diff;
-
-        if (buf_map(bp, &bufdat)) {
-            log("fuse4x: failed to map buffer in strategy\n");
-            return EFAULT;
-        } else {
-            mapped = true;
-        }
-
-        /* Write begin */
-
-        buf_setresid(bp, buf_count(bp));
-        offset = (off_t)((off_t)buf_blkno(bp) * biosize);
-
+        op = FUSE_WRITE;
         /* XXX: TBD -- Check here for extension (writing past end) */
+    }
 
-        left = buf_count(bp);
-
-        while (left) {
-
-            fdi.iosize = sizeof(*fwi);
-            op = FUSE_WRITE;
-
-            fuse_dispatcher_make_vp(&fdi, op, vp, NULL);
-            chunksize = min((size_t)left, data->iosize);
-            
-            /* Take the size of the write buffer into account */
-            fdi.finh->len += (typeof(fdi.finh->len))chunksize;
-
-            fwi = fdi.indata;
-            fwi->fh = fufh->fh_id;
-            fwi->offset = offset;
-            fwi->size = (typeof(fwi->size))chunksize;
-
-            fdi.ticket->ms_type = FT_M_BUF;
-            fdi.ticket->ms_bufdata = bufdat;
-            fdi.ticket->ms_bufsize = chunksize;
-
-            /* About to write <chunksize> at <offset> */
+    buf_setresid(bp, buf_count(bp));
 
-            if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-                merr = 1;
-                break;
-            }
+    /*
+     * The cluster bufs of pagein, pageout and cluster I/O come with their
+     * pages in a UPL. The daemon's reply is copied right into those pages
+     * and pageout data served from them, so such a buf is never mapped
+     * into the kernel map.
+     */
+    bupl = (bflags & B_CLUSTER) ? buf_upl(bp) : NULL;
 
-            fwo = fdi.answer;
-            diff = chunksize - fwo->size;
-            if (diff < 0) {
-                err = EINVAL;
-                break;
-            }
+    if (bupl) {
+        bufdat = NULL;
+    } else if (buf_map(bp, &bufdat)) {
+        log("fuse4x: failed to map buffer in strategy\n");
+        return EFAULT;
+    }
 
-            left -= fwo->size;
-            bufdat += fwo->size;
-            offset += fwo->size;
-            buf_setresid(bp, buf_resid(bp) - fwo->size);
+    sio = FUSE_OSMalloc(sizeof(*sio), fuse_malloc_tag);
+    if (!sio) {
+        if (bufdat) {
+            buf_unmap(bp);
         }
+        buf_seterror(bp, ENOMEM);
+        buf_biodone(bp);
+        return ENOMEM;
+    }
+
+    bzero(sio, sizeof(*sio));
+    sio->bp        = bp;
+    sio->mp        = mp;
+    sio->nodeid    = VTOI(vp);
+    sio->fh_id     = fufh->fh_id;
+    sio->op        = op;
+    sio->bufdat    = bufdat;
+    sio->upl       = bupl;
+    sio->uploff    = bupl ? (upl_offset_t)buf_uploffset(bp) : 0;
+    sio->offset    = offset;
+    sio->filesize  = fvdat->filesize;
+    sio->count     = (int32_t)buf_count(bp);
+    sio->chunksize = (int32_t)((op == FUSE_WRITE) ? data->max_write : data->max_read);
+    sio->pid       = proc_selfpid();
+    sio->uid       = kauth_getuid();
+    sio->gid       = kauth_getgid();
+    if (op == FUSE_WRITE && fvdat->wb_pid) {
+        /* Write-behind, most likely pushed by the flusher thread. */
+        sio->pid   = fvdat->wb_pid;
+        sio->uid   = fvdat->wb_uid;
+        sio->gid   = fvdat->wb_gid;
+    }
+    sio->background = (bflags & B_ASYNC) != 0;
+    sio->refcount  = 1; /* the issuer's reference */
 
-        if (merr) {
-            goto out;
+    /*
+     * Fill the pipeline. The remaining chunks are issued by completions, so
+     * the calling thread never waits for the daemon here: whoever drops the
+     * last reference to sio calls buf_biodone().
+     */
+    inflight = (int)max(fuse_strategy_max_inflight, 1U);
+    for (i = 0; i < inflight; i++) {
+        if (!fuse_internal_strategy_issue_next(sio)) {
+            break;
         }
     }
 
-    if (fdi.ticket) {
-        fuse_ticket_drop(fdi.ticket);
-    } else {
-        /* No ticket upon leaving */
-    }
-
-out:
-
-    if (err) {
-        buf_seterror(bp, err);
-    }
-
-    if (mapped) {
-        buf_unmap(bp);
-    }
-
-    buf_biodone(bp);
+    fuse_internal_strategy_release(sio);
 
-    return err;
+    return 0;
 }
 
 __private_extern__
@@ -1271,7 +2699,10 @@ fuse_internal_newentry_core(vnode_t                 dvp,
     struct fuse_entry_out *feo;
     mount_t mp = vnode_mount(dvp);
 
-    if ((err = fuse_dispatcher_wait_answer(dispatcher))) {
+    err = fuse_dispatcher_wait_answer(dispatcher);
+    fuse_invalidate_dircache(dvp);
+    fuse_vncache_purge_negatives(dvp);
+    if (err) {
         return err;
     }
 
@@ -1339,6 +2770,97 @@ fuse_internal_forget_callback(struct fuse_ticket *ticket, __unused uio_t uio)
     return 0;
 }
 
+/*
+ * Sends everything queued for BATCH_FORGET as one message. Entries queued
+ * after the copy simply wait for the next flush.
+ */
+__private_extern__
+void
+fuse_internal_forget_flush(struct fuse_data *data)
+{
+    struct fuse_dispatcher       fdi;
+    struct fuse_batch_forget_in *fbfi;
+    uint32_t count;
+    size_t   len;
+
+    if (!data->forget_count) {
+        return;
+    }
+
+    if (data->dead) {
+        fuse_lck_mtx_lock(data->forget_mtx);
+        data->forget_count = 0;
+        fuse_lck_mtx_unlock(data->forget_mtx);
+        return;
+    }
+
+    /* The ticket may have to be allocated, so get it before locking. */
+    fuse_dispatcher_init(&fdi, sizeof(*fbfi) +
+                               FUSE_FORGET_BATCH_MAX * sizeof(struct fuse_forget_one));
+    fuse_dispatcher_make(&fdi, FUSE_BATCH_FORGET, data->mp, (uint64_t)0, NULL);
+    fbfi = fdi.indata;
+
+    fuse_lck_mtx_lock(data->forget_mtx);
+    count = data->forget_count;
+    memcpy(fbfi + 1, data->forget_batch, count * sizeof(struct fuse_forget_one));
+    data->forget_count = 0;
+    fuse_lck_mtx_unlock(data->forget_mtx);
+
+    if (!count) {
+        fuse_ticket_drop(fdi.ticket);
+        return;
+    }
+
+    fbfi->count = count;
+
+    /* Only send the entries in use. */
+    len = sizeof(struct fuse_in_header) + sizeof(*fbfi) +
+          count * sizeof(struct fuse_forget_one);
+    fdi.finh->len = (uint32_t)len;
+    fiov_adjust(&fdi.ticket->ms_fiov, len);
+
+    fdi.ticket->invalid = true;
+    fuse_insert_message(fdi.ticket);
+}
+
+static void
+fuse_internal_forget_queue(struct fuse_data *data, uint64_t nodeid,
+                           uint64_t nlookup)
+{
+    uint64_t deadline = 0;
+    bool flush;
+
+    fuse_lck_mtx_lock(data->forget_mtx);
+
+    while (data->forget_count == FUSE_FORGET_BATCH_MAX) {
+        fuse_lck_mtx_unlock(data->forget_mtx);
+        fuse_internal_forget_flush(data);
+        fuse_lck_mtx_lock(data->forget_mtx);
+    }
+
+    if (data->forget_count == 0) {
+        clock_interval_to_deadline(FUSE_FORGET_BATCH_TIMEOUT, NSEC_PER_MSEC,
+                                   &data->forget_deadline);
+        deadline = data->forget_deadline;
+    }
+
+    data->forget_batch[data->forget_count].nodeid  = nodeid;
+    data->forget_batch[data->forget_count].nlookup = nlookup;
+    data->forget_count++;
+
+    flush = (data->forget_count == FUSE_FORGET_BATCH_MAX) ||
+            mach_absolute_time() >= data->forget_deadline;
+
+    fuse_lck_mtx_unlock(data->forget_mtx);
+
+    if (flush) {
+        fuse_internal_forget_flush(data);
+    } else if (deadline) {
+        /* A busy daemon may not come looking for it; see fuse_data_timer_fire(). */
+        fuse_data_timer_arm(data, deadline);
+    }
+}
+
 __private_extern__
 void
 fuse_internal_forget_send(mount_t                 mp,
@@ -1347,6 +2869,7 @@ fuse_internal_forget_send(mount_t                 mp,
                           uint64_t                nlookup,
                           struct fuse_dispatcher *dispatcher)
 {
+    struct fuse_data      *data = fuse_get_mpdata(mp);
     struct fuse_forget_in *ffi;
 
     /*
@@ -1354,7 +2877,21 @@ fuse_internal_forget_send(mount_t                 mp,
      *         (long long unsigned) nodeid));
      */
 
-    fuse_dispatcher_init(dispatcher, sizeof(*ffi));
+    /*
+     * The caller may hand in a ticket it is done with, such as the answered
+     * LOOKUP or RELEASE that led to this forget. It is reused for the FORGET
+     * or, if the forget is only queued, dropped.
+     */
+    if (data->dataflags & FSESS_BATCH_FORGET) {
+        fuse_internal_forget_queue(data, nodeid, nlookup);
+        if (dispatcher->ticket) {
+            fuse_ticket_drop(dispatcher->ticket);
+            dispatcher->ticket = NULL;
+        }
+        return;
+    }
+
+    dispatcher->iosize = sizeof(*ffi);
     fuse_dispatcher_make(dispatcher, FUSE_FORGET, mp, nodeid, context);
 
     ffi = dispatcher->indata;
@@ -1364,24 +2901,226 @@ fuse_internal_forget_send(mount_t                 mp,
     fuse_insert_message(dispatcher->ticket);
 }
 
+/*
+ * Asks the daemon to give up on a request it has read. The message jumps
+ * the queue and expects no answer. A daemon may still finish the request and
+ * answer it normally. An EAGAIN, sent when the interrupt overtook its
+ * request, is ignored like any reply to an unknown unique.
+ */
 __private_extern__
 void
-fuse_internal_interrupt_send(struct fuse_ticket *ticket)
+fuse_internal_interrupt_send(struct fuse_data *data, uint64_t unique)
 {
     struct fuse_dispatcher fdi;
     struct fuse_interrupt_in *fii;
 
-    fdi.ticket = ticket;
+    if (data->dead || !fuse_implemented(data, FSESS_NOIMPLBIT(INTERRUPT))) {
+        return;
+    }
+
     fuse_dispatcher_init(&fdi, sizeof(*fii));
-    fuse_dispatcher_make(&fdi, FUSE_INTERRUPT, ticket->data->mp, (uint64_t)0, NULL);
+    fuse_dispatcher_make(&fdi, FUSE_INTERRUPT, data->mp, (uint64_t)0, NULL);
     fii = fdi.indata;
-    fii->unique = ticket->unique;
+    fii->unique = unique;
     fdi.ticket->invalid = true;
     fuse_insert_message(fdi.ticket);
+
+    fuse_counter_inc(FUSE_CNT_INTERRUPTS_SENT);
 }
 
 /* fuse start/stop */
 
+/*
+ * Makes the cluster layer build bufs no bigger than a single READ or WRITE
+ * to the daemon. Called at mount and again once INIT has told us the
+ * daemon's limits, whichever comes last wins with the current values.
+ */
+__private_extern__
+void
+fuse_internal_setioattr(struct fuse_data *data)
+{
+    struct vfsioattr ioattr;
+
+    fuse_lck_mtx_lock(data->ticket_mtx);
+
+    vfs_ioattr(data->mp, &ioattr);
+    ioattr.io_devblocksize = data->blocksize;
+    ioattr.io_maxsegreadsize = ioattr.io_maxreadcnt = data->max_read;
+    ioattr.io_maxsegwritesize = ioattr.io_maxwritecnt = data->max_write;
+    ioattr.io_segreadcnt = data->max_read / PAGE_SIZE;
+    ioattr.io_segwritecnt = data->max_write / PAGE_SIZE;
+    vfs_setioattr(data->mp, &ioattr);
+
+    fuse_lck_mtx_unlock(data->ticket_mtx);
+}
+
+/*
+ * Write-back caching: writes only dirty UBC pages, and closing a file
+ * does not push them. A per-mount flusher thread wakes up every
+ * FUSE_WRITEBACK_INTERVAL seconds and, if anything was written in the
+ * meantime, starts an asynchronous cluster_push() of every file on the
+ * dirty list. The files stay listed, so sync still sends FSYNC. The
+ * cluster layer hands strategy runs of adjacent dirty pages as large as
+ * max_write, so each run goes out as one WRITE. fsync, sync and unmount
+ * still push synchronously.
+ *
+ * The WRITEs go out through the file handle of the writer and with its
+ * identity, even after it closed the file: see fuse_vnop_close() and
+ * fuse_vnop_write().
+ */
+
+static bool
+fuse_internal_writeback_callback(vnode_t vp, __unused void *cargs)
+{
+    if (fuse_isdeadfs(vp)) {
+        return false;
+    }
+
+    if (vnode_isreg(vp) && vnode_hasdirtyblks(vp)) {
+        (void)cluster_push(vp, 0);
+    }
+
+    fuse_internal_writeback_release(vp);
+    if (VTOFUD(vp)->wb_held) {
+        /* Pages still on their way out; the next pass releases the handle. */
+        fuse_get_mpdata(vnode_mount(vp))->wb_dirty = true;
+    }
+
+    return true;
+}
+
+/*
+ * Releases the file handles close left open for the flusher once the node
+ * has no dirty pages left. The RELEASE is queued behind the WRITEs just
+ * pushed through the handle. Must be called without the biglock.
+ */
+__private_extern__
+void
+fuse_internal_writeback_release(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data       *data = fuse_get_mpdata(vnode_mount(vp));
+    int type;
+
+    if (!fvdat->wb_held || vnode_hasdirtyblks(vp)) {
+        return;
+    }
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    if (fuse_isfinelocking(data)) {
+        fusefs_lock(fvdat, FUSEFS_FORCE_LOCK);
+    } else {
+        fuse_biglock_lock(data->biglock);
+    }
+#endif
+
+    for (type = 0; type < FUFH_MAXTYPE; type++) {
+        struct fuse_filehandle *fufh = &(fvdat->fufh[type]);
+
+        if (!(fvdat->wb_held & (1 << type))) {
+            continue;
+        }
+
+        fvdat->wb_held &= ~(1 << type);
+        FUFH_USE_DEC(fufh);
+        if (!FUFH_IS_VALID(fufh) && !fuse_isdeadfs(vp)) {
+            (void)fuse_filehandle_put(vp, NULL, type);
+        }
+    }
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    if (fuse_isfinelocking(data)) {
+        fusefs_unlock(fvdat);
+    } else {
+        fuse_biglock_unlock(data->biglock);
+    }
+#endif
+}
+
+static void
+fuse_internal_writeback_thread(void *param, __unused wait_result_t result)
+{
+    struct fuse_data *data = param;
+    struct timespec   ts;
+
+    fuse_lck_mtx_lock(data->wb_mtx);
+
+    while (!data->wb_stop) {
+        ts.tv_sec = FUSE_WRITEBACK_INTERVAL;
+        ts.tv_nsec = 0;
+        (void)fuse_msleep(&data->wb_dirty, data->wb_mtx, PINOD, "fu_wback", &ts);
+
+        if (data->wb_stop || !data->wb_dirty) {
+            continue;
+        }
+        data->wb_dirty = false;
+
+        fuse_lck_mtx_unlock(data->wb_mtx);
+        fuse_node_dirty_iterate(data, fuse_internal_writeback_callback, NULL);
+        fuse_lck_mtx_lock(data->wb_mtx);
+    }
+
+    data->wb_thread = NULL;
+    fuse_wakeup(&data->wb_thread);
+    fuse_lck_mtx_unlock(data->wb_mtx);
+
+    thread_terminate(current_thread());
+}
+
+__private_extern__
+void
+fuse_internal_writeback_start(struct fuse_data *data)
+{
+    thread_t thread;
+
+    fuse_lck_mtx_lock(data->wb_mtx);
+
+    /* Once stopped, the flusher stays stopped until resumed. */
+    if (!data->wb_thread && !data->wb_stop) {
+        if (kernel_thread_start(fuse_internal_writeback_thread, data,
+                                &thread) == KERN_SUCCESS) {
+            data->wb_thread = thread;
+            thread_deallocate(thread);
+        } else {
+            /* Dirty pages still go out on sync, fsync and unmount. */
+            log("fuse4x: cannot start the write-back flusher\n");
+        }
+    }
+
+    fuse_lck_mtx_unlock(data->wb_mtx);
+}
+
+/*
+ * Returns once the flusher has exited. A later fuse_internal_writeback_start(),
+ * as from a belated INIT answer, does nothing.
+ */
+__private_extern__
+void
+fuse_internal_writeback_stop(struct fuse_data *data)
+{
+    fuse_lck_mtx_lock(data->wb_mtx);
+
+    data->wb_stop = true;
+    fuse_wakeup(&data->wb_dirty);
+    while (data->wb_thread) {
+        (void)fuse_msleep(&data->wb_thread, data->wb_mtx, PINOD, "fu_wbstop", NULL);
+    }
+
+    fuse_lck_mtx_unlock(data->wb_mtx);
+}
+
+/* Restarts the flusher after fuse_internal_writeback_stop(). */
+__private_extern__
+void
+fuse_internal_writeback_resume(struct fuse_data *data)
+{
+    fuse_lck_mtx_lock(data->wb_mtx);
+    data->wb_stop = false;
+    fuse_lck_mtx_unlock(data->wb_mtx);
+
+    fuse_internal_writeback_start(data);
+}
+
 __private_extern__
 int
 fuse_internal_init_callback(struct fuse_ticket *ticket, __unused uio_t uio)
@@ -1406,20 +3145,40 @@ fuse_internal_init_callback(struct fuse_ticket *ticket, __unused uio_t uio)
     fiio = ticket->aw_fiov.base;
 
     if ((fiio->major < FUSE_KERNEL_VERSION) ||
-        (fiio->minor < FUSE_KERNEL_MINOR_VERSION)) {
+        (fiio->minor < FUSE_KERNEL_MINOR_VERSION_MIN)) {
         log("fuse4x: user-space library has outdated protocol version. Required(%d.%d), user returned (%d.%d)\n",
-              FUSE_KERNEL_VERSION, FUSE_KERNEL_MINOR_VERSION,
+              FUSE_KERNEL_VERSION, FUSE_KERNEL_MINOR_VERSION_MIN,
               fiio->major, fiio->minor);
         err = EPROTONOSUPPORT;
         goto out;
     }
 
     if (ticket->aw_fiov.len == sizeof(struct fuse_init_out)) {
-        data->max_write = fiio->max_write;
+        uint32_t max_write = fiio->max_write;
+
+        /* Without BIG_WRITES the mount's iosize stays the upper bound. */
+        if (!(fiio->flags & FUSE_BIG_WRITES) && max_write > data->iosize) {
+            max_write = data->iosize;
+        }
+        max_write &= ~(PAGE_SIZE - 1);
+        if (max_write < FUSE_MIN_IOSIZE) {
+            max_write = FUSE_MIN_IOSIZE;
+        } else if (max_write > FUSE_MAX_IOSIZE) {
+            max_write = FUSE_MAX_IOSIZE;
+        }
+        data->max_write = max_write;
+
+        if (fiio->max_readahead < data->max_readahead) {
+            data->max_readahead = fiio->max_readahead;
+        }
     } else {
         err = EINVAL;
     }
 
+    if (fiio->minor >= 16) {
+        data->dataflags |= FSESS_BATCH_FORGET;
+    }
+
     if (fiio->flags & FUSE_CASE_INSENSITIVE) {
         data->dataflags |= FSESS_CASE_INSENSITIVE;
     }
@@ -1436,6 +3195,32 @@ fuse_internal_init_callback(struct fuse_ticket *ticket, __unused uio_t uio)
         data->dataflags |= FSESS_ATOMIC_O_TRUNC;
     }
 
+    if (fiio->flags & FUSE_BATCH_IO) {
+        data->dataflags |= FSESS_BATCH_IO;
+    }
+
+    if (fiio->flags & FUSE_ASYNC_FLUSH) {
+        data->dataflags |= FSESS_ASYNC_FLUSH;
+    }
+
+    if (fiio->flags & FUSE_DO_READDIRPLUS) {
+        data->dataflags |= FSESS_READDIRPLUS;
+    }
+
+    /* Same restrictions as the 'nosyncwrites' mount option. */
+    if ((fiio->flags & FUSE_WRITEBACK_CACHE) &&
+        !(data->dataflags & (FSESS_DIRECT_IO | FSESS_NO_READAHEAD))) {
+        data->dataflags |= FSESS_WRITEBACK_CACHE;
+    }
+
+    if (!err && data->mounted) {
+        fuse_internal_setioattr(data);
+        if (data->dataflags & FSESS_WRITEBACK_CACHE) {
+            fuse_setnosyncwrites_mp(data->mp);
+            fuse_internal_writeback_start(data);
+        }
+    }
+
 out:
     fuse_ticket_drop(ticket);
 
@@ -1463,8 +3248,9 @@ fuse_send_init(struct fuse_data *data, vfs_context_t context)
     fiii = fdi.indata;
     fiii->major = FUSE_KERNEL_VERSION;
     fiii->minor = FUSE_KERNEL_MINOR_VERSION;
-    fiii->max_readahead = data->iosize * 16;
-    fiii->flags = 0;
+    fiii->max_readahead = data->max_readahead;
+    fiii->flags = FUSE_BATCH_IO | FUSE_BIG_WRITES | FUSE_WRITEBACK_CACHE |
+                  FUSE_ASYNC_FLUSH | FUSE_DO_READDIRPLUS;
 
     fuse_insert_callback(fdi.ticket, fuse_internal_init_callback);
     fuse_insert_message(fdi.ticket);
@@ -17,6 +17,7 @@
 #include <AvailabilityMacros.h>
 #include <kern/clock.h>
 #include <sys/types.h>
+#include <sys/attr.h>
 #include <sys/kauth.h>
 #include <sys/kernel_types.h>
 #include <sys/mount.h>
@@ -53,6 +54,56 @@ struct fuse_ticket;
          ((tvp)->tv_nsec cmp (uvp)->tv_nsec) : \
          ((tvp)->tv_sec cmp (uvp)->tv_sec))
 
+/* negative name cache */
+
+/*
+ * The VFS name cache does not age its entries, so every directory keeps one
+ * deadline for all of its negative entries. The earliest timeout supplied by
+ * the daemon wins, and the entries are purged together once it has passed.
+ */
+static __inline__
+void
+fuse_vncache_enter_negative(vnode_t dvp, struct componentname *cnp,
+                            struct timespec *timeout)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(dvp);
+    struct timespec deadline;
+
+    nanouptime(&deadline);
+    fuse_timespec_add(&deadline, timeout);
+
+    if ((fvdat->negative_expires.tv_sec == 0 &&
+         fvdat->negative_expires.tv_nsec == 0) ||
+        fuse_timespec_cmp(&deadline, &fvdat->negative_expires, <)) {
+        fvdat->negative_expires = deadline;
+    }
+
+    fuse_vncache_enter(dvp, NULLVP, cnp);
+}
+
+/* Returns true if expired negative entries of dvp were purged. */
+static __inline__
+bool
+fuse_vncache_expire_negatives(vnode_t dvp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(dvp);
+    struct timespec uptsp;
+
+    if (fvdat->negative_expires.tv_sec == 0 &&
+        fvdat->negative_expires.tv_nsec == 0) {
+        return false;
+    }
+
+    nanouptime(&uptsp);
+    if (fuse_timespec_cmp(&uptsp, &fvdat->negative_expires, <=)) {
+        return false;
+    }
+
+    fuse_vncache_purge_negatives(dvp);
+
+    return true;
+}
+
 
 #ifndef MAC_OS_X_VERSION_10_6
 extern const char *vnode_getname(vnode_t vp);
@@ -182,6 +233,28 @@ fuse_isnosynconclose(vnode_t vp)
     return (fuse_get_mpdata(vnode_mount(vp))->dataflags & FSESS_NO_SYNCONCLOSE);
 }
 
+static __inline__
+int
+fuse_iswriteback_mp(mount_t mp)
+{
+    if (fuse_isdirectio_mp(mp)) {
+        return 0;
+    }
+
+    return (fuse_get_mpdata(mp)->dataflags & FSESS_WRITEBACK_CACHE);
+}
+
+static __inline__
+int
+fuse_iswriteback(vnode_t vp)
+{
+    if (fuse_isdirectio(vp)) {
+        return 0;
+    }
+
+    return fuse_iswriteback_mp(vnode_mount(vp));
+}
+
 static __inline__
 int
 fuse_isnosyncwrites_mp(mount_t mp)
@@ -210,7 +283,8 @@ fuse_clearnosyncwrites_mp(mount_t mp)
     if (!vfs_issynchronous(mp)) {
         vfs_clearflags(mp, MNT_ASYNC);
         vfs_setflags(mp, MNT_SYNCHRONOUS);
-        fuse_get_mpdata(mp)->dataflags &= ~FSESS_NO_SYNCWRITES;
+        fuse_get_mpdata(mp)->dataflags &= ~(FSESS_NO_SYNCWRITES |
+                                            FSESS_WRITEBACK_CACHE);
     }
 }
 
@@ -623,6 +697,15 @@ fuse_internal_fsync(vnode_t                 vp,
                     struct fuse_filehandle *fufh,
                     void                   *param);
 
+void
+fuse_internal_fsync_send(vnode_t                 vp,
+                         vfs_context_t           context,
+                         struct fuse_filehandle *fufh,
+                         struct fuse_dispatcher *dispatcher);
+
+int
+fuse_internal_fsync_wait(vnode_t vp, struct fuse_dispatcher *dispatcher);
+
 int
 fuse_internal_fsync_callback(struct fuse_ticket *ticket, uio_t uio);
 
@@ -634,17 +717,22 @@ fuse_internal_readdir(vnode_t                 vp,
                       uio_t                   uio,
                       vfs_context_t           context,
                       struct fuse_filehandle *fufh,
-                      struct fuse_iov        *cookediov,
                       int                    *numdirent);
 
+/* readdirattr */
+
 int
-fuse_internal_readdir_processdata(vnode_t          vp,
-                                  uio_t            uio,
-                                  size_t           reqsize,
-                                  void            *buf,
-                                  size_t           bufsize,
-                                  struct fuse_iov *cookediov,
-                                  int             *numdirent);
+fuse_internal_readdirattr_check(vnode_t vp, struct attrlist *alist);
+
+int
+fuse_internal_readdirattr(vnode_t                 vp,
+                          struct attrlist        *alist,
+                          uio_t                   uio,
+                          uint32_t                maxcount,
+                          vfs_context_t           context,
+                          struct fuse_filehandle *fufh,
+                          uint32_t               *count,
+                          int                    *eofflag);
 
 /* remove */
 
@@ -667,6 +755,52 @@ fuse_internal_rename(vnode_t               fdvp,
                      vfs_context_t         context);
 
 
+/* direct I/O */
+
+int
+fuse_internal_directio_read(vnode_t                 vp,
+                            uio_t                   uio,
+                            vfs_context_t           context,
+                            struct fuse_filehandle *fufh);
+
+int
+fuse_internal_directio_write(vnode_t                 vp,
+                             uio_t                   uio,
+                             vfs_context_t           context,
+                             struct fuse_filehandle *fufh);
+
+
+/* notify */
+
+int
+fuse_internal_notify(struct fuse_data *data, int code, uio_t uio);
+
+
+/* readahead */
+
+void
+fuse_internal_readahead(vnode_t vp, off_t offset, off_t resid);
+
+
+/* xattr cache */
+
+bool
+fuse_internal_xattrcache_usable(vnode_t vp);
+
+struct fuse_xattr *
+fuse_internal_xattrcache_find(struct fuse_vnode_data *fvdat, const char *name);
+
+void
+fuse_internal_xattrcache_insert(struct fuse_vnode_data *fvdat,
+                                uint32_t                gen,
+                                const char             *name,
+                                int                     err,
+                                const void             *value,
+                                size_t                  size);
+
+int
+fuse_internal_xattrcache_copyout(struct fuse_xattr *xa, uio_t uio, size_t *sizep);
+
 /* strategy */
 
 int
@@ -730,6 +864,9 @@ fuse_internal_newentry_core(vnode_t                 dvp,
 int
 fuse_internal_forget_callback(struct fuse_ticket *ticket, uio_t uio);
 
+void
+fuse_internal_forget_flush(struct fuse_data *data);
+
 void
 fuse_internal_forget_send(mount_t                 mp,
                           vfs_context_t           context,
@@ -738,11 +875,16 @@ fuse_internal_forget_send(mount_t                 mp,
                           struct fuse_dispatcher *dispatcher);
 
 void
-fuse_internal_interrupt_send(struct fuse_ticket *ticket);
+fuse_internal_interrupt_send(struct fuse_data *data, uint64_t unique);
 
 /* fuse start/stop */
 
 int fuse_internal_init_callback(struct fuse_ticket *ticket, uio_t uio);
+void fuse_internal_writeback_start(struct fuse_data *data);
+void fuse_internal_writeback_stop(struct fuse_data *data);
+void fuse_internal_writeback_resume(struct fuse_data *data);
+void fuse_internal_writeback_release(vnode_t vp);
+void fuse_internal_setioattr(struct fuse_data *data);
 int fuse_send_init(struct fuse_data *data, vfs_context_t context);
 
 /* other */
@@ -758,7 +900,13 @@ static __inline__
 void
 fuse_clear_implemented(struct fuse_data *data, uint64_t which)
 {
-    data->noimplflags |= which;
+    uint64_t old;
+
+    /* Not necessarily under the biglock: see fuse_isfinelocking(). */
+    do {
+        old = data->noimplflags;
+    } while (!OSCompareAndSwap64(old, old | which,
+                                 (volatile UInt64 *)&data->noimplflags));
 }
 
 void
@@ -5,12 +5,12 @@
  */
 
 #include "fuse.h"
+#include "fuse_device.h"
 #include "fuse_internal.h"
 #include "fuse_ipc.h"
 #include "fuse_locking.h"
 #include "fuse_node.h"
 #include "fuse_sysctl.h"
-#include "compat/tree.h"
 
 #include <sys/types.h>
 #include <sys/malloc.h>
@@ -45,109 +45,167 @@ static __inline__ void fuse_setup_ihead(struct fuse_in_header *ihead,
 static fuse_callback_t  fuse_standard_callback;
 
 
+/* fuse_iov buffer pool */
+
 static __inline__
-void *
-FUSE_OSRealloc_nocopy(void *oldptr, size_t oldsize, size_t newsize)
+size_t
+fuse_iov_class_size(int class)
 {
-    void *data;
+    return ((size_t)PAGE_SIZE << class) + FUSE_IOV_HEADROOM;
+}
 
-    data = FUSE_OSMalloc(newsize, fuse_malloc_tag);
-    if (!data) {
-        panic("fuse4x: OSMalloc failed in realloc");
+/* Returns the smallest class <size> fits in, -1 if it is too big for all. */
+static __inline__
+int
+fuse_iov_class_of(size_t size)
+{
+    for (int class = 0; class < FUSE_IOV_POOL_CLASSES; class++) {
+        if (size <= fuse_iov_class_size(class)) {
+            return class;
+        }
     }
 
-    FUSE_OSFree(oldptr, oldsize, fuse_malloc_tag);
-    OSIncrementAtomic((SInt32 *)&fuse_realloc_count);
+    return -1;
+}
 
-    return data;
+void
+fuse_iov_pool_init(struct fuse_iov_pool *pool)
+{
+    for (int class = 0; class < FUSE_IOV_POOL_CLASSES; class++) {
+        pool->classes[class].mtx = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+        pool->classes[class].head = NULL;
+        pool->classes[class].count = 0;
+    }
 }
 
-static __inline__
-void *
-FUSE_OSRealloc_nocopy_canfail(void *oldptr, size_t oldsize, size_t newsize)
+/* Every buffer must have been given back by now. */
+void
+fuse_iov_pool_destroy(struct fuse_iov_pool *pool)
 {
-    void *data;
+    for (int class = 0; class < FUSE_IOV_POOL_CLASSES; class++) {
+        struct fuse_iov_class *cls = &pool->classes[class];
+        void *buf;
 
-    data = FUSE_OSMalloc(newsize, fuse_malloc_tag);
-    if (!data) {
-        goto out;
-    } else {
-        FUSE_OSFree(oldptr, oldsize, fuse_malloc_tag);
-        OSIncrementAtomic((SInt32 *)&fuse_realloc_count);
-    }
+        while ((buf = cls->head)) {
+            cls->head = *(void **)buf;
+            FUSE_OSFree(buf, fuse_iov_class_size(class), fuse_malloc_tag);
+        }
+        cls->count = 0;
 
-out:
-    return data;
+        lck_mtx_free(cls->mtx, fuse_lock_group);
+        cls->mtx = NULL;
+    }
 }
 
-void
-fiov_init(struct fuse_iov *fiov, size_t size)
+/*
+ * Hands out a buffer of at least <size> bytes and stores its real size in
+ * <allocated>. Only if the class is empty (or <size> is bigger than every
+ * class) does this go to the allocator, which is what memory_reallocs
+ * counts now.
+ */
+static void *
+fuse_iov_pool_get(struct fuse_iov_pool *pool, size_t size, size_t *allocated)
 {
-    size_t msize = FU_AT_LEAST(size);
+    int   class = fuse_iov_class_of(size);
+    void *buf = NULL;
 
-    fiov->len = 0;
+    if (class >= 0) {
+        struct fuse_iov_class *cls = &pool->classes[class];
+
+        fuse_lck_mtx_lock(cls->mtx);
+        if ((buf = cls->head)) {
+            cls->head = *(void **)buf;
+            cls->count--;
+        }
+        fuse_lck_mtx_unlock(cls->mtx);
 
-    fiov->base = FUSE_OSMalloc(msize, fuse_malloc_tag);
-    if (!fiov->base) {
-        panic("fuse4x: OSMalloc failed in fiov_init");
+        size = fuse_iov_class_size(class);
     }
 
-    OSIncrementAtomic((SInt32 *)&fuse_iov_current);
+    if (!buf) {
+        buf = FUSE_OSMalloc(size, fuse_malloc_tag);
+        if (!buf) {
+            return NULL;
+        }
+        fuse_counter_inc(FUSE_CNT_REALLOCS);
+    }
 
-    bzero(fiov->base, msize);
+    *allocated = size;
 
-    fiov->allocated_size = msize;
-    fiov->credit = fuse_iov_credit;
+    return buf;
 }
 
-void
-fiov_teardown(struct fuse_iov *fiov)
+static void
+fuse_iov_pool_put(struct fuse_iov_pool *pool, void *buf, size_t size)
 {
-    FUSE_OSFree(fiov->base, fiov->allocated_size, fuse_malloc_tag);
-    fiov->allocated_size = 0;
+    int class = fuse_iov_class_of(size);
+
+    if (class >= 0 && size == fuse_iov_class_size(class)) {
+        struct fuse_iov_class *cls = &pool->classes[class];
 
-    OSDecrementAtomic((SInt32 *)&fuse_iov_current);
+        fuse_lck_mtx_lock(cls->mtx);
+        if (cls->count * size < FUSE_IOV_POOL_CLASS_BUDGET) {
+            *(void **)buf = cls->head;
+            cls->head = buf;
+            cls->count++;
+            buf = NULL;
+        }
+        fuse_lck_mtx_unlock(cls->mtx);
+    }
+
+    if (buf) {
+        FUSE_OSFree(buf, size, fuse_malloc_tag);
+    }
 }
 
+/* Goes back to the inline buffer. */
+static __inline__
 void
-fiov_adjust(struct fuse_iov *fiov, size_t size)
+fiov_release(struct fuse_iov *fiov)
 {
-    if (fiov->allocated_size < size ||
-        (fiov->allocated_size - size > fuse_iov_permanent_bufsize &&
-             --fiov->credit < 0)) {
+    if (fiov->base != fiov->inline_buf) {
+        fuse_iov_pool_put(fiov->pool, fiov->base, fiov->allocated_size);
+        fiov->base = fiov->inline_buf;
+        fiov->allocated_size = sizeof(fiov->inline_buf);
+    }
+}
 
-        fiov->base = FUSE_OSRealloc_nocopy(fiov->base, fiov->allocated_size,
-                                           FU_AT_LEAST(size));
-        if (!fiov->base) {
-            panic("fuse4x: realloc failed");
-        }
+void
+fiov_init(struct fuse_iov *fiov, struct fuse_iov_pool *pool, size_t size)
+{
+    fiov->pool = pool;
+    fiov->base = fiov->inline_buf;
+    fiov->allocated_size = sizeof(fiov->inline_buf);
 
-        fiov->allocated_size = FU_AT_LEAST(size);
-        fiov->credit = fuse_iov_credit;
-    }
+    fuse_counter_inc(FUSE_CNT_IOV_CURRENT);
 
-    fiov->len = size;
+    fiov_adjust(fiov, size);
+}
+
+void
+fiov_teardown(struct fuse_iov *fiov)
+{
+    fiov_release(fiov);
+    fiov->allocated_size = 0;
+
+    fuse_counter_dec(FUSE_CNT_IOV_CURRENT);
 }
 
+/* The contents are not preserved when the buffer has to grow. */
 int
 fiov_adjust_canfail(struct fuse_iov *fiov, size_t size)
 {
-    if (fiov->allocated_size < size ||
-        (fiov->allocated_size - size > fuse_iov_permanent_bufsize &&
-             --fiov->credit < 0)) {
+    if (fiov->allocated_size < size) {
+        size_t allocated;
+        void  *buf = fuse_iov_pool_get(fiov->pool, size, &allocated);
 
-        void *tmpbase = NULL;
-
-        tmpbase = FUSE_OSRealloc_nocopy_canfail(fiov->base,
-                                                fiov->allocated_size,
-                                                FU_AT_LEAST(size));
-        if (!tmpbase) {
+        if (!buf) {
             return ENOMEM;
         }
 
-        fiov->base = tmpbase;
-        fiov->allocated_size = FU_AT_LEAST(size);
-        fiov->credit = fuse_iov_credit;
+        fiov_release(fiov);
+        fiov->base = buf;
+        fiov->allocated_size = allocated;
     }
 
     fiov->len = size;
@@ -155,11 +213,28 @@ fiov_adjust_canfail(struct fuse_iov *fiov, size_t size)
     return 0;
 }
 
+void
+fiov_adjust(struct fuse_iov *fiov, size_t size)
+{
+    if (fiov_adjust_canfail(fiov, size)) {
+        panic("fuse4x: cannot allocate a %lu byte fuse_iov", size);
+    }
+}
+
+/*
+ * Prepares the fiov for the ticket's next use. Nothing is cleared here:
+ * fuse_dispatcher_make() clears the header and the fixed-size part of a new
+ * request, and answers are written over in full. A buffer bigger than
+ * fuse_iov_permanent_bufsize goes back to the pool rather than staying
+ * with an idle ticket.
+ */
 void
 fiov_refresh(struct fuse_iov *fiov)
 {
-    bzero(fiov->base, fiov->len);
-    fiov_adjust(fiov, 0);
+    if (fiov->allocated_size > fuse_iov_permanent_bufsize) {
+        fiov_release(fiov);
+    }
+    fiov->len = 0;
 }
 
 static struct fuse_ticket *
@@ -173,21 +248,17 @@ fuse_ticket_alloc(struct fuse_data *data)
         panic("fuse4x: OSMalloc failed in " __FUNCTION__);
     }
 
-    OSIncrementAtomic((SInt32 *)&fuse_tickets_current);
+    fuse_counter_inc(FUSE_CNT_TICKETS_CURRENT);
 
     bzero(ticket, sizeof(struct fuse_ticket));
 
-    fuse_lck_mtx_lock(data->ticket_mtx);
-    ticket->unique = data->ticketer++;
-    fuse_lck_mtx_unlock(data->ticket_mtx);
-
     ticket->data = data;
 
-    fiov_init(&ticket->ms_fiov, sizeof(struct fuse_in_header));
+    fiov_init(&ticket->ms_fiov, &data->iov_pool, sizeof(struct fuse_in_header));
     ticket->ms_type = FT_M_FIOV;
+    ticket->ms_channel = FUSE_MS_UNQUEUED;
 
-    ticket->aw_mtx = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
-    fiov_init(&ticket->aw_fiov, 0);
+    fiov_init(&ticket->aw_fiov, &data->iov_pool, 0);
     ticket->aw_type = FT_A_FIOV;
 
     return ticket;
@@ -200,7 +271,10 @@ fuse_ticket_refresh(struct fuse_ticket *ticket)
     fiov_refresh(&ticket->ms_fiov);
     ticket->ms_bufdata = NULL;
     ticket->ms_bufsize = 0;
+    ticket->ms_upl = NULL;
+    ticket->ms_uploff = 0;
     ticket->ms_type = FT_M_FIOV;
+    ticket->ms_channel = FUSE_MS_UNQUEUED;
 
     bzero(&ticket->aw_ohead, sizeof(struct fuse_out_header));
 
@@ -208,12 +282,20 @@ fuse_ticket_refresh(struct fuse_ticket *ticket)
     ticket->aw_errno = 0;
     ticket->aw_bufdata = NULL;
     ticket->aw_bufsize = 0;
+    ticket->aw_upl = NULL;
+    ticket->aw_uploff = 0;
     ticket->aw_type = FT_A_FIOV;
+    ticket->aw_cookie = NULL;
+    ticket->aw_deadline = 0;
 
     ticket->answered = false;
     ticket->invalid = false;
     ticket->dirty = false;
     ticket->killed = false;
+    ticket->async = false;
+    ticket->background = false;
+    ticket->abandoned = false;
+    ticket->read = false;
 }
 
 static void
@@ -221,13 +303,12 @@ fuse_ticket_destroy(struct fuse_ticket *ticket)
 {
     fiov_teardown(&ticket->ms_fiov);
 
-    lck_mtx_free(ticket->aw_mtx, fuse_lock_group);
     ticket->aw_mtx = NULL;
     fiov_teardown(&ticket->aw_fiov);
 
     FUSE_OSFree(ticket, sizeof(struct fuse_ticket), fuse_malloc_tag);
 
-    OSDecrementAtomic((SInt32 *)&fuse_tickets_current);
+    fuse_counter_dec(FUSE_CNT_TICKETS_CURRENT);
 }
 
 static int
@@ -276,15 +357,6 @@ fuse_ticket_wait_answer(struct fuse_ticket *ticket)
         goto out;
     }
 
-#ifdef FUSE4X_ENABLE_INTERRUPT
-    else if (err == EINTR) {
-       /*
-        * XXX: Stop gap! I really need to finish interruption plumbing.
-        */
-       fuse_internal_interrupt_send(ticket);
-    }
-#endif
-
 out:
     fuse_lck_mtx_unlock(ticket->aw_mtx);
 
@@ -328,6 +400,20 @@ fuse_ticket_aw_pull_uio(struct fuse_ticket *ticket, uio_t uio)
             }
             break;
 
+        case FT_A_UPL: {
+            /* Copied to the physical pages, they need no kernel mapping. */
+            int resid = (int)len;
+
+            err = cluster_copy_upl_data(uio, ticket->aw_upl,
+                                        (int)ticket->aw_uploff, &resid);
+            ticket->aw_bufsize = len - (size_t)resid;
+            if (err) {
+                log("fuse4x: FT_A_UPL error is %d (%p, %u, %ld, %p)\n",
+                      err, ticket->aw_upl, ticket->aw_uploff, len, uio);
+            }
+            break;
+        }
+
         default:
             panic("fuse4x: unknown answer type for ticket %p", ticket);
         }
@@ -353,6 +439,103 @@ fuse_ticket_pull(struct fuse_ticket *ticket, uio_t uio)
     return err;
 }
 
+/*
+ * Nobody sleeps on an asynchronous ticket, so nothing would notice a daemon
+ * that never answers it: the buf of a strategy call would stay busy forever.
+ * The per-mount timer gives such tickets the same daemon_timeout a sleeping
+ * requester has. One not answered in time marks the file system dead, as a
+ * sleeper's timeout does, and fails every request still waiting.
+ *
+ * The timer also sends a partial BATCH_FORGET that has waited long enough.
+ * Queueing it wakes a reader; the daemon's readers only flush the batch on
+ * their own once they run out of work.
+ */
+static void
+fuse_data_timer_fire(thread_call_param_t param, __unused thread_call_param_t unused)
+{
+    struct fuse_data   *data = param;
+    struct fuse_ticket *ticket;
+    uint64_t now;
+    uint64_t next = 0;
+    bool     expired = false;
+    bool     flush = false;
+
+    fuse_lck_mtx_lock(data->timer_mtx);
+    if (data->timer_stop) {
+        fuse_lck_mtx_unlock(data->timer_mtx);
+        return;
+    }
+    data->timer_busy++;
+    data->timer_deadline = 0;
+    fuse_lck_mtx_unlock(data->timer_mtx);
+
+    now = mach_absolute_time();
+
+    for (int i = 0; i < FUSE_AW_HASH_BUCKETS && !expired; i++) {
+        struct fuse_aw_bucket *bucket = &data->aw_hash[i];
+
+        fuse_lck_mtx_lock(bucket->mtx);
+        TAILQ_FOREACH(ticket, &bucket->head, aw_link) {
+            if (!ticket->aw_deadline) {
+                continue;
+            }
+            if (ticket->aw_deadline <= now) {
+                expired = true;
+                break;
+            }
+            if (!next || ticket->aw_deadline < next) {
+                next = ticket->aw_deadline;
+            }
+        }
+        fuse_lck_mtx_unlock(bucket->mtx);
+    }
+
+    fuse_lck_mtx_lock(data->forget_mtx);
+    if (data->forget_count && data->forget_deadline > now) {
+        if (!next || data->forget_deadline < next) {
+            next = data->forget_deadline;
+        }
+    } else if (data->forget_count) {
+        flush = true;
+    }
+    fuse_lck_mtx_unlock(data->forget_mtx);
+
+    if (flush && !expired) {
+        fuse_internal_forget_flush(data);
+    }
+
+    if (expired) {
+        if (fuse_data_kill(data) && data->mp) {
+            struct vfsstatfs *statfs = vfs_statfs(data->mp);
+            log("fuse4x: daemon (pid=%d, mountpoint=%s) did not respond in %ld seconds. Mark the filesystem as dead.\n",
+                    data->daemonpid, statfs->f_mntonname, data->daemon_timeout.tv_sec);
+        }
+        fuse_reject_answers(data);
+    } else if (next) {
+        fuse_data_timer_arm(data, next);
+    }
+
+    fuse_lck_mtx_lock(data->timer_mtx);
+    data->timer_busy--;
+    if (data->timer_stop && !data->timer_busy) {
+        fuse_wakeup(&data->timer_busy);
+    }
+    fuse_lck_mtx_unlock(data->timer_mtx);
+}
+
+/* Makes the timer fire no later than at the absolute time deadline. */
+void
+fuse_data_timer_arm(struct fuse_data *data, uint64_t deadline)
+{
+    fuse_lck_mtx_lock(data->timer_mtx);
+    if (!data->timer_stop &&
+        (!data->timer_deadline || deadline < data->timer_deadline)) {
+        data->timer_deadline = deadline;
+        (void)thread_call_enter_delayed(data->timer, deadline);
+    }
+    fuse_lck_mtx_unlock(data->timer_mtx);
+}
+
 struct fuse_data *
 fuse_data_alloc(struct proc *p)
 {
@@ -378,23 +561,58 @@ fuse_data_alloc(struct proc *p)
     data->inited        = false;
     data->dead          = false;
 
-    data->ms_mtx        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
-    data->aw_mtx        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
     data->ticket_mtx    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
-    data->node_mtx      = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr); // TODO: it is better to use spin lock here, they are cheaper
+    data->forget_mtx    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->wb_mtx        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->node_create_mtx = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->dirty_mtx     = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->timer_mtx     = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    data->timer         = thread_call_allocate(fuse_data_timer_fire, data);
 
-    STAILQ_INIT(&data->ms_head);
-    TAILQ_INIT(&data->aw_head);
-    STAILQ_INIT(&data->freetickets_head);
     TAILQ_INIT(&data->alltickets_head);
-    RB_INIT(&data->nodes_head);
+    TAILQ_INIT(&data->dirty_head);
+    fuse_node_hash_init(data);
+
+    for (int i = 0; i < FUSE4X_NCHANNELS; i++) {
+        data->ch[i].mtx = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+        for (int c = 0; c < FUSE_MS_CLASSES; c++) {
+            STAILQ_INIT(&data->ch[i].head[c]);
+        }
+        data->ch[i].closed = (i != 0);
+    }
+
+    for (int i = 0; i < FUSE_AW_HASH_BUCKETS; i++) {
+        data->aw_hash[i].mtx = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+        TAILQ_INIT(&data->aw_hash[i].head);
+    }
+
+    for (int i = 0; i < FUSE_TICKET_CACHE_SHARDS; i++) {
+        data->freetickets[i].mtx = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+        STAILQ_INIT(&data->freetickets[i].head);
+    }
+
+    for (int i = 0; i < FUSE_TICKET_WAIT_LOCKS; i++) {
+        data->ticket_wait_mtx[i] = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    }
+
+    fuse_iov_pool_init(&data->iov_pool);
 
     data->freeticket_counter = 0;
     data->deadticket_counter = 0;
+    data->ticket_count       = 0;
     data->ticketer           = 0;
+    data->forget_count       = 0;
 
 #ifdef FUSE4X_ENABLE_BIGLOCK
-    data->biglock        = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+    /* The mode is fixed for the lifetime of the session. Experimental. */
+    if (fuse_fine_grained_locking) {
+        data->biglock    = NULL;
+    } else
+#endif
+    {
+        data->biglock    = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    }
 #endif
 
     return data;
@@ -405,30 +623,70 @@ fuse_data_destroy(struct fuse_data *data)
 {
     struct fuse_ticket *ticket;
 
-    lck_mtx_free(data->ms_mtx, fuse_lock_group);
-    data->ms_mtx = NULL;
+    /* The timer may be firing right now; it must be done with data. */
+    fuse_lck_mtx_lock(data->timer_mtx);
+    data->timer_stop = true;
+    (void)thread_call_cancel(data->timer);
+    while (data->timer_busy) {
+        (void)fuse_msleep(&data->timer_busy, data->timer_mtx, PINOD, "fu_timer", NULL);
+    }
+    fuse_lck_mtx_unlock(data->timer_mtx);
+    (void)thread_call_free(data->timer);
+    data->timer = NULL;
+
+    lck_mtx_free(data->timer_mtx, fuse_lock_group);
+    data->timer_mtx = NULL;
 
-    lck_mtx_free(data->aw_mtx, fuse_lock_group);
-    data->aw_mtx = NULL;
+    for (int i = 0; i < FUSE4X_NCHANNELS; i++) {
+        selthreadclear(&data->ch[i].rsel);
+        lck_mtx_free(data->ch[i].mtx, fuse_lock_group);
+        data->ch[i].mtx = NULL;
+    }
+
+    for (int i = 0; i < FUSE_AW_HASH_BUCKETS; i++) {
+        lck_mtx_free(data->aw_hash[i].mtx, fuse_lock_group);
+        data->aw_hash[i].mtx = NULL;
+    }
 
     lck_mtx_free(data->ticket_mtx, fuse_lock_group);
     data->ticket_mtx = NULL;
 
-    lck_mtx_free(data->node_mtx, fuse_lock_group);
-    data->node_mtx = NULL;
+    lck_mtx_free(data->forget_mtx, fuse_lock_group);
+    data->forget_mtx = NULL;
+
+    lck_mtx_free(data->wb_mtx, fuse_lock_group);
+    data->wb_mtx = NULL;
+
+    for (int i = 0; i < FUSE_TICKET_CACHE_SHARDS; i++) {
+        lck_mtx_free(data->freetickets[i].mtx, fuse_lock_group);
+        data->freetickets[i].mtx = NULL;
+    }
+
+    for (int i = 0; i < FUSE_TICKET_WAIT_LOCKS; i++) {
+        lck_mtx_free(data->ticket_wait_mtx[i], fuse_lock_group);
+        data->ticket_wait_mtx[i] = NULL;
+    }
+
+    lck_mtx_free(data->node_create_mtx, fuse_lock_group);
+    data->node_create_mtx = NULL;
+
+    lck_mtx_free(data->dirty_mtx, fuse_lock_group);
+    data->dirty_mtx = NULL;
 
 #ifdef FUSE4X_ENABLE_BIGLOCK
-    lck_mtx_free(data->biglock, fuse_lock_group);
-    data->biglock = NULL;
+    if (data->biglock) {
+        lck_mtx_free(data->biglock, fuse_lock_group);
+        data->biglock = NULL;
+    }
 #endif
 
     while ((ticket = fuse_pop_allticks(data))) {
         fuse_ticket_destroy(ticket);
     }
 
-    if (!RB_EMPTY(&data->nodes_head)) {
-        log("fuse4x: nodes rbtree (%p) still contains vnodes\n", &data->nodes_head);
-    }
+    fuse_iov_pool_destroy(&data->iov_pool);
+
+    fuse_node_hash_destroy(data);
 
     kauth_cred_unref(&(data->daemoncred));
 
@@ -441,15 +699,22 @@ fuse_data_kill(struct fuse_data *data)
 {
     fuse_trace_printf_func();
 
-    fuse_lck_mtx_lock(data->ms_mtx);
+    fuse_lck_mtx_lock(data->ch[0].mtx);
     if (data->dead) {
-        fuse_lck_mtx_unlock(data->ms_mtx);
+        fuse_lck_mtx_unlock(data->ch[0].mtx);
         return false;
     }
 
     data->dead = true;
-    fuse_wakeup_one((caddr_t)data);
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    fuse_lck_mtx_unlock(data->ch[0].mtx);
+
+    /* Every sleeping reader has to notice, not just one. */
+    for (int i = 0; i < FUSE4X_NCHANNELS; i++) {
+        fuse_lck_mtx_lock(data->ch[i].mtx);
+        fuse_wakeup(&data->ch[i]);
+        fuse_lck_mtx_unlock(data->ch[i].mtx);
+        selwakeup(&data->ch[i].rsel);
+    }
 
     fuse_lck_mtx_lock(data->ticket_mtx);
     fuse_wakeup(&data->ticketer);
@@ -458,29 +723,77 @@ fuse_data_kill(struct fuse_data *data)
     return true;
 }
 
+/*
+ * Waits until the daemon has read every queued request and answered every
+ * one that gets an answer, or is dead. Tickets of other nodes queue on other
+ * channels, which the class order of a single channel does not cover.
+ */
+void
+fuse_data_drain(struct fuse_data *data)
+{
+    fuse_lck_mtx_lock(data->ticket_mtx);
+    while (!data->dead && (data->stats.ms_depth || data->stats.aw_depth)) {
+        /* Nobody wakes us for that but fuse_data_kill(); look again soon. */
+        struct timespec ts = { 0, 10 * 1000 * 1000 };
+
+        (void)fuse_msleep(&data->ticketer, data->ticket_mtx, PINOD, "fu_drain", &ts);
+    }
+    fuse_lck_mtx_unlock(data->ticket_mtx);
+}
+
+/* Free ticket list the current thread should use. */
+static __inline__
+int
+fuse_ticket_shard_index(void)
+{
+    uintptr_t thread = (uintptr_t)current_thread();
+
+    return (int)(((thread >> 8) ^ (thread >> 16)) & (FUSE_TICKET_CACHE_SHARDS - 1));
+}
+
 static __inline__
 void
 fuse_push_freeticks(struct fuse_ticket *ticket)
 {
-    STAILQ_INSERT_TAIL(&ticket->data->freetickets_head, ticket,
-                       freetickets_link);
-    ticket->data->freeticket_counter++;
+    struct fuse_data *data = ticket->data;
+    struct fuse_ticket_shard *shard = &data->freetickets[fuse_ticket_shard_index()];
+
+    fuse_lck_mtx_lock(shard->mtx);
+    STAILQ_INSERT_TAIL(&shard->head, ticket, freetickets_link);
+    fuse_lck_mtx_unlock(shard->mtx);
+
+    OSIncrementAtomic((SInt32 *)&data->freeticket_counter);
 }
 
+/*
+ * Takes a free ticket from the current thread's list, or from any other
+ * list if that one is empty. Returns NULL if there are no free tickets.
+ */
 static __inline__
 struct fuse_ticket *
 fuse_pop_freeticks(struct fuse_data *data)
 {
-    struct fuse_ticket *ticket;
+    struct fuse_ticket *ticket = NULL;
+    int start = fuse_ticket_shard_index();
 
-    if ((ticket = STAILQ_FIRST(&data->freetickets_head))) {
-        STAILQ_REMOVE_HEAD(&data->freetickets_head, freetickets_link);
-        data->freeticket_counter--;
+    for (int i = 0; i < FUSE_TICKET_CACHE_SHARDS && !ticket; i++) {
+        struct fuse_ticket_shard *shard =
+            &data->freetickets[(start + i) & (FUSE_TICKET_CACHE_SHARDS - 1)];
+
+        /* Unlocked peek, the list is checked again under its lock. */
+        if (STAILQ_EMPTY(&shard->head)) {
+            continue;
+        }
+
+        fuse_lck_mtx_lock(shard->mtx);
+        if ((ticket = STAILQ_FIRST(&shard->head))) {
+            STAILQ_REMOVE_HEAD(&shard->head, freetickets_link);
+        }
+        fuse_lck_mtx_unlock(shard->mtx);
     }
 
-    if (STAILQ_EMPTY(&data->freetickets_head) &&
-        (data->freeticket_counter != 0)) {
-        panic("fuse4x: ticket count mismatch!");
+    if (ticket) {
+        OSDecrementAtomic((SInt32 *)&data->freeticket_counter);
     }
 
     return ticket;
@@ -520,33 +833,33 @@ fuse_ticket_fetch(struct fuse_data *data)
     int err = 0;
     struct fuse_ticket *ticket;
 
-    fuse_lck_mtx_lock(data->ticket_mtx);
+    ticket = fuse_pop_freeticks(data);
 
-    if (data->freeticket_counter == 0) {
-        fuse_lck_mtx_unlock(data->ticket_mtx);
+    if (!ticket) {
         ticket = fuse_ticket_alloc(data);
         if (!ticket) {
             panic("fuse4x: ticket allocation failed");
         }
         fuse_lck_mtx_lock(data->ticket_mtx);
+        data->ticket_count++;
         fuse_push_allticks(ticket);
-    } else {
-        /* locked here */
-        ticket = fuse_pop_freeticks(data);
-        if (!ticket) {
-            panic("fuse4x: no free ticket despite the counter's value");
-        }
+        fuse_lck_mtx_unlock(data->ticket_mtx);
     }
 
-    if (!data->inited && data->ticketer > 1) {
-        err = fuse_msleep(&data->ticketer, data->ticket_mtx, PCATCH | PDROP,
-                          "fu_ini", 0);
-    } else {
-        if ((fuse_max_tickets != 0) &&
-            ((data->ticketer - data->deadticket_counter) > fuse_max_tickets)) {
-            err = 1;
+    if (!data->inited) {
+        /* Nothing but INIT may be sent until the daemon answers INIT. */
+        fuse_lck_mtx_lock(data->ticket_mtx);
+        if (!data->inited && data->ticketer > 0) {
+            err = fuse_msleep(&data->ticketer, data->ticket_mtx, PCATCH | PDROP,
+                              "fu_ini", 0);
+        } else {
+            fuse_lck_mtx_unlock(data->ticket_mtx);
         }
-        fuse_lck_mtx_unlock(data->ticket_mtx);
+    }
+
+    if (!err && (fuse_max_tickets != 0) &&
+        ((data->ticket_count - data->deadticket_counter) > fuse_max_tickets)) {
+        err = 1;
     }
 
     if (err) {
@@ -561,19 +874,14 @@ fuse_ticket_drop(struct fuse_ticket *ticket)
 {
     struct fuse_data *data = ticket->data;
 
-    fuse_lck_mtx_lock(data->ticket_mtx);
+    fuse_ticket_trace(FUSE4X_KDBG_TICKET_DROP, ticket, 0, 0);
 
     if ((fuse_max_freetickets <= data->freeticket_counter) ||
         ticket->killed) {
-        fuse_remove_allticks(ticket);
-        fuse_lck_mtx_unlock(data->ticket_mtx);
-        fuse_ticket_destroy(ticket);
+        fuse_ticket_kill(ticket);
     } else {
-        fuse_lck_mtx_unlock(data->ticket_mtx);
         fuse_ticket_refresh(ticket);
-        fuse_lck_mtx_lock(data->ticket_mtx);
         fuse_push_freeticks(ticket);
-        fuse_lck_mtx_unlock(data->ticket_mtx);
     }
 }
 
@@ -595,26 +903,358 @@ fuse_ticket_drop_invalid(struct fuse_ticket *ticket)
     }
 }
 
+/* statistics */
+
+static __inline__
+uint64_t
+fuse_uptime_ns(void)
+{
+    struct timespec ts;
+
+    nanouptime(&ts);
+
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/* Bucket i of a latency histogram holds [2^i, 2^(i+1)) microseconds. */
+static __inline__
+int
+fuse_stats_bucket(uint64_t ns)
+{
+    uint64_t us = ns / NSEC_PER_USEC;
+    int bucket = 0;
+
+    while (us > 1 && bucket < FUSE_STATS_HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+static void
+fuse_stats_depth_inc(uint32_t *depth, uint32_t *depth_max)
+{
+    uint32_t n = (uint32_t)OSIncrementAtomic((SInt32 *)depth) + 1;
+    uint32_t old;
+
+    while ((old = *depth_max) < n &&
+           !OSCompareAndSwap(old, n, (volatile UInt32 *)depth_max)) {
+        /* somebody else raised it, look again */
+    }
+}
+
+static __inline__
+struct fuse_opcode_stats *
+fuse_stats_opcode(struct fuse_ticket *ticket)
+{
+    uint32_t opcode = fuse_ticket_opcode(ticket);
+
+    if (opcode >= FUSE_STATS_MAX_OPCODE) {
+        return NULL;
+    }
+
+    return &ticket->data->stats.op[opcode];
+}
+
+/* The daemon has just read the message of the ticket. */
 void
+fuse_stats_sent(struct fuse_ticket *ticket)
+{
+    struct fuse_opcode_stats *st = fuse_stats_opcode(ticket);
+    size_t len = fuse_ticket_msglen(ticket);
+
+    ticket->ms_sent = fuse_uptime_ns();
+
+    if (!st) {
+        return;
+    }
+
+    OSIncrementAtomic64((SInt64 *)&st->count);
+    OSAddAtomic64((SInt64)len, (SInt64 *)&st->bytes_in);
+    OSIncrementAtomic((SInt32 *)&st->queue_hist[fuse_stats_bucket(ticket->ms_sent - ticket->ms_queued)]);
+}
+
+/* The daemon has just answered the ticket with a message of len bytes. */
+void
+fuse_stats_answered(struct fuse_ticket *ticket, size_t len)
+{
+    struct fuse_opcode_stats *st = fuse_stats_opcode(ticket);
+
+    if (!st) {
+        return;
+    }
+
+    OSIncrementAtomic64((SInt64 *)&st->answers);
+    OSAddAtomic64((SInt64)len, (SInt64 *)&st->bytes_out);
+    OSIncrementAtomic((SInt32 *)&st->daemon_hist[fuse_stats_bucket(fuse_uptime_ns() - ticket->ms_sent)]);
+}
+
+/*
+ * Returns false if the filesystem is dead and the ticket has not been
+ * inserted. Once inserted, the ticket is guaranteed to be either answered by
+ * the daemon or rejected by fuse_reject_answers().
+ */
+bool
 fuse_insert_callback(struct fuse_ticket *ticket, fuse_callback_t *callback)
 {
     struct fuse_data *data = ticket->data;
+    struct fuse_aw_bucket *bucket = fuse_aw_bucket(data, ticket->unique);
 
     if (data->dead) {
-        return;
+        return false;
     }
 
     ticket->aw_callback = callback;
 
-    fuse_lck_mtx_lock(data->aw_mtx);
-    TAILQ_INSERT_TAIL(&data->aw_head, ticket, aw_link);
-    fuse_lck_mtx_unlock(data->aw_mtx);
+    fuse_lck_mtx_lock(bucket->mtx);
+    if (data->dead) {
+        fuse_lck_mtx_unlock(bucket->mtx);
+        return false;
+    }
+    if (ticket->async && data->daemon_timeout_p) {
+        clock_interval_to_deadline((uint32_t)data->daemon_timeout.tv_sec,
+                                   NSEC_PER_SEC, &ticket->aw_deadline);
+    }
+    TAILQ_INSERT_TAIL(&bucket->head, ticket, aw_link);
+    fuse_lck_mtx_unlock(bucket->mtx);
+
+    fuse_stats_depth_inc(&data->stats.aw_depth, &data->stats.aw_depth_max);
+
+    if (ticket->aw_deadline) {
+        fuse_data_timer_arm(data, ticket->aw_deadline);
+    }
+
+    return true;
+}
+
+/*
+ * Finds the ticket waiting for the answer with the given unique id and
+ * removes it from the answer-wait table. Returns NULL if there is no such
+ * ticket (e.g. it has already been rejected).
+ */
+struct fuse_ticket *
+fuse_remove_callback(struct fuse_data *data, uint64_t unique)
+{
+    struct fuse_ticket *ticket;
+    struct fuse_aw_bucket *bucket = fuse_aw_bucket(data, unique);
+
+    fuse_lck_mtx_lock(bucket->mtx);
+
+    TAILQ_FOREACH(ticket, &bucket->head, aw_link) {
+        if (ticket->unique == unique) {
+            TAILQ_REMOVE(&bucket->head, ticket, aw_link);
+            OSDecrementAtomic((SInt32 *)&data->stats.aw_depth);
+            break;
+        }
+    }
+
+    fuse_lck_mtx_unlock(bucket->mtx);
+
+    return ticket;
+}
+
+/* Which class of a channel's queue the request waits in. */
+static __inline__
+enum fuse_ms_class
+fuse_ms_class(struct fuse_ticket *ticket)
+{
+    switch (fuse_ticket_opcode(ticket)) {
+
+    case FUSE_READ:
+    case FUSE_WRITE:
+        return ticket->background ? FUSE_MS_BACKGROUND : FUSE_MS_DATA;
+
+    /*
+     * Cleanup nobody waits for: it can queue behind write-behind, and a
+     * RELEASE then does not overtake the WRITEs sent through its handle.
+     * DESTROY comes last, see fuse_vfsop_unmount().
+     */
+    case FUSE_FLUSH:
+    case FUSE_RELEASE:
+    case FUSE_RELEASEDIR:
+    case FUSE_FORGET:
+    case FUSE_BATCH_FORGET:
+    case FUSE_DESTROY:
+        return FUSE_MS_BACKGROUND;
+
+    /* Also goes first in its class, see fuse_insert_message(). */
+    case FUSE_INTERRUPT:
+    default:
+        return FUSE_MS_METADATA;
+    }
+}
+
+static const uint32_t fuse_ms_weight[FUSE_MS_CLASSES] = {
+    FUSE_MS_WEIGHT_METADATA,
+    FUSE_MS_WEIGHT_DATA,
+    FUSE_MS_WEIGHT_BACKGROUND
+};
+
+/* Accounts for a ticket just taken off a queue of its channel. */
+static __inline__
+void
+fuse_channel_dequeued(struct fuse_data *data, struct fuse_ticket *ticket)
+{
+    int c = ticket->ms_class;
+
+    ticket->ms_channel = FUSE_MS_UNQUEUED;
+    OSDecrementAtomic((SInt32 *)&data->stats.ms_depth);
+    OSDecrementAtomic((SInt32 *)&data->stats.ms_class_depth[c]);
+    fuse_counter_dec((enum fuse_counter)(FUSE_CNT_QUEUED_METADATA + c));
+}
+
+/* Peeks without the lock; a reader checks again under it. */
+bool
+fuse_channel_empty(struct fuse_channel *ch)
+{
+    for (int c = 0; c < FUSE_MS_CLASSES; c++) {
+        if (!STAILQ_EMPTY(&ch->head[c])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Takes the next request of the channel, whose mutex is held. Classes are
+ * served by weighted round robin: each class with requests queued gets up
+ * to its weight of them per round, so bulk I/O cannot starve metadata and
+ * neither can starve the background.
+ */
+struct fuse_ticket *
+fuse_channel_pop(struct fuse_data *data, struct fuse_channel *ch)
+{
+    struct fuse_ticket *ticket;
+
+    /* Interrupts are not held up by the round robin. */
+    ticket = STAILQ_FIRST(&ch->head[FUSE_MS_METADATA]);
+    if (ticket && fuse_ticket_opcode(ticket) == FUSE_INTERRUPT) {
+        STAILQ_REMOVE_HEAD(&ch->head[FUSE_MS_METADATA], ms_link);
+        fuse_channel_dequeued(data, ticket);
+        return ticket;
+    }
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (int c = 0; c < FUSE_MS_CLASSES; c++) {
+            if (ch->credit[c] && (ticket = STAILQ_FIRST(&ch->head[c]))) {
+                STAILQ_REMOVE_HEAD(&ch->head[c], ms_link);
+                ch->credit[c]--;
+                fuse_channel_dequeued(data, ticket);
+                return ticket;
+            }
+        }
+
+        /* Every class with work has used up its share, start a new round. */
+        for (int c = 0; c < FUSE_MS_CLASSES; c++) {
+            ch->credit[c] = fuse_ms_weight[c];
+        }
+    }
+
+    return NULL;
+}
+
+/* Puts back the ticket fuse_channel_pop() has just returned. */
+void
+fuse_channel_unpop(struct fuse_data *data, struct fuse_channel *ch,
+                   struct fuse_ticket *ticket)
+{
+    int c = ticket->ms_class;
+
+    STAILQ_INSERT_HEAD(&ch->head[c], ticket, ms_link);
+    ticket->ms_channel = (uint8_t)(ch - data->ch);
+    ch->credit[c]++;
+    OSIncrementAtomic((SInt32 *)&data->stats.ms_depth);
+    OSIncrementAtomic((SInt32 *)&data->stats.ms_class_depth[c]);
+    fuse_counter_inc((enum fuse_counter)(FUSE_CNT_QUEUED_METADATA + c));
+}
+
+/* Appends every request of <from> to <to>; both mutexes are held. */
+void
+fuse_channel_move(struct fuse_data *data, struct fuse_channel *to,
+                  struct fuse_channel *from)
+{
+    struct fuse_ticket *ticket;
+
+    for (int c = 0; c < FUSE_MS_CLASSES; c++) {
+        STAILQ_FOREACH(ticket, &from->head[c], ms_link) {
+            ticket->ms_channel = (uint8_t)(to - data->ch);
+        }
+        STAILQ_CONCAT(&to->head[c], &from->head[c]);
+    }
+}
+
+/*
+ * Takes the ticket off the queue it waits in, if the daemon has not read it
+ * yet. Returns whether it did. Only the requester, who owns the ticket until
+ * it is answered, may call this.
+ */
+bool
+fuse_channel_withdraw(struct fuse_data *data, struct fuse_ticket *ticket)
+{
+    for (;;) {
+        /* Peeked at without the lock; the ticket may move to channel 0. */
+        uint8_t              c = *(volatile uint8_t *)&ticket->ms_channel;
+        struct fuse_channel *ch;
+
+        if (c == FUSE_MS_UNQUEUED) {
+            return false;
+        }
+
+        ch = &data->ch[c];
+
+        fuse_lck_mtx_lock(ch->mtx);
+        if (ticket->ms_channel == c) {
+            STAILQ_REMOVE(&ch->head[ticket->ms_class], ticket, fuse_ticket,
+                          ms_link);
+            fuse_channel_dequeued(data, ticket);
+            fuse_lck_mtx_unlock(ch->mtx);
+            return true;
+        }
+        fuse_lck_mtx_unlock(ch->mtx);
+    }
+}
+
+/*
+ * Picks the channel for a new request among the open ones. Requests for one
+ * node stay on one channel, in order; the others go by the submitting CPU.
+ */
+static struct fuse_channel *
+fuse_channel_pick(struct fuse_data *data, struct fuse_ticket *ticket)
+{
+    uint32_t open = data->ch_open | 1;
+    uint32_t nopen = __builtin_popcount(open);
+    uint64_t nodeid = ((struct fuse_in_header *)ticket->ms_fiov.base)->nodeid;
+    uint32_t k;
+    int      c;
+
+    if (nopen == 1) {
+        return &data->ch[0];
+    }
+
+    if (nodeid > FUSE_ROOT_ID) {
+        k = (uint32_t)((nodeid * 0x9E3779B97F4A7C15ULL) >> 32) % nopen;
+    } else {
+        k = (uint32_t)cpu_number() % nopen;
+    }
+
+    /* The k-th open channel. */
+    for (c = 0; c < FUSE4X_NCHANNELS; c++) {
+        if ((open & (1U << c)) && k-- == 0) {
+            break;
+        }
+    }
+
+    return &data->ch[c];
 }
 
 void
 fuse_insert_message(struct fuse_ticket *ticket)
 {
-    struct fuse_data *data = ticket->data;
+    struct fuse_data    *data = ticket->data;
+    struct fuse_channel *ch;
+    bool                 idle;
 
     if (ticket->dirty) {
         panic("fuse4x: ticket reused without being refreshed");
@@ -626,10 +1266,73 @@ fuse_insert_message(struct fuse_ticket *ticket)
         return;
     }
 
-    fuse_lck_mtx_lock(data->ms_mtx);
-    STAILQ_INSERT_TAIL(&data->ms_head, ticket, ms_link);
-    fuse_wakeup_one((caddr_t)data);
-    fuse_lck_mtx_unlock(data->ms_mtx);
+    ticket->ms_queued = fuse_uptime_ns();
+
+    ch = fuse_channel_pick(data, ticket);
+    ticket->ms_class = fuse_ms_class(ticket);
+
+    /* Once queued, the ticket may be read and dropped at any time. */
+    fuse_ticket_trace(FUSE4X_KDBG_TICKET_ENQUEUE, ticket,
+                      fuse_ticket_msglen(ticket), 0);
+
+    fuse_lck_mtx_lock(ch->mtx);
+    if (ch->closed) {
+        /*
+         * ch_open was read without fdev->mtx and the channel has been closed
+         * since. Its queue has already gone to channel 0, and so does this.
+         */
+        fuse_lck_mtx_unlock(ch->mtx);
+        ch = &data->ch[0];
+        fuse_lck_mtx_lock(ch->mtx);
+    }
+    if (fuse_ticket_opcode(ticket) == FUSE_INTERRUPT) {
+        STAILQ_INSERT_HEAD(&ch->head[ticket->ms_class], ticket, ms_link);
+    } else {
+        STAILQ_INSERT_TAIL(&ch->head[ticket->ms_class], ticket, ms_link);
+    }
+    ticket->ms_channel = (uint8_t)(ch - data->ch);
+    OSIncrementAtomic((SInt32 *)&data->ms_gen);
+    fuse_stats_depth_inc(&data->stats.ms_depth, &data->stats.ms_depth_max);
+    OSIncrementAtomic((SInt32 *)&data->stats.ms_class_depth[ticket->ms_class]);
+    fuse_counter_inc((enum fuse_counter)(FUSE_CNT_QUEUED_METADATA + ticket->ms_class));
+    /* Only ring the doorbell if a reader is actually asleep. */
+    idle = !ch->waiters;
+    if (!idle) {
+        fuse_wakeup_one(ch);
+    }
+    fuse_lck_mtx_unlock(ch->mtx);
+
+    /* Event-driven daemons wait in select or kevent instead. */
+    selwakeup(&ch->rsel);
+
+    /*
+     * Nobody is waiting on that channel, let a sleeping reader of another one
+     * steal the request. ms_gen was bumped before ms_idle is read, and a
+     * reader counts itself in ms_idle before it checks ms_gen, so either it
+     * looks again or we see it here. Under its channel's mutex it is then
+     * asleep or about to look again.
+     */
+    if (idle && data->ch_open && *(volatile uint32_t *)&data->ms_idle) {
+        for (int i = 0; i < FUSE4X_NCHANNELS; i++) {
+            struct fuse_channel *sibling = &data->ch[i];
+            bool woken = false;
+
+            if (sibling == ch) {
+                continue;
+            }
+
+            fuse_lck_mtx_lock(sibling->mtx);
+            if (sibling->waiters) {
+                fuse_wakeup_one(sibling);
+                woken = true;
+            }
+            fuse_lck_mtx_unlock(sibling->mtx);
+
+            if (woken) {
+                break;
+            }
+        }
+    }
 }
 
 static int
@@ -653,6 +1356,10 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         panic("fuse4x: a callback has been intalled for FUSE_FORGET");
         break;
 
+    case FUSE_BATCH_FORGET:
+        panic("fuse4x: a callback has been intalled for FUSE_BATCH_FORGET");
+        break;
+
     case FUSE_GETATTR:
         err = (blen == sizeof(struct fuse_attr_out)) ? 0 : EINVAL;
         break;
@@ -767,6 +1474,13 @@ fuse_body_audit(struct fuse_ticket *ticket, size_t blen)
         err = (blen == 0) ? 0 : EINVAL;
         break;
 
+    case FUSE_READDIRPLUS:
+        err = (((struct fuse_read_in *)(
+                (char *)ticket->ms_fiov.base +
+                        sizeof(struct fuse_in_header)
+                  ))->size >= blen) ? 0 : EINVAL;
+        break;
+
     case FUSE_FSYNCDIR:
         err = (blen == 0) ? 0 : EINVAL;
         break;
@@ -832,11 +1546,23 @@ fuse_setup_ihead(struct fuse_in_header *ihead,
                  size_t                 blen,
                  vfs_context_t          context)
 {
+    struct fuse_data *data = ticket->data;
+
+    /*
+     * Every request gets a unique of its own, also when its ticket is
+     * reused, so a late answer or INTERRUPT never matches a newer request.
+     * Unique 0 is reserved for notifications from the daemon.
+     */
+    ticket->unique = (uint64_t)OSIncrementAtomic64((SInt64 *)&data->ticketer) + 1;
+    ticket->aw_mtx = data->ticket_wait_mtx[ticket->unique & (FUSE_TICKET_WAIT_LOCKS - 1)];
+
     ihead->len = (uint32_t)(sizeof(*ihead) + blen);
     ihead->unique = ticket->unique;
     ihead->nodeid = nid;
     ihead->opcode = op;
 
+    fuse_ticket_trace(FUSE4X_KDBG_TICKET_FETCH, ticket, ihead->len, 0);
+
     if (context) {
         ihead->pid = vfs_context_pid(context);
         ihead->uid = kauth_cred_getuid(vfs_context_ucred(context));
@@ -855,15 +1581,21 @@ fuse_standard_callback(struct fuse_ticket *ticket, uio_t uio)
     int err = 0;
     bool dropflag = false;
 
-    err = fuse_ticket_pull(ticket, uio);
-
+    /*
+     * The reply is pulled with aw_mtx held so that a waiter which gives up
+     * (interrupt, timeout) cannot return while the answer is still landing
+     * in a buffer it owns (FT_A_BUF). An abandoned ticket is not pulled at
+     * all; the device skips whatever body is left.
+     */
     fuse_lck_mtx_lock(ticket->aw_mtx);
 
-    if (ticket->answered) {
+    if (ticket->abandoned) {
         dropflag = true;
-    } else {
+    } else if (!ticket->answered) {
+        err = fuse_ticket_pull(ticket, uio);
         ticket->answered = true;
         ticket->aw_errno = err;
+        fuse_ticket_trace(FUSE4X_KDBG_TICKET_WAKEUP, ticket, 0, err);
         fuse_wakeup(ticket);
     }
 
@@ -897,6 +1629,7 @@ fuse_dispatcher_make(struct fuse_dispatcher *dispatcher,
 
     FUSE_DIMALLOC(&dispatcher->ticket->ms_fiov, dispatcher->finh,
                   dispatcher->indata, dispatcher->iosize);
+    fiov_clear_request(&dispatcher->ticket->ms_fiov);
 
     fuse_setup_ihead(dispatcher->finh, dispatcher->ticket, nid, op, dispatcher->iosize, context);
 }
@@ -933,6 +1666,7 @@ fuse_dispatcher_make_canfail(struct fuse_dispatcher *dispatcher,
         return failed;
     }
 
+    fiov_clear_request(fiov);
     dispatcher->finh = fiov->base;
     dispatcher->indata = (char *)(fiov->base) + sizeof(struct fuse_in_header);
 
@@ -959,18 +1693,85 @@ fuse_dispatcher_make_vp_canfail(struct fuse_dispatcher *dispatcher,
     return fuse_dispatcher_make_canfail(dispatcher, op, vnode_mount(vp), VTOI(vp), context);
 }
 
-/* The function returns 0 in case of success and errorcode in case of error */
-int
-fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
+/*
+ * Queues the dispatcher's message without waiting for the answer. Several
+ * dispatchers may be sent back to back and then collected one by one with
+ * fuse_dispatcher_wait(), which keeps them all in flight at the daemon.
+ */
+void
+fuse_dispatcher_send(struct fuse_dispatcher *dispatcher)
 {
-    int err = 0;
     struct fuse_ticket *ticket = dispatcher->ticket;
 
     dispatcher->answer_errno = 0;
     fuse_insert_callback(ticket, fuse_standard_callback);
     fuse_insert_message(ticket);
+}
+
+static int
+fuse_async_callback(struct fuse_ticket *ticket, __unused uio_t uio)
+{
+    struct fuse_in_header *ihead = ticket->ms_fiov.base;
+
+    /* aw_errno is set if the session died before the answer came. */
+    if (!ticket->aw_errno && ticket->aw_ohead.error == ENOSYS) {
+        fuse_clear_implemented(ticket->data, 1ULL << ihead->opcode);
+    }
+
+    fuse_ticket_drop(ticket);
+
+    return 0;
+}
+
+/*
+ * Queues the dispatcher's message and forgets about it. Nobody waits for
+ * the answer; the ticket is dropped when it arrives or the session dies.
+ * Only for requests whose result the caller could not act on anyway.
+ */
+void
+fuse_dispatcher_send_async(struct fuse_dispatcher *dispatcher)
+{
+    struct fuse_ticket *ticket = dispatcher->ticket;
+
+    ticket->async = true;
+
+    if (!fuse_insert_callback(ticket, fuse_async_callback)) {
+        fuse_ticket_drop(ticket);
+        return;
+    }
+
+    /* The ticket may be answered and dropped before this returns. */
+    fuse_insert_message(ticket);
+}
+
+/* The function returns 0 in case of success and errorcode in case of error */
+int
+fuse_dispatcher_wait(struct fuse_dispatcher *dispatcher)
+{
+    int err = 0;
+    struct fuse_ticket *ticket = dispatcher->ticket;
 
     if ((err = fuse_ticket_wait_answer(ticket))) { /* interrupted */
+#ifdef FUSE4X_ENABLE_INTERRUPT
+        struct fuse_data *data = ticket->data;
+        uint64_t unique = ticket->unique;
+        bool interrupted = (err == EINTR || err == ERESTART);
+
+        /*
+         * Not read by the daemon yet: take it back, then nobody will ever
+         * answer it. Unless a dying session has just rejected it, the
+         * ticket is ours alone.
+         */
+        if (interrupted && fuse_channel_withdraw(data, ticket)) {
+            if (fuse_remove_callback(data, unique) == ticket) {
+                fuse_counter_inc(FUSE_CNT_INTERRUPTS_WITHDRAWN);
+                fuse_ticket_drop(ticket);
+                return err;
+            }
+            interrupted = false;
+        }
+#endif
+
         fuse_lck_mtx_lock(ticket->aw_mtx);
 
         if (ticket->answered) {
@@ -978,9 +1779,25 @@ fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
             fuse_lck_mtx_unlock(ticket->aw_mtx);
             goto out;
         } else {
-            /* IPC: explicitly setting to answered */
+            /*
+             * IPC: explicitly setting to answered. The ticket then belongs to
+             * whoever completes it, it must not be touched past the unlock.
+             */
             ticket->answered = true;
+            ticket->abandoned = true;
+#ifdef FUSE4X_ENABLE_INTERRUPT
+            /*
+             * A request the reader is going to drop unread needs no
+             * INTERRUPT, and the daemon would never see what it refers to.
+             */
+            interrupted = interrupted && ticket->read;
+#endif
             fuse_lck_mtx_unlock(ticket->aw_mtx);
+#ifdef FUSE4X_ENABLE_INTERRUPT
+            if (interrupted) {
+                fuse_internal_interrupt_send(data, unique);
+            }
+#endif
             return err;
         }
     }
@@ -1013,3 +1830,11 @@ out:
 
     return err;
 }
+
+int
+fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher)
+{
+    fuse_dispatcher_send(dispatcher);
+
+    return fuse_dispatcher_wait(dispatcher);
+}
@@ -11,7 +11,6 @@
 #include "fuse_kernel.h"
 #include "fuse_device.h"
 #include "fuse_locking.h"
-#include "compat/tree.h"
 
 #include <kern/assert.h>
 #include <libkern/libkern.h>
@@ -25,26 +24,64 @@
 #include <sys/stat.h>
 #include <sys/proc.h>
 #include <sys/fcntl.h>
+#include <sys/kdebug.h>
 #include <sys/queue.h>
 #include <sys/select.h>
+#include <sys/ubc.h>
 #include <sys/uio.h>
 #include <sys/vm.h>
 #include <sys/vnode.h>
 #include <sys/vnode_if.h>
 
+struct fuse_iov_pool;
+
+/*
+ * Message buffer of a ticket. Headers and small payloads live in inline_buf;
+ * bigger buffers are borrowed from the mount's fuse_iov_pool.
+ */
 struct fuse_iov {
-    void   *base;
-    size_t  len;
-    size_t  allocated_size;
-    ssize_t credit;
+    void                 *base;
+    size_t                len;
+    size_t                allocated_size;
+    struct fuse_iov_pool *pool;
+    char                  inline_buf[FUSE_IOV_INLINE_SIZE];
+};
+
+/*
+ * Free buffers of one size class: PAGE_SIZE << class bytes plus
+ * FUSE_IOV_HEADROOM for the headers in front of the data. A free buffer's
+ * first word links it to the next one.
+ */
+struct fuse_iov_class {
+    lck_mtx_t *mtx;
+    void      *head;
+    uint32_t   count;
+};
+
+struct fuse_iov_pool {
+    struct fuse_iov_class classes[FUSE_IOV_POOL_CLASSES];
 };
 
-void fiov_init(struct fuse_iov *fiov, size_t size);
+void fuse_iov_pool_init(struct fuse_iov_pool *pool);
+void fuse_iov_pool_destroy(struct fuse_iov_pool *pool);
+
+void fiov_init(struct fuse_iov *fiov, struct fuse_iov_pool *pool, size_t size);
 void fiov_teardown(struct fuse_iov *fiov);
 void fiov_refresh(struct fuse_iov *fiov);
 void fiov_adjust(struct fuse_iov *fiov, size_t size);
 int  fiov_adjust_canfail(struct fuse_iov *fiov, size_t size);
 
+/*
+ * Zeroes the header and the fixed-size request struct behind it, whose
+ * padding daemons expect to be zero. Bulk payload is never cleared.
+ */
+static __inline__
+void
+fiov_clear_request(struct fuse_iov *fiov)
+{
+    bzero(fiov->base, min(fiov->len, sizeof(fiov->inline_buf)));
+}
+
 #define FUSE_DIMALLOC(fiov, spc1, spc2, amnt)          \
 do {                                                   \
     fiov_adjust(fiov, (sizeof(*(spc1)) + (amnt)));     \
@@ -52,10 +89,11 @@ do {                                                   \
     (spc2) = (char *)(fiov)->base + (sizeof(*(spc1))); \
 } while (0)
 
-#define FU_AT_LEAST(siz) max((size_t)(siz), (size_t)160)
-
 struct fuse_ticket;
 struct fuse_data;
+struct fuse_vnode_data;
+
+LIST_HEAD(fuse_node_bucket, fuse_vnode_data);
 
 typedef int fuse_callback_t(struct fuse_ticket *ticket, uio_t uio);
 
@@ -67,6 +105,10 @@ struct fuse_ticket {
     bool                         invalid: 1; // ticket is invalidated
     bool                         dirty: 1; // ticket has been used
     bool                         killed: 1; // ticket has been marked for death (KILLL => KILL_LATER)
+    bool                         async: 1; // nobody sleeps on the ticket, aw_callback completes it
+    bool                         background: 1; // no application waits for this I/O
+    bool                         abandoned: 1; // the requester gave up, whoever completes the ticket drops it
+    bool                         read: 1; // handed to the daemon, under aw_mtx; only such a request is interrupted
 
     STAILQ_ENTRY(fuse_ticket)    freetickets_link;
     TAILQ_ENTRY(fuse_ticket)     alltickets_link;
@@ -74,18 +116,28 @@ struct fuse_ticket {
     struct fuse_iov              ms_fiov;
     void                        *ms_bufdata;
     size_t                       ms_bufsize;
-    enum { FT_M_FIOV, FT_M_BUF } ms_type;
+    upl_t                        ms_upl;    // FT_M_UPL: ms_bufsize bytes of its pages at ms_uploff
+    upl_offset_t                 ms_uploff;
+    enum { FT_M_FIOV, FT_M_BUF, FT_M_UPL } ms_type;
     STAILQ_ENTRY(fuse_ticket)    ms_link;
+    uint8_t                      ms_class; // enum fuse_ms_class, set by fuse_insert_message()
+    uint8_t                      ms_channel; // whose queue holds the ticket, under its mtx; FUSE_MS_UNQUEUED if none
+    uint64_t                     ms_queued; // uptime (ns) at fuse_insert_message()
+    uint64_t                     ms_sent; // uptime (ns) at which the daemon read the message
 
     struct fuse_iov              aw_fiov;
     void                        *aw_bufdata;
     size_t                       aw_bufsize;
-    enum { FT_A_FIOV, FT_A_BUF } aw_type;
+    upl_t                        aw_upl;    // FT_A_UPL: the body goes to its pages at aw_uploff
+    upl_offset_t                 aw_uploff;
+    enum { FT_A_FIOV, FT_A_BUF, FT_A_UPL } aw_type;
 
     struct fuse_out_header       aw_ohead;
     int                          aw_errno;
-    lck_mtx_t                   *aw_mtx;
+    lck_mtx_t                   *aw_mtx; // borrowed from fuse_data.ticket_wait_mtx
     fuse_callback_t             *aw_callback;
+    void                        *aw_cookie; // private data of aw_callback
+    uint64_t                     aw_deadline; // absolute time an async ticket must be answered by, 0 if never
     TAILQ_ENTRY(fuse_ticket)     aw_link;
 };
 
@@ -96,9 +148,93 @@ fuse_ticket_opcode(struct fuse_ticket *ticket)
     return (((struct fuse_in_header *)(ticket->ms_fiov.base))->opcode);
 }
 
+static __inline__
+size_t
+fuse_ticket_msglen(struct fuse_ticket *ticket)
+{
+    size_t len = ticket->ms_fiov.len;
+
+    if (ticket->ms_type != FT_M_FIOV) {
+        len += ticket->ms_bufsize;
+    }
+
+    return len;
+}
+
+/*
+ * Fires the FUSE4X_KDBG_TICKET_<code> tracepoint. While nobody traces,
+ * KERNEL_DEBUG_CONSTANT costs a test of kdebug_enable. Its fifth argument
+ * is replaced by the thread id, so only four are ours; see fuse_param.h for
+ * how they are packed.
+ */
+#define fuse_ticket_trace_size_error(size, error) \
+    (((uint64_t)(uint32_t)(size) << 32) | (uint32_t)(error))
+
+#ifdef __LP64__
+#define fuse_ticket_trace(code, ticket, size, error)                          \
+    KERNEL_DEBUG_CONSTANT(                                                    \
+        KDBG_CODE(DBG_FSYSTEM, FUSE4X_KDBG_SUBCLASS, (code)) | DBG_FUNC_NONE, \
+        (ticket)->unique,                                                     \
+        ((struct fuse_in_header *)(ticket)->ms_fiov.base)->opcode,            \
+        ((struct fuse_in_header *)(ticket)->ms_fiov.base)->nodeid,            \
+        fuse_ticket_trace_size_error((size), (error)), 0)
+#else
+#define fuse_ticket_trace(code, ticket, size, error)                          \
+    do {                                                                      \
+        uint64_t _nodeid =                                                    \
+            ((struct fuse_in_header *)(ticket)->ms_fiov.base)->nodeid;        \
+        KERNEL_DEBUG_CONSTANT(                                                \
+            KDBG_CODE(DBG_FSYSTEM, FUSE4X_KDBG_SUBCLASS, (code)) | DBG_FUNC_NONE, \
+            (uint32_t)(ticket)->unique, (uint32_t)((ticket)->unique >> 32),   \
+            (uint32_t)_nodeid, (uint32_t)(_nodeid >> 32), 0);                 \
+        KERNEL_DEBUG_CONSTANT(                                                \
+            KDBG_CODE(DBG_FSYSTEM, FUSE4X_KDBG_SUBCLASS,                      \
+                      FUSE4X_KDBG_TICKET_ARGS) | DBG_FUNC_NONE,               \
+            (uint32_t)(ticket)->unique,                                       \
+            ((struct fuse_in_header *)(ticket)->ms_fiov.base)->opcode,        \
+            (uint32_t)(size), (uint32_t)(error), 0);                          \
+    } while (0)
+#endif
+
 
 int fuse_ticket_pull(struct fuse_ticket *ticket, uio_t uio);
 
+struct fuse_aw_bucket {
+    lck_mtx_t                 *mtx;
+    TAILQ_HEAD(, fuse_ticket)  head;
+};
+
+struct fuse_ticket_shard {
+    lck_mtx_t                 *mtx;
+    STAILQ_HEAD(, fuse_ticket) head;
+};
+
+enum fuse_ms_class {
+    FUSE_MS_METADATA = 0,
+    FUSE_MS_DATA,
+    FUSE_MS_BACKGROUND
+};
+
+#define FUSE_MS_UNQUEUED 0xff
+
+/* Request queue one or more daemon threads read through one device node. */
+struct fuse_channel {
+    lck_mtx_t                 *mtx;
+    STAILQ_HEAD(, fuse_ticket) head[FUSE_MS_CLASSES];
+    uint32_t                   credit[FUSE_MS_CLASSES]; // left of this round of dequeuing
+    uint32_t                   waiters;       // readers asleep on the channel, protected by mtx
+    bool                       closed;        // no reader has it open (never channel 0), protected by mtx
+    struct selinfo             rsel;          // select/poll readers of the channel
+};
+
+bool                fuse_channel_empty(struct fuse_channel *ch);
+struct fuse_ticket *fuse_channel_pop(struct fuse_data *data, struct fuse_channel *ch);
+void                fuse_channel_unpop(struct fuse_data *data, struct fuse_channel *ch,
+                                       struct fuse_ticket *ticket);
+void                fuse_channel_move(struct fuse_data *data, struct fuse_channel *to,
+                                      struct fuse_channel *from);
+bool                fuse_channel_withdraw(struct fuse_data *data, struct fuse_ticket *ticket);
+
 struct fuse_data {
     fuse_device_t              fdev;
     mount_t                    mp;
@@ -113,21 +249,38 @@ struct fuse_data {
     bool                       inited: 1;
     bool                       dead: 1;
 
-    lck_mtx_t                 *ms_mtx;
-    STAILQ_HEAD(, fuse_ticket) ms_head;
+    struct fuse_channel        ch[FUSE4X_NCHANNELS]; // requests for the daemon
+    uint32_t                   ch_open;       // bitmask of open channels other than 0, under fdev->mtx
+    uint32_t                   ms_gen;        // bumped on every enqueue, atomic
+    uint32_t                   ms_idle;       // readers asleep on any channel, atomic
 
-    lck_mtx_t                 *aw_mtx;
-    TAILQ_HEAD(, fuse_ticket)  aw_head;
+    struct fuse_aw_bucket      aw_hash[FUSE_AW_HASH_BUCKETS]; // tickets waiting for answer, keyed by unique
+
+    struct fuse_ticket_shard   freetickets[FUSE_TICKET_CACHE_SHARDS];
+    uint32_t                   freeticket_counter; // updated atomically
+    lck_mtx_t                 *ticket_wait_mtx[FUSE_TICKET_WAIT_LOCKS];
 
     lck_mtx_t                 *ticket_mtx;
-    STAILQ_HEAD(, fuse_ticket) freetickets_head; // protected by ticket_mtx
     TAILQ_HEAD(, fuse_ticket)  alltickets_head; // protected by ticket_mtx
-    uint32_t                   freeticket_counter; // protected by ticket_mtx
+    uint32_t                   ticket_count;  // tickets allocated, protected by ticket_mtx
     uint32_t                   deadticket_counter; // protected by ticket_mtx
-    uint64_t                   ticketer; // protected by ticket_mtx
+    uint64_t                   ticketer; // last unique handed out, updated atomically, sleep channel for INIT (under ticket_mtx)
+
+    lck_mtx_t                 *forget_mtx;
+    struct fuse_forget_one     forget_batch[FUSE_FORGET_BATCH_MAX]; // pending BATCH_FORGET entries, protected by forget_mtx
+    uint32_t                   forget_count;  // protected by forget_mtx
+    uint64_t                   forget_deadline; // absolute time the pending entries go out, protected by forget_mtx
 
-    uint32_t                   max_write;
-    uint32_t                   max_read;
+    struct fuse_iov_pool       iov_pool;      // message buffers of this mount's tickets
+
+    lck_mtx_t                 *wb_mtx;
+    thread_t                   wb_thread;     // write-back flusher, protected by wb_mtx
+    bool                       wb_dirty;      // written to since the flusher's last pass
+    bool                       wb_stop;       // protected by wb_mtx
+
+    uint32_t                   max_write;     // largest WRITE, set up by INIT
+    uint32_t                   max_read;      // largest READ or READDIR
+    uint32_t                   max_readahead; // cap of the readahead window
     uint32_t                   blocksize;
     uint32_t                   iosize;
     uint32_t                   userkernel_bufsize;
@@ -136,12 +289,26 @@ struct fuse_data {
 
     struct timespec            daemon_timeout;
     struct timespec           *daemon_timeout_p;
+
+    lck_mtx_t                 *timer_mtx;
+    thread_call_t              timer;         // daemon_timeout of asynchronous tickets
+    uint64_t                   timer_deadline; // absolute time it is armed for, 0 if not; protected by timer_mtx
+    uint32_t                   timer_busy;    // handlers running, protected by timer_mtx
+    bool                       timer_stop;    // protected by timer_mtx
 #ifdef FUSE4X_ENABLE_BIGLOCK
     lck_mtx_t                 *biglock;
 #endif
 
-    lck_mtx_t                                *node_mtx;
-    RB_HEAD(fuse_data_nodes, fuse_vnode_data) nodes_head; // map ino->vnode_data
+    lck_mtx_t                 *node_mtx[FUSE_NODE_HASH_LOCKS]; // bucket i is under node_mtx[i % FUSE_NODE_HASH_LOCKS]
+    lck_mtx_t                 *node_create_mtx;
+    struct fuse_node_bucket   *node_hash;     // map ino->vnode_data, changed under every node_mtx
+    uint32_t                   node_hash_mask;
+
+    lck_mtx_t                 *dirty_mtx;
+    TAILQ_HEAD(, fuse_vnode_data) dirty_head; // nodes sync has to visit, protected by dirty_mtx
+    bool                       dirty_walking; // a walk of dirty_head is running, protected by dirty_mtx
+
+    struct fuse_mount_stats    stats; // updated atomically
 };
 
 /* Not-Implemented Bits */
@@ -158,12 +325,14 @@ enum {
     FSESS_DIRECT_IO           = 1 << 5,
     FSESS_EXTENDED_SECURITY   = 1 << 6,
     FSESS_JAIL_SYMLINKS       = 1 << 7,
+    FSESS_BATCH_IO            = 1 << 8,
     FSESS_NO_APPLEDOUBLE      = 1 << 9,
     FSESS_NO_APPLEXATTR       = 1 << 10,
     FSESS_NO_ATTRCACHE        = 1 << 11,
     FSESS_NO_READAHEAD        = 1 << 12,
     FSESS_NO_SYNCONCLOSE      = 1 << 13,
     FSESS_NO_SYNCWRITES       = 1 << 14,
+    FSESS_BATCH_FORGET        = 1 << 15,
     FSESS_NO_VNCACHE          = 1 << 16,
     FSESS_CASE_INSENSITIVE    = 1 << 17,
     FSESS_VOL_RENAME          = 1 << 18,
@@ -171,9 +340,38 @@ enum {
     FSESS_AUTO_CACHE          = 1 << 20,
     FSESS_NATIVE_XATTR        = 1 << 21,
     FSESS_SPARSE              = 1 << 22,
-    FSESS_ATOMIC_O_TRUNC      = 1 << 23
+    FSESS_ATOMIC_O_TRUNC      = 1 << 23,
+    FSESS_WRITEBACK_CACHE     = 1 << 24,
+    FSESS_ASYNC_FLUSH         = 1 << 25,
+    FSESS_READDIRPLUS         = 1 << 26
 };
 
+static __inline__
+struct fuse_aw_bucket *
+fuse_aw_bucket(struct fuse_data *data, uint64_t unique)
+{
+    return &data->aw_hash[unique & (FUSE_AW_HASH_BUCKETS - 1)];
+}
+
+/*
+ * Multiplicative hashing, nodeids are often sequential or aligned pointers.
+ * The low bits pick the lock, so a node keeps its lock when the table grows;
+ * the bucket has to be looked up again once the lock is held.
+ */
+static __inline__
+uint32_t
+fuse_node_hash(struct fuse_data *data, uint64_t nodeid)
+{
+    return (uint32_t)((nodeid * 0x9E3779B97F4A7C15ULL) >> 32) & data->node_hash_mask;
+}
+
+static __inline__
+lck_mtx_t *
+fuse_node_mtx(struct fuse_data *data, uint32_t hash)
+{
+    return data->node_mtx[hash & (FUSE_NODE_HASH_LOCKS - 1)];
+}
+
 static __inline__
 struct fuse_data *
 fuse_get_mpdata(mount_t mp)
@@ -184,16 +382,39 @@ fuse_get_mpdata(mount_t mp)
     return (struct fuse_data *)vfs_fsprivate(mp);
 }
 
+/*
+ * True if vnode operations on this mount are serialized by the node locks
+ * alone, see the fine_grained_locking tunable. Never true unless the kext is
+ * built with the experimental FUSE4X_ENABLE_FINE_LOCKING.
+ */
+static __inline__
+bool
+fuse_isfinelocking(struct fuse_data *data)
+{
+#if defined(FUSE4X_ENABLE_BIGLOCK) && defined(FUSE4X_ENABLE_FINE_LOCKING)
+    return (data->biglock == NULL);
+#else
+    (void)data;
+    return false;
+#endif
+}
+
 struct fuse_ticket *fuse_ticket_fetch(struct fuse_data *data);
 void fuse_ticket_drop(struct fuse_ticket *ticket);
 void fuse_ticket_drop_invalid(struct fuse_ticket *ticket);
 void fuse_ticket_kill(struct fuse_ticket *ticket);
-void fuse_insert_callback(struct fuse_ticket *ticket, fuse_callback_t *callback);
+bool fuse_insert_callback(struct fuse_ticket *ticket, fuse_callback_t *callback);
+struct fuse_ticket *fuse_remove_callback(struct fuse_data *data, uint64_t unique);
 void fuse_insert_message(struct fuse_ticket *ticket);
 
+void fuse_stats_sent(struct fuse_ticket *ticket);
+void fuse_stats_answered(struct fuse_ticket *ticket, size_t len);
+
 struct fuse_data *fuse_data_alloc(struct proc *p);
 void fuse_data_destroy(struct fuse_data *data);
 bool fuse_data_kill(struct fuse_data *data);
+void fuse_data_drain(struct fuse_data *data);
+void fuse_data_timer_arm(struct fuse_data *data, uint64_t deadline);
 
 struct fuse_dispatcher {
 
@@ -227,6 +448,12 @@ void fuse_dispatcher_make_vp(struct fuse_dispatcher *dispatcher, enum fuse_opcod
 int  fuse_dispatcher_make_vp_canfail(struct fuse_dispatcher *dispatcher, enum fuse_opcode op,
                            vnode_t vp, vfs_context_t context);
 
+void fuse_dispatcher_send(struct fuse_dispatcher *dispatcher);
+
+void fuse_dispatcher_send_async(struct fuse_dispatcher *dispatcher);
+
+int  fuse_dispatcher_wait(struct fuse_dispatcher *dispatcher);
+
 int  fuse_dispatcher_wait_answer(struct fuse_dispatcher *dispatcher);
 
 static __inline__
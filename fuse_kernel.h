@@ -56,6 +56,20 @@
  *  - add umask flag to input argument of open, mknod and mkdir
  *  - add notification messages for invalidation of inodes and
  *    directory entries
+ *
+ * 7.13
+ *  - make max number of background requests and congestion threshold
+ *    tunables
+ *
+ * 7.14
+ *  - add splice support to fuse device
+ *
+ * 7.15
+ *  - add store notify
+ *  - add retrieve notify
+ *
+ * 7.16
+ *  - add BATCH_FORGET request
  */
 
 #ifndef _LINUX_FUSE_H
@@ -65,6 +79,7 @@
 #define __u64 uint64_t
 #define __s64 int64_t
 #define __u32 uint32_t
+#define __u16 uint16_t
 #define __s32 int32_t
 
 /*
@@ -91,7 +106,12 @@
 #define FUSE_KERNEL_VERSION 7
 
 /** Minor version number of this interface */
-#define FUSE_KERNEL_MINOR_VERSION 12
+#define FUSE_KERNEL_MINOR_VERSION 16
+
+#ifdef __APPLE__
+/** Oldest minor version of the user space library that is still accepted */
+#define FUSE_KERNEL_MINOR_VERSION_MIN 12
+#endif /* __APPLE__ */
 
 /** The node ID of the root inode */
 #define FUSE_ROOT_ID 1
@@ -187,6 +207,11 @@ struct fuse_file_lock {
  *
  * FUSE_EXPORT_SUPPORT: filesystem handles lookups of "." and ".."
  * FUSE_DONT_MASK: don't apply umask to file mode on create operations
+ * FUSE_DO_READDIRPLUS: do READDIRPLUS (READDIR+LOOKUP in one)
+ * FUSE_WRITEBACK_CACHE: use writeback cache for buffered writes
+ * FUSE_BATCH_IO: several requests may be read from and several replies
+ *                written to the device in one read/write call
+ * FUSE_ASYNC_FLUSH: the kernel does not wait for the answer to FLUSH
  */
 #define FUSE_ASYNC_READ		(1 << 0)
 #define FUSE_POSIX_LOCKS	(1 << 1)
@@ -195,7 +220,11 @@ struct fuse_file_lock {
 #define FUSE_EXPORT_SUPPORT	(1 << 4)
 #define FUSE_BIG_WRITES		(1 << 5)
 #define FUSE_DONT_MASK		(1 << 6)
+#define FUSE_DO_READDIRPLUS	(1 << 13)
+#define FUSE_WRITEBACK_CACHE	(1 << 16)
 #ifdef __APPLE__
+#define FUSE_ASYNC_FLUSH	(1 << 27)
+#define FUSE_BATCH_IO		(1 << 28)
 #define FUSE_CASE_INSENSITIVE	(1 << 29)
 #define FUSE_VOL_RENAME		(1 << 30)
 #define FUSE_XTIMES		(1 << 31)
@@ -298,6 +327,8 @@ enum fuse_opcode {
 	FUSE_DESTROY       = 38,
 	FUSE_IOCTL         = 39,
 	FUSE_POLL          = 40,
+	FUSE_BATCH_FORGET  = 42,
+	FUSE_READDIRPLUS   = 44,
 #ifdef __APPLE__
 	FUSE_SETVOLNAME    = 61,
 	FUSE_GETXTIMES     = 62,
@@ -335,6 +366,16 @@ struct fuse_forget_in {
 	__u64	nlookup;
 };
 
+struct fuse_forget_one {
+	__u64	nodeid;
+	__u64	nlookup;
+};
+
+struct fuse_batch_forget_in {
+	__u32	count;
+	__u32	dummy;
+};
+
 struct fuse_getattr_in {
 	__u32	getattr_flags;
 	__u32	dummy;
@@ -540,7 +581,8 @@ struct fuse_init_out {
 	__u32	minor;
 	__u32	max_readahead;
 	__u32	flags;
-	__u32	unused;
+	__u16	max_background;
+	__u16	congestion_threshold;
 	__u32	max_write;
 };
 
@@ -641,6 +683,16 @@ struct fuse_dirent {
 #define FUSE_DIRENT_SIZE(d) \
 	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + (d)->namelen)
 
+struct fuse_direntplus {
+	struct fuse_entry_out entry_out;
+	struct fuse_dirent dirent;
+};
+
+#define FUSE_NAME_OFFSET_DIRENTPLUS \
+	offsetof(struct fuse_direntplus, dirent.name)
+#define FUSE_DIRENTPLUS_SIZE(d) \
+	FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + (d)->dirent.namelen)
+
 struct fuse_notify_inval_inode_out {
 	__u64	ino;
 	__s64	off;
@@ -69,6 +69,63 @@ fusefs_lock(fusenode_t cp, enum fusefslocktype locktype)
     return 0;
 }
 
+/*
+ * Lock a fusenode if that can be done without waiting. Returns EBUSY if the
+ * lock is held elsewhere.
+ */
+__private_extern__
+int
+fusefs_trylock(fusenode_t cp, enum fusefslocktype locktype)
+{
+    if (locktype == FUSEFS_SHARED_LOCK) {
+        if (!lck_rw_try_lock(cp->nodelock, LCK_RW_TYPE_SHARED)) {
+            return EBUSY;
+        }
+        cp->nodelockowner = FUSEFS_SHARED_OWNER;
+    } else {
+        if (!lck_rw_try_lock(cp->nodelock, LCK_RW_TYPE_EXCLUSIVE)) {
+            return EBUSY;
+        }
+        cp->nodelockowner = current_thread();
+    }
+
+    if ((locktype != FUSEFS_FORCE_LOCK) && (cp->c_flag & C_NOEXISTS)) {
+        fusefs_unlock(cp);
+        return ENOENT;
+    }
+
+    return 0;
+}
+
+/*
+ * Check ordering of two fusenodes. Return true if they are are in-order.
+ */
+static int
+fusefs_isordered(fusenode_t cp1, fusenode_t cp2)
+{
+    if (cp1 == cp2) {
+        return 0;
+    }
+
+    if (cp1 == NULL || cp2 == (fusenode_t)0xffffffff) {
+        return 1;
+    }
+
+    if (cp2 == NULL || cp1 == (fusenode_t)0xffffffff) {
+        return 0;
+    }
+
+    if (cp1->nodeid == cp2->parent_nodeid) {
+        return 1;  /* cp1 is the parent and should go first */
+    }
+
+    if (cp2->nodeid == cp1->parent_nodeid) {
+        return 0;  /* cp1 is the child and should go last */
+    }
+
+    return (cp1 < cp2);  /* fall-back is to use address order */
+}
+
 /*
  * Lock a pair of fusenodes.
  */
@@ -86,6 +143,20 @@ fusefs_lockpair(fusenode_t cp1, fusenode_t cp2, enum fusefslocktype locktype)
         return fusefs_lock(cp1, locktype);
     }
 
+#ifdef FUSE4X_ENABLE_FINE_LOCKING
+    /*
+     * Lock in cnode parent-child order (if there is a relationship);
+     * otherwise lock in cnode address order. This is the same order
+     * fusefs_lockfour() uses, so pairs and quads agree with each other.
+     */
+    if (fusefs_isordered(cp1, cp2)) {
+        first = cp1;
+        last = cp2;
+    } else {
+        first = cp2;
+        last = cp1;
+    }
+#else
     /*
      * Lock in cnode parent-child order (if there is a relationship);
      * otherwise lock in cnode address order.
@@ -100,6 +171,7 @@ fusefs_lockpair(fusenode_t cp1, fusenode_t cp2, enum fusefslocktype locktype)
         first = cp2;
         last = cp1;
     }
+#endif
 
     if ( (error = fusefs_lock(first, locktype))) {
         return error;
@@ -113,35 +185,6 @@ fusefs_lockpair(fusenode_t cp1, fusenode_t cp2, enum fusefslocktype locktype)
     return 0;
 }
 
-/*
- * Check ordering of two fusenodes. Return true if they are are in-order.
- */
-static int
-fusefs_isordered(fusenode_t cp1, fusenode_t cp2)
-{
-    if (cp1 == cp2) {
-        return 0;
-    }
-
-    if (cp1 == NULL || cp2 == (fusenode_t)0xffffffff) {
-        return 1;
-    }
-
-    if (cp2 == NULL || cp1 == (fusenode_t)0xffffffff) {
-        return 0;
-    }
-
-    if (cp1->nodeid == cp2->parent_nodeid) {
-        return 1;  /* cp1 is the parent and should go first */
-    }
-
-    if (cp2->nodeid == cp1->parent_nodeid) {
-        return 0;  /* cp1 is the child and should go last */
-    }
-
-    return (cp1 < cp2);  /* fall-back is to use address order */
-}
-
 /*
  * Acquire 4 fusenode locks.
  *   - locked in fusenode parent-child order (if there is a relationship)
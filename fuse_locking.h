@@ -22,6 +22,7 @@ enum fusefslocktype {
 
 /* Locking */
 extern int fusefs_lock(fusenode_t, enum fusefslocktype);
+extern int fusefs_trylock(fusenode_t, enum fusefslocktype);
 extern int fusefs_lockpair(fusenode_t, fusenode_t, enum fusefslocktype);
 extern int fusefs_lockfour(fusenode_t, fusenode_t, fusenode_t, fusenode_t,
                            enum fusefslocktype);
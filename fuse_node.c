@@ -9,7 +9,6 @@
 #include "fuse_locking.h"
 #include "fuse_node.h"
 #include "fuse_sysctl.h"
-#include "compat/tree.h"
 
 #include <stdbool.h>
 
@@ -18,22 +17,312 @@
 #endif
 
 
-static int fuse_vnode_compare(struct fuse_vnode_data *d1, struct fuse_vnode_data *d2)
+/* nodeid hash */
+
+void
+fuse_node_hash_init(struct fuse_data *data)
+{
+    uint32_t nbuckets = FUSE_MIN_NODE_HASH_BUCKETS;
+
+    while (nbuckets < fuse_node_hash_buckets && nbuckets < FUSE_MAX_NODE_HASH_BUCKETS) {
+        nbuckets <<= 1;
+    }
+
+    data->node_hash = FUSE_OSMalloc(nbuckets * sizeof(struct fuse_node_bucket), fuse_malloc_tag);
+    if (!data->node_hash) {
+        panic("fuse4x: OSMalloc failed in " __FUNCTION__);
+    }
+    data->node_hash_mask = nbuckets - 1;
+    data->stats.node_buckets = nbuckets;
+
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        LIST_INIT(&data->node_hash[i]);
+    }
+
+    for (int i = 0; i < FUSE_NODE_HASH_LOCKS; i++) {
+        data->node_mtx[i] = lck_mtx_alloc_init(fuse_lock_group, fuse_lock_attr);
+    }
+}
+
+void
+fuse_node_hash_destroy(struct fuse_data *data)
+{
+    uint32_t nbuckets = data->node_hash_mask + 1;
+
+    for (uint32_t i = 0; i < nbuckets; i++) {
+        if (!LIST_EMPTY(&data->node_hash[i])) {
+            log("fuse4x: nodes hash (%p) still contains vnodes\n", data->node_hash);
+            break;
+        }
+    }
+
+    for (int i = 0; i < FUSE_NODE_HASH_LOCKS; i++) {
+        lck_mtx_free(data->node_mtx[i], fuse_lock_group);
+        data->node_mtx[i] = NULL;
+    }
+
+    FUSE_OSFree(data->node_hash, nbuckets * sizeof(struct fuse_node_bucket), fuse_malloc_tag);
+    data->node_hash = NULL;
+}
+
+/*
+ * Doubles the table that had nbuckets buckets, unless somebody else already
+ * has. Takes every node lock, so it must be called with none held.
+ */
+static void
+fuse_node_hash_grow(struct fuse_data *data, uint32_t nbuckets)
+{
+    struct fuse_node_bucket *table;
+    struct fuse_node_bucket *old;
+    struct fuse_vnode_data  *fvdat;
+    uint32_t used = 0;
+    uint32_t chain_max = 0;
+    int i;
+
+    if (nbuckets >= FUSE_MAX_NODE_HASH_BUCKETS) {
+        return;
+    }
+
+    /* Allocated before locking; it may sleep. */
+    table = FUSE_OSMalloc(2 * nbuckets * sizeof(struct fuse_node_bucket), fuse_malloc_tag);
+    if (!table) {
+        /* The chains just get longer. */
+        return;
+    }
+    for (uint32_t b = 0; b < 2 * nbuckets; b++) {
+        LIST_INIT(&table[b]);
+    }
+
+    for (i = 0; i < FUSE_NODE_HASH_LOCKS; i++) {
+        fuse_lck_mtx_lock(data->node_mtx[i]);
+    }
+
+    if (data->node_hash_mask + 1 != nbuckets) {
+        for (i = FUSE_NODE_HASH_LOCKS - 1; i >= 0; i--) {
+            fuse_lck_mtx_unlock(data->node_mtx[i]);
+        }
+        FUSE_OSFree(table, 2 * nbuckets * sizeof(struct fuse_node_bucket), fuse_malloc_tag);
+        return;
+    }
+
+    old = data->node_hash;
+    data->node_hash = table;
+    data->node_hash_mask = 2 * nbuckets - 1;
+
+    for (uint32_t b = 0; b < nbuckets; b++) {
+        while ((fvdat = LIST_FIRST(&old[b]))) {
+            LIST_REMOVE(fvdat, nodes_link);
+            LIST_INSERT_HEAD(&table[fuse_node_hash(data, fvdat->nodeid)], fvdat, nodes_link);
+        }
+    }
+
+    for (uint32_t b = 0; b < 2 * nbuckets; b++) {
+        uint32_t chain = 0;
+
+        LIST_FOREACH(fvdat, &table[b], nodes_link) {
+            chain++;
+        }
+        if (chain) {
+            used++;
+            chain_max = max(chain_max, chain);
+        }
+    }
+
+    data->stats.node_buckets      = 2 * nbuckets;
+    data->stats.node_buckets_used = used;
+    data->stats.node_chain_max    = chain_max;
+
+    for (i = FUSE_NODE_HASH_LOCKS - 1; i >= 0; i--) {
+        fuse_lck_mtx_unlock(data->node_mtx[i]);
+    }
+
+    FUSE_OSFree(old, nbuckets * sizeof(struct fuse_node_bucket), fuse_malloc_tag);
+}
+
+void
+fuse_node_insert(struct fuse_data *data, struct fuse_vnode_data *fvdat)
 {
-    if (d1->nodeid > d2->nodeid) {
-        return 1;
-    } else if (d1->nodeid == d2->nodeid) {
-        return 0;
+    lck_mtx_t *mtx = fuse_node_mtx(data, fuse_node_hash(data, fvdat->nodeid));
+    struct fuse_vnode_data *other;
+    uint32_t   hash;
+    uint32_t   chain = 1;
+    uint32_t   old;
+    uint32_t   nbuckets;
+    uint32_t   count;
+
+    fuse_lck_mtx_lock(mtx);
+    hash = fuse_node_hash(data, fvdat->nodeid);
+    nbuckets = data->node_hash_mask + 1;
+    if (LIST_EMPTY(&data->node_hash[hash])) {
+        OSIncrementAtomic((SInt32 *)&data->stats.node_buckets_used);
     } else {
-        return -1;
+        OSIncrementAtomic64((SInt64 *)&data->stats.node_collisions);
+        LIST_FOREACH(other, &data->node_hash[hash], nodes_link) {
+            chain++;
+        }
+    }
+    LIST_INSERT_HEAD(&data->node_hash[hash], fvdat, nodes_link);
+    count = (uint32_t)OSIncrementAtomic((SInt32 *)&data->stats.node_count) + 1;
+    while ((old = data->stats.node_chain_max) < chain &&
+           !OSCompareAndSwap(old, chain, (volatile UInt32 *)&data->stats.node_chain_max)) {
+        /* somebody else raised it, look again */
+    }
+    fuse_lck_mtx_unlock(mtx);
+
+    if (count > FUSE_NODE_HASH_LOAD * nbuckets) {
+        fuse_node_hash_grow(data, nbuckets);
+    }
+}
+
+void
+fuse_node_remove(struct fuse_data *data, struct fuse_vnode_data *fvdat)
+{
+    lck_mtx_t *mtx = fuse_node_mtx(data, fuse_node_hash(data, fvdat->nodeid));
+
+    fuse_lck_mtx_lock(mtx);
+    LIST_REMOVE(fvdat, nodes_link);
+    if (LIST_EMPTY(&data->node_hash[fuse_node_hash(data, fvdat->nodeid)])) {
+        OSDecrementAtomic((SInt32 *)&data->stats.node_buckets_used);
+    }
+    OSDecrementAtomic((SInt32 *)&data->stats.node_count);
+    fuse_lck_mtx_unlock(mtx);
+}
+
+/* dirty list */
+
+/*
+ * A node goes on its mount's dirty list when it may have data the daemon
+ * has not been asked to make durable: written through the UBC, paged out
+ * or resized. sync visits the list instead of every vnode of the mount.
+ */
+void
+fuse_node_dirty(vnode_t vp)
+{
+    struct fuse_vnode_data *fvdat = VTOFUD(vp);
+    struct fuse_data       *data;
+
+    if (!fvdat || fvdat->dirty) {
+        return;
+    }
+
+    data = fuse_get_mpdata(vnode_mount(vp));
+
+    fuse_lck_mtx_lock(data->dirty_mtx);
+    if (!fvdat->dirty) {
+        TAILQ_INSERT_TAIL(&data->dirty_head, fvdat, dirty_link);
+        fvdat->dirty = true;
+        data->stats.dirty_nodes++;
+        fuse_counter_inc(FUSE_CNT_VNODES_DIRTY);
     }
+    fuse_lck_mtx_unlock(data->dirty_mtx);
 }
 
-RB_GENERATE(fuse_data_nodes, fuse_vnode_data, nodes_link, fuse_vnode_compare);
+static __inline__
+void
+fuse_node_dirty_remove(struct fuse_data *data, struct fuse_vnode_data *fvdat)
+{
+    TAILQ_REMOVE(&data->dirty_head, fvdat, dirty_link);
+    fvdat->dirty = false;
+    data->stats.dirty_nodes--;
+    fuse_counter_dec(FUSE_CNT_VNODES_DIRTY);
+}
+
+/* Called on reclaim. */
+void
+fuse_node_undirty(struct fuse_data *data, struct fuse_vnode_data *fvdat)
+{
+    fuse_lck_mtx_lock(data->dirty_mtx);
+    if (fvdat->dirty) {
+        fuse_node_dirty_remove(data, fvdat);
+    }
+    fuse_lck_mtx_unlock(data->dirty_mtx);
+}
+
+/*
+ * Calls back for every node that is on the dirty list when the walk starts,
+ * once it is off the list and holds an iocount. Nodes dirtied meanwhile are
+ * left for the next walk. Must be called without the biglock.
+ *
+ * Walks run one at a time. A node is off the list while its callback runs,
+ * so a second walk would not see the nodes the first one is busy with and
+ * sync(MNT_WAIT) could return with the flusher's nodes still unsynced.
+ */
+void
+fuse_node_dirty_iterate(struct fuse_data *data,
+                        fuse_node_dirty_callback_t *callback, void *cargs)
+{
+    struct fuse_vnode_data *fvdat;
+    uint32_t n;
+
+    fuse_lck_mtx_lock(data->dirty_mtx);
+
+    while (data->dirty_walking) {
+        (void)fuse_msleep(&data->dirty_walking, data->dirty_mtx, PINOD, "fu_dirty", NULL);
+    }
+    data->dirty_walking = true;
+
+    n = data->stats.dirty_nodes;
+    while (n-- && !data->dead && (fvdat = TAILQ_FIRST(&data->dirty_head))) {
+        vnode_t  vp  = fvdat->vp;
+        uint32_t vid = fvdat->vid;
+
+        fuse_node_dirty_remove(data, fvdat);
+        fuse_lck_mtx_unlock(data->dirty_mtx);
+
+        /* fvdat may be reclaimed until we hold the vnode. */
+        if (vnode_getwithvid(vp, vid) == 0) {
+            if (callback(vp, cargs)) {
+                fuse_node_dirty(vp);
+            }
+            vnode_put(vp);
+        }
+
+        fuse_lck_mtx_lock(data->dirty_mtx);
+    }
+
+    data->dirty_walking = false;
+    fuse_wakeup(&data->dirty_walking);
+
+    fuse_lck_mtx_unlock(data->dirty_mtx);
+}
+
+/* Drops every cached readdir page of the directory. */
+void
+fuse_dircache_purge(struct fuse_vnode_data *fvdat)
+{
+    struct fuse_dirpage *page;
+
+    fvdat->dircache_gen++;
+
+    while ((page = LIST_FIRST(&fvdat->dirpages))) {
+        LIST_REMOVE(page, link);
+        fvdat->dircache_size -= page->allocsize;
+        FUSE_OSFree(page, page->allocsize, fuse_malloc_tag);
+    }
+}
+
+/* Drops every cached extended attribute of the node. */
+void
+fuse_xattrcache_purge(struct fuse_vnode_data *fvdat)
+{
+    struct fuse_xattr *xa;
+
+    fvdat->xattrcache_gen++;
+    bzero(&fvdat->xattrcache_expires, sizeof(struct timespec));
+
+    while ((xa = LIST_FIRST(&fvdat->xattrs))) {
+        LIST_REMOVE(xa, link);
+        fvdat->xattrcache_size -= xa->allocsize;
+        FUSE_OSFree(xa, xa->allocsize, fuse_malloc_tag);
+    }
+}
 
 void
 fuse_vnode_data_destroy(struct fuse_vnode_data *fvdat)
 {
+    fuse_dircache_purge(fvdat);
+    fuse_xattrcache_purge(fvdat);
+
 #ifdef FUSE4X_ENABLE_TSLOCKING
     lck_rw_free(fvdat->nodelock, fuse_lock_group);
     lck_rw_free(fvdat->truncatelock, fuse_lock_group);
@@ -43,6 +332,54 @@ fuse_vnode_data_destroy(struct fuse_vnode_data *fvdat)
     FUSE_OSFree(fvdat, sizeof(*fvdat), fuse_malloc_tag);
 }
 
+/*
+ * Returns the vnode attached to nodeid with an iocount taken, or NULLVP if
+ * the node is not in core. The caller must vnode_put() a returned vnode.
+ */
+vnode_t
+fuse_node_find(struct fuse_data *mntdata, uint64_t nodeid)
+{
+    vnode_t vn = NULLVP;
+    uint32_t vid = 0;
+    lck_mtx_t *mtx = fuse_node_mtx(mntdata, fuse_node_hash(mntdata, nodeid));
+    struct fuse_vnode_data *fvdat;
+
+    fuse_lck_mtx_lock(mtx);
+    LIST_FOREACH(fvdat, &mntdata->node_hash[fuse_node_hash(mntdata, nodeid)], nodes_link) {
+        if (fvdat->nodeid == nodeid) {
+            vn = fvdat->vp;
+            vid = vnode_vid(vn);
+            break;
+        }
+    }
+    fuse_lck_mtx_unlock(mtx);
+
+    if (vn) {
+        int geterr = vnode_getwithvid(vn, vid);
+        if (geterr == ENOENT) {
+            // What happened here is a race condition between this function and vnode reclaiming.
+            // We do not increase a usage counter when we put nodes to the hash.
+            // So vnode can be reclaimed by kernel at any time.
+            // Let's think what heppens when this function is called at the very same time as reclaim.
+            // T(this process), R(reclaim process)
+            //   T - find vnode in the hash
+            //   R - remove vnode from the hash
+            //   R - free fuse_vnode_data structure
+            //   R - reclaim vnode and let someone else use it, let's say process O
+            //   O - call vnode_create() and reuse vnode reclaimed above
+            //   T - call vnode_get() for vnode we got from the hash at the step one but now used by process O. bummer!!!
+            // The problem is that vnode that we try to get() is completely different from the one that we
+            // had in the hash at the beginning of the process.
+            // To avoid this race condition we need to store and check vid. vid is some kind of vnode identifier -
+            // once a vnode is reclaimend this id is changed. If vnode reclaim happened then vnode_getwithvid()
+            // above fails with ENOENT error. In such case we just ignore the vnode and perform a new vnode creation.
+            vn = NULLVP;
+        }
+    }
+
+    return vn;
+}
+
 errno_t
 FSNodeGetOrCreateFileVNodeByID(vnode_t               *vnPtr,
                                bool                   is_root,
@@ -54,9 +391,9 @@ FSNodeGetOrCreateFileVNodeByID(vnode_t               *vnPtr,
 {
     int err = 0;
     vnode_t vn = NULLVP;
-    uint32_t vid = 0;
 
     struct fuse_data       *mntdata = NULL;
+    struct fuse_vnode_data *fvdat = NULL;
     enum vtype vtyp = IFTOVT(feo->attr.mode);
 
     if ((vtyp >= VBAD) || (vtyp == VNON)) {
@@ -68,39 +405,7 @@ FSNodeGetOrCreateFileVNodeByID(vnode_t               *vnPtr,
 
     mntdata = fuse_get_mpdata(mp);
 
-    struct fuse_vnode_data tt = {
-        .nodeid = feo->nodeid
-    };
-    fuse_lck_mtx_lock(mntdata->node_mtx);
-    struct fuse_vnode_data *fvdat = RB_FIND(fuse_data_nodes, &mntdata->nodes_head, &tt);
-    if (fvdat) {
-        vn = fvdat->vp;
-        vid = vnode_vid(vn);
-    }
-    fuse_lck_mtx_unlock(mntdata->node_mtx);
-
-    if (vn) {
-        int geterr = vnode_getwithvid(vn, vid);
-        if (geterr == ENOENT) {
-            // What happened here is a race condition between this function and vnode reclaiming.
-            // We do not increase a usage counter when we put nodes to rb-tree.
-            // So vnode can be reclaimed by kernel at any time.
-            // Let's think what heppens when this function is called at the very same time as reclaim.
-            // T(this process), R(reclaim process)
-            //   T - find vnode in rb-tree
-            //   R - remove vnode from rb-tree
-            //   R - free fuse_vnode_data structure
-            //   R - reclaim vnode and let someone else use it, let's say process O
-            //   O - call vnode_create() and reuse vnode reclaimed above
-            //   T - call vnode_get() for vnode we got from rb-tree at the step one but now used by process O. bummer!!!
-            // The problem is that vnode that we try to get() is completely different from the one that we
-            // had in rb-tree at the beginning of the process.
-            // To avoid this race condition we need to store and check vid. vid is some kind of vnode identifier -
-            // once a vnode is reclaimend this id is changed. If vnode reclaim happened then vnode_getwithvid()
-            // above fails with ENOENT error. In such case we just ignore the vnode and perform a new vnode creation.
-            vn = NULLVP;
-        }
-    }
+    vn = fuse_node_find(mntdata, feo->nodeid);
 
     if (!vn) {
         fvdat = FUSE_OSMalloc(sizeof(*fvdat), fuse_malloc_tag);
@@ -174,35 +479,54 @@ FSNodeGetOrCreateFileVNodeByID(vnode_t               *vnPtr,
 #ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_unlock(mntdata->biglock);
 #endif
-        err = vnode_create(VNCREATE_FLAVOR, (uint32_t)sizeof(params),
+
+        /*
+         * Without the biglock a lookup through another directory may be
+         * instantiating the same node right now. Create under
+         * node_create_mtx and look again once we hold it. Reclaim does not
+         * take this lock, so vnode_create() may recycle one of our vnodes.
+         */
+        if (fuse_isfinelocking(mntdata)) {
+            fuse_lck_mtx_lock(mntdata->node_create_mtx);
+            vn = fuse_node_find(mntdata, feo->nodeid);
+        }
+
+        if (vn) {
+            fuse_vnode_data_destroy(fvdat);
+        } else {
+            err = vnode_create(VNCREATE_FLAVOR, (uint32_t)sizeof(params),
                                &params, &vn);
-#ifdef FUSE4X_ENABLE_BIGLOCK
-        fuse_biglock_lock(mntdata->biglock);
-#endif
 
-        if (err == 0) {
-            if (is_root) {
-                fvdat->parentvp = vn;
-            } else {
-                fvdat->parentvp = dvp;
-            }
-            if (oflags) {
-                *oflags |= MAKEENTRY;
-            }
+            if (err == 0) {
+                if (is_root) {
+                    fvdat->parentvp = vn;
+                } else {
+                    fvdat->parentvp = dvp;
+                }
+                if (oflags) {
+                    *oflags |= MAKEENTRY;
+                }
 
-            fvdat->vp = vn;
-            fvdat->vid = vnode_vid(vn);
+                fvdat->vp = vn;
+                fvdat->vid = vnode_vid(vn);
 
-            fuse_lck_mtx_lock(mntdata->node_mtx);
-            RB_INSERT(fuse_data_nodes, &mntdata->nodes_head, fvdat);
-            fuse_lck_mtx_unlock(mntdata->node_mtx);
-            vnode_addfsref(vn);
+                fuse_node_insert(mntdata, fvdat);
+                vnode_addfsref(vn);
 
-            OSIncrementAtomic((SInt32 *)&fuse_vnodes_current);
-        } else {
-            log("fuse4x: vnode (ino=%llu) cannot be created, err=%d\n", feo->nodeid, err);
-            fuse_vnode_data_destroy(fvdat);
+                fuse_counter_inc(FUSE_CNT_VNODES_CURRENT);
+            } else {
+                log("fuse4x: vnode (ino=%llu) cannot be created, err=%d\n", feo->nodeid, err);
+                fuse_vnode_data_destroy(fvdat);
+            }
         }
+
+        if (fuse_isfinelocking(mntdata)) {
+            fuse_lck_mtx_unlock(mntdata->node_create_mtx);
+        }
+
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_lock(mntdata->biglock);
+#endif
     }
 
     if (err == 0) {
@@ -267,7 +591,8 @@ fuse_vget_i(vnode_t               *vpp,
 
 /* found: */
 
-    VTOFUD(*vpp)->nlookup++;
+    /* Lookups through different directories may get here at once. */
+    OSIncrementAtomic64((SInt64 *)&VTOFUD(*vpp)->nlookup);
 
     return 0;
 }
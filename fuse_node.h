@@ -9,7 +9,6 @@
 #include "fuse_file.h"
 #include "fuse_ipc.h"
 #include "fuse_kernel.h"
-#include "compat/tree.h"
 #include <fuse_param.h>
 
 #include <stdbool.h>
@@ -42,6 +41,36 @@ enum {
 #define C_TOUCH_MODTIME      0x000040000
 #define C_XTIMES_VALID       0x000080000
 
+/*
+ * A run of converted directory entries, as returned by one FUSE_READDIR.
+ * cookies[i] is the directory offset that follows data entry i. A page
+ * without entries marks the end of the directory.
+ */
+struct fuse_dirpage {
+    LIST_ENTRY(fuse_dirpage) link;
+    uint64_t   offset;    /* directory offset the page was read at */
+    uint32_t   nent;
+    size_t     size;      /* bytes of struct dirent records in data */
+    size_t     allocsize;
+    uint64_t  *cookies;
+    char      *data;
+};
+
+/*
+ * A cached extended attribute: its value, only its size, or (err ENOATTR)
+ * the fact that there is none. The entry with the empty name, which no
+ * attribute can have, holds the listxattr result.
+ */
+struct fuse_xattr {
+    LIST_ENTRY(fuse_xattr) link;
+    size_t     allocsize;
+    int        err;
+    bool       has_value;
+    size_t     size;      /* of the value */
+    char      *value;     /* follows name in the same allocation */
+    char       name[];
+};
+
 struct fuse_vnode_data {
 
     /** self **/
@@ -49,7 +78,9 @@ struct fuse_vnode_data {
     uint64_t   nodeid;
     uint32_t   vid; // id from vnode_vid()
     uint64_t   generation;
-    RB_ENTRY(fuse_vnode_data)  nodes_link;
+    LIST_ENTRY(fuse_vnode_data) nodes_link; // in the mount's nodeid hash
+    TAILQ_ENTRY(fuse_vnode_data) dirty_link; // in the mount's dirty list
+    bool       dirty;      // on the dirty list, protected by the mount's dirty_mtx
 
     /** parent **/
     vnode_t    parentvp;
@@ -57,6 +88,10 @@ struct fuse_vnode_data {
 
     /** I/O **/
     struct     fuse_filehandle fufh[FUFH_MAXTYPE];
+    uint32_t   wb_held;    // fufh types close left open for the flusher, a bitmask
+    uint32_t   wb_pid;     // last writer, whom write-behind goes out as
+    uint32_t   wb_uid;
+    uint32_t   wb_gid;
 
     /** flags **/
     uint32_t   flag;
@@ -71,6 +106,26 @@ struct fuse_vnode_data {
     uint64_t          nlookup;
     enum vtype        vtype;
 
+    /** readdir cache (directories only) **/
+    LIST_HEAD(, fuse_dirpage) dirpages;
+    struct timespec   dircache_expires;
+    size_t            dircache_size;
+    uint32_t          dircache_gen;     /* bumped on every purge */
+
+    /** xattr cache **/
+    LIST_HEAD(, fuse_xattr) xattrs;
+    struct timespec   xattrcache_expires;
+    size_t            xattrcache_size;
+    uint32_t          xattrcache_gen;   /* bumped on every purge */
+
+    /** negative name cache **/
+    struct timespec   negative_expires; /* deadline of all negative entries */
+
+    /** readahead (regular files only) **/
+    off_t             ra_next;          /* where a sequential read continues */
+    off_t             ra_end;           /* end of what has been prefetched */
+    uint32_t          ra_window;        /* 0 unless the reader is streaming */
+
 #ifdef FUSE4X_ENABLE_TSLOCKING
     /*
      * The nodelock must be held when data in the FUSE node is accessed or
@@ -91,9 +146,6 @@ typedef struct fuse_vnode_data * fusenode_t;
 
 void fuse_vnode_data_destroy(struct fuse_vnode_data *fvdat);
 
-struct fuse_data_nodes;
-RB_PROTOTYPE(fuse_data_nodes, fuse_vnode_data, nodes_link, x);
-
 #define VTOFUD(vp) \
     ((struct fuse_vnode_data *)vnode_fsnode(vp))
 #define VTOI(vp)    (VTOFUD(vp)->nodeid)
@@ -112,6 +164,80 @@ fuse_invalidate_attr(vnode_t vp)
     }
 }
 
+vnode_t
+fuse_node_find(struct fuse_data *mntdata, uint64_t nodeid);
+
+void fuse_node_hash_init(struct fuse_data *data);
+void fuse_node_hash_destroy(struct fuse_data *data);
+void fuse_node_insert(struct fuse_data *data, struct fuse_vnode_data *fvdat);
+void fuse_node_remove(struct fuse_data *data, struct fuse_vnode_data *fvdat);
+
+/* Returns whether the node has to stay on the dirty list. */
+typedef bool fuse_node_dirty_callback_t(vnode_t vp, void *cargs);
+
+void fuse_node_dirty(vnode_t vp);
+void fuse_node_undirty(struct fuse_data *data, struct fuse_vnode_data *fvdat);
+void fuse_node_dirty_iterate(struct fuse_data *data,
+                             fuse_node_dirty_callback_t *callback, void *cargs);
+
+void
+fuse_dircache_purge(struct fuse_vnode_data *fvdat);
+
+void
+fuse_xattrcache_purge(struct fuse_vnode_data *fvdat);
+
+static __inline__
+void
+fuse_invalidate_xattrcache(vnode_t vp)
+{
+    if (VTOFUD(vp)) {
+        fuse_xattrcache_purge(VTOFUD(vp));
+    }
+}
+
+static __inline__
+void
+fuse_invalidate_dircache(vnode_t vp)
+{
+    if (VTOFUD(vp)) {
+        fuse_dircache_purge(VTOFUD(vp));
+    }
+}
+
+/*
+ * Lock-free variants of the above, for callers that cannot take the node
+ * lock. The caches are only marked stale: attributes are refetched and
+ * readdir pages dropped by the next operation that holds the lock.
+ */
+static __inline__
+void
+fuse_expire_attr(vnode_t vp)
+{
+    if (VTOFUD(vp)) {
+        bzero(&VTOFUD(vp)->attr_valid, sizeof(struct timespec));
+    }
+}
+
+static __inline__
+void
+fuse_expire_dircache(vnode_t vp)
+{
+    if (VTOFUD(vp)) {
+        OSIncrementAtomic((SInt32 *)&VTOFUD(vp)->dircache_gen);
+        bzero(&VTOFUD(vp)->dircache_expires, sizeof(struct timespec));
+    }
+}
+
+static __inline__
+void
+fuse_expire_xattrcache(vnode_t vp)
+{
+    if (VTOFUD(vp)) {
+        OSIncrementAtomic((SInt32 *)&VTOFUD(vp)->xattrcache_gen);
+        bzero(&VTOFUD(vp)->xattrcache_expires, sizeof(struct timespec));
+    }
+}
+
 errno_t
 FSNodeGetOrCreateFileVNodeByID(vnode_t               *vpp,
                                bool                   is_root,
@@ -151,6 +277,19 @@ fuse_vncache_purge(vnode_t vp)
     return cache_purge(vp);
 }
 
+static __inline__
+void
+fuse_vncache_purge_negatives(vnode_t dvp)
+{
+#ifdef FUSE4X_TRACE_VNCACHE
+    log("fuse4x: cache purge negatives dvp=%p\n", dvp);
+#endif
+    if (VTOFUD(dvp)) {
+        bzero(&VTOFUD(dvp)->negative_expires, sizeof(struct timespec));
+    }
+    cache_purge_negatives(dvp);
+}
+
 static __inline__
 int
 fuse_vncache_lookup(vnode_t dvp, vnode_t *vpp, struct componentname *cnp)
@@ -16,29 +16,28 @@
 
 /* NB: none of these are bigger than unsigned 32-bit. */
 
+int32_t  fuse_adaptive_readahead     = 1;                                  // rw
 int32_t  fuse_admin_group            = 0;                                  // rw
+int32_t  fuse_async_release          = 0;                                  // rw
 int32_t  fuse_allow_other            = 0;                                  // rw
 uint32_t fuse_api_major              = FUSE_KERNEL_VERSION;                // r
 uint32_t fuse_api_minor              = FUSE_KERNEL_MINOR_VERSION;          // r
-int32_t  fuse_fh_current             = 0;                                  // r
-uint32_t fuse_fh_reuse_count         = 0;                                  // r
-uint32_t fuse_fh_upcall_count        = 0;                                  // r
-uint32_t fuse_fh_zombies             = 0;                                  // r
-int32_t  fuse_iov_credit             = FUSE_DEFAULT_IOV_CREDIT;            // rw
-int32_t  fuse_iov_current            = 0;                                  // r
+uint32_t fuse_directio_max_inflight = FUSE_DEFAULT_DIRECTIO_MAX_INFLIGHT; // rw
+#if defined(FUSE4X_ENABLE_BIGLOCK) && defined(FUSE4X_ENABLE_FINE_LOCKING)
+int32_t  fuse_fine_grained_locking   = 0;                                  // rw
+#endif
 uint32_t fuse_iov_permanent_bufsize  = FUSE_DEFAULT_IOV_PERMANENT_BUFSIZE; // rw
 int32_t  fuse_kill                   = -1;                                 // w
 int32_t  fuse_print_vnodes           = -1;                                 // w
-uint32_t fuse_lookup_cache_hits      = 0;                                  // r
-uint32_t fuse_lookup_cache_misses    = 0;                                  // r
-uint32_t fuse_lookup_cache_overrides = 0;                                  // r
 uint32_t fuse_max_freetickets        = FUSE_DEFAULT_MAX_FREE_TICKETS;      // rw
 uint32_t fuse_max_tickets            = 0;                                  // rw
+uint32_t fuse_node_hash_buckets      = FUSE_DEFAULT_NODE_HASH_BUCKETS;     // rw
+int32_t  fuse_readdir_cache          = 0;                                  // rw
 int32_t  fuse_mount_count            = 0;                                  // r
-int32_t  fuse_realloc_count          = 0;                                  // r
-int32_t  fuse_tickets_current        = 0;                                  // r
+uint32_t fuse_strategy_max_inflight  = FUSE_DEFAULT_STRATEGY_MAX_INFLIGHT; // rw
+uint32_t fuse_sync_max_inflight      = FUSE_DEFAULT_SYNC_MAX_INFLIGHT;     // rw
 uint32_t fuse_userkernel_bufsize     = FUSE_DEFAULT_USERKERNEL_BUFSIZE;    // rw
-int32_t  fuse_vnodes_current         = 0;                                  // r
+int32_t  fuse_xattr_cache            = 0;                                  // rw
 #ifdef FUSE4X_ENABLE_MACFUSE_MODE
 int32_t  fuse_macfuse_mode           = 0;                                  // w
 #endif
@@ -46,6 +45,20 @@ int32_t  fuse_macfuse_mode           = 0;                                  // w
 int32_t  fuse_memory_allocated       = 0;                                  // r
 #endif
 
+struct fuse_counter_slot fuse_counters[FUSE_COUNTER_SLOTS];                // r
+
+int32_t
+fuse_counter_read(enum fuse_counter c)
+{
+    int32_t sum = 0;
+
+    for (int i = 0; i < FUSE_COUNTER_SLOTS; i++) {
+        sum += fuse_counters[i].cnt[c];
+    }
+
+    return sum;
+}
+
 SYSCTL_DECL(_vfs_generic);
 SYSCTL_NODE(_vfs_generic, OID_AUTO, fuse4x, CTLFLAG_RW, 0,
             "fuse4x Sysctl Interface");
@@ -63,10 +76,12 @@ SYSCTL_NODE(_vfs_generic_fuse4x, OID_AUTO, version, CTLFLAG_RW, 0,
 /* fuse.control */
 
 int sysctl_fuse4x_control_kill_handler SYSCTL_HANDLER_ARGS;
+int sysctl_fuse4x_counter_handler SYSCTL_HANDLER_ARGS;
 #ifdef FUSE4X_ENABLE_MACFUSE_MODE
 int sysctl_fuse4x_control_macfuse_mode_handler SYSCTL_HANDLER_ARGS;
 #endif
 int sysctl_fuse4x_control_print_vnodes_handler SYSCTL_HANDLER_ARGS;
+int sysctl_fuse4x_resourceusage_mount_stats_handler SYSCTL_HANDLER_ARGS;
 int sysctl_fuse4x_tunables_userkernel_bufsize_handler SYSCTL_HANDLER_ARGS;
 
 int
@@ -195,6 +210,23 @@ exit:
 }
 #endif
 
+/* arg2 is the enum fuse_counter to sum up. */
+int
+sysctl_fuse4x_counter_handler SYSCTL_HANDLER_ARGS
+{
+    int32_t value;
+    (void)oidp;
+    (void)arg1;
+
+    if (req->newptr) {
+        return EPERM;
+    }
+
+    value = fuse_counter_read((enum fuse_counter)arg2);
+
+    return SYSCTL_OUT(req, &value, sizeof(value));
+}
+
 int
 sysctl_fuse4x_control_print_vnodes_handler SYSCTL_HANDLER_ARGS
 {
@@ -224,6 +256,40 @@ sysctl_fuse4x_control_print_vnodes_handler SYSCTL_HANDLER_ARGS
     return error;
 }
 
+int
+sysctl_fuse4x_resourceusage_mount_stats_handler SYSCTL_HANDLER_ARGS
+{
+    int error = 0;
+    struct fuse_mount_stats *stats;
+    (void)oidp;
+    (void)arg1;
+    (void)arg2;
+
+    if (req->newptr) {
+        return EPERM;
+    }
+
+    stats = FUSE_OSMalloc(sizeof(*stats), fuse_malloc_tag);
+    if (!stats) {
+        return ENOMEM;
+    }
+
+    /* One record per mounted device; a NULL oldptr just sizes the output. */
+    for (int unit = 0; unit < FUSE4X_NDEVICES; unit++) {
+        if (fuse_device_get_stats(unit, stats)) {
+            continue;
+        }
+        error = SYSCTL_OUT(req, stats, sizeof(*stats));
+        if (error) {
+            break;
+        }
+    }
+
+    FUSE_OSFree(stats, sizeof(*stats), fuse_malloc_tag);
+
+    return error;
+}
+
 int
 sysctl_fuse4x_tunables_userkernel_bufsize_handler SYSCTL_HANDLER_ARGS
 {
@@ -310,51 +376,101 @@ SYSCTL_PROC(_vfs_generic_fuse4x_control,   // our parent
             "I",                // our data type (integer)
             "fuse4x Controls: Print Vnodes for the Given File System");
 
+#define FUSE_SYSCTL_COUNTER(parent, name, counter)                      \
+    SYSCTL_PROC(parent, OID_AUTO, name, (CTLTYPE_INT | CTLFLAG_RD), NULL, \
+                (counter), sysctl_fuse4x_counter_handler, "I", "")
+
 /* fuse.counters */
-SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_reuse, CTLFLAG_RD,
-           &fuse_fh_reuse_count, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, filehandle_upcalls, CTLFLAG_RD,
-           &fuse_fh_upcall_count, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_hits, CTLFLAG_RD,
-           &fuse_lookup_cache_hits, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_misses, CTLFLAG_RD,
-           &fuse_lookup_cache_misses, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, lookup_cache_overrides,
-           CTLFLAG_RD, &fuse_lookup_cache_overrides, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_counters, OID_AUTO, memory_reallocs, CTLFLAG_RD,
-           &fuse_realloc_count, 0, "");
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, filehandle_reuse,
+                    FUSE_CNT_FH_REUSE);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, filehandle_upcalls,
+                    FUSE_CNT_FH_UPCALLS);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, interrupts_sent,
+                    FUSE_CNT_INTERRUPTS_SENT);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, interrupts_withdrawn,
+                    FUSE_CNT_INTERRUPTS_WITHDRAWN);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, lookup_cache_hits,
+                    FUSE_CNT_LOOKUP_CACHE_HITS);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, lookup_cache_misses,
+                    FUSE_CNT_LOOKUP_CACHE_MISSES);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, lookup_cache_overrides,
+                    FUSE_CNT_LOOKUP_CACHE_OVERRIDES);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, lookup_negative_hits,
+                    FUSE_CNT_LOOKUP_NEGATIVE_HITS);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, lookup_negative_misses,
+                    FUSE_CNT_LOOKUP_NEGATIVE_MISSES);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, lookup_negative_overrides,
+                    FUSE_CNT_LOOKUP_NEGATIVE_OVERRIDES);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, readdir_cache_hits,
+                    FUSE_CNT_READDIR_CACHE_HITS);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, readdir_cache_misses,
+                    FUSE_CNT_READDIR_CACHE_MISSES);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, memory_reallocs,
+                    FUSE_CNT_REALLOCS);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, xattr_cache_hits,
+                    FUSE_CNT_XATTR_CACHE_HITS);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_counters, xattr_cache_misses,
+                    FUSE_CNT_XATTR_CACHE_MISSES);
 
 /* fuse.resourceusage */
-SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, filehandles, CTLFLAG_RD,
-           &fuse_fh_current, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, filehandles_zombies, CTLFLAG_RD,
-           &fuse_fh_zombies, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, ipc_iovs, CTLFLAG_RD,
-           &fuse_iov_current, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, ipc_tickets, CTLFLAG_RD,
-           &fuse_tickets_current, 0, "");
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, filehandles,
+                    FUSE_CNT_FH_CURRENT);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, filehandles_zombies,
+                    FUSE_CNT_FH_ZOMBIES);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, ipc_iovs,
+                    FUSE_CNT_IOV_CURRENT);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, ipc_queued_background,
+                    FUSE_CNT_QUEUED_BACKGROUND);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, ipc_queued_data,
+                    FUSE_CNT_QUEUED_DATA);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, ipc_queued_metadata,
+                    FUSE_CNT_QUEUED_METADATA);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, ipc_tickets,
+                    FUSE_CNT_TICKETS_CURRENT);
 SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, mounts, CTLFLAG_RD,
            &fuse_mount_count, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, vnodes, CTLFLAG_RD,
-           &fuse_vnodes_current, 0, "");
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, vnodes,
+                    FUSE_CNT_VNODES_CURRENT);
+FUSE_SYSCTL_COUNTER(_vfs_generic_fuse4x_resourceusage, vnodes_dirty,
+                    FUSE_CNT_VNODES_DIRTY);
 #ifdef FUSE4X_COUNT_MEMORY
 SYSCTL_INT(_vfs_generic_fuse4x_resourceusage, OID_AUTO, memory_bytes, CTLFLAG_RD,
            &fuse_memory_allocated, 0, "");
 #endif
+SYSCTL_PROC(_vfs_generic_fuse4x_resourceusage, OID_AUTO, mount_stats,
+            (CTLTYPE_OPAQUE | CTLFLAG_RD), NULL, 0,
+            sysctl_fuse4x_resourceusage_mount_stats_handler,
+            "S,fuse_mount_stats", "");
 
 /* fuse.tunables */
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, adaptive_readahead, CTLFLAG_RW,
+           &fuse_adaptive_readahead, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, admin_group, CTLFLAG_RW,
            &fuse_admin_group, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, allow_other, CTLFLAG_RW,
            &fuse_allow_other, 0, "");
-SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, iov_credit, CTLFLAG_RW,
-           &fuse_iov_credit, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, async_release, CTLFLAG_RW,
+           &fuse_async_release, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, directio_max_inflight, CTLFLAG_RW,
+           &fuse_directio_max_inflight, 0, "");
+#if defined(FUSE4X_ENABLE_BIGLOCK) && defined(FUSE4X_ENABLE_FINE_LOCKING)
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, fine_grained_locking, CTLFLAG_RW,
+           &fuse_fine_grained_locking, 0, "");
+#endif
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, iov_permanent_bufsize, CTLFLAG_RW,
            &fuse_iov_permanent_bufsize, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, max_freetickets, CTLFLAG_RW,
            &fuse_max_freetickets, 0, "");
 SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, max_tickets, CTLFLAG_RW,
            &fuse_max_tickets, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, node_hash_buckets, CTLFLAG_RW,
+           &fuse_node_hash_buckets, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, readdir_cache, CTLFLAG_RW,
+           &fuse_readdir_cache, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, strategy_max_inflight, CTLFLAG_RW,
+           &fuse_strategy_max_inflight, 0, "");
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, sync_max_inflight, CTLFLAG_RW,
+           &fuse_sync_max_inflight, 0, "");
 SYSCTL_PROC(_vfs_generic_fuse4x_tunables,          // our parent
             OID_AUTO,                   // automatically assign object ID
             userkernel_bufsize,         // our name
@@ -364,6 +480,8 @@ SYSCTL_PROC(_vfs_generic_fuse4x_tunables,          // our parent
             sysctl_fuse4x_tunables_userkernel_bufsize_handler,
             "I",                        // our data type (integer)
             "fuse4x Tunables");        // our description
+SYSCTL_INT(_vfs_generic_fuse4x_tunables, OID_AUTO, xattr_cache, CTLFLAG_RW,
+           &fuse_xattr_cache, 0, "");
 
 /* fuse.version */
 SYSCTL_INT(_vfs_generic_fuse4x_version, OID_AUTO, api_major, CTLFLAG_RD,
@@ -389,26 +507,50 @@ static struct sysctl_oid *fuse_sysctl_list[] =
     &sysctl__vfs_generic_fuse4x_control_print_vnodes,
     &sysctl__vfs_generic_fuse4x_counters_filehandle_reuse,
     &sysctl__vfs_generic_fuse4x_counters_filehandle_upcalls,
+    &sysctl__vfs_generic_fuse4x_counters_interrupts_sent,
+    &sysctl__vfs_generic_fuse4x_counters_interrupts_withdrawn,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_hits,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_misses,
     &sysctl__vfs_generic_fuse4x_counters_lookup_cache_overrides,
+    &sysctl__vfs_generic_fuse4x_counters_lookup_negative_hits,
+    &sysctl__vfs_generic_fuse4x_counters_lookup_negative_misses,
+    &sysctl__vfs_generic_fuse4x_counters_lookup_negative_overrides,
+    &sysctl__vfs_generic_fuse4x_counters_readdir_cache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_readdir_cache_misses,
     &sysctl__vfs_generic_fuse4x_counters_memory_reallocs,
+    &sysctl__vfs_generic_fuse4x_counters_xattr_cache_hits,
+    &sysctl__vfs_generic_fuse4x_counters_xattr_cache_misses,
     &sysctl__vfs_generic_fuse4x_resourceusage_filehandles,
     &sysctl__vfs_generic_fuse4x_resourceusage_filehandles_zombies,
     &sysctl__vfs_generic_fuse4x_resourceusage_ipc_iovs,
+    &sysctl__vfs_generic_fuse4x_resourceusage_ipc_queued_background,
+    &sysctl__vfs_generic_fuse4x_resourceusage_ipc_queued_data,
+    &sysctl__vfs_generic_fuse4x_resourceusage_ipc_queued_metadata,
     &sysctl__vfs_generic_fuse4x_resourceusage_ipc_tickets,
 #ifdef FUSE4X_COUNT_MEMORY
     &sysctl__vfs_generic_fuse4x_resourceusage_memory_bytes,
 #endif
+    &sysctl__vfs_generic_fuse4x_resourceusage_mount_stats,
     &sysctl__vfs_generic_fuse4x_resourceusage_mounts,
     &sysctl__vfs_generic_fuse4x_resourceusage_vnodes,
+    &sysctl__vfs_generic_fuse4x_resourceusage_vnodes_dirty,
+    &sysctl__vfs_generic_fuse4x_tunables_adaptive_readahead,
     &sysctl__vfs_generic_fuse4x_tunables_admin_group,
     &sysctl__vfs_generic_fuse4x_tunables_allow_other,
-    &sysctl__vfs_generic_fuse4x_tunables_iov_credit,
+    &sysctl__vfs_generic_fuse4x_tunables_async_release,
+    &sysctl__vfs_generic_fuse4x_tunables_directio_max_inflight,
+#if defined(FUSE4X_ENABLE_BIGLOCK) && defined(FUSE4X_ENABLE_FINE_LOCKING)
+    &sysctl__vfs_generic_fuse4x_tunables_fine_grained_locking,
+#endif
     &sysctl__vfs_generic_fuse4x_tunables_iov_permanent_bufsize,
     &sysctl__vfs_generic_fuse4x_tunables_max_freetickets,
     &sysctl__vfs_generic_fuse4x_tunables_max_tickets,
+    &sysctl__vfs_generic_fuse4x_tunables_node_hash_buckets,
+    &sysctl__vfs_generic_fuse4x_tunables_readdir_cache,
+    &sysctl__vfs_generic_fuse4x_tunables_strategy_max_inflight,
+    &sysctl__vfs_generic_fuse4x_tunables_sync_max_inflight,
     &sysctl__vfs_generic_fuse4x_tunables_userkernel_bufsize,
+    &sysctl__vfs_generic_fuse4x_tunables_xattr_cache,
     &sysctl__vfs_generic_fuse4x_version_api_major,
     &sysctl__vfs_generic_fuse4x_version_api_minor,
     &sysctl__vfs_generic_fuse4x_version_number,
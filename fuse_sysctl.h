@@ -8,30 +8,88 @@
 
 #include "fuse.h"
 
+extern int32_t  fuse_adaptive_readahead;
 extern int32_t  fuse_admin_group;
 extern int32_t  fuse_allow_other;
-extern int32_t  fuse_fh_current;
-extern uint32_t fuse_fh_reuse_count;
-extern uint32_t fuse_fh_upcall_count;
-extern uint32_t fuse_fh_zombies;
-extern int32_t  fuse_iov_credit;
-extern int32_t  fuse_iov_current;
+extern int32_t  fuse_async_release;
+extern uint32_t fuse_directio_max_inflight;
+#if defined(FUSE4X_ENABLE_BIGLOCK) && defined(FUSE4X_ENABLE_FINE_LOCKING)
+extern int32_t  fuse_fine_grained_locking;
+#endif
 extern uint32_t fuse_iov_permanent_bufsize;
-extern uint32_t fuse_lookup_cache_hits;
-extern uint32_t fuse_lookup_cache_misses;
-extern uint32_t fuse_lookup_cache_overrides;
 extern uint32_t fuse_max_tickets;
 extern uint32_t fuse_max_freetickets;
 extern int32_t  fuse_mount_count;
-extern int32_t  fuse_realloc_count;
-extern int32_t  fuse_tickets_current;
+extern uint32_t fuse_node_hash_buckets;
+extern int32_t  fuse_readdir_cache;
+extern uint32_t fuse_strategy_max_inflight;
+extern uint32_t fuse_sync_max_inflight;
 extern uint32_t fuse_userkernel_bufsize;
-extern int32_t  fuse_vnodes_current;
+extern int32_t  fuse_xattr_cache;
 
 #ifdef FUSE4X_COUNT_MEMORY
 extern int32_t  fuse_memory_allocated;
 #endif
 
+/*
+ * Counters bumped on hot paths (lookup, strategy, ticket and iov
+ * allocation). Each CPU updates its own cache line, so the atomic add never
+ * has to pull the line away from another core; fuse_counter_read() sums the
+ * slots when the sysctl is read. A thread may migrate between picking its
+ * slot and updating it, which is why the update is still atomic.
+ */
+enum fuse_counter {
+    FUSE_CNT_FH_CURRENT = 0,
+    FUSE_CNT_FH_REUSE,
+    FUSE_CNT_FH_UPCALLS,
+    FUSE_CNT_FH_ZOMBIES,
+    FUSE_CNT_INTERRUPTS_SENT,
+    FUSE_CNT_INTERRUPTS_WITHDRAWN,
+    FUSE_CNT_IOV_CURRENT,
+    FUSE_CNT_LOOKUP_CACHE_HITS,
+    FUSE_CNT_LOOKUP_CACHE_MISSES,
+    FUSE_CNT_LOOKUP_CACHE_OVERRIDES,
+    FUSE_CNT_LOOKUP_NEGATIVE_HITS,
+    FUSE_CNT_LOOKUP_NEGATIVE_MISSES,
+    FUSE_CNT_LOOKUP_NEGATIVE_OVERRIDES,
+    FUSE_CNT_QUEUED_METADATA,    /* in enum fuse_ms_class order */
+    FUSE_CNT_QUEUED_DATA,
+    FUSE_CNT_QUEUED_BACKGROUND,
+    FUSE_CNT_READDIR_CACHE_HITS,
+    FUSE_CNT_READDIR_CACHE_MISSES,
+    FUSE_CNT_REALLOCS,
+    FUSE_CNT_TICKETS_CURRENT,
+    FUSE_CNT_VNODES_CURRENT,
+    FUSE_CNT_VNODES_DIRTY,
+    FUSE_CNT_XATTR_CACHE_HITS,
+    FUSE_CNT_XATTR_CACHE_MISSES,
+    FUSE_CNT_MAX
+};
+
+struct fuse_counter_slot {
+    int32_t cnt[FUSE_CNT_MAX];
+} __attribute__((aligned(FUSE_CACHE_LINE_SIZE)));
+
+extern struct fuse_counter_slot fuse_counters[FUSE_COUNTER_SLOTS];
+
+/* com.apple.kpi.unsupported */
+extern int cpu_number(void);
+
+static __inline__
+void
+fuse_counter_add(enum fuse_counter c, int32_t n)
+{
+    struct fuse_counter_slot *slot;
+
+    slot = &fuse_counters[(unsigned)cpu_number() & (FUSE_COUNTER_SLOTS - 1)];
+    OSAddAtomic(n, (SInt32 *)&slot->cnt[c]);
+}
+
+#define fuse_counter_inc(c) fuse_counter_add((c), 1)
+#define fuse_counter_dec(c) fuse_counter_add((c), -1)
+
+extern int32_t fuse_counter_read(enum fuse_counter c);
+
 extern void fuse_sysctl_start(void);
 extern void fuse_sysctl_stop(void);
 
@@ -130,8 +130,6 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
     int mntopts  = 0;
     bool mounted = false;
 
-    uint32_t max_read = ~0;
-
     size_t len;
 
     fuse_device_t      fdev = NULL;
@@ -420,7 +418,6 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         data->daemon_timeout_p = NULL;
     }
 
-    data->max_read = max_read;
     data->fssubtype = fusefs_args.fssubtype;
     data->noimplflags = (uint64_t)0;
 
@@ -434,6 +431,11 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
         data->iosize = data->blocksize;
     }
 
+    /* Until the daemon answers INIT. READ is not negotiated at all. */
+    data->max_read = data->iosize;
+    data->max_write = data->iosize;
+    data->max_readahead = FUSE_MAX_IOSIZE;
+
     data->userkernel_bufsize = FUSE_DEFAULT_USERKERNEL_BUFSIZE;
 
     copystr(fusefs_args.fsname, vfsstatfsp->f_mntfromname,
@@ -487,6 +489,20 @@ fuse_vfsop_mount(mount_t mp, __unused vnode_t devvp, user_addr_t udata,
 
 out:
     if (err) {
+        if (mounted) {
+            /*
+             * The INIT answer may have started the flusher, or may still
+             * come in. Either way it must be gone before data can be.
+             */
+#ifdef FUSE4X_ENABLE_BIGLOCK
+            fuse_biglock_unlock(biglock);
+#endif
+            fuse_internal_writeback_stop(data);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+            fuse_biglock_lock(biglock);
+#endif
+        }
+
         vfs_setfsprivate(mp, NULL);
 
         fuse_lck_mtx_lock(fdev->mtx);
@@ -496,7 +512,7 @@ out:
         }
         if (data) {
             data->mounted = false;
-            if (!data->opened) {
+            if (!data->opened && !data->ch_open) {
 #ifdef FUSE4X_ENABLE_BIGLOCK
                 assert(biglock == data->biglock);
                 fuse_biglock_unlock(biglock);
@@ -517,14 +533,7 @@ out:
         if (err) {
             goto out; /* go back and follow error path */
         } else {
-            struct vfsioattr ioattr;
-
-            vfs_ioattr(mp, &ioattr);
-            ioattr.io_devblocksize = data->blocksize;
-            ioattr.io_maxsegreadsize = ioattr.io_maxsegwritesize =
-              ioattr.io_maxreadcnt = ioattr.io_maxwritecnt = data->iosize;
-            ioattr.io_segreadcnt = ioattr.io_segwritecnt = data->iosize / PAGE_SIZE;
-            vfs_setioattr(mp, &ioattr);
+            fuse_internal_setioattr(data);
         }
     }
 
@@ -599,6 +608,18 @@ fuse_vfsop_unmount(mount_t mp, int mntflags, vfs_context_t context)
 
     fuse_rootvp = data->rootvp;
 
+    /*
+     * The flusher must not iterate vnodes vflush() is tearing down. It may
+     * need the biglock to get out of strategy.
+     */
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_unlock(data->biglock);
+#endif
+    fuse_internal_writeback_stop(data);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+    fuse_biglock_lock(data->biglock);
+#endif
+
     fuse_trace_printf("%s: Calling vflush(mp, fuse_rootvp, flags=0x%X);\n", __FUNCTION__, force ? FORCECLOSE : 0);
 #ifdef FUSE4X_ENABLE_BIGLOCK
     fuse_biglock_unlock(data->biglock);
@@ -608,18 +629,15 @@ fuse_vfsop_unmount(mount_t mp, int mntflags, vfs_context_t context)
     fuse_biglock_lock(data->biglock);
 #endif
     fuse_trace_printf("%s:   Done.\n", __FUNCTION__);
-    if (err) {
-#ifdef FUSE4X_ENABLE_BIGLOCK
-        fuse_biglock_unlock(data->biglock);
-#endif
-        return err;
-    }
-
-    if (vnode_isinuse(fuse_rootvp, 1) && !force) {
+    if (err || (vnode_isinuse(fuse_rootvp, 1) && !force)) {
+        /* Staying mounted after all. */
+        if (fuse_iswriteback_mp(mp)) {
+            fuse_internal_writeback_resume(data);
+        }
 #ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_unlock(data->biglock);
 #endif
-        return EBUSY;
+        return err ? err : EBUSY;
     }
 
     fuse_trace_printf("%s: Calling vnode_rele(fuse_rootp);\n", __FUNCTION__);
@@ -645,6 +663,18 @@ fuse_vfsop_unmount(mount_t mp, int mntflags, vfs_context_t context)
     fuse_trace_printf("%s:   Done.\n", __FUNCTION__);
 
     if (!data->dead) {
+        /* The reclaims above may have left a partial BATCH_FORGET behind. */
+        fuse_internal_forget_flush(data);
+
+        /* DESTROY must come after the RELEASEs and FORGETs of the vflush. */
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_unlock(data->biglock);
+#endif
+        fuse_data_drain(data);
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        fuse_biglock_lock(data->biglock);
+#endif
+
         fuse_dispatcher_init(&fdi, 0 /* no data to send along */);
         fuse_dispatcher_make(&fdi, FUSE_DESTROY, mp, FUSE_ROOT_ID, context);
 
@@ -668,7 +698,7 @@ fuse_vfsop_unmount(mount_t mp, int mntflags, vfs_context_t context)
     fuse_biglock_unlock(data->biglock);
 #endif
 
-    if (!data->opened) {
+    if (!data->opened && !data->ch_open) {
 
         /* fdev->data was left for us to clean up */
 
@@ -1121,50 +1151,85 @@ dostatfs:
     return 0;
 }
 
+/*
+ * sync sends the FSYNC of a file right after pushing its pages and moves on
+ * to the next file; up to fuse_sync_max_inflight of them wait for the
+ * daemon together. Each pending request holds an iocount on its vnode, so
+ * the handle cannot be released under it.
+ */
+struct fuse_sync_pending {
+    vnode_t                vp;
+    struct fuse_dispatcher fdi;
+};
+
 struct fuse_sync_cargs {
     vfs_context_t context;
     int waitfor;
     int error;
+    uint32_t depth;
+    uint32_t count;
+    struct fuse_sync_pending pending[FUSE_MAX_SYNC_INFLIGHT];
 };
 
-static int
+static void
+fuse_sync_drain(struct fuse_sync_cargs *args)
+{
+    for (uint32_t i = 0; i < args->count; i++) {
+        struct fuse_sync_pending *p = &args->pending[i];
+
+        (void)fuse_internal_fsync_wait(p->vp, &p->fdi);
+        vnode_put(p->vp);
+    }
+
+    args->count = 0;
+}
+
+static bool
 fuse_sync_callback(vnode_t vp, void *cargs)
 {
     int type;
     struct fuse_sync_cargs *args;
     struct fuse_vnode_data *fvdat;
-    struct fuse_dispatcher  fdi;
     struct fuse_filehandle *fufh;
     struct fuse_data       *data;
     mount_t mp;
 
-    if (!vnode_hasdirtyblks(vp)) {
-        return VNODE_RETURNED;
-    }
-
     mp = vnode_mount(vp);
 
     if (fuse_isdeadfs(vp)) {
-        return VNODE_RETURNED_DONE;
+        return false;
     }
 
     data = fuse_get_mpdata(mp);
+    args = (struct fuse_sync_cargs *)cargs;
+    fvdat = VTOFUD(vp);
+
+    /* The data has to go out even if the daemon has no FSYNC. */
+    cluster_push(vp, (args->waitfor == MNT_WAIT) ? IO_SYNC : 0);
 
     if (!fuse_implemented(data, (vnode_isdir(vp)) ?
         FSESS_NOIMPLBIT(FSYNCDIR) : FSESS_NOIMPLBIT(FSYNC))) {
-        return VNODE_RETURNED;
+        fuse_internal_writeback_release(vp);
+        return vnode_hasdirtyblks(vp);
     }
 
-    args = (struct fuse_sync_cargs *)cargs;
-    fvdat = VTOFUD(vp);
-
-    cluster_push(vp, 0);
-
-    fuse_dispatcher_init(&fdi, 0);
     for (type = 0; type < FUFH_MAXTYPE; type++) {
         fufh = &(fvdat->fufh[type]);
         if (FUFH_IS_VALID(fufh)) {
-            (void)fuse_internal_fsync(vp, args->context, fufh, &fdi);
+            struct fuse_sync_pending *p;
+
+            if (args->count == args->depth) {
+                fuse_sync_drain(args);
+            }
+
+            /* We hold an iocount already, this cannot fail. */
+            if (vnode_get(vp)) {
+                continue;
+            }
+
+            p = &args->pending[args->count++];
+            p->vp = vp;
+            fuse_internal_fsync_send(vp, args->context, fufh, &p->fdi);
         }
     }
 
@@ -1176,7 +1241,11 @@ fuse_sync_callback(vnode_t vp, void *cargs)
      * - note that umount will call ubc_sync_range()
      */
 
-    return VNODE_RETURNED;
+    /* The FSYNCs above are queued ahead of the RELEASE this may send. */
+    fuse_internal_writeback_release(vp);
+
+    /* Pages dirtied while we were at it are the next sync's business. */
+    return vnode_hasdirtyblks(vp);
 }
 
 static errno_t
@@ -1203,17 +1272,21 @@ fuse_vfsop_sync(mount_t mp, int waitfor, vfs_context_t context)
     }
 
     /*
-     * Write back each (modified) fuse node.
+     * Write back each modified fuse node; only those on the dirty list can
+     * have anything to write.
      */
     args.context = context;
     args.waitfor = waitfor;
     args.error = 0;
+    args.depth = min(max(fuse_sync_max_inflight, 1), FUSE_MAX_SYNC_INFLIGHT);
+    args.count = 0;
 
-#ifdef FUSE4X_ENABLE_BIGLOCK
     struct fuse_data *data = fuse_get_mpdata(mp);
+#ifdef FUSE4X_ENABLE_BIGLOCK
     fuse_biglock_unlock(data->biglock);
 #endif
-    vnode_iterate(mp, 0, fuse_sync_callback, (void *)&args);
+    fuse_node_dirty_iterate(data, fuse_sync_callback, (void *)&args);
+    fuse_sync_drain(&args);
 #ifdef FUSE4X_ENABLE_BIGLOCK
     fuse_biglock_lock(data->biglock);
 #endif
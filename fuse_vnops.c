@@ -13,7 +13,6 @@
 #include <fuse_param.h>
 #include "fuse_sysctl.h"
 #include "fuse_vnops.h"
-#include "compat/tree.h"
 
 #ifdef FUSE4X_ENABLE_BIGLOCK
 #include "fuse_biglock_vnops.h"
@@ -276,7 +275,8 @@ fuse_vnop_close(struct vnop_close_args *ap)
      * writing before we close this precious writable descriptor, we might
      * be doomed.
      */
-    if (vnode_hasdirtyblks(vp) && !fuse_isnosynconclose(vp)) {
+    if (vnode_hasdirtyblks(vp) && !fuse_isnosynconclose(vp) &&
+        !fuse_iswriteback(vp)) {
         (void)cluster_push(vp, IO_SYNC | IO_CLOSE);
     }
 
@@ -286,6 +286,15 @@ fuse_vnop_close(struct vnop_close_args *ap)
         struct fuse_dispatcher  fdi;
         struct fuse_flush_in   *ffi;
 
+        if (vnode_hasdirtyblks(vp) && fuse_iswriteback(vp)) {
+            /*
+             * The daemon expects to have seen every write to the handle
+             * by the time FLUSH comes in, write-back or not.
+             */
+            (void)ubc_msync(vp, (off_t)0, ubc_getsize(vp), NULL,
+                            UBC_PUSHDIRTY | UBC_SYNC);
+        }
+
         fuse_dispatcher_init(&fdi, sizeof(*ffi));
         fuse_dispatcher_make_vp(&fdi, FUSE_FLUSH, vp, context);
 
@@ -295,20 +304,38 @@ fuse_vnop_close(struct vnop_close_args *ap)
         ffi->padding = 0;
         ffi->lock_owner = 0;
 
-        err = fuse_dispatcher_wait_answer(&fdi);
-
-        if (!err) {
-            fuse_ticket_drop(fdi.ticket);
+        if (data->dataflags & FSESS_ASYNC_FLUSH) {
+            /* The daemon said it does not need close() to wait for it. */
+            fuse_dispatcher_send_async(&fdi);
         } else {
-            if (err == ENOSYS) {
-                fuse_clear_implemented(data, FSESS_NOIMPLBIT(FLUSH));
-                err = 0;
+            err = fuse_dispatcher_wait_answer(&fdi);
+
+            if (!err) {
+                fuse_ticket_drop(fdi.ticket);
+            } else {
+                if (err == ENOSYS) {
+                    fuse_clear_implemented(data, FSESS_NOIMPLBIT(FLUSH));
+                    err = 0;
+                }
             }
         }
     }
 
 skipdir:
 
+    /*
+     * With write-back caching the last close of a handle that may still
+     * have written pages behind it leaves the handle open. The flusher
+     * writes them through it, so neither the handle nor the file mode
+     * has to be acquired again, and releases it afterwards.
+     */
+    if (!isdir && fufh->open_count == 1 && fufh_type != FUFH_RDONLY &&
+        fuse_iswriteback(vp) && vnode_hasdirtyblks(vp) &&
+        !(fvdat->wb_held & (1 << fufh_type))) {
+        fvdat->wb_held |= 1 << fufh_type;
+        return err;
+    }
+
     /* This must be done after we have flushed any pending I/O. */
     FUFH_USE_DEC(fufh);
 
@@ -460,10 +487,11 @@ bringup:
          */
         fufh->open_count = 1;
 
-        OSIncrementAtomic((SInt32 *)&fuse_fh_current);
+        fuse_counter_inc(FUSE_CNT_FH_CURRENT);
     }
 
-    cache_purge_negatives(dvp);
+    fuse_vncache_purge_negatives(dvp);
+    fuse_invalidate_dircache(dvp);
 
     fuse_ticket_drop(dispatcher->ticket);
 
@@ -613,7 +641,6 @@ fuse_vnop_fsync(struct vnop_fsync_args *ap)
     struct fuse_vnode_data *fvdat = VTOFUD(vp);
 
     int type, err = 0, tmp_err = 0;
-    (void)waitfor;
 
     fuse_trace_printf_vnop();
 
@@ -621,7 +648,12 @@ fuse_vnop_fsync(struct vnop_fsync_args *ap)
         return 0;
     }
 
-    cluster_push(vp, 0);
+    /* With write-back caching this is where the data becomes durable. */
+    cluster_push(vp, (waitfor == MNT_WAIT) ? IO_SYNC : 0);
+    if (waitfor == MNT_WAIT) {
+        /* Including write-behind the flusher sent; FSYNC may overtake it. */
+        (void)vnode_waitforwrites(vp, 0, 0, 0, "fuse_fsync");
+    }
 
     /*
      * struct timeval tv;
@@ -840,10 +872,16 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
     struct fuse_getxattr_in  *fgxi;
     struct fuse_getxattr_out *fgxo;
     struct fuse_data         *data;
+    struct fuse_vnode_data   *fvdat;
+    struct fuse_xattr        *xa;
     mount_t mp;
 
     int err = 0;
     size_t namelen;
+    uint32_t position = uio ? (uint32_t)uio_offset(uio) : 0;
+    uint32_t asked;
+    uint32_t gen;
+    bool cache;
 
     fuse_trace_printf_vnop();
 
@@ -872,8 +910,23 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
         return ENOTSUP;
     }
 
+    /* Resource fork reads at an offset are not cached. */
+    fvdat = VTOFUD(vp);
+    cache = (position == 0) && fuse_internal_xattrcache_usable(vp);
+    gen = fvdat->xattrcache_gen;
+
+    if (cache) {
+        xa = fuse_internal_xattrcache_find(fvdat, name);
+        if (xa && (xa->err || xa->has_value || !uio)) {
+            fuse_counter_inc(FUSE_CNT_XATTR_CACHE_HITS);
+            return fuse_internal_xattrcache_copyout(xa, uio, ap->a_size);
+        }
+        fuse_counter_inc(FUSE_CNT_XATTR_CACHE_MISSES);
+    }
+
     namelen = strlen(name);
 
+again:
     fuse_dispatcher_init(&fdi, sizeof(*fgxi) + namelen + 1);
     fuse_dispatcher_make_vp(&fdi, FUSE_GETXATTR, vp, context);
     fgxi = fdi.indata;
@@ -884,7 +937,16 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
         fgxi->size = 0;
     }
 
-    fgxi->position = (uint32_t)uio_offset(uio);
+    /*
+     * When caching, ask for the value even if the caller only wants its
+     * size, so that the usual size-then-value pair costs one round trip.
+     */
+    if (cache) {
+        fgxi->size = max(fgxi->size, FUSE_XATTRCACHE_MAX_VALUE);
+    }
+    asked = fgxi->size;
+
+    fgxi->position = position;
 
     memcpy((char *)fdi.indata + sizeof(*fgxi), name, namelen);
     ((char *)fdi.indata)[sizeof(*fgxi) + namelen] = '\0';
@@ -899,12 +961,25 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
             fuse_clear_implemented(data, FSESS_NOIMPLBIT(GETXATTR));
             return ENOTSUP;
         }
+        if (cache && err == ENOATTR) {
+            fuse_internal_xattrcache_insert(fvdat, gen, name, ENOATTR, NULL, 0);
+        }
+        if (cache && err == ERANGE && !uio) {
+            /* Too big to cache; the caller just wants the size. */
+            cache = false;
+            goto again;
+        }
         return err;
     }
 
-    if (uio) {
+    if (asked) {
+        if (cache) {
+            fuse_internal_xattrcache_insert(fvdat, gen, name, 0, fdi.answer, fdi.iosize);
+        }
         *ap->a_size = fdi.iosize;
-        if ((user_ssize_t)fdi.iosize > uio_resid(uio)) {
+        if (!uio) {
+            /* We asked for the value only to cache it. */
+        } else if ((user_ssize_t)fdi.iosize > uio_resid(uio)) {
             err = ERANGE;
         } else {
             err = uiomove((char *)fdi.answer, (int)fdi.iosize, uio);
@@ -912,6 +987,9 @@ fuse_vnop_getxattr(struct vnop_getxattr_args *ap)
     } else {
         fgxo = (struct fuse_getxattr_out *)fdi.answer;
         *ap->a_size = fgxo->size;
+        if (cache) {
+            fuse_internal_xattrcache_insert(fvdat, gen, name, 0, NULL, fgxo->size);
+        }
     }
 
     fuse_ticket_drop(fdi.ticket);
@@ -942,11 +1020,18 @@ fuse_vnop_inactive(struct vnop_inactive_args *ap)
      * Cannot do early bail out on a dead file system in this case.
      */
 
+    if (fvdat->wb_held && vnode_hasdirtyblks(vp) && !fuse_isdeadfs(vp)) {
+        /* The handles left open for the flusher go away below, push now. */
+        (void)cluster_push(vp, IO_SYNC);
+    }
+
     for (int fufh_type = 0; fufh_type < FUFH_MAXTYPE; fufh_type++) {
 
         fufh = &(fvdat->fufh[fufh_type]);
         //TOTHINK: should we just check that all fuse_fh are zero??
 
+        fvdat->wb_held &= ~(1 << fufh_type);
+
         if (FUFH_IS_VALID(fufh)) {
             FUFH_USE_RESET(fufh);
             (void)fuse_filehandle_put(vp, context, fufh_type);
@@ -1013,10 +1098,12 @@ fuse_vnop_link(struct vnop_link_args *ap)
     err = fuse_internal_checkentry(feo, vnode_vtype(vp));
     fuse_ticket_drop(fdi.ticket);
     fuse_invalidate_attr(tdvp);
+    fuse_invalidate_dircache(tdvp);
+    fuse_vncache_purge_negatives(tdvp);
     fuse_invalidate_attr(vp);
 
     if (err == 0) {
-        VTOFUD(vp)->nlookup++;
+        OSIncrementAtomic64((SInt64 *)&VTOFUD(vp)->nlookup);
     }
 
     return err;
@@ -1044,8 +1131,13 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
     struct fuse_getxattr_in  *fgxi;
     struct fuse_getxattr_out *fgxo;
     struct fuse_data         *data;
+    struct fuse_vnode_data   *fvdat;
+    struct fuse_xattr        *xa;
 
     int err = 0;
+    uint32_t asked;
+    uint32_t gen;
+    bool cache;
 
     fuse_trace_printf_vnop();
 
@@ -1065,6 +1157,21 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
         return ENOTSUP;
     }
 
+    /* The name list is cached under the empty name. */
+    fvdat = VTOFUD(vp);
+    cache = fuse_internal_xattrcache_usable(vp);
+    gen = fvdat->xattrcache_gen;
+
+    if (cache) {
+        xa = fuse_internal_xattrcache_find(fvdat, "");
+        if (xa && (xa->has_value || !uio)) {
+            fuse_counter_inc(FUSE_CNT_XATTR_CACHE_HITS);
+            return fuse_internal_xattrcache_copyout(xa, uio, ap->a_size);
+        }
+        fuse_counter_inc(FUSE_CNT_XATTR_CACHE_MISSES);
+    }
+
+again:
     fuse_dispatcher_init(&fdi, sizeof(*fgxi));
     fuse_dispatcher_make_vp(&fdi, FUSE_LISTXATTR, vp, context);
     fgxi = fdi.indata;
@@ -1074,18 +1181,33 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
         fgxi->size = 0;
     }
 
+    /* Fetch the list along with its size, as getxattr does. */
+    if (cache) {
+        fgxi->size = max(fgxi->size, FUSE_XATTRCACHE_MAX_VALUE);
+    }
+    asked = fgxi->size;
+
     err = fuse_dispatcher_wait_answer(&fdi);
     if (err) {
         if (err == ENOSYS) {
             fuse_clear_implemented(data, FSESS_NOIMPLBIT(LISTXATTR));
             return ENOTSUP;
         }
+        if (cache && err == ERANGE && !uio) {
+            cache = false;
+            goto again;
+        }
         return err;
     }
 
-    if (uio) {
+    if (asked) {
+        if (cache) {
+            fuse_internal_xattrcache_insert(fvdat, gen, "", 0, fdi.answer, fdi.iosize);
+        }
         *ap->a_size = fdi.iosize;
-        if ((user_ssize_t)fdi.iosize > uio_resid(uio)) {
+        if (!uio) {
+            /* We asked for the list only to cache it. */
+        } else if ((user_ssize_t)fdi.iosize > uio_resid(uio)) {
             err = ERANGE;
         } else {
             err = uiomove((char *)fdi.answer, (int)fdi.iosize, uio);
@@ -1093,6 +1215,9 @@ fuse_vnop_listxattr(struct vnop_listxattr_args *ap)
     } else {
         fgxo = (struct fuse_getxattr_out *)fdi.answer;
         *ap->a_size = fgxo->size;
+        if (cache) {
+            fuse_internal_xattrcache_insert(fvdat, gen, "", 0, NULL, fgxo->size);
+        }
     }
 
     fuse_ticket_drop(fdi.ticket);
@@ -1138,6 +1263,8 @@ fuse_vnop_lookup(struct vnop_lookup_args *ap)
     uint64_t nodeid;
     uint64_t parent_nodeid;
 
+    struct timespec negative_valid = { 0, 0 };
+
     *vpp = NULLVP;
 
     fuse_trace_printf_vnop_novp();
@@ -1183,9 +1310,13 @@ fuse_vnop_lookup(struct vnop_lookup_args *ap)
         goto calldaemon;
     } else if (fuse_isnovncache_mp(mp)) {
         /* pretend it's a vncache miss */
-        OSIncrementAtomic((SInt32 *)&fuse_lookup_cache_overrides);
+        fuse_counter_inc(FUSE_CNT_LOOKUP_CACHE_OVERRIDES);
         err = 0;
     } else {
+        if (fuse_vncache_expire_negatives(dvp)) {
+            fuse_counter_inc(FUSE_CNT_LOOKUP_NEGATIVE_OVERRIDES);
+        }
+
 #ifdef FUSE4X_ENABLE_BIGLOCK
         struct fuse_data *data = fuse_get_mpdata(mp);
         fuse_biglock_unlock(data->biglock);
@@ -1197,15 +1328,17 @@ fuse_vnop_lookup(struct vnop_lookup_args *ap)
         switch (err) {
 
         case -1: /* positive match */
-            OSIncrementAtomic((SInt32 *)&fuse_lookup_cache_hits);
+            fuse_counter_inc(FUSE_CNT_LOOKUP_CACHE_HITS);
             return 0;
 
         case 0: /* no match in cache (or aged out) */
-            OSIncrementAtomic((SInt32 *)&fuse_lookup_cache_misses);
+            fuse_counter_inc(FUSE_CNT_LOOKUP_CACHE_MISSES);
             break;
 
         case ENOENT: /* negative match */
-            /* fall through */
+            fuse_counter_inc(FUSE_CNT_LOOKUP_NEGATIVE_HITS);
+            return err;
+
         default:
             return err;
         }
@@ -1229,10 +1362,20 @@ calldaemon:
     lookup_err = fuse_dispatcher_wait_answer(&fdi);
 
     if ((op == FUSE_LOOKUP) && !lookup_err) { /* lookup call succeeded */
-        nodeid = ((struct fuse_entry_out *)fdi.answer)->nodeid;
-        size = ((struct fuse_entry_out *)fdi.answer)->attr.size;
+        struct fuse_entry_out *feo = (struct fuse_entry_out *)fdi.answer;
+
+        nodeid = feo->nodeid;
+        size = feo->attr.size;
         if (!nodeid) {
-            fdi.answer_errno = ENOENT; /* XXX: negative_timeout case */
+            /*
+             * A negative entry: entry_valid says how long the name may be
+             * remembered as missing.
+             */
+            /* XXX: truncation */
+            negative_valid.tv_sec  = (time_t)feo->entry_valid;
+            negative_valid.tv_nsec = feo->entry_valid_nsec;
+            fuse_ticket_drop(fdi.ticket);
+            fdi.answer_errno = ENOENT;
             lookup_err = ENOENT;
         } else if (nodeid == FUSE_ROOT_ID) {
             lookup_err = EINVAL;
@@ -1270,8 +1413,13 @@ calldaemon:
             goto out;
         }
 
-        if ((cnp->cn_flags & MAKEENTRY) && (nameiop != CREATE)) {
-            fuse_vncache_enter(dvp, NULLVP, cnp);
+        /* A plain ENOENT error is not cached, only timed negative entries. */
+        if ((cnp->cn_flags & MAKEENTRY) && (nameiop != CREATE) &&
+            (negative_valid.tv_sec || negative_valid.tv_nsec) &&
+            !fuse_isnovncache_mp(mp)) {
+            /* The daemon was asked; its timed answer is remembered now. */
+            fuse_counter_inc(FUSE_CNT_LOOKUP_NEGATIVE_MISSES);
+            fuse_vncache_enter_negative(dvp, cnp, &negative_valid);
         }
 
         err = ENOENT;
@@ -1354,6 +1502,22 @@ calldaemon:
             *vpp = vp;
         }
 
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        /*
+         * Only dvp is locked. Without the biglock the attributes of another
+         * node are cached only if its lock is free: waiting for it here
+         * would take the locks child-first for "..". Not caching is safe.
+         */
+        bool unlock_vp = false;
+
+        if (*vpp != dvp && fuse_isfinelocking(fuse_get_mpdata(mp))) {
+            if (fusefs_trylock(VTOFUD(*vpp), FUSEFS_EXCLUSIVE_LOCK)) {
+                goto out;
+            }
+            unlock_vp = true;
+        }
+#endif
+
         if (op == FUSE_GETATTR) {
 
             /* ATTR_FUDGE_CASE */
@@ -1374,6 +1538,12 @@ calldaemon:
             cache_attrs(*vpp, (struct fuse_entry_out *)fdi.answer);
         }
 
+#ifdef FUSE4X_ENABLE_BIGLOCK
+        if (unlock_vp) {
+            fusefs_unlock(VTOFUD(*vpp));
+        }
+#endif
+
         /*
          * We do this elsewhere...
          *
@@ -1389,9 +1559,12 @@ out:
         /* No lookup error; need to clean up. */
 
         if (err) { /* Found inode; exit with no vnode. */
+            /* The forget takes over the ticket. */
             if (op == FUSE_LOOKUP) {
                 fuse_internal_forget_send(vnode_mount(dvp), context,
                                           nodeid, 1, &fdi);
+            } else {
+                fuse_ticket_drop(fdi.ticket);
             }
             return err;
         } else {
@@ -1560,7 +1733,7 @@ retry:
 
     if (FUFH_IS_VALID(fufh)) {
         FUFH_USE_INC(fufh);
-        OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
+        fuse_counter_inc(FUSE_CNT_FH_REUSE);
         goto out;
     }
 
@@ -1742,7 +1915,7 @@ fuse_vnop_open(struct vnop_open_args *ap)
 
     if (FUFH_IS_VALID(fufh)) {
         FUFH_USE_INC(fufh);
-        OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
+        fuse_counter_inc(FUSE_CNT_FH_REUSE);
         goto ok; /* return 0 */
     }
 
@@ -1925,6 +2098,11 @@ fuse_vnop_pageout(struct vnop_pageout_args *ap)
    fuse_biglock_lock(data->biglock);
 #endif
 
+    if (!error) {
+        /* The daemon has the pages now, but sync still owes it an FSYNC. */
+        fuse_node_dirty(vp);
+    }
+
     return error;
 }
 
@@ -2070,10 +2248,7 @@ fuse_vnop_read(struct vnop_read_args *ap)
 
     if (fuse_isdirectio(vp)) {
         fufh_type_t             fufh_type = FUFH_RDONLY;
-        struct fuse_dispatcher  fdi;
         struct fuse_filehandle *fufh = NULL;
-        struct fuse_read_in    *fri = NULL;
-        int err = 0;
 
         fufh = &(fvdat->fufh[fufh_type]);
 
@@ -2094,41 +2269,17 @@ fuse_vnop_read(struct vnop_read_args *ap)
             /* Using existing fufh of type fufh_type. */
         }
 
-        fuse_dispatcher_init(&fdi, 0);
-
-        while (uio_resid(uio) > 0) {
-
-            fdi.iosize = sizeof(*fri);
-            fuse_dispatcher_make_vp(&fdi, FUSE_READ, vp, context);
-            fri = fdi.indata;
-            fri->fh = fufh->fh_id;
-            fri->offset = uio_offset(uio);
-            fri->size = (uint32_t)min((size_t)uio_resid(uio), data->iosize);
-
-            if ((err = fuse_dispatcher_wait_answer(&fdi))) {
-                return err;
-            }
-
-#ifdef FUSE4X_ENABLE_BIGLOCK
-            fuse_biglock_unlock(data->biglock);
-#endif
-            err = uiomove(fdi.answer, (int)min(fri->size, fdi.iosize), uio);
-#ifdef FUSE4X_ENABLE_BIGLOCK
-            fuse_biglock_lock(data->biglock);
-#endif
-            if (err || fdi.iosize < fri->size) {
-                break;
-            }
-        }
-        fuse_ticket_drop(fdi.ticket);
-
-        return err;
+        return fuse_internal_directio_read(vp, uio, context, fufh);
 
     } else {  /* direct_io */
 #ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_unlock(data->biglock);
 #endif
         int res = cluster_read(vp, uio, fvdat->filesize, ioflag);
+        if (!res) {
+            fuse_internal_readahead(vp, orig_offset,
+                                    orig_resid - uio_resid(uio));
+        }
 #ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_lock(data->biglock);
 #endif
@@ -2160,7 +2311,6 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
 
     struct fuse_filehandle *fufh = NULL;
     struct fuse_vnode_data *fvdat;
-    struct fuse_iov         cookediov;
 
     int err = 0;
 
@@ -2192,7 +2342,7 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
 
     if (FUFH_IS_VALID(fufh)) {
         FUFH_USE_INC(fufh);
-        OSIncrementAtomic((SInt32 *)&fuse_fh_reuse_count);
+        fuse_counter_inc(FUSE_CNT_FH_REUSE);
     } else {
         err = fuse_filehandle_get(vp, context, FUFH_RDONLY, 0 /* mode */);
         if (err) {
@@ -2201,19 +2351,93 @@ fuse_vnop_readdir(struct vnop_readdir_args *ap)
         }
     }
 
-    size_t dircookedsize = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + MAXNAMLEN + 1);
-    fiov_init(&cookediov, dircookedsize);
+    err = fuse_internal_readdir(vp, uio, context, fufh, numdirentPtr);
 
-    err = fuse_internal_readdir(vp, uio, context, fufh, &cookediov,
-                                numdirentPtr);
+    FUFH_USE_DEC(fufh);
+    if (!FUFH_IS_VALID(fufh)) {
+        (void)fuse_filehandle_put(vp, context, FUFH_RDONLY);
+    }
+
+    fuse_invalidate_attr(vp);
+
+    return err;
+}
+
+/*
+    struct vnop_readdirattr_args {
+        struct vnodeop_desc *a_desc;
+        vnode_t              a_vp;
+        struct attrlist     *a_alist;
+        struct uio          *a_uio;
+        uint32_t             a_maxcount;
+        uint32_t             a_options;
+        uint32_t            *a_newstate;
+        int                 *a_eofflag;
+        uint32_t            *a_actualcount;
+        vfs_context_t        a_context;
+    };
+*/
+FUSE_VNOP_EXPORT
+int
+fuse_vnop_readdirattr(struct vnop_readdirattr_args *ap)
+{
+    vnode_t          vp      = ap->a_vp;
+    struct attrlist *alist   = ap->a_alist;
+    uio_t            uio     = ap->a_uio;
+    vfs_context_t    context = ap->a_context;
+
+    struct fuse_filehandle *fufh = NULL;
+    struct fuse_vnode_data *fvdat;
+
+    int err = 0;
+
+    fuse_trace_printf_vnop();
+
+    *ap->a_actualcount = 0;
+    *ap->a_eofflag = 0;
+
+    if (fuse_isdeadfs(vp)) {
+        return ENXIO;
+    }
 
-    fiov_teardown(&cookediov);
+    CHECK_BLANKET_DENIAL(vp, context, EPERM);
+
+    /* Without READDIRPLUS the caller's fallback is as good as ours. */
+    if ((err = fuse_internal_readdirattr_check(vp, alist))) {
+        return err;
+    }
+
+    if ((uio_iovcnt(uio) > 1) ||
+        (uio_resid(uio) < (user_ssize_t)sizeof(uint32_t))) {
+        return EINVAL;
+    }
+
+    fvdat = VTOFUD(vp);
+
+    fufh = &(fvdat->fufh[FUFH_RDONLY]);
+
+    if (FUFH_IS_VALID(fufh)) {
+        FUFH_USE_INC(fufh);
+        fuse_counter_inc(FUSE_CNT_FH_REUSE);
+    } else {
+        err = fuse_filehandle_get(vp, context, FUFH_RDONLY, 0 /* mode */);
+        if (err) {
+            log("fuse4x: filehandle_get failed in readdirattr (err=%d)\n", err);
+            return err;
+        }
+    }
+
+    err = fuse_internal_readdirattr(vp, alist, uio, ap->a_maxcount, context,
+                                    fufh, ap->a_actualcount, ap->a_eofflag);
 
     FUFH_USE_DEC(fufh);
     if (!FUFH_IS_VALID(fufh)) {
         (void)fuse_filehandle_put(vp, context, FUFH_RDONLY);
     }
 
+    /* Like HFS, which hands out the directory's modification time. */
+    *ap->a_newstate = (uint32_t)VTOVA(vp)->va_modify_time.tv_sec;
+
     fuse_invalidate_attr(vp);
 
     return err;
@@ -2339,7 +2563,7 @@ fuse_vnop_reclaim(struct vnop_reclaim_args *ap)
                  */
 
                 if (!fuse_isdeadfs(vp)) {
-                    OSIncrementAtomic((SInt32 *)&fuse_fh_zombies);
+                    fuse_counter_inc(FUSE_CNT_FH_ZOMBIES);
                 } /* !deadfs */
 
                 (void)fuse_filehandle_put(vp, context, type);
@@ -2358,14 +2582,13 @@ fuse_vnop_reclaim(struct vnop_reclaim_args *ap)
 out:
     fuse_vncache_purge(vp);
 
-    fuse_lck_mtx_lock(data->node_mtx);
-    RB_REMOVE(fuse_data_nodes, &data->nodes_head, fvdat);
-    fuse_lck_mtx_unlock(data->node_mtx);
+    fuse_node_remove(data, fvdat);
+    fuse_node_undirty(data, fvdat);
     vnode_removefsref(vp);
 
     fuse_vnode_data_destroy(fvdat);
     vnode_clearfsnode(vp);
-    OSDecrementAtomic((SInt32 *)&fuse_vnodes_current);
+    fuse_counter_dec(FUSE_CNT_VNODES_CURRENT);
 
     return 0;
 }
@@ -2488,6 +2711,7 @@ fuse_vnop_removexattr(struct vnop_removexattr_args *ap)
     ((char *)fdi.indata)[namelen] = '\0';
 
     err = fuse_dispatcher_wait_answer(&fdi);
+    fuse_invalidate_xattrcache(vp);
     if (!err) {
         fuse_ticket_drop(fdi.ticket);
         VTOFUD(vp)->c_flag |= C_TOUCH_CHGTIME;
@@ -2717,6 +2941,12 @@ fuse_vnop_setattr(struct vnop_setattr_args *ap)
         goto out;
     }
 
+    if (sizechanged && fuse_iswriteback(vp)) {
+        /* Write-behind queued before a truncate must not land after it. */
+        (void)cluster_push(vp, IO_SYNC);
+        (void)vnode_waitforwrites(vp, 0, 0, 0, "fuse_setattr");
+    }
+
     if ((err = fuse_dispatcher_wait_answer(&fdi))) {
         fuse_invalidate_attr(vp);
         return err;
@@ -2765,6 +2995,7 @@ out:
     if (!err && sizechanged) {
         VTOFUD(vp)->filesize = newsize;
         ubc_setsize(vp, (off_t)newsize);
+        fuse_node_dirty(vp);
     }
 
     return err;
@@ -2887,6 +3118,8 @@ fuse_vnop_setxattr(struct vnop_setxattr_args *ap)
         err = fuse_dispatcher_wait_answer(&fdi);
     }
 
+    fuse_invalidate_xattrcache(vp);
+
     if (!err) {
         fuse_ticket_drop(fdi.ticket);
         fuse_invalidate_attr(vp);
@@ -3082,14 +3315,7 @@ fuse_vnop_write(struct vnop_write_args *ap)
 
     if (fuse_isdirectio(vp)) {
         fufh_type_t             fufh_type = FUFH_WRONLY;
-        struct fuse_dispatcher  fdi;
         struct fuse_filehandle *fufh = NULL;
-        struct fuse_write_in   *fwi  = NULL;
-        struct fuse_write_out  *fwo  = NULL;
-        struct fuse_data       *data = fuse_get_mpdata(vnode_mount(vp));
-
-        size_t chunksize;
-        off_t  diff;
 
         fufh = &(fvdat->fufh[fufh_type]);
 
@@ -3110,48 +3336,7 @@ fuse_vnop_write(struct vnop_write_args *ap)
             /* Using existing fufh of type fufh_type. */
         }
 
-        fuse_dispatcher_init(&fdi, 0);
-
-        while (uio_resid(uio) > 0) {
-            chunksize = min((size_t)uio_resid(uio), data->iosize);
-            fdi.iosize = sizeof(*fwi) + chunksize;
-            fuse_dispatcher_make_vp(&fdi, FUSE_WRITE, vp, context);
-            fwi = fdi.indata;
-            fwi->fh = fufh->fh_id;
-            fwi->offset = uio_offset(uio);
-            fwi->size = (uint32_t)chunksize;
-
-            error = uiomove((char *)fdi.indata + sizeof(*fwi), (int)chunksize,
-                            uio);
-            if (error) {
-                break;
-            }
-
-            error = fuse_dispatcher_wait_answer(&fdi);
-            if (error) {
-                return error;
-            }
-
-            fwo = (struct fuse_write_out *)fdi.answer;
-
-            diff = chunksize - fwo->size;
-            if (diff < 0) {
-                error = EINVAL;
-                break;
-            }
-
-            uio_setresid(uio, (uio_resid(uio) + diff));
-            uio_setoffset(uio, (uio_offset(uio) - diff));
-
-        } /* while */
-
-        if (!error) {
-            fuse_invalidate_attr(vp);
-        }
-
-        fuse_ticket_drop(fdi.ticket);
-
-        return error;
+        return fuse_internal_directio_write(vp, uio, context, fufh);
 
     } else { /* !direct_io */
 
@@ -3192,8 +3377,8 @@ fuse_vnop_write(struct vnop_write_args *ap)
             zero_off = 0;
         }
 
-#ifdef FUSE4X_ENABLE_BIGLOCK
         struct fuse_data *data = fuse_get_mpdata(vnode_mount(vp));
+#ifdef FUSE4X_ENABLE_BIGLOCK
         fuse_biglock_unlock(data->biglock);
 #endif
         error = cluster_write(vp, uio, (off_t)original_size, (off_t)filesize,
@@ -3203,6 +3388,8 @@ fuse_vnop_write(struct vnop_write_args *ap)
 #endif
 
         if (!error) {
+            fuse_node_dirty(vp);
+
             if (uio_offset(uio) > original_size) {
                 /* Updating to new size. */
                 fvdat->filesize = uio_offset(uio);
@@ -3210,7 +3397,27 @@ fuse_vnop_write(struct vnop_write_args *ap)
             } else {
                 fvdat->filesize = original_size;
             }
-            fuse_invalidate_attr(vp);
+
+            if (fuse_iswriteback(vp)) {
+                /*
+                 * The daemon hears about the new size and mtime when the
+                 * data goes out; until then our copy is the right one.
+                 */
+                struct timespec now;
+
+                nanotime(&now);
+                VTOVA(vp)->va_data_size = fvdat->filesize;
+                VTOVA(vp)->va_modify_time = now;
+                VTOVA(vp)->va_change_time = now;
+
+                /* The flusher's WRITEs go out on behalf of the writer. */
+                fvdat->wb_pid = vfs_context_pid(context);
+                fvdat->wb_uid = kauth_cred_getuid(vfs_context_ucred(context));
+                fvdat->wb_gid = kauth_cred_getgid(vfs_context_ucred(context));
+                data->wb_dirty = true;
+            } else {
+                fuse_invalidate_attr(vp);
+            }
         }
 
         /*
@@ -3355,6 +3562,7 @@ struct vnodeopv_entry_desc fuse_vnode_operation_entries[] = {
     { &vnop_pathconf_desc,      (fuse_vnode_op_t) fuse_vnop_pathconf      },
     { &vnop_read_desc,          (fuse_vnode_op_t) fuse_vnop_read          },
     { &vnop_readdir_desc,       (fuse_vnode_op_t) fuse_vnop_readdir       },
+    { &vnop_readdirattr_desc,   (fuse_vnode_op_t) fuse_vnop_readdirattr   },
     { &vnop_readlink_desc,      (fuse_vnode_op_t) fuse_vnop_readlink      },
     { &vnop_reclaim_desc,       (fuse_vnode_op_t) fuse_vnop_reclaim       },
     { &vnop_remove_desc,        (fuse_vnode_op_t) fuse_vnop_remove        },
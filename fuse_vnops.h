@@ -78,7 +78,7 @@ FUSE_VNOP_EXPORT int fuse_vnop_read(struct vnop_read_args *ap);
 
 FUSE_VNOP_EXPORT int fuse_vnop_readdir(struct vnop_readdir_args *ap);
 
-// FUSE_VNOP_EXPORT int fuse_vnop_readdirattr(struct vnop_readdirattr_args *ap);
+FUSE_VNOP_EXPORT int fuse_vnop_readdirattr(struct vnop_readdirattr_args *ap);
 
 FUSE_VNOP_EXPORT int fuse_vnop_readlink(struct vnop_readlink_args *ap);
 